@@ -0,0 +1,475 @@
+#ifndef _BASIC_MQTT_CLIENT_H_
+#define _BASIC_MQTT_CLIENT_H_
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <chrono>
+#include "MQTTConfig.h"
+#include "MQTTMessage.h"
+#include "MQTTTopic.h"
+#include "MQTTConnectOptions.h"
+#include "MQTTTransport.h"
+#include "Utils.h"
+
+//Protocol version policies, the name and level written in CONNECT
+struct MQTTProtocol311
+{
+	inline static const char* Name() { return "MQTT"; }
+	inline static uint16_t NameLength() { return 4; }
+	inline static uint8_t Level() { return 0x04; }
+};
+
+struct MQTTProtocol31
+{
+	inline static const char* Name() { return "MQIsdp"; }
+	inline static uint16_t NameLength() { return 6; }
+	inline static uint8_t Level() { return 0x03; }
+};
+
+#if defined(MQTT_VERSION_311)
+using MQTTDefaultProtocol = MQTTProtocol311;
+#elif defined(MQTT_VERSION_31)
+using MQTTDefaultProtocol = MQTTProtocol31;
+#endif
+
+//Allocator policy keeping the packet buffers inside the client object, a client on the stack then makes no heap allocation at all
+struct MQTTInlineAllocator {};
+
+//Buffer of Length bytes taken from Allocator once, when the client is made
+template<class Allocator, uint32_t Length>
+class MQTTPacketBuffer
+{
+	using ByteAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<uint8_t>;
+	using Traits = std::allocator_traits<ByteAllocator>;
+	public:
+		MQTTPacketBuffer() : data(Traits::allocate(allocator, Length)) {}
+		~MQTTPacketBuffer() { Traits::deallocate(allocator, data, Length); }
+		MQTTPacketBuffer(MQTTPacketBuffer&) = delete;
+		MQTTPacketBuffer& operator=(MQTTPacketBuffer&) = delete;
+		inline uint8_t* Get() { return data; }
+	private:
+		ByteAllocator allocator;
+		uint8_t *data;
+};
+
+template<uint32_t Length>
+class MQTTPacketBuffer<MQTTInlineAllocator, Length>
+{
+	public:
+		inline uint8_t* Get() { return data; }
+	private:
+		uint8_t data[Length];
+};
+
+//Handler of Poll ignoring everything received, the calls compile away
+struct MQTTNullHandler
+{
+	inline void OnPublish(const char*, uint16_t, const uint8_t*, uint32_t) {}
+	inline void OnAcknowledged(MQTTMessageType, uint16_t) {}
+};
+
+//MQTT client specialized at compile time, for embedded targets and hot paths where the features of MQTTClient cost more than they bring.
+//It has no thread, no timer, no token and no virtual call: the caller drives it with Poll, which reads from the transport, decodes the frames
+//in place and hands them to a handler whose methods are resolved statically. Packets are encoded straight into one buffer of MaxPacket bytes,
+//publishes longer than that send their payload from the caller's memory. Frames received longer than MaxPacket close the connection.
+//Acknowledgements are answered and reported to the handler by packet identifier but not tracked, there is no retransmission.
+//  Transport       class with Connect, Send, Receive and Close, see MQTTPlainTransport
+//  Allocator       where the two packet buffers come from, MQTTInlineAllocator keeps them in the object
+//  ProtocolVersion MQTTProtocol311 or MQTTProtocol31
+//  MaxPacket       length of the send and receive buffers
+//Not thread safe: one thread makes all the calls
+template<class Transport, class Allocator = std::allocator<uint8_t>, class ProtocolVersion = MQTTDefaultProtocol, uint32_t MaxPacket = MQTT_MAX_MESSAGE_LENGTH>
+class BasicMQTTClient
+{
+	static_assert(MaxPacket >= 128, "MaxPacket must hold at least a CONNECT with short strings");
+	public:
+		BasicMQTTClient() : receiveLength(0), packetIdentifier(0), keepAlive(0), connected(false) {}
+		~BasicMQTTClient() { Disconnect(); }
+		BasicMQTTClient(BasicMQTTClient&) = delete;
+		BasicMQTTClient& operator=(BasicMQTTClient&) = delete;
+		inline Transport& GetTransport() { return transport; }
+
+		//Returns once the broker accepted the connection, or false when it refused it or did not answer within timeout ms
+		bool Connect(const std::string &host, uint32_t port, const std::string &clientID, MQTTConnectOptions &mqttConnectOptions, int32_t timeout)
+		{
+			Disconnect();
+			const std::string &username = mqttConnectOptions.GetUsername();
+			const std::string &password = mqttConnectOptions.GetPassword();
+			const std::string &lastWillTopic = mqttConnectOptions.GetLastWillTopic();
+			const std::string &lastWillMessage = mqttConnectOptions.GetLastWillMessage();
+			bool lastWill = !lastWillTopic.empty() && !lastWillMessage.empty();
+			bool sendPassword = !username.empty() && !password.empty();
+			uint8_t flags = mqttConnectOptions.GetCleanSession() ? 0x02 : 0x00;
+			uint32_t remainingLength = 2 + ProtocolVersion::NameLength() + 1 /*protocol level*/ + 1 /*connect flags*/ + 2 /*keep alive*/ + 2 + static_cast<uint32_t>(clientID.size());
+			if (lastWill)
+			{
+				flags |= 0x04 | ((mqttConnectOptions.GetLastWillQos() & 0x03) << 3) | (mqttConnectOptions.GetLastWillRetain() ? 0x20 : 0x00);
+				remainingLength += 2 + static_cast<uint32_t>(lastWillTopic.size()) + 2 + static_cast<uint32_t>(lastWillMessage.size());
+			}
+			if (!username.empty())
+			{
+				flags |= 0x80;
+				remainingLength += 2 + static_cast<uint32_t>(username.size());
+			}
+			if (sendPassword)
+			{
+				flags |= 0x40;
+				remainingLength += 2 + static_cast<uint32_t>(password.size());
+			}
+			if (1 + RemainingLengthBytes(remainingLength) + remainingLength > MaxPacket || !transport.Connect(host, port))
+			{
+				return false;
+			}
+			keepAlive = mqttConnectOptions.GetKeepAlive();
+			uint8_t *ptr = sendBuffer.Get();
+			*ptr++ = MQTT_MSG_CONNECT << 4;
+			ptr = WriteRemainingLength(ptr, remainingLength);
+			ptr = WriteString(ptr, ProtocolVersion::Name(), ProtocolVersion::NameLength());
+			*ptr++ = ProtocolVersion::Level();
+			*ptr++ = flags;
+			ptr = WriteShort(ptr, keepAlive);
+			ptr = WriteString(ptr, clientID.data(), static_cast<uint16_t>(clientID.size()));
+			if (lastWill)
+			{
+				ptr = WriteString(ptr, lastWillTopic.data(), static_cast<uint16_t>(lastWillTopic.size()));
+				ptr = WriteString(ptr, lastWillMessage.data(), static_cast<uint16_t>(lastWillMessage.size()));
+			}
+			if (!username.empty())
+			{
+				ptr = WriteString(ptr, username.data(), static_cast<uint16_t>(username.size()));
+			}
+			if (sendPassword)
+			{
+				ptr = WriteString(ptr, password.data(), static_cast<uint16_t>(password.size()));
+			}
+			connected = true;
+			if (!Send(sendBuffer.Get(), static_cast<uint32_t>(ptr - sendBuffer.Get())))
+			{
+				return false;
+			}
+			//CONNACK is the first frame the broker sends, anything after it stays in the receive buffer for Poll
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+			while (receiveLength < 4)
+			{
+				auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+				int32_t received = (remaining > 0) ? transport.Receive(receiveBuffer.Get() + receiveLength, MaxPacket - receiveLength, static_cast<int32_t>(remaining)) : -1;
+				if (received < 0)
+				{
+					Disconnect();
+					return false;
+				}
+				receiveLength += static_cast<uint32_t>(received);
+			}
+			uint8_t *connack = receiveBuffer.Get();
+			if (MQTTMessage::GetMessageType(connack) != MQTT_MSG_CONNACK || MQTTMessage::GetConnectReturnCode(connack) != MQTT_CONNECTION_ACCEPTED)
+			{
+				Disconnect();
+				return false;
+			}
+			Consume(4);
+			return true;
+		}
+
+		void Disconnect()
+		{
+			if (connected)
+			{
+				uint8_t disconnect[2] = { MQTT_MSG_DISCONNECT << 4, 0x00 };
+				transport.Send(disconnect, sizeof(disconnect));
+				connected = false;
+			}
+			transport.Close();
+			receiveLength = 0;
+		}
+
+		inline bool IsConnected() { return connected; }
+
+		//packetIdentifier receives the identifier the acknowledgement will carry, 0 for QoS0
+		bool Publish(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain, uint16_t &packetIdentifier)
+		{
+			uint32_t variableHeaderLength = 2 + topicNameLength + ((qos > 0) ? 2 : 0);
+			if (!connected || qos > 2 || payloadLength > MQTT_MAX_REMAINING_LENGTH - variableHeaderLength || !MQTTTopic::IsValidTopicName(topicName, topicNameLength))
+			{
+				return false;
+			}
+			uint32_t remainingLength = variableHeaderLength + payloadLength;
+			uint32_t headerLength = 1 + RemainingLengthBytes(remainingLength) + variableHeaderLength;
+			if (headerLength > MaxPacket)
+			{
+				return false;
+			}
+			uint8_t *ptr = sendBuffer.Get();
+			*ptr++ = (MQTT_MSG_PUBLISH << 4) | (qos << 1) | (retain ? 0x01 : 0x00);
+			ptr = WriteRemainingLength(ptr, remainingLength);
+			ptr = WriteString(ptr, topicName, topicNameLength);
+			packetIdentifier = 0;
+			if (qos > 0)
+			{
+				packetIdentifier = NextPacketIdentifier();
+				ptr = WriteShort(ptr, packetIdentifier);
+			}
+			if (payloadLength <= MaxPacket - headerLength)
+			{
+				memcpy(ptr, payload, payloadLength);
+				return Send(sendBuffer.Get(), headerLength + payloadLength);
+			}
+			//Too long for the buffer, the payload is written from where it is
+			return Send(sendBuffer.Get(), headerLength) && Send(payload, payloadLength);
+		}
+
+		inline bool Publish(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain, uint16_t &packetIdentifier)
+		{
+			return Publish(topicName.data(), static_cast<uint16_t>(topicName.size()), reinterpret_cast<const uint8_t*>(payload.data()), static_cast<uint32_t>(payload.size()), qos, retain, packetIdentifier);
+		}
+
+		bool Subscribe(const char *topicFilter, uint16_t topicFilterLength, uint8_t qos, uint16_t &packetIdentifier)
+		{
+			return SendTopicFilter((MQTT_MSG_SUBSCRIBE << 4) | 0x02, topicFilter, topicFilterLength, qos, true, packetIdentifier);
+		}
+
+		bool Unsubscribe(const char *topicFilter, uint16_t topicFilterLength, uint16_t &packetIdentifier)
+		{
+			return SendTopicFilter((MQTT_MSG_UNSUBSCRIBE << 4) | 0x02, topicFilter, topicFilterLength, 0, false, packetIdentifier);
+		}
+
+		//Waits up to timeout ms for data, then dispatches every complete frame received: handler.OnPublish(topicName, topicNameLength, payload, payloadLength)
+		//for PUBLISH and handler.OnAcknowledged(type, packetIdentifier) for PUBACK, PUBCOMP, SUBACK and UNSUBACK. The pointers are valid during the call only.
+		//Also sends the PINGREQ of the keep alive, so call it at least that often. Returns the number of frames dispatched, -1 once disconnected.
+		//The handler may publish, subscribe or disconnect but not connect again
+		template<class Handler>
+		int32_t Poll(Handler &handler, int32_t timeout)
+		{
+			if (!connected)
+			{
+				return -1;
+			}
+			if (keepAlive > 0 && std::chrono::steady_clock::now() - lastSent >= std::chrono::seconds(keepAlive))
+			{
+				uint8_t pingReq[2] = { MQTT_MSG_PINGREQ << 4, 0x00 };
+				if (!Send(pingReq, sizeof(pingReq)))
+				{
+					return -1;
+				}
+			}
+			uint32_t frameLength;
+			//Frames left over by the previous call are dispatched without waiting
+			int32_t received = transport.Receive(receiveBuffer.Get() + receiveLength, MaxPacket - receiveLength, (FrameLength(receiveBuffer.Get(), receiveLength, frameLength) && frameLength <= receiveLength) ? 0 : timeout);
+			if (received < 0)
+			{
+				Disconnect();
+				return -1;
+			}
+			receiveLength += static_cast<uint32_t>(received);
+			uint8_t *data = receiveBuffer.Get();
+			uint32_t offset = 0;
+			int32_t frames = 0;
+			while (FrameLength(data + offset, receiveLength - offset, frameLength))
+			{
+				if (frameLength > MaxPacket)
+				{
+					LOGI("Frame of %u bytes is longer than the receive buffer", frameLength);
+					Disconnect();
+					return -1;
+				}
+				if (frameLength > receiveLength - offset)
+				{
+					break;
+				}
+				if (!Dispatch(handler, data + offset, frameLength))
+				{
+					Disconnect();
+					return -1;
+				}
+				if (!connected)
+				{
+					//A send of the handler failed, or it disconnected: the receive buffer is already emptied
+					return -1;
+				}
+				offset += frameLength;
+				++frames;
+			}
+			Consume(offset);
+			return connected ? frames : -1;
+		}
+	private:
+		//Returns false until the fixed header is complete. A malformed remaining length reads as a frame too long for any buffer
+		inline static bool FrameLength(const uint8_t *data, uint32_t dataLength, uint32_t &frameLength)
+		{
+			uint32_t remainingLength = 0;
+			uint32_t multiplier = 1;
+			for (uint32_t index = 1; index < dataLength; ++index)
+			{
+				remainingLength += (data[index] & 127) * multiplier;
+				if ((data[index] & 0x80) == 0)
+				{
+					frameLength = 1 + index + remainingLength;
+					return true;
+				}
+				if (index == 4)
+				{
+					frameLength = UINT32_MAX;
+					return true;
+				}
+				multiplier *= 128;
+			}
+			return false;
+		}
+
+		template<class Handler>
+		bool Dispatch(Handler &handler, uint8_t *frame, uint32_t frameLength)
+		{
+			uint32_t index = 1;
+			while ((frame[index++] & 0x80) == 0x80);
+			const uint8_t *body = frame + index;
+			uint32_t bodyLength = frameLength - index;
+			MQTTMessageType type = MQTTMessage::GetMessageType(frame);
+			if (type == MQTT_MSG_PUBLISH)
+			{
+				uint8_t qos = MQTTMessage::GetPublishQos(frame);
+				if (bodyLength < 2)
+				{
+					return false;
+				}
+				uint16_t topicNameLength = (body[0] << 8) | body[1];
+				uint32_t payloadOffset = 2 + topicNameLength + ((qos > 0) ? 2 : 0);
+				if (payloadOffset > bodyLength || !MQTTTopic::IsValidTopicName(reinterpret_cast<const char*>(body + 2), topicNameLength))
+				{
+					return false;
+				}
+				handler.OnPublish(reinterpret_cast<const char*>(body + 2), topicNameLength, body + payloadOffset, bodyLength - payloadOffset);
+				if (qos > 0)
+				{
+					uint16_t publishIdentifier = (body[2 + topicNameLength] << 8) | body[3 + topicNameLength];
+					return SendAcknowledgement((qos == 1) ? (MQTT_MSG_PUBACK << 4) : (MQTT_MSG_PUBREC << 4), publishIdentifier);
+				}
+				return true;
+			}
+			if (type == MQTT_MSG_CONNACK || type == MQTT_MSG_PINGRESP)
+			{
+				return true;
+			}
+			if (bodyLength < 2)
+			{
+				return false;
+			}
+			uint16_t acknowledgedIdentifier = (body[0] << 8) | body[1];
+			switch (type)
+			{
+				case MQTT_MSG_PUBREC:
+					return SendAcknowledgement((MQTT_MSG_PUBREL << 4) | 0x02, acknowledgedIdentifier);
+				case MQTT_MSG_PUBREL:
+					return SendAcknowledgement(MQTT_MSG_PUBCOMP << 4, acknowledgedIdentifier);
+				case MQTT_MSG_PUBACK:
+				case MQTT_MSG_PUBCOMP:
+				case MQTT_MSG_SUBACK:
+				case MQTT_MSG_UNSUBACK:
+					handler.OnAcknowledged(type, acknowledgedIdentifier);
+					return true;
+				default:
+					return false;
+			}
+		}
+
+		bool SendTopicFilter(uint8_t header, const char *topicFilter, uint16_t topicFilterLength, uint8_t qos, bool subscribe, uint16_t &packetIdentifier)
+		{
+			uint32_t remainingLength = 2 /*packet identifier*/ + 2 + topicFilterLength + (subscribe ? 1 : 0);
+			if (!connected || qos > 2 || !MQTTTopic::IsValidTopicFilter(topicFilter, topicFilterLength) || 1 + RemainingLengthBytes(remainingLength) + remainingLength > MaxPacket)
+			{
+				return false;
+			}
+			packetIdentifier = NextPacketIdentifier();
+			uint8_t *ptr = sendBuffer.Get();
+			*ptr++ = header;
+			ptr = WriteRemainingLength(ptr, remainingLength);
+			ptr = WriteShort(ptr, packetIdentifier);
+			ptr = WriteString(ptr, topicFilter, topicFilterLength);
+			if (subscribe)
+			{
+				*ptr++ = qos;
+			}
+			return Send(sendBuffer.Get(), static_cast<uint32_t>(ptr - sendBuffer.Get()));
+		}
+
+		inline bool SendAcknowledgement(uint8_t header, uint16_t acknowledgedIdentifier)
+		{
+			uint8_t acknowledgement[4] = { header, 0x02, static_cast<uint8_t>(acknowledgedIdentifier >> 8), static_cast<uint8_t>(acknowledgedIdentifier & 0xFF) };
+			return Send(acknowledgement, sizeof(acknowledgement));
+		}
+
+		inline bool Send(const uint8_t *data, uint32_t dataLength)
+		{
+			if (!transport.Send(data, dataLength))
+			{
+				connected = false;
+				Disconnect();
+				return false;
+			}
+			lastSent = std::chrono::steady_clock::now();
+			return true;
+		}
+
+		inline void Consume(uint32_t length)
+		{
+			receiveLength -= length;
+			if (receiveLength > 0 && length > 0)
+			{
+				memmove(receiveBuffer.Get(), receiveBuffer.Get() + length, receiveLength);
+			}
+		}
+
+		inline uint16_t NextPacketIdentifier()
+		{
+			//0 is not a valid packet identifier
+			if (++packetIdentifier == 0)
+			{
+				packetIdentifier = 1;
+			}
+			return packetIdentifier;
+		}
+
+		inline static uint32_t RemainingLengthBytes(uint32_t remainingLength)
+		{
+			return (remainingLength < 128) ? 1 : (remainingLength < 16384) ? 2 : (remainingLength < 2097152) ? 3 : 4;
+		}
+
+		inline static uint8_t* WriteRemainingLength(uint8_t *ptr, uint32_t remainingLength)
+		{
+			do
+			{
+				uint8_t digit = remainingLength % 128;
+				remainingLength /= 128;
+				*ptr++ = (remainingLength > 0) ? (digit | 0x80) : digit;
+			} while (remainingLength > 0);
+			return ptr;
+		}
+
+		inline static uint8_t* WriteShort(uint8_t *ptr, uint16_t value)
+		{
+			*ptr++ = static_cast<uint8_t>(value >> 8);
+			*ptr++ = static_cast<uint8_t>(value & 0xFF);
+			return ptr;
+		}
+
+		inline static uint8_t* WriteString(uint8_t *ptr, const char *value, uint16_t valueLength)
+		{
+			ptr = WriteShort(ptr, valueLength);
+			memcpy(ptr, value, valueLength);
+			return ptr + valueLength;
+		}
+	private:
+		Transport transport;
+		MQTTPacketBuffer<Allocator, MaxPacket> sendBuffer;
+		MQTTPacketBuffer<Allocator, MaxPacket> receiveBuffer;
+		uint32_t receiveLength;
+		uint16_t packetIdentifier;
+		uint16_t keepAlive;
+		bool connected;
+		std::chrono::steady_clock::time_point lastSent;
+};
+
+#if defined(__linux__)
+using MQTTPlainClient = BasicMQTTClient<MQTTPlainTransport>;
+#endif
+
+#endif //_BASIC_MQTT_CLIENT_H_
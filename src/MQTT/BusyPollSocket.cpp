@@ -0,0 +1,189 @@
+#include "BusyPollSocket.h"
+#include <errno.h>
+#include <thread>
+#if !defined(WIN32) && !defined(WIN64)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "Utils.h"
+
+BusyPollSocket::BusyPollSocket(int cpu) : cpu(cpu), running(false), looping(false), destroyed(std::make_shared<std::atomic<bool>>(false)), readBuffer(nullptr), readLength(0), readTotal(0)
+{
+}
+
+BusyPollSocket::~BusyPollSocket()
+{
+	*destroyed = true;
+	running = false;
+	//The loop holds this object, wait for it unless it is the one destroying us: it then returns as soon as the callback does
+	while (looping && (loopThread != std::this_thread::get_id()))
+	{
+		std::this_thread::yield();
+	}
+}
+
+void BusyPollSocket::Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback)
+{
+	TCPSocket::Connect(host, port, [this, connectedCallback](bool error)
+	{
+		if (error)
+		{
+			if (connectedCallback)
+			{
+				connectedCallback(FAIL);
+			}
+			return;
+		}
+		//The connect thread becomes the I/O thread
+		SetLowLatencyOptions();
+		loopThread = std::this_thread::get_id();
+		running = true;
+		looping = true;
+		std::shared_ptr<std::atomic<bool>> destroyed = this->destroyed;
+		if (connectedCallback)
+		{
+			connectedCallback(SUCCESS);
+		}
+		if (*destroyed)
+		{
+			return;
+		}
+		Run();
+	});
+}
+
+void BusyPollSocket::ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback)
+{
+	if (bytes == 0)
+	{
+		return;
+	}
+	readBuffer = buffer;
+	readLength = bytes;
+	readTotal = 0;
+	readCallback = receivedCallback;
+}
+
+void BusyPollSocket::Close()
+{
+	running = false;
+	TCPSocket::Close();
+}
+
+bool BusyPollSocket::SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred)
+{
+	bytesTransferred = 0;
+	while (bytesTransferred < dataLength)
+	{
+		int sent = send(sockfd, (char*)data + bytesTransferred, static_cast<int>(dataLength - bytesTransferred), 0);
+		if (sent <= 0)
+		{
+			if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+			{
+				continue;
+			}
+			return false;
+		}
+		bytesTransferred += sent;
+	}
+	return true;
+}
+
+void BusyPollSocket::SetLowLatencyOptions()
+{
+	int opt = 1;
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt)) < 0)
+	{
+		LOGI("Set TCP_NODELAY error");
+	}
+#if defined(__linux__)
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt)) < 0)
+	{
+		LOGI("Set TCP_QUICKACK error");
+	}
+	//Raising it above net.core.busy_poll needs CAP_NET_ADMIN, the spinning recv does not depend on it
+	int busyPoll = BUSY_POLL_SOCKET_BUSY_POLL;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) < 0)
+	{
+		LOGI("Set SO_BUSY_POLL error");
+	}
+	if (cpu >= 0)
+	{
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(cpu, &cpuSet);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0)
+		{
+			LOGI("Pin I/O thread to cpu %d error", cpu);
+		}
+	}
+#endif
+}
+
+void BusyPollSocket::Run()
+{
+	std::shared_ptr<std::atomic<bool>> destroyed = this->destroyed;
+	while (running)
+	{
+		if (readTotal == readLength)
+		{
+			//Nothing asked for, the callback of the last read did not queue another one
+			std::this_thread::yield();
+			continue;
+		}
+		int received = recv(sockfd, (char*)readBuffer + readTotal, static_cast<int>(readLength - readTotal), 0);
+		if (received > 0)
+		{
+			readTotal += received;
+#if defined(__linux__)
+			//The kernel falls back to delayed acks after a while, keep them immediate
+			int opt = 1;
+			setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+#endif
+			if (readTotal == readLength)
+			{
+				std::function<void(bool, std::size_t)> callback;
+				callback.swap(readCallback);
+				if (callback)
+				{
+					callback(SUCCESS, readLength);
+					//The callback may own the socket, release it before looking
+					callback = nullptr;
+					if (*destroyed)
+					{
+						return;
+					}
+				}
+			}
+			continue;
+		}
+		if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+		{
+			continue;
+		}
+		if (running)
+		{
+			LOGI("Read data fail");
+			running = false;
+			std::function<void(bool, std::size_t)> callback;
+			callback.swap(readCallback);
+			if (callback)
+			{
+				callback(FAIL, 0);
+				callback = nullptr;
+				if (*destroyed)
+				{
+					return;
+				}
+			}
+		}
+	}
+	//A read queued after the loop ended never completes, and its callback holds the owner of this socket
+	std::function<void(bool, std::size_t)> callback;
+	callback.swap(readCallback);
+	looping = false;
+}
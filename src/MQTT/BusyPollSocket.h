@@ -0,0 +1,43 @@
+#ifndef _BUSY_POLL_SOCKET_H_
+#define _BUSY_POLL_SOCKET_H_
+#include <atomic>
+#include <thread>
+#include <memory>
+#include "TCPSocket.h"
+
+//Microseconds the kernel busy polls the device queue on a blocking receive (SO_BUSY_POLL)
+#define BUSY_POLL_SOCKET_BUSY_POLL 50
+
+//Low latency TCP socket. Once connected the connect thread stays alive as the only reader, pinned to cpu (-1 leaves it unpinned),
+//spinning on a nonblocking recv instead of waiting in select and delivering every read callback itself.
+//Writes keep the order of the FIFO queue but are sent on the calling thread when no other write is pending, spinning while the kernel
+//buffer is full. Costs one core at 100% while connected
+class BusyPollSocket : public TCPSocket
+{
+	public:
+		BusyPollSocket(int cpu);
+		~BusyPollSocket();
+		void Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback) override;
+		//Only called from callbacks running on the I/O thread, it queues the read for the next turn of the loop
+		void ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback) override;
+		void Close() override;
+	protected:
+		bool SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred) override;
+		bool CallerWriteEnabled() override { return true; };
+	private:
+		void SetLowLatencyOptions();
+		void Run();
+	private:
+		int cpu;
+		std::atomic<bool> running;
+		std::atomic<bool> looping;
+		//Set by the destructor. The loop keeps its own reference and checks it after every callback, which may have destroyed the socket
+		std::shared_ptr<std::atomic<bool>> destroyed;
+		std::thread::id loopThread;
+		uint8_t *readBuffer;
+		std::size_t readLength;
+		std::size_t readTotal;
+		std::function<void(bool, std::size_t)> readCallback;
+};
+
+#endif //_BUSY_POLL_SOCKET_H_
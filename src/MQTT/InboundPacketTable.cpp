@@ -0,0 +1,52 @@
+#include "InboundPacketTable.h"
+#include <string.h>
+
+InboundPacketTable::InboundPacketTable()
+{
+	Reset();
+}
+
+bool InboundPacketTable::MarkReceived(uint16_t packetIdentifier)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t bit = 1ULL << (packetIdentifier % 64);
+	uint64_t &word = words[packetIdentifier / 64];
+	if ((word & bit) != 0)
+	{
+		return false;
+	}
+	word |= bit;
+	++receivedCount;
+	return true;
+}
+
+void InboundPacketTable::Release(uint16_t packetIdentifier)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t bit = 1ULL << (packetIdentifier % 64);
+	uint64_t &word = words[packetIdentifier / 64];
+	if ((word & bit) != 0)
+	{
+		word &= ~bit;
+		--receivedCount;
+	}
+}
+
+bool InboundPacketTable::IsReceived(uint16_t packetIdentifier)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (words[packetIdentifier / 64] & (1ULL << (packetIdentifier % 64))) != 0;
+}
+
+uint32_t InboundPacketTable::GetReceivedCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return receivedCount;
+}
+
+void InboundPacketTable::Reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	memset(words, 0, sizeof(words));
+	receivedCount = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _INBOUND_PACKET_TABLE_H_
+#define _INBOUND_PACKET_TABLE_H_
+#include <stdint.h>
+#include <mutex>
+
+#define INBOUND_PACKET_WORDS (65536 / 64)
+
+//Packet identifiers of inbound QoS2 publishes received but not released yet (MQTT 3.1.1 section 4.3.3, method B).
+//One bit per identifier: 8 KB whatever the broker sends, nothing allocated per message. Belongs to the session so it is only reset with it
+class InboundPacketTable
+{
+	public:
+		InboundPacketTable();
+		~InboundPacketTable() = default;
+		InboundPacketTable(InboundPacketTable&) = delete;
+		InboundPacketTable& operator=(InboundPacketTable&) = delete;
+		//Returns false when the identifier is already waiting for its PUBREL, the publish is then a duplicate and must not be delivered again
+		bool MarkReceived(uint16_t packetIdentifier);
+		void Release(uint16_t packetIdentifier);
+		bool IsReceived(uint16_t packetIdentifier);
+		uint32_t GetReceivedCount();
+		void Reset();
+	private:
+		std::mutex mutex;
+		uint64_t words[INBOUND_PACKET_WORDS];
+		uint32_t receivedCount;
+};
+
+#endif //_INBOUND_PACKET_TABLE_H_
@@ -0,0 +1,268 @@
+#include "MQTTAggregator.h"
+#include <string.h>
+#include "MQTTConfig.h"
+#include "MQTTTopic.h"
+
+//Fixed header, remaining length, topic length and packet identifier of the PUBLISH carrying a batch
+#define MQTT_AGGREGATE_PUBLISH_OVERHEAD 9
+
+static void WriteVariableByteInteger(std::string &payload, uint32_t value)
+{
+	do
+	{
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		if (value > 0)
+		{
+			byte |= 0x80;
+		}
+		payload.push_back(static_cast<char>(byte));
+	} while (value > 0);
+}
+
+static bool ReadVariableByteInteger(const uint8_t *&data, const uint8_t *end, uint32_t &value)
+{
+	value = 0;
+	for (uint8_t shift = 0; shift < 28; shift += 7)
+	{
+		if (data == end)
+		{
+			return false;
+		}
+		uint8_t byte = *data++;
+		value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint8_t VariableByteIntegerLength(uint32_t value)
+{
+	uint8_t length = 1;
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		++length;
+	}
+	return length;
+}
+
+MQTTAggregator::MQTTAggregator(MQTTAggregateCallback aggregateCallback) : aggregateCallback(aggregateCallback), sending(false), queuedCount(0), sentCount(0), running(true)
+{
+	thread = std::thread(&MQTTAggregator::Run, this);
+}
+
+MQTTAggregator::~MQTTAggregator()
+{
+	Flush();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	condition.notify_one();
+	thread.join();
+}
+
+void MQTTAggregator::AddTopicFilter(std::string topicFilter, uint32_t maxMessages, uint32_t lingerTime)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	topicFilters.push_back(std::make_pair(topicFilter, std::make_pair(maxMessages, lingerTime)));
+}
+
+bool MQTTAggregator::Add(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr token)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	Batch *batch = GetBatch(topicName);
+	if (batch == nullptr)
+	{
+		return false;
+	}
+	uint32_t recordLength = VariableByteIntegerLength(static_cast<uint32_t>(payload.size())) + static_cast<uint32_t>(payload.size());
+	if (MQTT_AGGREGATE_MAGIC_LENGTH + recordLength > batch->maxLength)
+	{
+		//Would not fit in a batch of its own. The caller sends it next, after the publishes collected before it
+		if (!batch->tokens.empty())
+		{
+			Queue(topicName, *batch);
+		}
+		SendQueued(lock);
+		WaitSent(lock);
+		return false;
+	}
+	if (!batch->tokens.empty() && ((batch->qos != qos) || (batch->retain != retain) || (batch->payload.size() + recordLength > batch->maxLength)))
+	{
+		Queue(topicName, *batch);
+	}
+	bool first = batch->tokens.empty();
+	if (first)
+	{
+		batch->payload.assign(MQTT_AGGREGATE_MAGIC, MQTT_AGGREGATE_MAGIC_LENGTH);
+		batch->qos = qos;
+		batch->retain = retain;
+		batch->deadline = std::chrono::steady_clock::now() + batch->lingerTime;
+	}
+	WriteVariableByteInteger(batch->payload, static_cast<uint32_t>(payload.size()));
+	batch->payload.append(payload);
+	batch->tokens.push_back(token);
+	if (batch->tokens.size() >= batch->maxMessages)
+	{
+		Queue(topicName, *batch);
+	}
+	else if (first)
+	{
+		condition.notify_one();
+	}
+	SendQueued(lock);
+	return true;
+}
+
+void MQTTAggregator::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (auto &batch : batches)
+	{
+		if (!batch.second.tokens.empty())
+		{
+			Queue(batch.first, batch.second);
+		}
+	}
+	SendQueued(lock);
+	WaitSent(lock);
+}
+
+bool MQTTAggregator::Split(const uint8_t *payload, uint32_t payloadLength, MQTTRecordCallback recordCallback)
+{
+	if ((payloadLength < MQTT_AGGREGATE_MAGIC_LENGTH) || (memcmp(payload, MQTT_AGGREGATE_MAGIC, MQTT_AGGREGATE_MAGIC_LENGTH) != 0))
+	{
+		return false;
+	}
+	const uint8_t *end = payload + payloadLength;
+	//Checked whole before the first record is delivered so a payload that only looks aggregated is passed on untouched
+	const uint8_t *data = payload + MQTT_AGGREGATE_MAGIC_LENGTH;
+	while (data != end)
+	{
+		uint32_t recordLength;
+		if (!ReadVariableByteInteger(data, end, recordLength) || (recordLength > static_cast<uint32_t>(end - data)))
+		{
+			return false;
+		}
+		data += recordLength;
+	}
+	data = payload + MQTT_AGGREGATE_MAGIC_LENGTH;
+	while (data != end)
+	{
+		uint32_t recordLength;
+		ReadVariableByteInteger(data, end, recordLength);
+		recordCallback(data, recordLength);
+		data += recordLength;
+	}
+	return true;
+}
+
+MQTTAggregator::Batch* MQTTAggregator::GetBatch(const std::string &topicName)
+{
+	auto iterator = batches.find(topicName);
+	if (iterator != batches.end())
+	{
+		return &iterator->second;
+	}
+	//Only aggregated topics get a batch, others are matched against the filters on every publish
+	for (auto &topicFilter : topicFilters)
+	{
+		if (MQTTTopic::Matches(topicFilter.first, topicName))
+		{
+			if (MQTT_MAX_MESSAGE_LENGTH <= MQTT_AGGREGATE_PUBLISH_OVERHEAD + MQTT_AGGREGATE_MAGIC_LENGTH + topicName.size())
+			{
+				return nullptr;
+			}
+			Batch &batch = batches[topicName];
+			batch.maxMessages = topicFilter.second.first;
+			batch.lingerTime = std::chrono::milliseconds(topicFilter.second.second);
+			//Keep batches small enough for the receiving side to read them
+			batch.maxLength = static_cast<uint32_t>(MQTT_MAX_MESSAGE_LENGTH - MQTT_AGGREGATE_PUBLISH_OVERHEAD - topicName.size());
+			batch.qos = 0;
+			batch.retain = false;
+			return &batch;
+		}
+	}
+	return nullptr;
+}
+
+void MQTTAggregator::Queue(const std::string &topicName, Batch &batch)
+{
+	outgoing.emplace_back();
+	Outgoing &next = outgoing.back();
+	next.topicName = topicName;
+	next.payload.swap(batch.payload);
+	next.qos = batch.qos;
+	next.retain = batch.retain;
+	next.tokens.swap(batch.tokens);
+	++queuedCount;
+}
+
+void MQTTAggregator::SendQueued(std::unique_lock<std::mutex> &lock)
+{
+	//The thread sending keeps the batches in order, others only queue theirs
+	if (sending)
+	{
+		return;
+	}
+	sending = true;
+	while (!outgoing.empty())
+	{
+		Outgoing next = std::move(outgoing.front());
+		outgoing.pop_front();
+		lock.unlock();
+		aggregateCallback(next.topicName, next.payload, next.qos, next.retain, next.tokens);
+		lock.lock();
+		++sentCount;
+		sentCondition.notify_all();
+	}
+	sending = false;
+}
+
+void MQTTAggregator::WaitSent(std::unique_lock<std::mutex> &lock)
+{
+	uint64_t count = queuedCount;
+	sentCondition.wait(lock, [&]()
+	{
+		return sentCount >= count;
+	});
+}
+
+void MQTTAggregator::Run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (running)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point deadline = now + std::chrono::hours(1);
+		bool expired = false;
+		for (auto &batch : batches)
+		{
+			if (batch.second.tokens.empty())
+			{
+				continue;
+			}
+			if (batch.second.deadline <= now)
+			{
+				Queue(batch.first, batch.second);
+				expired = true;
+			}
+			else if (batch.second.deadline < deadline)
+			{
+				deadline = batch.second.deadline;
+			}
+		}
+		if (expired)
+		{
+			//Batches started while the lock was released are seen on the next pass
+			SendQueued(lock);
+			continue;
+		}
+		condition.wait_until(lock, deadline);
+	}
+}
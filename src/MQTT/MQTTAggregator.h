@@ -0,0 +1,87 @@
+#ifndef _MQTT_AGGREGATOR_H_
+#define _MQTT_AGGREGATOR_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "MQTTToken.h"
+
+//An aggregated payload is the magic followed by one record per publish: its length as an MQTT variable byte integer then its bytes
+#define MQTT_AGGREGATE_MAGIC "\xA6MQB"
+#define MQTT_AGGREGATE_MAGIC_LENGTH 4
+
+//Sends a batch, tokens are those handed out for the publishes it carries
+using MQTTAggregateCallback = std::function<void(std::string &topicName, std::string &payload, uint8_t qos, bool retain, std::vector<MQTTTokenPtr> &tokens)>;
+using MQTTRecordCallback = std::function<void(const uint8_t *record, uint32_t recordLength)>;
+
+//Collects small publishes to the same topic and sends them as one PUBLISH, once maxMessages are collected, lingerTime has passed since
+//the first one or the next one would not fit in MQTT_MAX_MESSAGE_LENGTH. Batches expiring on their linger are sent from a thread of the aggregator.
+//Full batches are queued under the lock and sent outside it, in the order they were queued, by one thread at a time
+class MQTTAggregator
+{
+	public:
+		MQTTAggregator(MQTTAggregateCallback aggregateCallback);
+		~MQTTAggregator();
+		MQTTAggregator(MQTTAggregator&) = delete;
+		MQTTAggregator& operator=(MQTTAggregator&) = delete;
+		//Policies are looked up in the order they were added, the first filter matching the topic wins
+		void AddTopicFilter(std::string topicFilter, uint32_t maxMessages, uint32_t lingerTime);
+		//Returns false when the topic is not aggregated or the payload would not fit in a batch, the publish is then the caller's to send.
+		//The batch collected for the topic before it has been sent by then
+		bool Add(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr token);
+		//Returns once every batch collected so far has been sent
+		void Flush();
+
+		//Calls recordCallback for every record of an aggregated payload. Returns false, without any call, when the payload is not one
+		static bool Split(const uint8_t *payload, uint32_t payloadLength, MQTTRecordCallback recordCallback);
+	private:
+		struct Batch
+		{
+			uint32_t maxMessages;
+			std::chrono::milliseconds lingerTime;
+			uint32_t maxLength;
+			std::string payload;
+			uint8_t qos;
+			bool retain;
+			std::vector<MQTTTokenPtr> tokens;
+			std::chrono::steady_clock::time_point deadline;
+		};
+		//A batch taken out of its topic, waiting to be sent
+		struct Outgoing
+		{
+			std::string topicName;
+			std::string payload;
+			uint8_t qos;
+			bool retain;
+			std::vector<MQTTTokenPtr> tokens;
+		};
+		Batch* GetBatch(const std::string &topicName);
+		//Called with the lock held
+		void Queue(const std::string &topicName, Batch &batch);
+		//Sends the queued batches unless another thread already does, releasing the lock around every send
+		void SendQueued(std::unique_lock<std::mutex> &lock);
+		//Waits until the batches queued so far have been sent
+		void WaitSent(std::unique_lock<std::mutex> &lock);
+		void Run();
+	private:
+		MQTTAggregateCallback aggregateCallback;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::vector<std::pair<std::string, std::pair<uint32_t, uint32_t>>> topicFilters;
+		std::unordered_map<std::string, Batch> batches;
+		std::deque<Outgoing> outgoing;
+		bool sending;
+		uint64_t queuedCount;
+		uint64_t sentCount;
+		std::condition_variable sentCondition;
+		bool running;
+		std::thread thread;
+};
+
+#endif //_MQTT_AGGREGATOR_H_
@@ -0,0 +1,728 @@
+#include "MQTTBridge.h"
+#if defined(__linux__)
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <algorithm>
+#include "MQTTTopic.h"
+#include "Utils.h"
+
+#define MQTT_BRIDGE_POLL_TIMEOUT 200
+#define MQTT_BRIDGE_MAX_EVENTS 64
+//Frames are forwarded from the buffer they are read into, longer ones close their bridge
+#define MQTT_BRIDGE_READ_LENGTH (256 * 1024)
+//Fixed headers, prefixes and packet identifiers written in front of the copies of one read
+#define MQTT_BRIDGE_HEADERS_LENGTH (64 * 1024)
+//The source is not read while the destination has this many bytes unsent or this many copies unacknowledged
+#define MQTT_BRIDGE_HIGH_WATER (1024 * 1024)
+#define MQTT_BRIDGE_MAX_IN_FLIGHT 16384
+
+//Connections of bridge n are registered with epoll as 2n (source) and 2n + 1 (destination)
+#define MQTT_BRIDGE_SOURCE(bridge) ((bridge) * 2)
+#define MQTT_BRIDGE_DESTINATION(bridge) ((bridge) * 2 + 1)
+
+MQTTBridge::MQTTBridge() : epollfd(-1), headers(new uint8_t[MQTT_BRIDGE_HEADERS_LENGTH]), headersLength(0), tick(0), running(false)
+{
+	//Bridges may be added before Start, they connect once the bridge runs
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	segments.reserve(IOV_MAX);
+	mqttConnectedCallback = nullptr;
+	mqttDisconnectedCallback = nullptr;
+}
+
+MQTTBridge::~MQTTBridge()
+{
+	Stop();
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	for (uint32_t bridge = 0; bridge < bridges.size(); ++bridge)
+	{
+		Close(bridge);
+	}
+	if (epollfd != -1)
+	{
+		close(epollfd);
+	}
+}
+
+bool MQTTBridge::Start()
+{
+	if (epollfd == -1)
+	{
+		LOGI("Create epoll fail");
+		return false;
+	}
+	running = true;
+	thread = std::thread(&MQTTBridge::Run, this);
+	return true;
+}
+
+void MQTTBridge::Stop()
+{
+	running = false;
+	if (thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+uint32_t MQTTBridge::AddBridge(MQTTBridgeEndpoint source, MQTTBridgeEndpoint destination)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	uint32_t bridge = static_cast<uint32_t>(bridges.size());
+	bridges.emplace_back();
+	Bridge &added = bridges.back();
+	added.forwardedCount = 0;
+	added.forwardedBytes = 0;
+	added.source.state = MQTTBridgeState::CLOSED;
+	added.destination.state = MQTTBridgeState::CLOSED;
+	if (!Connect(MQTT_BRIDGE_SOURCE(bridge), added.source, source) || !Connect(MQTT_BRIDGE_DESTINATION(bridge), added.destination, destination))
+	{
+		Close(bridge);
+	}
+	return bridge;
+}
+
+void MQTTBridge::AddRule(uint32_t bridge, std::string topicFilter, std::string localPrefix, std::string remotePrefix, uint8_t qos)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	if (bridge < bridges.size())
+	{
+		bridges[bridge].rules.push_back({ topicFilter, localPrefix, remotePrefix, qos });
+	}
+}
+
+bool MQTTBridge::IsConnected(uint32_t bridge)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return (bridge < bridges.size()) && (bridges[bridge].source.state == MQTTBridgeState::CONNECTED) && (bridges[bridge].destination.state == MQTTBridgeState::CONNECTED);
+}
+
+uint64_t MQTTBridge::GetForwardedCount(uint32_t bridge)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return (bridge < bridges.size()) ? bridges[bridge].forwardedCount : 0;
+}
+
+uint64_t MQTTBridge::GetForwardedBytes(uint32_t bridge)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return (bridge < bridges.size()) ? bridges[bridge].forwardedBytes : 0;
+}
+
+void MQTTBridge::MQTTOnConnected(MQTTBridgeCallback mqttConnectedCallback)
+{
+	this->mqttConnectedCallback = mqttConnectedCallback;
+}
+
+void MQTTBridge::MQTTOnDisconnected(MQTTBridgeCallback mqttDisconnectedCallback)
+{
+	this->mqttDisconnectedCallback = mqttDisconnectedCallback;
+}
+
+void MQTTBridge::Run()
+{
+	struct epoll_event events[MQTT_BRIDGE_MAX_EVENTS];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (running)
+	{
+		int count = epoll_wait(epollfd, events, MQTT_BRIDGE_MAX_EVENTS, MQTT_BRIDGE_POLL_TIMEOUT);
+		if ((count < 0) && (errno != EINTR))
+		{
+			LOGI("Poll error");
+			break;
+		}
+		std::lock_guard<std::recursive_mutex> lock(mutex);
+		for (int i = 0; i < count; ++i)
+		{
+			uint32_t bridge = events[i].data.u32 / 2;
+			Connection &connection = (events[i].data.u32 & 1) ? bridges[bridge].destination : bridges[bridge].source;
+			if ((connection.state != MQTTBridgeState::CLOSED) && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			{
+				HandleWritable(bridge, connection);
+			}
+			if ((connection.state != MQTTBridgeState::CLOSED) && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			{
+				HandleReadable(bridge, connection);
+			}
+			if (connection.state != MQTTBridgeState::CLOSED)
+			{
+				UpdateEvents(bridge);
+			}
+		}
+		uint32_t now = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count());
+		if (now != tick)
+		{
+			tick = now;
+			KeepAlive();
+		}
+	}
+}
+
+bool MQTTBridge::Connect(uint32_t index, Connection &connection, MQTTBridgeEndpoint &endpoint)
+{
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(endpoint.port);
+	if ((epollfd == -1) || (inet_pton(AF_INET, endpoint.host.c_str(), &address.sin_addr.s_addr) <= 0))
+	{
+		LOGI("Invalid address");
+		return false;
+	}
+	connection.sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (connection.sockfd < 0)
+	{
+		LOGI("Create socket fail");
+		return false;
+	}
+	if ((connect(connection.sockfd, (struct sockaddr*)&address, sizeof(address)) < 0) && (errno != EINPROGRESS))
+	{
+		LOGI("Failed to connect to server");
+		close(connection.sockfd);
+		return false;
+	}
+	connection.events = EPOLLIN | EPOLLOUT;
+	struct epoll_event event;
+	event.events = connection.events;
+	event.data.u32 = index;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connection.sockfd, &event) < 0)
+	{
+		LOGI("Register socket fail");
+		close(connection.sockfd);
+		return false;
+	}
+	connection.state = MQTTBridgeState::CONNECTING;
+	connection.keepAlive = endpoint.mqttConnectOptions.GetKeepAlive();
+	connection.packetIdentifier = 0;
+	connection.lastSent = tick;
+	connection.readBuffer.reset(new uint8_t[MQTT_BRIDGE_READ_LENGTH]);
+	connection.readLength = 0;
+	connection.writeOffset = 0;
+	//Waits in the write buffer until the TCP handshake completes
+	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageConnect(endpoint.clientID, endpoint.mqttConnectOptions);
+	connection.writeBuffer.assign(mqttMessage->GetMessageData(), mqttMessage->GetMessageData() + mqttMessage->GetMessageLength());
+	return true;
+}
+
+void MQTTBridge::HandleWritable(uint32_t bridge, Connection &connection)
+{
+	if (connection.state == MQTTBridgeState::CONNECTING)
+	{
+		int error = 0;
+		socklen_t errorLength = sizeof(error);
+		if ((getsockopt(connection.sockfd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0) || (error != 0))
+		{
+			LOGI("Failed to connect to server");
+			Close(bridge);
+			return;
+		}
+		connection.state = MQTTBridgeState::WAIT_CONNACK;
+	}
+	while (connection.writeOffset < connection.writeBuffer.size())
+	{
+		ssize_t sent = send(connection.sockfd, connection.writeBuffer.data() + connection.writeOffset, connection.writeBuffer.size() - connection.writeOffset, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			{
+				return;
+			}
+			LOGI("Write data error");
+			Close(bridge);
+			return;
+		}
+		connection.writeOffset += static_cast<std::size_t>(sent);
+	}
+	connection.writeBuffer.clear();
+	connection.writeOffset = 0;
+}
+
+void MQTTBridge::HandleReadable(uint32_t bridge, Connection &connection)
+{
+	bool source = &connection == &bridges[bridge].source;
+	uint8_t *buffer = connection.readBuffer.get();
+	ssize_t received = recv(connection.sockfd, buffer + connection.readLength, MQTT_BRIDGE_READ_LENGTH - connection.readLength, 0);
+	if (received <= 0)
+	{
+		if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+		{
+			return;
+		}
+		LOGI("Read data fail");
+		Close(bridge);
+		return;
+	}
+	uint32_t total = connection.readLength + static_cast<uint32_t>(received);
+	uint32_t offset = 0;
+	while (connection.state != MQTTBridgeState::CLOSED)
+	{
+		uint8_t *frame = buffer + offset;
+		uint32_t available = total - offset;
+		uint32_t remainingLength = 0;
+		uint32_t multiplier = 1;
+		uint32_t index = 1;
+		bool complete = false;
+		while ((index < available) && (index <= 4))
+		{
+			remainingLength += (frame[index] & 127) * multiplier;
+			multiplier *= 128;
+			if ((frame[index++] & 0x80) == 0)
+			{
+				complete = true;
+				break;
+			}
+		}
+		if (!complete)
+		{
+			if (index > 4)
+			{
+				LOGI("Malformed remaining length");
+				Close(bridge);
+				return;
+			}
+			break;
+		}
+		uint32_t frameLength = index + remainingLength;
+		if (frameLength > MQTT_BRIDGE_READ_LENGTH)
+		{
+			LOGI("Frame of %u bytes is too long", frameLength);
+			Close(bridge);
+			return;
+		}
+		if (available < frameLength)
+		{
+			break;
+		}
+		if (source)
+		{
+			HandleSourceFrame(bridge, frame, frameLength);
+		}
+		else
+		{
+			HandleDestinationFrame(bridge, frame);
+		}
+		offset += frameLength;
+	}
+	if (connection.state == MQTTBridgeState::CLOSED)
+	{
+		return;
+	}
+	if (source)
+	{
+		//The copies point into the read buffer, they must be out of it before the next read
+		FlushForwarded(bridge);
+		if (connection.state == MQTTBridgeState::CLOSED)
+		{
+			return;
+		}
+	}
+	connection.readLength = total - offset;
+	if ((connection.readLength > 0) && (offset > 0))
+	{
+		memmove(buffer, buffer + offset, connection.readLength);
+	}
+}
+
+void MQTTBridge::HandleSourceFrame(uint32_t bridge, uint8_t *frame, uint32_t frameLength)
+{
+	Bridge &current = bridges[bridge];
+	switch (MQTTMessage::GetMessageType(frame))
+	{
+		case MQTTMessageType::MQTT_MSG_CONNACK:
+		{
+			if (MQTTMessage::GetConnectReturnCode(frame) != MQTT_CONNECTION_ACCEPTED)
+			{
+				LOGI("Bridge %u not accepted by the source broker", bridge);
+				Close(bridge);
+				break;
+			}
+			current.source.state = MQTTBridgeState::CONNECTED;
+			HandleConnected(bridge);
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBLISH:
+		{
+			if (!MQTTMessage::IsWellFormedPublish(frame, frameLength))
+			{
+				LOGI("Bridge %u received a malformed publish", bridge);
+				Close(bridge);
+				break;
+			}
+			uint16_t topicLength;
+			const char *topicName = MQTTMessage::GetPublishTopicName(frame, topicLength);
+			for (const Rule &rule : current.rules)
+			{
+				if (MQTTTopic::Matches(rule.topicFilter.data(), rule.topicFilter.size(), topicName, topicLength))
+				{
+					Forward(bridge, rule, frame, frameLength);
+					return;
+				}
+			}
+			//Matches none of the rules, as when a subscription of an earlier session is still there: acknowledged and dropped
+			uint8_t qos = MQTTMessage::GetPublishQos(frame);
+			if (qos == 1)
+			{
+				WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubAck(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			else if (qos == 2)
+			{
+				WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubRec(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBREL:
+		{
+			WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubComp(MQTTMessage::GetPacketIdentifier(frame)));
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void MQTTBridge::HandleDestinationFrame(uint32_t bridge, uint8_t *frame)
+{
+	Bridge &current = bridges[bridge];
+	switch (MQTTMessage::GetMessageType(frame))
+	{
+		case MQTTMessageType::MQTT_MSG_CONNACK:
+		{
+			if (MQTTMessage::GetConnectReturnCode(frame) != MQTT_CONNECTION_ACCEPTED)
+			{
+				LOGI("Bridge %u not accepted by the destination broker", bridge);
+				Close(bridge);
+				break;
+			}
+			current.destination.state = MQTTBridgeState::CONNECTED;
+			HandleConnected(bridge);
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBACK:
+		{
+			//The copy is safe at the destination, the source may now forget the original
+			auto forwarded = current.inFlight.find(MQTTMessage::GetPacketIdentifier(frame));
+			if (forwarded == current.inFlight.end())
+			{
+				break;
+			}
+			Forwarded original = forwarded->second;
+			current.inFlight.erase(forwarded);
+			if (original.qos == 1)
+			{
+				WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubAck(original.packetIdentifier));
+			}
+			else
+			{
+				WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubRec(original.packetIdentifier));
+			}
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBLISH:
+		{
+			//Nothing is subscribed at the destination, a publish of an earlier session is acknowledged and dropped
+			uint8_t qos = MQTTMessage::GetPublishQos(frame);
+			if (qos == 1)
+			{
+				WriteMessage(bridge, current.destination, MQTTMessage::MQTTMessagePubAck(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			else if (qos == 2)
+			{
+				WriteMessage(bridge, current.destination, MQTTMessage::MQTTMessagePubRec(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBREL:
+		{
+			WriteMessage(bridge, current.destination, MQTTMessage::MQTTMessagePubComp(MQTTMessage::GetPacketIdentifier(frame)));
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void MQTTBridge::HandleConnected(uint32_t bridge)
+{
+	Bridge &current = bridges[bridge];
+	if ((current.source.state != MQTTBridgeState::CONNECTED) || (current.destination.state != MQTTBridgeState::CONNECTED))
+	{
+		return;
+	}
+	//Subscribed only now so nothing arrives before it can be forwarded
+	if (!current.rules.empty())
+	{
+		std::vector<std::pair<std::string, uint8_t>> topicFilters;
+		for (const Rule &rule : current.rules)
+		{
+			topicFilters.push_back(std::make_pair(rule.topicFilter, rule.qos));
+		}
+		//The only packet with an identifier the bridge sends to the source, its SUBACK is not waited for
+		if (!WriteMessage(bridge, current.source, MQTTMessage::MQTTMessageSubscribe(topicFilters, 1)))
+		{
+			return;
+		}
+	}
+	if (mqttConnectedCallback)
+	{
+		mqttConnectedCallback(bridge);
+	}
+}
+
+void MQTTBridge::Forward(uint32_t bridge, const Rule &rule, uint8_t *frame, uint32_t frameLength)
+{
+	Bridge &current = bridges[bridge];
+	uint8_t remainingLengthBytes;
+	MQTTMessage::GetRemainingLength(frame, remainingLengthBytes);
+	uint8_t *topic = frame + 1 + remainingLengthBytes + 2;
+	uint16_t topicLength = static_cast<uint16_t>((topic[-2] << 8) | topic[-1]);
+	uint8_t qos = MQTTMessage::GetPublishQos(frame);
+	uint16_t packetIdentifier = (qos > 0) ? static_cast<uint16_t>((topic[topicLength] << 8) | topic[topicLength + 1]) : 0;
+	uint8_t *payload = topic + topicLength + ((qos > 0) ? 2 : 0);
+	uint32_t payloadLength = static_cast<uint32_t>(frame + frameLength - payload);
+	//Only the prefix changes, the rest of the topic is copied from the frame
+	uint16_t keptLength = topicLength;
+	const std::string *prefix = nullptr;
+	if ((rule.localPrefix.size() <= topicLength) && (memcmp(topic, rule.localPrefix.data(), rule.localPrefix.size()) == 0))
+	{
+		keptLength = static_cast<uint16_t>(topicLength - rule.localPrefix.size());
+		prefix = &rule.remotePrefix;
+	}
+	uint32_t forwardedTopicLength = keptLength + (prefix ? static_cast<uint32_t>(prefix->size()) : 0);
+	uint8_t forwardedQos = std::min<uint8_t>(std::min<uint8_t>(qos, rule.qos), 1);
+	if (forwardedTopicLength > 0xFFFF)
+	{
+		LOGI("Forwarded topic is too long, publish dropped");
+	}
+	else
+	{
+		uint32_t headerLength = 1 + 4 + 2 + (prefix ? static_cast<uint32_t>(prefix->size()) : 0) + 2;
+		if ((headersLength + headerLength > MQTT_BRIDGE_HEADERS_LENGTH) || (segments.size() + 4 > IOV_MAX))
+		{
+			FlushForwarded(bridge);
+			if (current.source.state == MQTTBridgeState::CLOSED)
+			{
+				return;
+			}
+		}
+		uint16_t forwardedPacketIdentifier = (forwardedQos > 0) ? NextPacketIdentifier(current) : 0;
+		uint32_t remainingLength = 2 + forwardedTopicLength + ((forwardedQos > 0) ? 2 : 0) + payloadLength;
+		uint8_t *header = headers.get() + headersLength;
+		uint8_t *end = header;
+		*end++ = static_cast<uint8_t>((MQTT_MSG_PUBLISH << 4) | (forwardedQos << 1) | (frame[0] & 0x01));
+		do
+		{
+			uint8_t byte = remainingLength & 0x7F;
+			remainingLength >>= 7;
+			*end++ = byte | ((remainingLength > 0) ? 0x80 : 0);
+		} while (remainingLength > 0);
+		*end++ = static_cast<uint8_t>(forwardedTopicLength >> 8);
+		*end++ = static_cast<uint8_t>(forwardedTopicLength & 0xFF);
+		if (prefix)
+		{
+			memcpy(end, prefix->data(), prefix->size());
+			end += prefix->size();
+		}
+		segments.push_back({ header, static_cast<std::size_t>(end - header) });
+		uint8_t *kept = topic + topicLength - keptLength;
+		if (forwardedQos > 0)
+		{
+			segments.push_back({ kept, keptLength });
+			uint8_t *identifier = end;
+			*end++ = static_cast<uint8_t>(forwardedPacketIdentifier >> 8);
+			*end++ = static_cast<uint8_t>(forwardedPacketIdentifier & 0xFF);
+			segments.push_back({ identifier, 2 });
+			segments.push_back({ payload, payloadLength });
+		}
+		else if (qos == 0)
+		{
+			//Topic rest and payload are adjacent in the frame
+			segments.push_back({ kept, keptLength + payloadLength });
+		}
+		else
+		{
+			segments.push_back({ kept, keptLength });
+			segments.push_back({ payload, payloadLength });
+		}
+		headersLength += static_cast<uint32_t>(end - header);
+		++current.forwardedCount;
+		current.forwardedBytes += payloadLength;
+		if (forwardedQos > 0)
+		{
+			current.inFlight[forwardedPacketIdentifier] = { packetIdentifier, qos };
+			return;
+		}
+	}
+	//Nothing will acknowledge the copy, the original is acknowledged once the copy is handed on
+	if (qos == 1)
+	{
+		WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubAck(packetIdentifier));
+	}
+	else if (qos == 2)
+	{
+		WriteMessage(bridge, current.source, MQTTMessage::MQTTMessagePubRec(packetIdentifier));
+	}
+}
+
+void MQTTBridge::FlushForwarded(uint32_t bridge)
+{
+	if (segments.empty())
+	{
+		return;
+	}
+	Connection &destination = bridges[bridge].destination;
+	bool success = Write(destination, segments.data(), static_cast<int>(segments.size()));
+	segments.clear();
+	headersLength = 0;
+	if (!success)
+	{
+		LOGI("Write data error");
+		Close(bridge);
+	}
+}
+
+bool MQTTBridge::Write(Connection &connection, const struct iovec *segments, int segmentCount)
+{
+	connection.lastSent = tick;
+	std::size_t sent = 0;
+	if ((connection.writeOffset == connection.writeBuffer.size()) && (connection.state != MQTTBridgeState::CONNECTING))
+	{
+		//Most writes go straight to the socket, only what it does not take is copied
+		ssize_t written = writev(connection.sockfd, segments, segmentCount);
+		if (written < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				return false;
+			}
+			written = 0;
+		}
+		sent = static_cast<std::size_t>(written);
+	}
+	for (int i = 0; i < segmentCount; ++i)
+	{
+		if (sent >= segments[i].iov_len)
+		{
+			sent -= segments[i].iov_len;
+			continue;
+		}
+		const uint8_t *data = static_cast<const uint8_t*>(segments[i].iov_base);
+		connection.writeBuffer.insert(connection.writeBuffer.end(), data + sent, data + segments[i].iov_len);
+		sent = 0;
+	}
+	return true;
+}
+
+bool MQTTBridge::WriteMessage(uint32_t bridge, Connection &connection, std::unique_ptr<MQTTMessage> mqttMessage)
+{
+	if (!mqttMessage)
+	{
+		return false;
+	}
+	//Write copies what the socket does not take right away
+	struct iovec segment = { mqttMessage->GetMessageData(), mqttMessage->GetMessageLength() };
+	bool success = Write(connection, &segment, 1);
+	if (!success)
+	{
+		LOGI("Write data error");
+		Close(bridge);
+		return false;
+	}
+	return true;
+}
+
+void MQTTBridge::UpdateEvents(uint32_t bridge)
+{
+	Bridge &current = bridges[bridge];
+	//Reading the source stops while the destination falls behind, TCP then slows the source broker down
+	bool destinationBehind = (current.destination.writeBuffer.size() - current.destination.writeOffset > MQTT_BRIDGE_HIGH_WATER) || (current.inFlight.size() >= MQTT_BRIDGE_MAX_IN_FLIGHT);
+	Connection *connections[2] = { &current.source, &current.destination };
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		Connection &connection = *connections[i];
+		uint32_t events = ((i == 0) && destinationBehind) ? 0 : static_cast<uint32_t>(EPOLLIN);
+		if ((connection.state == MQTTBridgeState::CONNECTING) || (connection.writeOffset < connection.writeBuffer.size()))
+		{
+			events |= EPOLLOUT;
+		}
+		if (events != connection.events)
+		{
+			struct epoll_event event;
+			event.events = events;
+			event.data.u32 = (i == 0) ? MQTT_BRIDGE_SOURCE(bridge) : MQTT_BRIDGE_DESTINATION(bridge);
+			epoll_ctl(epollfd, EPOLL_CTL_MOD, connection.sockfd, &event);
+			connection.events = events;
+		}
+	}
+}
+
+void MQTTBridge::Close(uint32_t bridge)
+{
+	Bridge &current = bridges[bridge];
+	bool connected = (current.source.state == MQTTBridgeState::CONNECTED) && (current.destination.state == MQTTBridgeState::CONNECTED);
+	bool open = false;
+	Connection *connections[2] = { &current.source, &current.destination };
+	for (Connection *connection : connections)
+	{
+		if (connection->state == MQTTBridgeState::CLOSED)
+		{
+			continue;
+		}
+		open = true;
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->sockfd, nullptr);
+		close(connection->sockfd);
+		connection->state = MQTTBridgeState::CLOSED;
+		connection->readBuffer.reset();
+		connection->readLength = 0;
+		std::vector<uint8_t>().swap(connection->writeBuffer);
+		connection->writeOffset = 0;
+	}
+	//Originals not acknowledged yet are sent again by the source broker when the bridge connects with a persistent session
+	current.inFlight.clear();
+	if (open && connected && mqttDisconnectedCallback)
+	{
+		mqttDisconnectedCallback(bridge);
+	}
+}
+
+void MQTTBridge::KeepAlive()
+{
+	//A ping is due once a connection wrote nothing for its whole keep alive period
+	for (uint32_t bridge = 0; bridge < bridges.size(); ++bridge)
+	{
+		Connection *connections[2] = { &bridges[bridge].source, &bridges[bridge].destination };
+		for (Connection *connection : connections)
+		{
+			if ((connection->state == MQTTBridgeState::CONNECTED) && (connection->keepAlive > 0) && (tick - connection->lastSent >= connection->keepAlive))
+			{
+				if (!WriteMessage(bridge, *connection, MQTTMessage::MQTTMessagePingReq()))
+				{
+					break;
+				}
+			}
+		}
+		if (bridges[bridge].source.state != MQTTBridgeState::CLOSED)
+		{
+			UpdateEvents(bridge);
+		}
+	}
+}
+
+uint16_t MQTTBridge::NextPacketIdentifier(Bridge &bridge)
+{
+	//Identifiers of copies still waiting for their PUBACK are skipped
+	do
+	{
+		if (++bridge.destination.packetIdentifier == 0)
+		{
+			bridge.destination.packetIdentifier = 1;
+		}
+	} while (bridge.inFlight.count(bridge.destination.packetIdentifier) > 0);
+	return bridge.destination.packetIdentifier;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef _MQTT_BRIDGE_H_
+#define _MQTT_BRIDGE_H_
+#if defined(__linux__)
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "MQTTConnectOptions.h"
+#include "MQTTMessage.h"
+
+enum class MQTTBridgeState : uint8_t
+{
+	CONNECTING = 0x01, //TCP handshake in progress, CONNECT waits in the write buffer
+	WAIT_CONNACK,
+	CONNECTED,
+	CLOSED
+};
+
+struct MQTTBridgeEndpoint
+{
+	std::string host; //IPv4 address
+	uint32_t port;
+	std::string clientID;
+	MQTTConnectOptions mqttConnectOptions;
+};
+
+using MQTTBridgeCallback = std::function<void(uint32_t bridge)>;
+
+//Copies publishes from a source broker to a destination broker. Many bridges, each a pair of connections, are driven by one thread over epoll.
+//Forwarded PUBLISH frames are not decoded: a new fixed header, topic prefix and packet identifier are written in front of the topic rest and
+//payload, which go out from the buffer they were read into. The acknowledgement of a QoS1 or QoS2 publish to the source is held until the
+//destination acknowledged its copy. Copies are sent with QoS1 at most, so a QoS2 publish is delivered at least once, not exactly once.
+//Bridges are referred to by the index AddBridge returns. A bridge losing either connection is closed, callbacks run on the bridge thread
+class MQTTBridge
+{
+	public:
+		MQTTBridge();
+		~MQTTBridge();
+		MQTTBridge(MQTTBridge&) = delete;
+		MQTTBridge& operator=(MQTTBridge&) = delete;
+		bool Start();
+		void Stop();
+		//Starts connecting both ends right away, the rules are subscribed at the source once both are connected. Returns the index of the bridge
+		uint32_t AddBridge(MQTTBridgeEndpoint source, MQTTBridgeEndpoint destination);
+		//Forward source publishes matching topicFilter, localPrefix of their topic replaced by remotePrefix, with a QoS up to qos.
+		//Rules are looked up in the order they were added, the first filter matching the topic wins. Call before the bridge is connected
+		void AddRule(uint32_t bridge, std::string topicFilter, std::string localPrefix, std::string remotePrefix, uint8_t qos);
+		bool IsConnected(uint32_t bridge);
+		uint64_t GetForwardedCount(uint32_t bridge);
+		uint64_t GetForwardedBytes(uint32_t bridge);
+
+		void MQTTOnConnected(MQTTBridgeCallback mqttConnectedCallback);
+		void MQTTOnDisconnected(MQTTBridgeCallback mqttDisconnectedCallback);
+	private:
+		struct Connection
+		{
+			int sockfd;
+			MQTTBridgeState state;
+			uint32_t events; //Registered with epoll
+			uint16_t keepAlive;
+			uint16_t packetIdentifier; //Last one used for a copy sent to the destination
+			uint32_t lastSent; //Bridge tick of the last frame written
+			std::unique_ptr<uint8_t[]> readBuffer;
+			uint32_t readLength; //Start of a frame not fully received yet
+			std::vector<uint8_t> writeBuffer; //Bytes the socket did not take yet
+			std::size_t writeOffset;
+		};
+		struct Rule
+		{
+			std::string topicFilter;
+			std::string localPrefix;
+			std::string remotePrefix;
+			uint8_t qos;
+		};
+		//Source publish waiting for the destination to acknowledge its copy
+		struct Forwarded
+		{
+			uint16_t packetIdentifier;
+			uint8_t qos;
+		};
+		struct Bridge
+		{
+			Connection source;
+			Connection destination;
+			std::vector<Rule> rules;
+			std::unordered_map<uint16_t, Forwarded> inFlight;
+			uint64_t forwardedCount;
+			uint64_t forwardedBytes;
+		};
+		void Run();
+		bool Connect(uint32_t index, Connection &connection, MQTTBridgeEndpoint &endpoint);
+		void HandleWritable(uint32_t bridge, Connection &connection);
+		void HandleReadable(uint32_t bridge, Connection &connection);
+		void HandleSourceFrame(uint32_t bridge, uint8_t *frame, uint32_t frameLength);
+		void HandleDestinationFrame(uint32_t bridge, uint8_t *frame);
+		void HandleConnected(uint32_t bridge);
+		void Forward(uint32_t bridge, const Rule &rule, uint8_t *frame, uint32_t frameLength);
+		void FlushForwarded(uint32_t bridge);
+		bool Write(Connection &connection, const struct iovec *segments, int segmentCount);
+		bool WriteMessage(uint32_t bridge, Connection &connection, std::unique_ptr<MQTTMessage> mqttMessage);
+		void UpdateEvents(uint32_t bridge);
+		void Close(uint32_t bridge);
+		void KeepAlive();
+		uint16_t NextPacketIdentifier(Bridge &bridge);
+	private:
+		int epollfd;
+		std::recursive_mutex mutex;
+		//Elements of a deque stay in place when bridges are added from a callback
+		std::deque<Bridge> bridges;
+		//Copies collected over one read of a source, written to the destination with one writev
+		std::vector<struct iovec> segments;
+		std::unique_ptr<uint8_t[]> headers;
+		uint32_t headersLength;
+		uint32_t tick;
+		std::atomic<bool> running;
+		std::thread thread;
+		MQTTBridgeCallback mqttConnectedCallback;
+		MQTTBridgeCallback mqttDisconnectedCallback;
+};
+
+#endif
+#endif //_MQTT_BRIDGE_H_
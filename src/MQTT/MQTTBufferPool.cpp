@@ -0,0 +1,56 @@
+#include "MQTTBufferPool.h"
+
+MQTTBufferPool::MQTTBufferPool(uint32_t blockLength, uint32_t maxFreeBlocks) : blockLength(blockLength), maxFreeBlocks(maxFreeBlocks), leased(0)
+{
+}
+
+MQTTBufferPool::~MQTTBufferPool()
+{
+	for (uint8_t *block : freeBlocks)
+	{
+		delete[] block;
+	}
+}
+
+uint8_t* MQTTBufferPool::Acquire(uint32_t length, uint32_t &capacity)
+{
+	++leased;
+	if (length > blockLength)
+	{
+		capacity = length;
+		return new uint8_t[length];
+	}
+	capacity = blockLength;
+	if (freeBlocks.empty())
+	{
+		return new uint8_t[blockLength];
+	}
+	uint8_t *block = freeBlocks.back();
+	freeBlocks.pop_back();
+	return block;
+}
+
+void MQTTBufferPool::Release(uint8_t *buffer, uint32_t capacity)
+{
+	if (buffer == nullptr)
+	{
+		return;
+	}
+	--leased;
+	if ((capacity != blockLength) || (freeBlocks.size() >= maxFreeBlocks))
+	{
+		delete[] buffer;
+		return;
+	}
+	freeBlocks.push_back(buffer);
+}
+
+uint32_t MQTTBufferPool::GetLeasedCount()
+{
+	return leased;
+}
+
+uint32_t MQTTBufferPool::GetFreeCount()
+{
+	return static_cast<uint32_t>(freeBlocks.size());
+}
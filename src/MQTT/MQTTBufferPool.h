@@ -0,0 +1,28 @@
+#ifndef _MQTT_BUFFER_POOL_H_
+#define _MQTT_BUFFER_POOL_H_
+#include <stdint.h>
+#include <vector>
+
+//Fixed size blocks shared by many connections and lent only while one of them has a frame partly read or partly written.
+//Longer requests get a buffer of their own, freed on release. Not thread safe, it belongs to the thread running the connections
+class MQTTBufferPool
+{
+	public:
+		//Up to maxFreeBlocks released blocks are kept for reuse, the others are freed
+		MQTTBufferPool(uint32_t blockLength, uint32_t maxFreeBlocks);
+		~MQTTBufferPool();
+		MQTTBufferPool(MQTTBufferPool&) = delete;
+		MQTTBufferPool& operator=(MQTTBufferPool&) = delete;
+		//Returns a buffer of at least length bytes, its actual length is written to capacity and must be handed back to Release
+		uint8_t* Acquire(uint32_t length, uint32_t &capacity);
+		void Release(uint8_t *buffer, uint32_t capacity);
+		uint32_t GetLeasedCount();
+		uint32_t GetFreeCount();
+	private:
+		uint32_t blockLength;
+		uint32_t maxFreeBlocks;
+		std::vector<uint8_t*> freeBlocks;
+		uint32_t leased;
+};
+
+#endif //_MQTT_BUFFER_POOL_H_
@@ -0,0 +1,338 @@
+#include "MQTTCapture.h"
+#include <string.h>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "Utils.h"
+
+static inline std::size_t AlignRecord(std::size_t length)
+{
+	return (length + 7) & ~static_cast<std::size_t>(7);
+}
+
+static inline uint64_t MonotonicNanoseconds()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static bool WriteAll(int fd, const uint8_t *data, std::size_t dataLength)
+{
+	while (dataLength > 0)
+	{
+#if defined(WIN32) || defined(WIN64)
+		int written = _write(fd, data, static_cast<unsigned int>(dataLength));
+#else
+		ssize_t written = write(fd, data, dataLength);
+#endif
+		if (written <= 0)
+		{
+			return false;
+		}
+		data += written;
+		dataLength -= written;
+	}
+	return true;
+}
+
+MQTTCaptureWriter::MQTTCaptureWriter() : fd(-1), bufferIndex(0), startTime(0), bufferCount(0), queuedCount(0), writtenCount(0), running(false)
+{
+}
+
+MQTTCaptureWriter::~MQTTCaptureWriter()
+{
+	Close();
+}
+
+bool MQTTCaptureWriter::Open(std::string path)
+{
+	Close();
+	std::lock_guard<std::mutex> lock(mutex);
+#if defined(WIN32) || defined(WIN64)
+	fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (fd < 0)
+	{
+		LOGI("Cannot create capture file %s", path.c_str());
+		return false;
+	}
+	buffer.reset(new uint8_t[MQTT_CAPTURE_BUFFER_LENGTH]);
+	bufferCount = 1;
+	bufferIndex = 0;
+	startTime = MonotonicNanoseconds();
+	MQTTCaptureFileHeader header;
+	memcpy(header.magic, MQTT_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = MQTT_CAPTURE_VERSION;
+	header.reserved = 0;
+	header.startTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	memcpy(buffer.get(), &header, sizeof(header));
+	bufferIndex = sizeof(header);
+	running = true;
+	thread = std::thread(&MQTTCaptureWriter::Run, this);
+	return true;
+}
+
+void MQTTCaptureWriter::Record(MQTTCaptureDirection direction, const uint8_t *data, std::size_t dataLength)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	uint8_t *ptr = Reserve(lock, direction, dataLength, 0);
+	if (ptr)
+	{
+		memcpy(ptr, data, dataLength);
+	}
+}
+
+void MQTTCaptureWriter::Record(MQTTCaptureDirection direction, const std::vector<DataSegment> &segments, uint8_t flags)
+{
+	std::size_t frameLength = 0;
+	for (const DataSegment &segment : segments)
+	{
+		frameLength += segment.length;
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	uint8_t *ptr = Reserve(lock, direction, frameLength, flags);
+	if (ptr)
+	{
+		for (const DataSegment &segment : segments)
+		{
+			memcpy(ptr, segment.data, segment.length);
+			ptr += segment.length;
+		}
+	}
+}
+
+uint8_t* MQTTCaptureWriter::Reserve(std::unique_lock<std::mutex> &lock, MQTTCaptureDirection direction, std::size_t frameLength, uint8_t flags)
+{
+	if ((fd < 0) || !running)
+	{
+		return nullptr;
+	}
+	std::size_t recordLength = AlignRecord(sizeof(MQTTCaptureRecordHeader) + frameLength);
+	if (recordLength > MQTT_CAPTURE_BUFFER_LENGTH)
+	{
+		LOGI("Frame of %u bytes is too large for the capture buffer", static_cast<unsigned int>(frameLength));
+		return nullptr;
+	}
+	if (bufferIndex + recordLength > MQTT_CAPTURE_BUFFER_LENGTH)
+	{
+		QueueBuffer(lock);
+	}
+	uint8_t *record = buffer.get() + bufferIndex;
+	MQTTCaptureRecordHeader header;
+	header.timestamp = MonotonicNanoseconds() - startTime;
+	header.length = static_cast<uint32_t>(frameLength);
+	header.direction = static_cast<uint8_t>(direction);
+	header.flags = flags;
+	header.reserved = 0;
+	memcpy(record, &header, sizeof(header));
+	//Zero the padding so captures are reproducible byte for byte
+	memset(record + sizeof(header) + frameLength, 0, recordLength - sizeof(header) - frameLength);
+	bufferIndex += recordLength;
+	return record + sizeof(header);
+}
+
+void MQTTCaptureWriter::QueueBuffer(std::unique_lock<std::mutex> &lock)
+{
+	if (bufferIndex == 0)
+	{
+		return;
+	}
+	Block block;
+	block.data = std::move(buffer);
+	block.length = bufferIndex;
+	fullBlocks.push_back(std::move(block));
+	++queuedCount;
+	writerCondition.notify_one();
+	if (freeBuffers.empty() && (bufferCount < MQTT_CAPTURE_BUFFER_COUNT))
+	{
+		freeBuffers.emplace_back(new uint8_t[MQTT_CAPTURE_BUFFER_LENGTH]);
+		++bufferCount;
+	}
+	writtenCondition.wait(lock, [&]()
+	{
+		return !freeBuffers.empty();
+	});
+	buffer = std::move(freeBuffers.back());
+	freeBuffers.pop_back();
+	bufferIndex = 0;
+}
+
+void MQTTCaptureWriter::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if ((fd < 0) || !running)
+	{
+		return;
+	}
+	QueueBuffer(lock);
+	uint64_t count = queuedCount;
+	writtenCondition.wait(lock, [&]()
+	{
+		return writtenCount >= count;
+	});
+}
+
+void MQTTCaptureWriter::Close()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!running)
+		{
+			return;
+		}
+		QueueBuffer(lock);
+		//The writer thread writes what is queued before it stops
+		running = false;
+	}
+	writerCondition.notify_one();
+	thread.join();
+	std::lock_guard<std::mutex> lock(mutex);
+	CloseFile(fd);
+	fd = -1;
+	fullBlocks.clear();
+	freeBuffers.clear();
+	buffer.reset();
+	bufferCount = 0;
+}
+
+void MQTTCaptureWriter::Run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		writerCondition.wait(lock, [&]()
+		{
+			return !fullBlocks.empty() || !running;
+		});
+		if (fullBlocks.empty())
+		{
+			return;
+		}
+		Block block = std::move(fullBlocks.front());
+		fullBlocks.pop_front();
+		//The file is only closed once this thread has stopped
+		lock.unlock();
+		if (!WriteAll(fd, block.data.get(), block.length))
+		{
+			LOGI("Write capture file error");
+		}
+		lock.lock();
+		freeBuffers.push_back(std::move(block.data));
+		++writtenCount;
+		writtenCondition.notify_all();
+	}
+}
+
+MQTTCaptureReader::MQTTCaptureReader() : data(nullptr), dataLength(0), position(0)
+{
+}
+
+MQTTCaptureReader::~MQTTCaptureReader()
+{
+	Close();
+}
+
+bool MQTTCaptureReader::Open(std::string path)
+{
+	Close();
+	int fd = OpenFile(path);
+	if (fd < 0)
+	{
+		LOGI("Cannot open capture file %s", path.c_str());
+		return false;
+	}
+#if defined(WIN32) || defined(WIN64)
+	struct _stat64 fileStat;
+	bool statResult = (_fstat64(fd, &fileStat) == 0);
+#else
+	struct stat fileStat;
+	bool statResult = (fstat(fd, &fileStat) == 0);
+#endif
+	if (!statResult || (static_cast<std::size_t>(fileStat.st_size) < sizeof(MQTTCaptureFileHeader)))
+	{
+		LOGI("Invalid capture file %s", path.c_str());
+		CloseFile(fd);
+		return false;
+	}
+	dataLength = static_cast<std::size_t>(fileStat.st_size);
+#if defined(WIN32) || defined(WIN64)
+	fileContent.resize(dataLength);
+	int bytesRead = _read(fd, fileContent.data(), static_cast<unsigned int>(dataLength));
+	CloseFile(fd);
+	if (bytesRead != static_cast<int>(dataLength))
+	{
+		fileContent.clear();
+		dataLength = 0;
+		return false;
+	}
+	data = fileContent.data();
+#else
+	void *map = mmap(nullptr, dataLength, PROT_READ, MAP_PRIVATE, fd, 0);
+	CloseFile(fd);
+	if (map == MAP_FAILED)
+	{
+		LOGI("mmap error %d", errno);
+		dataLength = 0;
+		return false;
+	}
+	madvise(map, dataLength, MADV_SEQUENTIAL);
+	data = static_cast<const uint8_t*>(map);
+#endif
+	const MQTTCaptureFileHeader *header = reinterpret_cast<const MQTTCaptureFileHeader*>(data);
+	if ((memcmp(header->magic, MQTT_CAPTURE_MAGIC, sizeof(header->magic)) != 0) || (header->version != MQTT_CAPTURE_VERSION))
+	{
+		LOGI("Unsupported capture file %s", path.c_str());
+		Close();
+		return false;
+	}
+	position = sizeof(MQTTCaptureFileHeader);
+	return true;
+}
+
+bool MQTTCaptureReader::Next(MQTTCaptureFrame &frame)
+{
+	if ((data == nullptr) || (position + sizeof(MQTTCaptureRecordHeader) > dataLength))
+	{
+		return false;
+	}
+	const MQTTCaptureRecordHeader *header = reinterpret_cast<const MQTTCaptureRecordHeader*>(data + position);
+	if (position + sizeof(MQTTCaptureRecordHeader) + header->length > dataLength)
+	{
+		//Capture cut short while the writer was running
+		return false;
+	}
+	frame.timestamp = header->timestamp;
+	frame.direction = static_cast<MQTTCaptureDirection>(header->direction);
+	frame.flags = header->flags;
+	frame.data = data + position + sizeof(MQTTCaptureRecordHeader);
+	frame.length = header->length;
+	position += AlignRecord(sizeof(MQTTCaptureRecordHeader) + header->length);
+	return true;
+}
+
+uint64_t MQTTCaptureReader::GetStartTime()
+{
+	return (data == nullptr) ? 0 : reinterpret_cast<const MQTTCaptureFileHeader*>(data)->startTime;
+}
+
+void MQTTCaptureReader::Close()
+{
+#if defined(WIN32) || defined(WIN64)
+	fileContent.clear();
+#else
+	if (data != nullptr)
+	{
+		munmap(const_cast<uint8_t*>(data), dataLength);
+	}
+#endif
+	data = nullptr;
+	dataLength = 0;
+	position = 0;
+}
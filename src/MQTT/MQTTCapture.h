@@ -0,0 +1,119 @@
+#ifndef _MQTT_CAPTURE_H_
+#define _MQTT_CAPTURE_H_
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <deque>
+#include "Socket.h"
+
+//Capture file layout, every field little endian and every record 8 byte aligned so a mapped file can be walked in place:
+//  header  : magic "MQTTCAP1" | uint32 version | uint32 reserved | uint64 wall clock of the first record in ns since epoch
+//  records : uint64 ns since the first record | uint32 frame length | uint8 direction | uint8 flags | uint16 reserved | frame bytes | padding
+#define MQTT_CAPTURE_MAGIC "MQTTCAP1"
+#define MQTT_CAPTURE_VERSION 1
+#define MQTT_CAPTURE_BUFFER_LENGTH (1024 * 1024)
+//Buffers filled ahead of the disk before recording waits for it
+#define MQTT_CAPTURE_BUFFER_COUNT 8
+
+enum MQTTCaptureDirection
+{
+	MQTT_CAPTURE_INBOUND = 0x00,
+	MQTT_CAPTURE_OUTBOUND
+};
+
+//Set when only the header of a frame was recorded, for payloads streamed from files
+#define MQTT_CAPTURE_FLAG_TRUNCATED 0x01
+
+struct MQTTCaptureFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t startTime;
+};
+
+struct MQTTCaptureRecordHeader
+{
+	uint64_t timestamp;
+	uint32_t length;
+	uint8_t direction;
+	uint8_t flags;
+	uint16_t reserved;
+};
+
+struct MQTTCaptureFrame
+{
+	uint64_t timestamp;
+	MQTTCaptureDirection direction;
+	uint8_t flags;
+	const uint8_t *data;
+	uint32_t length;
+};
+
+//Appends frames to a capture file. Records are staged in a large buffer and a full buffer is handed to a writer thread of the capture,
+//so recording costs one memcpy per frame on the I/O path and never a write to the disk. Once MQTT_CAPTURE_BUFFER_COUNT buffers
+//wait for the disk, recording waits too rather than losing frames
+class MQTTCaptureWriter
+{
+	public:
+		MQTTCaptureWriter();
+		~MQTTCaptureWriter();
+		MQTTCaptureWriter(MQTTCaptureWriter&) = delete;
+		MQTTCaptureWriter& operator=(MQTTCaptureWriter&) = delete;
+		bool Open(std::string path);
+		void Record(MQTTCaptureDirection direction, const uint8_t *data, std::size_t dataLength);
+		void Record(MQTTCaptureDirection direction, const std::vector<DataSegment> &segments, uint8_t flags);
+		//Returns once the frames recorded so far are written to the file
+		void Flush();
+		void Close();
+	private:
+		struct Block
+		{
+			std::unique_ptr<uint8_t[]> data;
+			std::size_t length;
+		};
+		uint8_t* Reserve(std::unique_lock<std::mutex> &lock, MQTTCaptureDirection direction, std::size_t frameLength, uint8_t flags);
+		//Hands the staged records to the writer thread and takes a free buffer, waiting for one when the disk is behind
+		void QueueBuffer(std::unique_lock<std::mutex> &lock);
+		void Run();
+	private:
+		std::mutex mutex;
+		std::condition_variable writerCondition;
+		std::condition_variable writtenCondition;
+		int fd;
+		std::unique_ptr<uint8_t[]> buffer;
+		std::size_t bufferIndex;
+		uint64_t startTime;
+		std::deque<Block> fullBlocks;
+		std::vector<std::unique_ptr<uint8_t[]>> freeBuffers;
+		uint32_t bufferCount;
+		uint64_t queuedCount;
+		uint64_t writtenCount;
+		bool running;
+		std::thread thread;
+};
+
+class MQTTCaptureReader
+{
+	public:
+		MQTTCaptureReader();
+		~MQTTCaptureReader();
+		MQTTCaptureReader(MQTTCaptureReader&) = delete;
+		MQTTCaptureReader& operator=(MQTTCaptureReader&) = delete;
+		bool Open(std::string path);
+		//Frame data points into the mapped file and stays valid until the reader is closed
+		bool Next(MQTTCaptureFrame &frame);
+		uint64_t GetStartTime();
+		void Close();
+	private:
+		const uint8_t *data;
+		std::size_t dataLength;
+		std::size_t position;
+		std::vector<uint8_t> fileContent;
+};
+
+#endif //_MQTT_CAPTURE_H_
@@ -1,11 +1,19 @@
 #include "MQTTClient.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "MQTTMessage.h"
+#include "MQTTTopic.h"
+#include <string.h>
+#include <thread>
 #include "Utils.h"
 
+//Topic filters sent in one SUBSCRIBE or UNSUBSCRIBE, bounded so the SUBACK (one byte per filter) fits in MQTT_MAX_MESSAGE_LENGTH
+#define MQTT_MAX_SUBSCRIBE_FILTERS (MQTT_MAX_MESSAGE_LENGTH - 5)
+
 MQTTClient::MQTTClient(std::string host, uint32_t port, std::string clientID)
 {	
 	clientState = ClientState::DISCONNECT;
-	keepAliveTick = 0;
 	this->host = host;
 	this->port = port;
 	this->clientID = clientID;
@@ -13,65 +21,478 @@ MQTTClient::MQTTClient(std::string host, uint32_t port, std::string clientID)
 	mqttDisconnectedCallback = nullptr;
 	mqttPublishedCallback = nullptr;
 	mqttDataCallback = nullptr;
+	mqttPublishCallback = nullptr;
+	mqttRequestCallback = nullptr;
+	draining = false;
+	closing = false;
+	replaying = false;
+	drainRate = 0;
+	busyPollEnabled = false;
+	busyPollCpu = -1;
+	clock = std::make_shared<MQTTSystemClock>();
+	linkMonitor = std::make_shared<MQTTLinkMonitor>();
+	security = false;
+	//One network for the life of the client, reconnecting only replaces its socket
+	alive = std::make_shared<bool>(true);
+	std::weak_ptr<void> token = alive;
+	network = std::make_shared<Network>();
+	network->RegisterConnectedCallback([this, token]()
+	{
+		std::shared_ptr<void> alive = token.lock();
+		if (alive)
+		{
+			TCPConnectedCallback();
+		}
+	});
+	network->RegisterDisconnectedCallback([this, token]()
+	{
+		std::shared_ptr<void> alive = token.lock();
+		if (alive)
+		{
+			TCPDisconnectedCallback();
+		}
+	});
+	network->RegisterReceivedCallback([this, token](uint8_t *data, std::size_t dataLength)
+	{
+		std::shared_ptr<void> alive = token.lock();
+		if (alive)
+		{
+			TCPReceivedCallback(data, dataLength);
+		}
+	});
+	network->RegisterSentCallback([this, token](std::size_t bytesTransferred)
+	{
+		std::shared_ptr<void> alive = token.lock();
+		if (alive)
+		{
+			TCPSentCallback(bytesTransferred);
+		}
+	});
 }
 
 MQTTClient::~MQTTClient()
 {
+	//Pending batches and queued publishes are sent while the rest of the client is still alive
+	std::atomic_store(&aggregator, std::shared_ptr<MQTTAggregator>());
+	std::atomic_store(&conflator, std::shared_ptr<MQTTConflator>());
+	std::atomic_store(&deliveryQueues, std::shared_ptr<std::vector<std::shared_ptr<MQTTDeliveryQueue>>>());
+	//Requests the drain did not get to stay in the offline buffer
+	closing = true;
+	{
+		std::lock_guard<std::mutex> lock(drainMutex);
+		if (drainThread.joinable())
+		{
+			drainThread.join();
+		}
+	}
+	//No clock task or network callback starts once the token is gone, those already running are waited for.
+	//The client must not be destroyed from one of its own callbacks
+	std::weak_ptr<void> token = alive;
+	alive.reset();
+	while (!token.expired())
+	{
+		std::this_thread::yield();
+	}
+	network->RegisterConnectedCallback(nullptr);
+	network->RegisterDisconnectedCallback(nullptr);
+	network->RegisterReceivedCallback(nullptr);
+	network->RegisterSentCallback(nullptr);
+	network->Disconnect();
 }
 
 void MQTTClient::Connect(MQTTConnectOptions mqttConnectOptions, bool security)
 {
 	this->mqttConnectOptions = mqttConnectOptions;
-	network = make_unique<Network>();
-	network->RegisterConnectedCallback(std::bind(&MQTTClient::TCPConnectedCallback, this));
-	network->RegisterDisconnectedCallback(std::bind(&MQTTClient::TCPDisconnectedCallback, this));
-	network->RegisterReceivedCallback(std::bind(&MQTTClient::TCPReceivedCallback, this, std::placeholders::_1, std::placeholders::_2));
-	network->RegisterSentCallback(std::bind(&MQTTClient::TCPSentCallback, this, std::placeholders::_1));
+	this->security = security;
+	if (this->mqttConnectOptions.GetCleanSession())
+	{
+		//The broker discards the session so nothing sent before can still be acknowledged
+		FailPendingPackets();
+		packetIdentifierAllocator.Reset();
+		inboundPacketTable.Reset();
+	}
+	network->SetBusyPoll(busyPollEnabled, busyPollCpu);
+	network->SetSocketFactory(socketFactory);
+	//Without a bound the backlog sits in the kernel send buffer, out of reach of the conflator
+	network->SetUnsentLimit(std::atomic_load(&conflator) ? MQTT_CONFLATION_UNSENT_LIMIT : 0);
 	network->Connect(host, port, security);
-	timer.Wait(1000, true, true, std::bind(&MQTTClient::TimerCallback, this));
 }
 
-void MQTTClient::Publish(std::string topicName, std::string payload, uint8_t qos, bool retain)
+MQTTTokenPtr MQTTClient::Publish(std::string topicName, std::string payload, uint8_t qos, bool retain)
+{
+	std::shared_ptr<MQTTAggregator> aggregator = std::atomic_load(&this->aggregator);
+	if (aggregator)
+	{
+		MQTTTokenPtr token = TrackPacket(0);
+		if (aggregator->Add(topicName, payload, qos, retain, token))
+		{
+			return token;
+		}
+	}
+	std::shared_ptr<MQTTConflator> conflator = std::atomic_load(&this->conflator);
+	if (conflator)
+	{
+		MQTTTokenPtr token = TrackPacket(0);
+		MQTTTokenPtr replacedToken;
+		if (conflator->Add(topicName, payload, qos, retain, token, replacedToken))
+		{
+			if (replacedToken)
+			{
+				replacedToken->Complete(MQTT_RESULT_CONFLATED);
+			}
+			return token;
+		}
+	}
+	return PublishPayload(topicName, payload, qos, retain);
+}
+
+MQTTTokenPtr MQTTClient::PublishPayload(std::string &topicName, std::string &payload, uint8_t qos, bool retain)
+{
+	if (IsBuffering())
+	{
+		return BufferRequest({ MQTT_OFFLINE_PUBLISH, qos, retain, topicName, payload });
+	}
+	return SendPublish(topicName, payload, qos, retain);
+}
+
+MQTTTokenPtr MQTTClient::SendPublish(std::string &topicName, std::string &payload, uint8_t qos, bool retain)
 {
 	if (clientState != ClientState::CONNECT)
 	{
-		return;
+		return MQTTToken::Failed();
 	}
 	bool dup = false;
-	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePublish(topicName, payload, dup, qos, retain);
-	network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+	uint16_t packetIdentifier = 0;
+	if ((qos != 0) && !AllocatePacketIdentifier(packetIdentifier))
+	{
+		return MQTTToken::Failed();
+	}
+	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePublish(topicName, payload, dup, qos, retain, packetIdentifier);
+	if (!mqttMessage)
+	{
+		packetIdentifierAllocator.Release(packetIdentifier);
+		return MQTTToken::Failed();
+	}
+	MQTTTokenPtr token = TrackPacket(packetIdentifier);
+	if (qos == 0)
+	{
+		//Nothing acknowledges QoS0, it is done once handed to the kernel
+		network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength(), [token](bool error)
+		{
+			token->Complete(error ? MQTT_RESULT_FAILURE : MQTT_RESULT_SUCCESS);
+		});
+	}
+	else
+	{
+		network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
+		std::chrono::nanoseconds deadline;
+		if (linkMonitor->OnPublishSent(packetIdentifier, clock->Now(), deadline))
+		{
+			ScheduleLinkCheck(deadline);
+		}
+	}
+	return token;
 }
 
-void MQTTClient::Subscribe(std::string topicName, uint8_t qos)
+MQTTTokenPtr MQTTClient::Publish(std::string topicName, const std::vector<MQTTPayloadSegment> &payload, uint8_t qos, bool retain)
 {
+	if (IsBuffering())
+	{
+		//The segments belong to the caller once we return, the buffer keeps its own copy
+		MQTTOfflineRequest request = { MQTT_OFFLINE_PUBLISH, qos, retain, topicName, std::string() };
+		for (const MQTTPayloadSegment &segment : payload)
+		{
+			request.payload.append(reinterpret_cast<const char*>(segment.data), segment.length);
+		}
+		return BufferRequest(request);
+	}
 	if (clientState != ClientState::CONNECT)
 	{
-		return;
+		return MQTTToken::Failed();
+	}
+	uint64_t payloadLength = 0;
+	for (const MQTTPayloadSegment &segment : payload)
+	{
+		payloadLength += segment.length;
 	}
-	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageSubscribe(topicName, qos);
-	network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+	if (payloadLength > MQTT_MAX_REMAINING_LENGTH)
+	{
+		LOGI("Publish payload is too large: %llu bytes", static_cast<unsigned long long>(payloadLength));
+		return MQTTToken::Failed();
+	}
+	bool dup = false;
+	uint16_t packetIdentifier = 0;
+	if ((qos != 0) && !AllocatePacketIdentifier(packetIdentifier))
+	{
+		return MQTTToken::Failed();
+	}
+	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePublishHeader(topicName, static_cast<uint32_t>(payloadLength), dup, qos, retain, packetIdentifier);
+	if (!mqttMessage)
+	{
+		packetIdentifierAllocator.Release(packetIdentifier);
+		return MQTTToken::Failed();
+	}
+	std::vector<DataSegment> segments;
+	segments.reserve(payload.size() + 1);
+	segments.push_back({ mqttMessage->GetMessageData(), mqttMessage->GetMessageLength() });
+	segments.insert(segments.end(), payload.begin(), payload.end());
+	MQTTTokenPtr token = TrackPacket(packetIdentifier);
+	bool written = network->WriteSegments(segments);
+	if (qos == 0)
+	{
+		token->Complete(written ? MQTT_RESULT_SUCCESS : MQTT_RESULT_FAILURE);
+	}
+	return token;
 }
 
-void MQTTClient::Unsubscribe(std::string topicName)
+MQTTTokenPtr MQTTClient::PublishFile(std::string topicName, std::string path, uint64_t offset, uint64_t length, uint8_t qos, bool retain)
 {
 	if (clientState != ClientState::CONNECT)
 	{
-		return;
+		return MQTTToken::Failed();
+	}
+	int fd = OpenFile(path);
+	if (fd < 0)
+	{
+		LOGI("Cannot open file %s", path.c_str());
+		return MQTTToken::Failed();
+	}
+	return PublishFile(topicName, fd, offset, length, qos, retain, true);
+}
+
+MQTTTokenPtr MQTTClient::PublishFile(std::string topicName, int fd, uint64_t offset, uint64_t length, uint8_t qos, bool retain)
+{
+	if (clientState != ClientState::CONNECT)
+	{
+		return MQTTToken::Failed();
+	}
+	return PublishFile(topicName, fd, offset, length, qos, retain, false);
+}
+
+MQTTTokenPtr MQTTClient::PublishFile(std::string topicName, int fd, uint64_t offset, uint64_t length, uint8_t qos, bool retain, bool closeFile)
+{
+#if defined(WIN32) || defined(WIN64)
+	struct _stat64 fileStat;
+	bool statResult = (_fstat64(fd, &fileStat) == 0);
+#else
+	struct stat fileStat;
+	bool statResult = (fstat(fd, &fileStat) == 0);
+#endif
+	uint64_t fileSize = statResult ? static_cast<uint64_t>(fileStat.st_size) : 0;
+	if (length == 0 && offset < fileSize)
+	{
+		length = fileSize - offset;
+	}
+	uint16_t packetIdentifier = 0;
+	std::unique_ptr<MQTTMessage> mqttMessage;
+	if (!statResult || (offset > fileSize) || (length > fileSize - offset) || (length > MQTT_MAX_REMAINING_LENGTH))
+	{
+		LOGI("Invalid file range offset %llu length %llu", static_cast<unsigned long long>(offset), static_cast<unsigned long long>(length));
+	}
+	else if ((qos == 0) || AllocatePacketIdentifier(packetIdentifier))
+	{
+		bool dup = false;
+		mqttMessage = MQTTMessage::MQTTMessagePublishHeader(topicName, static_cast<uint32_t>(length), dup, qos, retain, packetIdentifier);
+		if (!mqttMessage)
+		{
+			packetIdentifierAllocator.Release(packetIdentifier);
+		}
+	}
+	if (!mqttMessage)
+	{
+		if (closeFile)
+		{
+			CloseFile(fd);
+		}
+		return MQTTToken::Failed();
 	}
-	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageUnsubscribe(topicName);
-	network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+	MQTTTokenPtr token = TrackPacket(packetIdentifier);
+	if (qos == 0)
+	{
+		network->WriteFile(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength(), fd, offset, length, closeFile, [token](bool error)
+		{
+			token->Complete(error ? MQTT_RESULT_FAILURE : MQTT_RESULT_SUCCESS);
+		});
+	}
+	else
+	{
+		network->WriteFile(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength(), fd, offset, length, closeFile);
+	}
+	return token;
+}
+
+MQTTTokenPtr MQTTClient::Subscribe(std::string topicName, uint8_t qos)
+{
+	if (IsBuffering())
+	{
+		return BufferRequest({ MQTT_OFFLINE_SUBSCRIBE, qos, false, topicName, std::string() });
+	}
+	return SendSubscribe(topicName, qos);
+}
+
+MQTTTokenPtr MQTTClient::SendSubscribe(std::string &topicName, uint8_t qos)
+{
+	if (clientState != ClientState::CONNECT)
+	{
+		return MQTTToken::Failed();
+	}
+	uint16_t packetIdentifier;
+	if (!AllocatePacketIdentifier(packetIdentifier))
+	{
+		return MQTTToken::Failed();
+	}
+	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageSubscribe(topicName, qos, packetIdentifier);
+	if (!mqttMessage)
+	{
+		packetIdentifierAllocator.Release(packetIdentifier);
+		return MQTTToken::Failed();
+	}
+	MQTTTokenPtr token = TrackPacket(packetIdentifier);
+	network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
+	return token;
+}
+
+MQTTTokenPtr MQTTClient::Unsubscribe(std::string topicName)
+{
+	if (IsBuffering())
+	{
+		return BufferRequest({ MQTT_OFFLINE_UNSUBSCRIBE, 0, false, topicName, std::string() });
+	}
+	return SendUnsubscribe(topicName);
+}
+
+MQTTTokenPtr MQTTClient::SendUnsubscribe(std::string &topicName)
+{
+	if (clientState != ClientState::CONNECT)
+	{
+		return MQTTToken::Failed();
+	}
+	uint16_t packetIdentifier;
+	if (!AllocatePacketIdentifier(packetIdentifier))
+	{
+		return MQTTToken::Failed();
+	}
+	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageUnsubscribe(topicName, packetIdentifier);
+	if (!mqttMessage)
+	{
+		packetIdentifierAllocator.Release(packetIdentifier);
+		return MQTTToken::Failed();
+	}
+	MQTTTokenPtr token = TrackPacket(packetIdentifier);
+	network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
+	return token;
 } 
 
+std::vector<MQTTTokenPtr> MQTTClient::Subscribe(const std::vector<MQTTSubscription> &topicFilters)
+{
+	if (IsBuffering())
+	{
+		std::vector<MQTTTokenPtr> tokens;
+		for (const MQTTSubscription &topicFilter : topicFilters)
+		{
+			tokens.push_back(BufferRequest({ MQTT_OFFLINE_SUBSCRIBE, topicFilter.second, false, topicFilter.first, std::string() }));
+		}
+		return tokens;
+	}
+	return SendTopicFilters(topicFilters, true);
+}
+
+std::vector<MQTTTokenPtr> MQTTClient::Unsubscribe(const std::vector<std::string> &topicFilters)
+{
+	std::vector<MQTTSubscription> subscriptions;
+	for (const std::string &topicFilter : topicFilters)
+	{
+		subscriptions.push_back(std::make_pair(topicFilter, 0));
+	}
+	if (IsBuffering())
+	{
+		std::vector<MQTTTokenPtr> tokens;
+		for (const MQTTSubscription &subscription : subscriptions)
+		{
+			tokens.push_back(BufferRequest({ MQTT_OFFLINE_UNSUBSCRIBE, 0, false, subscription.first, std::string() }));
+		}
+		return tokens;
+	}
+	return SendTopicFilters(subscriptions, false);
+}
+
+std::vector<MQTTTokenPtr> MQTTClient::SendTopicFilters(const std::vector<MQTTSubscription> &topicFilters, bool subscribe)
+{
+	std::vector<MQTTTokenPtr> tokens(topicFilters.size());
+	std::size_t next = 0;
+	while (next < topicFilters.size())
+	{
+		//Fill a packet up to MQTT_MAX_SUBSCRIBE_LENGTH, its SUBACK must also fit in MQTT_MAX_MESSAGE_LENGTH
+		std::vector<MQTTSubscription> packetFilters;
+		std::vector<std::size_t> packetIndexes;
+		uint32_t remainingLength = 2 /*packet identifier*/;
+		for (; (next < topicFilters.size()) && (packetFilters.size() < MQTT_MAX_SUBSCRIBE_FILTERS); ++next)
+		{
+			const MQTTSubscription &topicFilter = topicFilters[next];
+			if (!MQTTTopic::IsValidTopicFilter(topicFilter.first))
+			{
+				LOGI("Invalid topic filter %s", topicFilter.first.c_str());
+				tokens[next] = MQTTToken::Failed();
+				continue;
+			}
+			uint32_t filterLength = static_cast<uint32_t>(topicFilter.first.size()) + 2 /*topic name*/ + (subscribe ? 1 /*qos*/ : 0);
+			if (!packetFilters.empty() && (remainingLength + filterLength > MQTT_MAX_SUBSCRIBE_LENGTH))
+			{
+				break;
+			}
+			remainingLength += filterLength;
+			packetFilters.push_back(topicFilter);
+			packetIndexes.push_back(next);
+		}
+		if (packetFilters.empty())
+		{
+			continue;
+		}
+		uint16_t packetIdentifier;
+		if ((clientState != ClientState::CONNECT) || !AllocatePacketIdentifier(packetIdentifier))
+		{
+			for (std::size_t index : packetIndexes)
+			{
+				tokens[index] = MQTTToken::Failed();
+			}
+			continue;
+		}
+		std::unique_ptr<MQTTMessage> mqttMessage;
+		if (subscribe)
+		{
+			mqttMessage = MQTTMessage::MQTTMessageSubscribe(packetFilters, packetIdentifier);
+		}
+		else
+		{
+			std::vector<std::string> names;
+			for (const MQTTSubscription &topicFilter : packetFilters)
+			{
+				names.push_back(topicFilter.first);
+			}
+			mqttMessage = MQTTMessage::MQTTMessageUnsubscribe(names, packetIdentifier);
+		}
+		//The n-th token of the packet gets the n-th return code of its SUBACK
+		for (std::size_t index : packetIndexes)
+		{
+			tokens[index] = TrackPacket(packetIdentifier);
+		}
+		network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
+	}
+	return tokens;
+}
+
 void MQTTClient::TCPConnectedCallback()
 {
 	LOGI("Connecting to broker...");
 	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageConnect(clientID, mqttConnectOptions);
-	network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+	network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
 }
 
 void MQTTClient::TCPDisconnectedCallback()
 {
 	LOGI("Disconnected");
+	//Requests made from now on are kept by the offline buffer, if any
+	clientState = ClientState::DISCONNECT;
 	if (mqttDisconnectedCallback)
 	{
 		mqttDisconnectedCallback();
@@ -80,6 +501,7 @@ void MQTTClient::TCPDisconnectedCallback()
 
 void MQTTClient::TCPReceivedCallback(uint8_t* data, std::size_t dataLength)
 {
+	linkMonitor->OnReceived(clock->Now());
 	MQTTMessageType messageType = MQTTMessage::GetMessageType(data);
 	switch (messageType)
 	{
@@ -88,8 +510,33 @@ void MQTTClient::TCPReceivedCallback(uint8_t* data, std::size_t dataLength)
 			MQTTConnectReturnCode connectReturnCode = MQTTMessage::GetConnectReturnCode(data);
 			if (connectReturnCode == MQTT_CONNECTION_ACCEPTED)
 			{
+#if defined(MQTT_VERSION_311)
+				if (!MQTTMessage::GetSessionPresent(data))
+				{
+					//The broker holds no session for us, the PUBRELs we wait for will never come
+					inboundPacketTable.Reset();
+				}
+#endif
+				//MQTT 3.1 has no session present flag, the byte is reserved and always 0: only Connect resets the table, on a clean session
 				clientState = ClientState::CONNECT;
+				if (replaying)
+				{
+					//Only the state is replayed, nothing is connected
+					break;
+				}
 				LOGI("Client connected to broker %s:%d", host.c_str(), port);
+				linkMonitor->Reset(clock->Now(), std::chrono::seconds(mqttConnectOptions.GetKeepAlive()));
+				CheckLink();
+				std::shared_ptr<MQTTOfflineBuffer> buffer = std::atomic_load(&offlineBuffer);
+				if (buffer && !buffer->IsEmpty() && !draining.exchange(true))
+				{
+					StartDrain(buffer);
+				}
+				std::shared_ptr<MQTTRpc> rpc = std::atomic_load(&this->rpc);
+				if (rpc)
+				{
+					Subscribe(rpc->GetReplyTopic(), 0);
+				}
 				if (mqttConnectedCallback)
 				{
 					mqttConnectedCallback();
@@ -121,51 +568,110 @@ void MQTTClient::TCPReceivedCallback(uint8_t* data, std::size_t dataLength)
 		}
 		case MQTTMessageType::MQTT_MSG_PUBLISH:
 		{
-			if (mqttDataCallback)
+			if (!MQTTMessage::IsWellFormedPublish(data, dataLength))
 			{
-				std::string topicName = MQTTMessage::GetPublishTopicName(data);
-				std::string payload = MQTTMessage::GetPublishPayload(data);
-
-				mqttDataCallback(topicName, payload);
+				//A topic running past the packet would have the validator read beyond the buffer
+				LOGI("Received malformed publish");
+				network->Disconnect();
+				break;
+			}
+			uint16_t topicLength;
+			const char *topicName = MQTTMessage::GetPublishTopicName(data, topicLength);
+			if (!MQTTTopic::IsValidTopicName(topicName, topicLength))
+			{
+				//Ill formed UTF-8 or wildcards in a received topic is a protocol violation, the connection must be closed
+				LOGI("Received invalid topic name");
+				network->Disconnect();
+				break;
 			}
 			uint8_t qos = MQTTMessage::GetPublishQos(data);
+			//A QoS2 publish already received and not released yet is a retransmission, it is acknowledged again but not delivered twice
+			bool duplicate = (qos == 2) && !inboundPacketTable.MarkReceived(MQTTMessage::GetPacketIdentifier(data));
+			if (duplicate)
+			{
+				LOGI("Duplicate QoS2 packet identifier: %d", MQTTMessage::GetPacketIdentifier(data));
+			}
+			else
+			{
+#if defined(__linux__)
+				std::shared_ptr<MQTTJournal> journal = std::atomic_load(&this->journal);
+				if (journal)
+				{
+					journal->Append(data, static_cast<uint32_t>(dataLength));
+				}
+#endif
+				uint32_t payloadLength;
+				const uint8_t *payload = MQTTMessage::GetPublishPayload(data, payloadLength);
+				bool retained = MQTTMessage::GetPublishRetain(data);
+				//Requests and responses are answered here, aggregated payloads are delivered record by record
+				if (!DispatchRpc(topicName, topicLength, payload, payloadLength) && (!IsDeaggregated(topicName, topicLength) || !MQTTAggregator::Split(payload, payloadLength, [&](const uint8_t *record, uint32_t recordLength)
+					{
+						DeliverPayload(topicName, topicLength, record, recordLength, qos, retained);
+					})))
+				{
+					DeliverPayload(topicName, topicLength, payload, payloadLength, qos, retained);
+				}
+			}
 			if (qos == 1)
 			{
 				std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePubAck(MQTTMessage::GetPacketIdentifier(data));
-				network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+				network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
 			}
 			else if (qos == 2)
 			{
 				std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePubRec(MQTTMessage::GetPacketIdentifier(data));
-				network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+				network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
 			}
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_PUBACK:
 		{
 			LOGI("Published QoS1 packet identifier: %d", MQTTMessage::GetPacketIdentifier(data));
+			linkMonitor->OnAcknowledged(MQTTMessage::GetPacketIdentifier(data), clock->Now());
+			AcknowledgePacket(MQTTMessage::GetPacketIdentifier(data), MQTT_RESULT_SUCCESS);
+			if (mqttPublishedCallback)
+			{
+				mqttPublishedCallback();
+			}
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_PUBREC:
 		{
+			//First answer to a QoS2 publish, one round trip after it was sent
+			linkMonitor->OnAcknowledged(MQTTMessage::GetPacketIdentifier(data), clock->Now());
 			std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePubRel(MQTTMessage::GetPacketIdentifier(data));
-			network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+			network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_PUBREL:
 		{
+			//From now on the identifier may carry a new message. PUBCOMP is sent even for unknown identifiers so the broker can finish the flow
+			inboundPacketTable.Release(MQTTMessage::GetPacketIdentifier(data));
 			std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePubComp(MQTTMessage::GetPacketIdentifier(data));
-			network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+			network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_PUBCOMP:
 		{
 			LOGI("Published QoS2 packet identifier: %d", MQTTMessage::GetPacketIdentifier(data));
+			AcknowledgePacket(MQTTMessage::GetPacketIdentifier(data), MQTT_RESULT_SUCCESS);
+			if (mqttPublishedCallback)
+			{
+				mqttPublishedCallback();
+			}
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_SUBACK:
 		{
-			MQTTSubscribeReturnCode subscribeReturnCode = MQTTMessage::GetSubscribeReturnCode(data);
+			uint32_t returnCodeCount;
+			const uint8_t *returnCodes = MQTTMessage::GetSubscribeReturnCodes(data, returnCodeCount);
+			AcknowledgePacket(MQTTMessage::GetPacketIdentifier(data), returnCodes, returnCodeCount);
+			if (returnCodeCount != 1)
+			{
+				LOGI("Subscribed %u topic filters packet identifier: %d", returnCodeCount, MQTTMessage::GetPacketIdentifier(data));
+				break;
+			}
+			MQTTSubscribeReturnCode subscribeReturnCode = static_cast<MQTTSubscribeReturnCode>(returnCodes[0]);
 			switch (subscribeReturnCode)
 			{
 			case MQTT_SUBSCRIBE_QOS0:
@@ -186,17 +692,19 @@ void MQTTClient::TCPReceivedCallback(uint8_t* data, std::size_t dataLength)
 		case MQTTMessageType::MQTT_MSG_UNSUBACK:
 		{
 			LOGI("Unsubscribe packet identifier: %d", MQTTMessage::GetPacketIdentifier(data));
+			AcknowledgePacket(MQTTMessage::GetPacketIdentifier(data), MQTT_RESULT_SUCCESS);
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_PINGREQ:
 		{
 			std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePingResp();
-			network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+			network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength());
 			break;
 		}
 		case MQTTMessageType::MQTT_MSG_PINGRESP:
 		{
 			LOGI("Server respond ping request");
+			linkMonitor->OnPingResponse(clock->Now());
 			break;
 		}
 	}
@@ -205,21 +713,659 @@ void MQTTClient::TCPReceivedCallback(uint8_t* data, std::size_t dataLength)
 void MQTTClient::TCPSentCallback(std::size_t bytesTransferred)
 {
 	LOGI("Sent %d bytes", static_cast<int>(bytesTransferred));
+	linkMonitor->OnSent(clock->Now());
 }
 
-void MQTTClient::TimerCallback()
+void MQTTClient::CheckLink()
 {
-	if (clientState == ClientState::CONNECT)
+	if (clientState != ClientState::CONNECT)
 	{
-		++keepAliveTick;
-		if (keepAliveTick >= mqttConnectOptions.GetKeepAlive())
+		//The next CONNACK checks again
+		return;
+	}
+	std::chrono::nanoseconds nextCheck;
+	switch (linkMonitor->Check(clock->Now(), nextCheck))
+	{
+		case MQTTLinkAction::PING:
 		{
 			LOGI("Send keep alive message");
-			keepAliveTick = 0;
 			std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessagePingReq();
-			network->WriteData(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+			//The PINGRESP is timed from when the PINGREQ leaves, it may wait behind large writes
+			std::weak_ptr<void> token = alive;
+			network->WriteData(mqttMessage->ReleaseMessageData(), mqttMessage->GetMessageLength(), [this, token](bool error)
+			{
+				std::shared_ptr<void> alive = token.lock();
+				std::chrono::nanoseconds deadline;
+				if (alive && !error)
+				{
+					linkMonitor->OnPingSent(clock->Now(), deadline);
+					ScheduleLinkCheck(deadline);
+				}
+			});
+			break;
+		}
+		case MQTTLinkAction::DEAD:
+		{
+			LOGI("No ping response within %lld ms, reconnecting", static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(linkMonitor->GetPingTimeout()).count()));
+			network->Disconnect();
+			Reconnect();
+			return;
+		}
+		default:
+			break;
+	}
+	ScheduleLinkCheck(nextCheck);
+}
+
+void MQTTClient::Reconnect()
+{
+	std::weak_ptr<void> token = alive;
+	clock->Schedule(std::chrono::milliseconds(MQTT_LINK_RECONNECT_DELAY), [this, token]()
+	{
+		std::shared_ptr<void> alive = token.lock();
+		if (!alive || (clientState == ClientState::CONNECT))
+		{
+			return;
+		}
+		Connect(mqttConnectOptions, security);
+		//Nothing answers on a link that is still dead, the attempt is given up after two ping timeouts and made again
+		clock->Schedule(2 * linkMonitor->GetPingTimeout(), [this, token]()
+		{
+			std::shared_ptr<void> alive = token.lock();
+			if (alive && (clientState != ClientState::CONNECT))
+			{
+				LOGI("No connection acknowledgement, reconnecting");
+				network->Disconnect();
+				Reconnect();
+			}
+		});
+	});
+}
+
+void MQTTClient::ScheduleLinkCheck(std::chrono::nanoseconds due)
+{
+	//Only the earliest check is scheduled: an idle link wakes up once per keep alive, a busy one about once per retransmit timeout
+	if ((due == std::chrono::nanoseconds::max()) || !linkMonitor->AddWakeup(due))
+	{
+		return;
+	}
+	std::weak_ptr<void> token = alive;
+	clock->Schedule(std::max(due - clock->Now(), std::chrono::nanoseconds(0)), [this, token, due]()
+	{
+		std::shared_ptr<void> alive = token.lock();
+		if (alive)
+		{
+			linkMonitor->RemoveWakeup(due);
+			CheckLink();
 		}
+	});
+}
+
+bool MQTTClient::AllocatePacketIdentifier(uint16_t &packetIdentifier)
+{
+	packetIdentifier = packetIdentifierAllocator.Allocate();
+	if (packetIdentifier == 0)
+	{
+		LOGI("All packet identifiers are waiting for acknowledgement");
+		return false;
 	}
+	return true;
+}
+
+MQTTTokenPtr MQTTClient::TrackPacket(uint16_t packetIdentifier)
+{
+	MQTTTokenPtr token = std::make_shared<MQTTToken>();
+	token->Start(packetIdentifier);
+	if (packetIdentifier != 0)
+	{
+		//Registered before the packet is written so an early acknowledgement always finds it
+		std::lock_guard<std::mutex> lock(pendingTokensMutex);
+		pendingTokens[packetIdentifier].push_back(token);
+	}
+	return token;
+}
+
+void MQTTClient::AcknowledgePacket(uint16_t packetIdentifier, uint8_t returnCode)
+{
+	for (MQTTTokenPtr &token : ReleasePacket(packetIdentifier))
+	{
+		token->Complete(returnCode);
+	}
+}
+
+void MQTTClient::AcknowledgePacket(uint16_t packetIdentifier, const uint8_t *returnCodes, uint32_t returnCodeCount)
+{
+	std::vector<MQTTTokenPtr> tokens = ReleasePacket(packetIdentifier);
+	for (std::size_t i = 0; i < tokens.size(); ++i)
+	{
+		//A SUBACK missing return codes fails the filters it does not cover
+		tokens[i]->Complete((i < returnCodeCount) ? returnCodes[i] : MQTT_RESULT_FAILURE);
+	}
+}
+
+std::vector<MQTTTokenPtr> MQTTClient::ReleasePacket(uint16_t packetIdentifier)
+{
+	std::vector<MQTTTokenPtr> tokens;
+	{
+		std::lock_guard<std::mutex> lock(pendingTokensMutex);
+		auto pendingToken = pendingTokens.find(packetIdentifier);
+		if (pendingToken != pendingTokens.end())
+		{
+			tokens.swap(pendingToken->second);
+			pendingTokens.erase(pendingToken);
+		}
+	}
+	packetIdentifierAllocator.Release(packetIdentifier);
+	return tokens;
+}
+
+void MQTTClient::FailPendingPackets()
+{
+	std::unordered_map<uint16_t, std::vector<MQTTTokenPtr>> failedTokens;
+	{
+		std::lock_guard<std::mutex> lock(pendingTokensMutex);
+		failedTokens.swap(pendingTokens);
+	}
+	for (auto &failedToken : failedTokens)
+	{
+		for (MQTTTokenPtr &token : failedToken.second)
+		{
+			token->Complete(MQTT_RESULT_FAILURE);
+		}
+	}
+}
+
+uint32_t MQTTClient::GetPacketIdentifiersInUse()
+{
+	return packetIdentifierAllocator.GetInUseCount();
+}
+
+bool MQTTClient::EnableOfflineBuffer(MQTTOfflineBufferOptions offlineBufferOptions)
+{
+	std::shared_ptr<MQTTOfflineBuffer> buffer = std::make_shared<MQTTOfflineBuffer>(offlineBufferOptions);
+	if (!buffer->Open())
+	{
+		return false;
+	}
+	drainRate = offlineBufferOptions.GetDrainRate();
+	std::atomic_store(&offlineBuffer, buffer);
+	return true;
+}
+
+std::shared_ptr<MQTTOfflineBuffer> MQTTClient::GetOfflineBuffer()
+{
+	return std::atomic_load(&offlineBuffer);
+}
+
+bool MQTTClient::IsBuffering()
+{
+	std::shared_ptr<MQTTOfflineBuffer> buffer = std::atomic_load(&offlineBuffer);
+	//While older requests are still buffered new ones queue behind them to keep the order
+	return buffer && ((clientState != ClientState::CONNECT) || draining || !buffer->IsEmpty());
+}
+
+MQTTTokenPtr MQTTClient::BufferRequest(const MQTTOfflineRequest &request)
+{
+	std::shared_ptr<MQTTOfflineBuffer> buffer = std::atomic_load(&offlineBuffer);
+	if (!buffer->Push(request))
+	{
+		return MQTTToken::Failed();
+	}
+	MQTTTokenPtr token = TrackPacket(0);
+	token->Complete(MQTT_RESULT_BUFFERED);
+	if ((clientState == ClientState::CONNECT) && !draining.exchange(true))
+	{
+		//The drain finished between our check and the push
+		StartDrain(buffer);
+	}
+	return token;
+}
+
+void MQTTClient::StartDrain(std::shared_ptr<MQTTOfflineBuffer> buffer)
+{
+	std::lock_guard<std::mutex> lock(drainMutex);
+	if (closing)
+	{
+		draining = false;
+		return;
+	}
+	//The previous drain cleared the flag we just set, it is only logging its count
+	if (drainThread.joinable())
+	{
+		drainThread.join();
+	}
+	drainThread = std::thread(&MQTTClient::DrainOfflineBuffer, this, buffer);
+}
+
+void MQTTClient::DrainOfflineBuffer(std::shared_ptr<MQTTOfflineBuffer> buffer)
+{
+	std::chrono::nanoseconds interval(drainRate ? 1000000000ULL / drainRate : 0);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	uint64_t drained = 0;
+	do
+	{
+		//Requests are written back to back without waiting for acknowledgements, but each one stays buffered until its token completes
+		//and they leave in order: those a disconnection cuts off are sent again on the next connection
+		std::deque<std::pair<uint64_t, MQTTTokenPtr>> inFlight;
+		while ((clientState == ClientState::CONNECT) && !closing)
+		{
+			while (!inFlight.empty() && inFlight.front().second->IsComplete())
+			{
+				if (inFlight.front().second->GetFuture().get().returnCode == MQTT_RESULT_FAILURE)
+				{
+					if (clientState != ClientState::CONNECT)
+					{
+						//Its write was cut off by the disconnection, kept for the next connection
+						break;
+					}
+					LOGI("Drop offline request %llu", static_cast<unsigned long long>(inFlight.front().first));
+				}
+				buffer->Pop(inFlight.front().first);
+				inFlight.pop_front();
+				++drained;
+			}
+			MQTTOfflineRequest request;
+			uint64_t sequence;
+			bool found = inFlight.empty() ? buffer->Peek(request, sequence) : buffer->PeekNext(inFlight.back().first, request, sequence);
+			if (!found)
+			{
+				if (inFlight.empty())
+				{
+					break;
+				}
+				//Everything buffered in memory is in flight, the rest waits for acknowledgements
+				inFlight.front().second->GetFuture().wait_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			MQTTTokenPtr token;
+			switch (request.type)
+			{
+				case MQTT_OFFLINE_PUBLISH:
+					token = SendPublish(request.topicName, request.payload, request.qos, request.retain);
+					break;
+				case MQTT_OFFLINE_SUBSCRIBE:
+					token = SendSubscribe(request.topicName, request.qos);
+					break;
+				case MQTT_OFFLINE_UNSUBSCRIBE:
+					token = SendUnsubscribe(request.topicName);
+					break;
+			}
+			if (token->IsComplete() && (token->GetFuture().get().returnCode == MQTT_RESULT_FAILURE))
+			{
+				if (clientState != ClientState::CONNECT)
+				{
+					//Kept for the next connection
+					break;
+				}
+				if (packetIdentifierAllocator.GetInUseCount() >= 65535)
+				{
+					if (inFlight.empty())
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					}
+					else
+					{
+						inFlight.front().second->GetFuture().wait_for(std::chrono::milliseconds(1));
+					}
+					continue;
+				}
+			}
+			inFlight.push_back(std::make_pair(sequence, token));
+			if (interval.count() != 0)
+			{
+				next += interval;
+				std::this_thread::sleep_until(next);
+			}
+		}
+		draining = false;
+		//Pushed between the last Peek and clearing the flag: nobody else will start a drain for it
+	} while ((clientState == ClientState::CONNECT) && !closing && !buffer->IsEmpty() && !draining.exchange(true));
+	LOGI("Drained %llu offline requests", static_cast<unsigned long long>(drained));
+}
+
+void MQTTClient::EnableBusyPoll(int cpu)
+{
+	busyPollEnabled = true;
+	busyPollCpu = cpu;
+}
+
+std::shared_ptr<MQTTLinkMonitor> MQTTClient::GetLinkMonitor()
+{
+	return linkMonitor;
+}
+
+void MQTTClient::SetClock(std::shared_ptr<MQTTClock> clock)
+{
+	this->clock = clock;
+	std::shared_ptr<MQTTRpc> rpc = std::atomic_load(&this->rpc);
+	if (rpc)
+	{
+		StartRpcExpiry(rpc);
+	}
+}
+
+void MQTTClient::SetSocketFactory(std::function<std::unique_ptr<Socket>()> socketFactory)
+{
+	this->socketFactory = socketFactory;
+}
+
+void MQTTClient::EnableAggregation(std::string topicFilter, uint32_t maxMessages, uint32_t lingerTime)
+{
+	std::shared_ptr<MQTTAggregator> aggregator = std::atomic_load(&this->aggregator);
+	if (!aggregator)
+	{
+		aggregator = std::make_shared<MQTTAggregator>(std::bind(&MQTTClient::PublishAggregate, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
+		std::atomic_store(&this->aggregator, aggregator);
+	}
+	aggregator->AddTopicFilter(topicFilter, maxMessages, lingerTime);
+}
+
+void MQTTClient::EnableDeaggregation(std::string topicFilter)
+{
+	//The network thread reads the list without a lock, it is replaced rather than changed
+	std::lock_guard<std::mutex> lock(deaggregationMutex);
+	std::shared_ptr<std::vector<std::string>> topicFilters = std::atomic_load(&deaggregatedTopicFilters);
+	std::shared_ptr<std::vector<std::string>> newTopicFilters = topicFilters ? std::make_shared<std::vector<std::string>>(*topicFilters) : std::make_shared<std::vector<std::string>>();
+	newTopicFilters->push_back(topicFilter);
+	std::atomic_store(&deaggregatedTopicFilters, newTopicFilters);
+}
+
+void MQTTClient::FlushAggregation()
+{
+	std::shared_ptr<MQTTAggregator> aggregator = std::atomic_load(&this->aggregator);
+	if (aggregator)
+	{
+		aggregator->Flush();
+	}
+}
+
+void MQTTClient::PublishAggregate(std::string &topicName, std::string &payload, uint8_t qos, bool retain, std::vector<MQTTTokenPtr> &tokens)
+{
+	MQTTTokenPtr token = PublishPayload(topicName, payload, qos, retain);
+	std::vector<MQTTTokenPtr> *aggregatedTokens = new std::vector<MQTTTokenPtr>();
+	aggregatedTokens->swap(tokens);
+	//Every publish of the batch completes with the batch itself
+	token->OnComplete(&MQTTClient::CompleteAggregate, aggregatedTokens);
+}
+
+void MQTTClient::CompleteAggregate(const MQTTResult &result, void *context)
+{
+	std::vector<MQTTTokenPtr> *aggregatedTokens = static_cast<std::vector<MQTTTokenPtr>*>(context);
+	for (MQTTTokenPtr &token : *aggregatedTokens)
+	{
+		token->Complete(result.returnCode);
+	}
+	delete aggregatedTokens;
+}
+
+void MQTTClient::EnableConflation(std::string topicFilter, uint8_t maxQos)
+{
+	std::shared_ptr<MQTTConflator> conflator = std::atomic_load(&this->conflator);
+	if (!conflator)
+	{
+		conflator = std::make_shared<MQTTConflator>(std::bind(&MQTTClient::PublishConflated, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
+		std::atomic_store(&this->conflator, conflator);
+	}
+	conflator->AddTopicFilter(topicFilter, maxQos);
+}
+
+std::shared_ptr<MQTTConflator> MQTTClient::GetConflator()
+{
+	return std::atomic_load(&conflator);
+}
+
+void MQTTClient::PublishConflated(std::string &topicName, std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr &token)
+{
+	//The segment publish returns once the bytes are written, so under congestion the next publishes wait in the conflator where they can be replaced
+	std::vector<MQTTPayloadSegment> segments{ { reinterpret_cast<const uint8_t*>(payload.data()), payload.size() } };
+	MQTTTokenPtr sentToken = Publish(topicName, segments, qos, retain);
+	sentToken->OnComplete(&MQTTClient::CompleteConflated, new MQTTTokenPtr(token));
+}
+
+void MQTTClient::CompleteConflated(const MQTTResult &result, void *context)
+{
+	MQTTTokenPtr *token = static_cast<MQTTTokenPtr*>(context);
+	(*token)->Complete(result.returnCode);
+	delete token;
+}
+
+void MQTTClient::EnableRpc(std::string replyTopic)
+{
+	std::shared_ptr<MQTTRpc> rpc = std::make_shared<MQTTRpc>(replyTopic);
+	std::atomic_store(&this->rpc, rpc);
+	StartRpcExpiry(rpc);
+	if (clientState == ClientState::CONNECT)
+	{
+		Subscribe(replyTopic, 0);
+	}
+}
+
+MQTTRpcCallPtr MQTTClient::Request(std::string topicName, std::string payload, uint8_t qos, uint32_t timeout)
+{
+	std::shared_ptr<MQTTRpc> rpc = std::atomic_load(&this->rpc);
+	if (!rpc)
+	{
+		LOGI("Call EnableRpc before sending requests");
+		return MQTTRpcCall::Failed();
+	}
+	uint64_t correlationId;
+	MQTTRpcCallPtr call = rpc->Begin(clock->Now() + std::chrono::milliseconds(timeout), correlationId);
+	if (!call)
+	{
+		LOGI("Too many requests waiting for a response");
+		return MQTTRpcCall::Failed();
+	}
+	std::string request = MQTTRpc::EncodeRequest(rpc->GetReplyTopic(), correlationId, payload);
+	//Neither aggregated nor conflated, every request expects its own response
+	MQTTTokenPtr token = PublishPayload(topicName, request, qos, false);
+	if (token->IsComplete() && (token->GetFuture().get().returnCode == MQTT_RESULT_FAILURE))
+	{
+		rpc->Complete(correlationId, MQTT_RESULT_FAILURE, nullptr, 0);
+	}
+	return call;
+}
+
+void MQTTClient::StartRpcExpiry(std::shared_ptr<MQTTRpc> rpc)
+{
+	//One sweep for all the calls rather than a timer each. It stops once the rpc or the clock is replaced, or the client is gone
+	std::weak_ptr<MQTTRpc> expiringRpc = rpc;
+	std::weak_ptr<MQTTClock> expiringClock = clock;
+	clock->Every(std::chrono::milliseconds(MQTT_RPC_EXPIRE_PERIOD), [expiringRpc, expiringClock]()
+	{
+		std::shared_ptr<MQTTRpc> rpc = expiringRpc.lock();
+		std::shared_ptr<MQTTClock> clock = expiringClock.lock();
+		if (!rpc || !clock)
+		{
+			return false;
+		}
+		rpc->Expire(clock->Now());
+		return true;
+	});
+}
+
+bool MQTTClient::DispatchRpc(const char *topicName, uint16_t topicLength, const uint8_t *payload, uint32_t payloadLength)
+{
+	uint64_t correlationId;
+	const uint8_t *body;
+	uint32_t bodyLength;
+	std::shared_ptr<MQTTRpc> rpc = std::atomic_load(&this->rpc);
+	if (rpc && (rpc->GetReplyTopic().compare(0, std::string::npos, topicName, topicLength) == 0) && MQTTRpc::DecodeResponse(payload, payloadLength, correlationId, body, bodyLength))
+	{
+		if (!rpc->Complete(correlationId, MQTT_RESULT_SUCCESS, body, bodyLength))
+		{
+			LOGI("Dropped a response nobody waits for");
+		}
+		return true;
+	}
+	std::string replyTopic;
+	if (mqttRequestCallback && MQTTRpc::DecodeRequest(payload, payloadLength, replyTopic, correlationId, body, bodyLength))
+	{
+		std::string response = MQTTRpc::EncodeResponse(correlationId, mqttRequestCallback(std::string(topicName, topicLength), std::string(reinterpret_cast<const char*>(body), bodyLength)));
+		PublishPayload(replyTopic, response, 0, false);
+		return true;
+	}
+	return false;
+}
+
+bool MQTTClient::IsDeaggregated(const char *topicName, uint16_t topicLength)
+{
+	std::shared_ptr<std::vector<std::string>> topicFilters = std::atomic_load(&deaggregatedTopicFilters);
+	if (!topicFilters)
+	{
+		return false;
+	}
+	for (const std::string &topicFilter : *topicFilters)
+	{
+		if (MQTTTopic::Matches(topicFilter.data(), topicFilter.size(), topicName, topicLength))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void MQTTClient::DeliverPayload(const char *topicName, uint16_t topicLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retained)
+{
+	std::shared_ptr<MQTTLastValueCache> cache = std::atomic_load(&lastValueCache);
+	if (cache)
+	{
+		cache->Update(topicName, topicLength, payload, payloadLength, retained);
+	}
+	std::shared_ptr<std::vector<std::shared_ptr<MQTTDeliveryQueue>>> queues = std::atomic_load(&deliveryQueues);
+	if (queues)
+	{
+		for (const std::shared_ptr<MQTTDeliveryQueue> &queue : *queues)
+		{
+			if (MQTTTopic::Matches(queue->GetTopicFilter().data(), queue->GetTopicFilter().size(), topicName, topicLength))
+			{
+				queue->Push(topicName, topicLength, payload, payloadLength);
+				return;
+			}
+		}
+	}
+	if (mqttPublishCallback)
+	{
+		mqttPublishCallback(topicName, topicLength, payload, payloadLength, qos, retained);
+	}
+	else if (mqttDataCallback)
+	{
+		mqttDataCallback(std::string(topicName, topicLength), std::string(reinterpret_cast<const char*>(payload), payloadLength));
+	}
+}
+
+std::shared_ptr<MQTTDeliveryQueue> MQTTClient::EnableDeliveryQueue(std::string topicFilter, uint32_t depth, MQTTOverflowPolicy overflowPolicy, MQTTDataCallback mqttDataCallback)
+{
+	std::shared_ptr<MQTTDeliveryQueue> queue = std::make_shared<MQTTDeliveryQueue>(topicFilter, depth, overflowPolicy, mqttDataCallback);
+	//The network thread reads the list without a lock, it is replaced rather than changed
+	std::shared_ptr<std::vector<std::shared_ptr<MQTTDeliveryQueue>>> queues = std::atomic_load(&deliveryQueues);
+	std::shared_ptr<std::vector<std::shared_ptr<MQTTDeliveryQueue>>> newQueues = queues ? std::make_shared<std::vector<std::shared_ptr<MQTTDeliveryQueue>>>(*queues) : std::make_shared<std::vector<std::shared_ptr<MQTTDeliveryQueue>>>();
+	newQueues->push_back(queue);
+	std::atomic_store(&deliveryQueues, newQueues);
+	return queue;
+}
+
+void MQTTClient::EnableLastValueCache(uint32_t maxTopics, std::size_t memoryLimit, MQTTCacheEvictionPolicy evictionPolicy)
+{
+	std::atomic_store(&lastValueCache, std::make_shared<MQTTLastValueCache>(maxTopics, memoryLimit, evictionPolicy));
+}
+
+std::shared_ptr<MQTTLastValueCache> MQTTClient::GetLastValueCache()
+{
+	return std::atomic_load(&lastValueCache);
+}
+
+bool MQTTClient::StartCapture(std::string path)
+{
+	std::shared_ptr<MQTTCaptureWriter> captureWriter = std::make_shared<MQTTCaptureWriter>();
+	if (!captureWriter->Open(path))
+	{
+		return false;
+	}
+	StopCapture();
+	capture = captureWriter;
+	network->SetCapture(capture);
+	LOGI("Capturing MQTT traffic to %s", path.c_str());
+	return true;
+}
+
+void MQTTClient::StopCapture()
+{
+	network->SetCapture(nullptr);
+	if (capture)
+	{
+		capture->Close();
+		capture = nullptr;
+	}
+}
+
+#if defined(__linux__)
+bool MQTTClient::StartJournal(MQTTJournalOptions journalOptions)
+{
+	std::shared_ptr<MQTTJournal> journalWriter = std::make_shared<MQTTJournal>();
+	if (!journalWriter->Open(journalOptions))
+	{
+		return false;
+	}
+	StopJournal();
+	std::atomic_store(&journal, journalWriter);
+	return true;
+}
+
+void MQTTClient::StopJournal()
+{
+	std::shared_ptr<MQTTJournal> journalWriter = std::atomic_exchange(&journal, std::shared_ptr<MQTTJournal>());
+	if (journalWriter)
+	{
+		journalWriter->Close();
+	}
+}
+#endif
+
+uint64_t MQTTClient::Replay(std::string path, bool originalTiming, uint64_t &skipped)
+{
+	skipped = 0;
+	if (clientState == ClientState::CONNECT)
+	{
+		LOGI("Cannot replay a capture while connected");
+		return 0;
+	}
+	MQTTCaptureReader captureReader;
+	if (!captureReader.Open(path))
+	{
+		return 0;
+	}
+	//Without a socket everything the dispatch path writes back is dropped
+	network->Disconnect();
+	replaying = true;
+	uint8_t buffer[MQTT_MAX_MESSAGE_LENGTH];
+	uint64_t frames = 0;
+	std::chrono::steady_clock::time_point replayStart = std::chrono::steady_clock::now();
+	MQTTCaptureFrame frame;
+	while (captureReader.Next(frame))
+	{
+		if ((frame.direction != MQTT_CAPTURE_INBOUND) || (frame.length < 2))
+		{
+			continue;
+		}
+		if (frame.length > MQTT_MAX_MESSAGE_LENGTH)
+		{
+			//The network never hands such a frame to the dispatch path either
+			++skipped;
+			continue;
+		}
+		if (originalTiming)
+		{
+			std::this_thread::sleep_until(replayStart + std::chrono::nanoseconds(frame.timestamp));
+		}
+		//The dispatch path may decode in place so hand it a private copy of the mapped frame
+		memcpy(buffer, frame.data, frame.length);
+		TCPReceivedCallback(buffer, frame.length);
+		++frames;
+	}
+	clientState = ClientState::DISCONNECT;
+	replaying = false;
+	LOGI("Replayed %llu frames from %s, skipped %llu too long", static_cast<unsigned long long>(frames), path.c_str(), static_cast<unsigned long long>(skipped));
+	return frames;
 }
 
 void MQTTClient::MQTTOnConnected(MQTTCallback mqttConnectedCallback)
@@ -241,3 +1387,13 @@ void MQTTClient::MQTTOnReceivedPayload(MQTTDataCallback mqttDataCallback)
 {
 	this->mqttDataCallback = mqttDataCallback;
 }
+
+void MQTTClient::MQTTOnReceivedPublish(MQTTPublishCallback mqttPublishCallback)
+{
+	this->mqttPublishCallback = mqttPublishCallback;
+}
+
+void MQTTClient::MQTTOnRequest(MQTTRequestCallback mqttRequestCallback)
+{
+	this->mqttRequestCallback = mqttRequestCallback;
+}
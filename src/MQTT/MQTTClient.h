@@ -2,7 +2,20 @@
 #define _MQTT_CLIENT_H_
 #include "Network.h"
 #include "MQTTConnectOptions.h"
-#include "Timer.h"
+#include "MQTTClock.h"
+#include <unordered_map>
+#include <thread>
+#include "PacketIdentifierAllocator.h"
+#include "InboundPacketTable.h"
+#include "MQTTToken.h"
+#include "MQTTLastValueCache.h"
+#include "MQTTOfflineBuffer.h"
+#include "MQTTAggregator.h"
+#include "MQTTConflator.h"
+#include "MQTTRpc.h"
+#include "MQTTLinkMonitor.h"
+#include "MQTTDeliveryQueue.h"
+#include "MQTTJournal.h"
 
 enum class ClientState: uint8_t
 {
@@ -10,8 +23,13 @@ enum class ClientState: uint8_t
 	DISCONNECT
 };
 
-using MQTTCallback = void(*)();
-using MQTTDataCallback = void(*)(std::string topic, std::string payload);
+using MQTTCallback = std::function<void()>;
+using MQTTPayloadSegment = DataSegment;
+using MQTTDataCallback = std::function<void(std::string topic, std::string payload)>;
+//Topic and payload point into the read buffer and are only valid during the call
+using MQTTPublishCallback = std::function<void(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain)>;
+//Topic filter and requested QoS
+using MQTTSubscription = std::pair<std::string, uint8_t>;
 
 class MQTTClient
 {
@@ -19,32 +37,165 @@ class MQTTClient
 		MQTTClient(std::string host, uint32_t port, std::string clientID);
 		~MQTTClient();
 		void Connect(MQTTConnectOptions mqttConnectOptions, bool security);
-		void Publish(std::string topicName, std::string payload, uint8_t qos, bool retain);
-		void Subscribe(std::string topicName, uint8_t qos);
-		void Unsubscribe(std::string topicName);
+		//Every request returns a token completed by its acknowledgement (QoS0 publishes complete once written) or failed right away when it cannot be sent
+		MQTTTokenPtr Publish(std::string topicName, std::string payload, uint8_t qos, bool retain);
+		//Publish the concatenation of the segments without joining them in memory. Returns once the segments have been written so they may be released
+		MQTTTokenPtr Publish(std::string topicName, const std::vector<MQTTPayloadSegment> &payload, uint8_t qos, bool retain);
+		//Publish length bytes of a file starting at offset (length 0 publishes up to the end of the file). The payload is streamed from the file, never loaded in memory
+		MQTTTokenPtr PublishFile(std::string topicName, std::string path, uint64_t offset, uint64_t length, uint8_t qos, bool retain);
+		//Same as above for an already open file. fd must stay open until the publish has been sent
+		MQTTTokenPtr PublishFile(std::string topicName, int fd, uint64_t offset, uint64_t length, uint8_t qos, bool retain);
+		MQTTTokenPtr Subscribe(std::string topicName, uint8_t qos);
+		MQTTTokenPtr Unsubscribe(std::string topicName);
+		//As many filters as fit go in each packet. The returned tokens are in the order of topicFilters, each completed with the return code of its filter
+		std::vector<MQTTTokenPtr> Subscribe(const std::vector<MQTTSubscription> &topicFilters);
+		std::vector<MQTTTokenPtr> Unsubscribe(const std::vector<std::string> &topicFilters);
+
+		//Number of packet identifiers held by unacknowledged QoS1/QoS2 publishes, subscribes and unsubscribes
+		uint32_t GetPacketIdentifiersInUse();
+
+		//Low latency mode for plain TCP connections made after this call: one I/O thread pinned to cpu (-1 leaves it unpinned) spins on the socket
+		//and runs the received callbacks, TCP_NODELAY and TCP_QUICKACK are set. Publishes are written on the calling thread
+		void EnableBusyPoll(int cpu);
+
+		//Round trip time estimate and keep alive state of the connection. A link found dead is dropped and connected again
+		std::shared_ptr<MQTTLinkMonitor> GetLinkMonitor();
+
+		//Time source of the keep alive. Call before the first Connect, the default is the system clock
+		void SetClock(std::shared_ptr<MQTTClock> clock);
+		//Make the socket of every connection with socketFactory, such as SimulatedNetwork::CreateSocket. Call before Connect
+		void SetSocketFactory(std::function<std::unique_ptr<Socket>()> socketFactory);
+
+		//Publishes to topics matching topicFilter are collected and sent as one PUBLISH once maxMessages are collected or lingerTime ms
+		//have passed since the first one. Their tokens complete with the batch. Receivers split batches back with EnableDeaggregation
+		void EnableAggregation(std::string topicFilter, uint32_t maxMessages, uint32_t lingerTime);
+		//Deliver the records of aggregated payloads received on topics matching topicFilter one by one
+		void EnableDeaggregation(std::string topicFilter);
+		//Send the batches being collected without waiting for their linger
+		void FlushAggregation();
+
+		//Publishes to topics matching topicFilter with a QoS up to maxQos (0 or 1) go through an outbound queue where a newer publish to the
+		//same topic replaces the one still waiting, keeping its place. The replaced publish's token completes with MQTT_RESULT_CONFLATED.
+		//Call before Connect: the connection then keeps at most MQTT_CONFLATION_UNSENT_LIMIT bytes unsent in the kernel
+		void EnableConflation(std::string topicFilter, uint8_t maxQos);
+		std::shared_ptr<MQTTConflator> GetConflator();
+
+		//Publishes received on topics matching topicFilter are handed to mqttDataCallback by a thread of their own, through a queue of depth
+		//publishes handled by overflowPolicy when full, so a slow consumer holds back its own topics only. The first queue whose filter matches
+		//takes the publish, the others go to the callback of MQTTOnReceivedPayload on the network thread. Call before Connect
+		std::shared_ptr<MQTTDeliveryQueue> EnableDeliveryQueue(std::string topicFilter, uint32_t depth, MQTTOverflowPolicy overflowPolicy, MQTTDataCallback mqttDataCallback);
+
+		//Subscribe to replyTopic, now and on every connection, to receive the responses of Request. The topic should be unique to this client
+		void EnableRpc(std::string replyTopic);
+		//Publish payload to topicName as a request and complete the call with the response, or with MQTT_RESULT_TIMEOUT after timeout ms
+		MQTTRpcCallPtr Request(std::string topicName, std::string payload, uint8_t qos, uint32_t timeout);
+
+		//Keep publishes, subscribes and unsubscribes made while disconnected and send them in order once connected again.
+		//Their tokens complete right away with MQTT_RESULT_BUFFERED. Publishing a file is not buffered
+		bool EnableOfflineBuffer(MQTTOfflineBufferOptions offlineBufferOptions);
+		std::shared_ptr<MQTTOfflineBuffer> GetOfflineBuffer();
+
+		//Keep the latest payload of every topic received, retained or not. Call before Connect; the cache may be read from any thread
+		void EnableLastValueCache(uint32_t maxTopics, std::size_t memoryLimit, MQTTCacheEvictionPolicy evictionPolicy);
+		std::shared_ptr<MQTTLastValueCache> GetLastValueCache();
+
+		//Record every MQTT frame sent and received to a capture file, also across reconnections until StopCapture
+		bool StartCapture(std::string path);
+		void StopCapture();
+		//Feed the inbound frames of a capture through the decode and dispatch path as if they came from the broker. Replies are dropped.
+		//With originalTiming the frames are spaced as they were recorded, otherwise they are dispatched back to back. Returns the number of frames dispatched,
+		//skipped counts the inbound frames longer than MQTT_MAX_MESSAGE_LENGTH. A replayed CONNACK does not start the link checks, the offline buffer
+		//drain or the connected callback
+		uint64_t Replay(std::string path, bool originalTiming, uint64_t &skipped);
+		inline uint64_t Replay(std::string path, bool originalTiming) { uint64_t skipped; return Replay(path, originalTiming, skipped); }
+#if defined(__linux__)
+		//Append every PUBLISH received to a journal of memory mapped segments, also across reconnections until StopJournal. Read it back with MQTTJournalReader
+		bool StartJournal(MQTTJournalOptions journalOptions);
+		void StopJournal();
+#endif
 
 		void MQTTOnConnected(MQTTCallback mqttConnectedCallback);
 		void MQTTOnDisconnected(MQTTCallback mqttDisconnectedCallback);
 		void MQTTOnPublished(MQTTCallback mqttPublishedCallback);
 		void MQTTOnReceivedPayload(MQTTDataCallback mqttDataCallback);
+		//Receive publishes without copying them and with their QoS and retain flag, instead of through the callback of MQTTOnReceivedPayload
+		void MQTTOnReceivedPublish(MQTTPublishCallback mqttPublishCallback);
+		//Requests received on the subscribed topics go to mqttRequestCallback instead of the data callback, its answer is published to their reply topic
+		void MQTTOnRequest(MQTTRequestCallback mqttRequestCallback);
 	private:
 		void TCPConnectedCallback();
 		void TCPDisconnectedCallback();
 		void TCPReceivedCallback(uint8_t* data, std::size_t dataLength);
 		void TCPSentCallback(std::size_t bytesTransferred);
-		void TimerCallback();
+		void CheckLink();
+		void Reconnect();
+		void ScheduleLinkCheck(std::chrono::nanoseconds due);
+		MQTTTokenPtr PublishFile(std::string topicName, int fd, uint64_t offset, uint64_t length, uint8_t qos, bool retain, bool closeFile);
+		MQTTTokenPtr PublishPayload(std::string &topicName, std::string &payload, uint8_t qos, bool retain);
+		void PublishAggregate(std::string &topicName, std::string &payload, uint8_t qos, bool retain, std::vector<MQTTTokenPtr> &tokens);
+		static void CompleteAggregate(const MQTTResult &result, void *context);
+		void PublishConflated(std::string &topicName, std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr &token);
+		static void CompleteConflated(const MQTTResult &result, void *context);
+		void StartRpcExpiry(std::shared_ptr<MQTTRpc> rpc);
+		bool DispatchRpc(const char *topicName, uint16_t topicLength, const uint8_t *payload, uint32_t payloadLength);
+		bool IsDeaggregated(const char *topicName, uint16_t topicLength);
+		void DeliverPayload(const char *topicName, uint16_t topicLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retained);
+		MQTTTokenPtr SendPublish(std::string &topicName, std::string &payload, uint8_t qos, bool retain);
+		MQTTTokenPtr SendSubscribe(std::string &topicName, uint8_t qos);
+		MQTTTokenPtr SendUnsubscribe(std::string &topicName);
+		bool IsBuffering();
+		MQTTTokenPtr BufferRequest(const MQTTOfflineRequest &request);
+		void StartDrain(std::shared_ptr<MQTTOfflineBuffer> buffer);
+		void DrainOfflineBuffer(std::shared_ptr<MQTTOfflineBuffer> buffer);
+		bool AllocatePacketIdentifier(uint16_t &packetIdentifier);
+		MQTTTokenPtr TrackPacket(uint16_t packetIdentifier);
+		std::vector<MQTTTokenPtr> SendTopicFilters(const std::vector<MQTTSubscription> &topicFilters, bool subscribe);
+		void AcknowledgePacket(uint16_t packetIdentifier, uint8_t returnCode);
+		void AcknowledgePacket(uint16_t packetIdentifier, const uint8_t *returnCodes, uint32_t returnCodeCount);
+		std::vector<MQTTTokenPtr> ReleasePacket(uint16_t packetIdentifier);
+		void FailPendingPackets();
 	private:
-		std::unique_ptr<Network> network;
+		std::shared_ptr<Network> network;
+		std::shared_ptr<MQTTCaptureWriter> capture;
+#if defined(__linux__)
+		std::shared_ptr<MQTTJournal> journal;
+#endif
+		std::shared_ptr<MQTTLastValueCache> lastValueCache;
+		std::shared_ptr<MQTTOfflineBuffer> offlineBuffer;
+		std::shared_ptr<MQTTAggregator> aggregator;
+		std::shared_ptr<MQTTConflator> conflator;
+		std::shared_ptr<MQTTRpc> rpc;
+		std::shared_ptr<std::vector<std::string>> deaggregatedTopicFilters;
+		std::mutex deaggregationMutex; //Held by EnableDeaggregation while it replaces the list
+		std::shared_ptr<std::vector<std::shared_ptr<MQTTDeliveryQueue>>> deliveryQueues;
+		std::atomic<bool> draining;
+		std::atomic<bool> closing; //Set by the destructor, stops the drain
+		std::atomic<bool> replaying;
+		std::mutex drainMutex;
+		std::thread drainThread; //Last drain started, joined by the next one and by the destructor
+		uint32_t drainRate;
+		bool busyPollEnabled;
+		int busyPollCpu;
+		std::function<std::unique_ptr<Socket>()> socketFactory;
+		std::shared_ptr<MQTTClock> clock;
+		std::shared_ptr<MQTTLinkMonitor> linkMonitor;
+		//Held by clock tasks and network callbacks while they run, never handed out. Reset by the destructor to stop them
+		std::shared_ptr<void> alive;
+		bool security;
 		std::string host;
 		uint32_t port;
 		std::string clientID;
-		uint16_t keepAliveTick;
 		MQTTConnectOptions mqttConnectOptions;
-		Timer timer;
-		ClientState clientState;
+		PacketIdentifierAllocator packetIdentifierAllocator;
+		InboundPacketTable inboundPacketTable;
+		std::mutex pendingTokensMutex;
+		std::unordered_map<uint16_t, std::vector<MQTTTokenPtr>> pendingTokens;
+		std::atomic<ClientState> clientState;
 		MQTTCallback mqttConnectedCallback;
 		MQTTCallback mqttDisconnectedCallback;
 		MQTTCallback mqttPublishedCallback;
 		MQTTDataCallback mqttDataCallback;
+		MQTTPublishCallback mqttPublishCallback;
+		MQTTRequestCallback mqttRequestCallback;
 };	
 #endif //_MQTT_CLIENT_H_
\ No newline at end of file
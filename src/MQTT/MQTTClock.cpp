@@ -0,0 +1,99 @@
+#include "MQTTClock.h"
+#include <thread>
+
+std::chrono::nanoseconds MQTTSystemClock::Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch());
+}
+
+void MQTTSystemClock::Schedule(std::chrono::nanoseconds delay, MQTTClockTask task)
+{
+	std::thread([delay, task]
+	{
+		std::this_thread::sleep_for(delay);
+		task();
+	}).detach();
+}
+
+void MQTTSystemClock::Every(std::chrono::nanoseconds period, MQTTClockRepeatedTask task)
+{
+	std::thread([period, task]
+	{
+		do
+		{
+			std::this_thread::sleep_for(period);
+		} while (task());
+	}).detach();
+}
+
+MQTTVirtualClock::MQTTVirtualClock() : now(0), sequence(0)
+{
+}
+
+std::chrono::nanoseconds MQTTVirtualClock::Now()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return now;
+}
+
+void MQTTVirtualClock::Schedule(std::chrono::nanoseconds delay, MQTTClockTask task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Push(now + delay, std::chrono::nanoseconds(0), [task]()
+	{
+		task();
+		return false;
+	});
+}
+
+void MQTTVirtualClock::Every(std::chrono::nanoseconds period, MQTTClockRepeatedTask task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Push(now + period, period, task);
+}
+
+void MQTTVirtualClock::Advance(std::chrono::nanoseconds duration)
+{
+	std::chrono::nanoseconds end = Now() + duration;
+	while (RunNext(end));
+	std::lock_guard<std::mutex> lock(mutex);
+	now = end;
+}
+
+bool MQTTVirtualClock::RunNext(std::chrono::nanoseconds limit)
+{
+	Task task;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (tasks.empty() || (tasks.top().time > limit))
+		{
+			return false;
+		}
+		task = tasks.top();
+		tasks.pop();
+		now = task.time;
+	}
+	//Outside the lock, tasks schedule others
+	if (task.task() && (task.period.count() > 0))
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Push(task.time + task.period, task.period, task.task);
+	}
+	return true;
+}
+
+std::size_t MQTTVirtualClock::GetPendingCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return tasks.size();
+}
+
+void MQTTVirtualClock::Push(std::chrono::nanoseconds time, std::chrono::nanoseconds period, MQTTClockRepeatedTask task)
+{
+	Task entry;
+	entry.time = time;
+	entry.sequence = sequence++;
+	entry.period = period;
+	entry.task = task;
+	tasks.push(entry);
+}
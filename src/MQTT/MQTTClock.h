@@ -0,0 +1,77 @@
+#ifndef _MQTT_CLOCK_H_
+#define _MQTT_CLOCK_H_
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <vector>
+#include <mutex>
+
+using MQTTClockTask = std::function<void()>;
+//Returns false once it no longer needs to run
+using MQTTClockRepeatedTask = std::function<bool()>;
+
+//Time source of the client timers, such as the keep alive
+class MQTTClock
+{
+	public:
+		MQTTClock() = default;
+		virtual ~MQTTClock() = default;
+		//Time elapsed since an arbitrary origin fixed for the life of the clock
+		virtual std::chrono::nanoseconds Now() = 0;
+		//Runs task once after delay
+		virtual void Schedule(std::chrono::nanoseconds delay, MQTTClockTask task) = 0;
+		//Runs task every period, the first time one period from now, until it returns false
+		virtual void Every(std::chrono::nanoseconds period, MQTTClockRepeatedTask task) = 0;
+};
+
+//Real time, tasks run on threads of their own
+class MQTTSystemClock : public MQTTClock
+{
+	public:
+		MQTTSystemClock() = default;
+		~MQTTSystemClock() = default;
+		std::chrono::nanoseconds Now() override;
+		void Schedule(std::chrono::nanoseconds delay, MQTTClockTask task) override;
+		void Every(std::chrono::nanoseconds period, MQTTClockRepeatedTask task) override;
+};
+
+//Time that only moves when its owner advances it. Due tasks then run on the advancing thread, in order of due time and, for equal times,
+//in the order they were scheduled, so a run is repeatable and hours of protocol time pass in the time it takes to run the tasks
+class MQTTVirtualClock : public MQTTClock
+{
+	public:
+		MQTTVirtualClock();
+		~MQTTVirtualClock() = default;
+		std::chrono::nanoseconds Now() override;
+		void Schedule(std::chrono::nanoseconds delay, MQTTClockTask task) override;
+		void Every(std::chrono::nanoseconds period, MQTTClockRepeatedTask task) override;
+		//Runs every task due within duration, tasks scheduled meanwhile included, then moves the time to the end of it
+		void Advance(std::chrono::nanoseconds duration);
+		//Moves the time to the next due task and runs it, returns false when no task is left or the next one is due after limit
+		bool RunNext(std::chrono::nanoseconds limit);
+		std::size_t GetPendingCount();
+	private:
+		struct Task
+		{
+			std::chrono::nanoseconds time;
+			uint64_t sequence;
+			std::chrono::nanoseconds period; //Zero for tasks run once
+			MQTTClockRepeatedTask task;
+		};
+		struct Later
+		{
+			bool operator()(const Task &left, const Task &right) const
+			{
+				return (left.time != right.time) ? (left.time > right.time) : (left.sequence > right.sequence);
+			}
+		};
+		void Push(std::chrono::nanoseconds time, std::chrono::nanoseconds period, MQTTClockRepeatedTask task);
+	private:
+		std::mutex mutex;
+		std::chrono::nanoseconds now;
+		uint64_t sequence;
+		std::priority_queue<Task, std::vector<Task>, Later> tasks;
+};
+
+#endif //_MQTT_CLOCK_H_
@@ -5,5 +5,29 @@
 #define MQTT_SECURITY 1 
 #define MQTT_KEEP_ALIVE 120
 #define MQTT_MAX_MESSAGE_LENGTH 1024
+//Largest SUBSCRIBE or UNSUBSCRIBE sent when subscribing to a list of topic filters
+#define MQTT_MAX_SUBSCRIBE_LENGTH (64 * 1024)
+#define MQTT_FILE_CHUNK_LENGTH (1024 * 1024)
+#define MQTT_LOCAL_RING_LENGTH (1024 * 1024)
+#define MQTT_OFFLINE_MEMORY_LIMIT (4 * 1024 * 1024)
+#define MQTT_OFFLINE_SEGMENT_LENGTH (1024 * 1024)
+//Bytes the kernel may hold unsent while conflation is enabled, beyond that publishes wait in the conflator
+#define MQTT_CONFLATION_UNSENT_LIMIT (16 * 1024)
+//Requests waiting for a response at once, a power of two
+#define MQTT_RPC_MAX_IN_FLIGHT 8192
+//Milliseconds between two sweeps for expired requests
+#define MQTT_RPC_EXPIRE_PERIOD 10
+//Link monitor, in ms: round trip time assumed before the first sample, bounds of the retransmit timeout,
+//least margin over 2 * SRTT allowed for a PINGRESP and delay before connecting again once the link is found dead
+#define MQTT_LINK_INITIAL_RTT 1000
+#define MQTT_LINK_MIN_RTO 200
+#define MQTT_LINK_MAX_RTO 60000
+#define MQTT_LINK_MARGIN 500
+#define MQTT_LINK_RECONNECT_DELAY 1000
+//A PINGRESP is always allowed at least keepAlive / MQTT_LINK_MIN_PING_TIMEOUT_DIVISOR
+#define MQTT_LINK_MIN_PING_TIMEOUT_DIVISOR 20
+//Default length of an inbound journal segment, and bytes of records between two entries of its sparse index
+#define MQTT_JOURNAL_SEGMENT_LENGTH (64 * 1024 * 1024)
+#define MQTT_JOURNAL_INDEX_INTERVAL (64 * 1024)
 
 #endif //_MQTT_CONFIG_H_
\ No newline at end of file
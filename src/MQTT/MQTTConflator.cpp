@@ -0,0 +1,120 @@
+#include "MQTTConflator.h"
+#include "MQTTTopic.h"
+
+MQTTConflator::MQTTConflator(MQTTConflateCallback conflateCallback) : conflateCallback(conflateCallback), conflatedCount(0), conflatedBytes(0), running(true)
+{
+	thread = std::thread(&MQTTConflator::Run, this);
+}
+
+MQTTConflator::~MQTTConflator()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	condition.notify_one();
+	//The queue is sent before the thread ends
+	thread.join();
+}
+
+void MQTTConflator::AddTopicFilter(std::string topicFilter, uint8_t maxQos)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	topicFilters.push_back(std::make_pair(topicFilter, maxQos));
+}
+
+bool MQTTConflator::Add(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr token, MQTTTokenPtr &replacedToken)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Topic *topic = GetTopic(topicName);
+	if (topic == nullptr)
+	{
+		return false;
+	}
+	bool conflatable = qos <= topic->maxQos;
+	if (conflatable && topic->queued)
+	{
+		Entry &entry = *topic->entry;
+		++conflatedCount;
+		conflatedBytes += entry.payload.size();
+		entry.payload = payload;
+		entry.qos = qos;
+		entry.retain = retain;
+		replacedToken = entry.token;
+		entry.token = token;
+		return true;
+	}
+	bool empty = queue.empty();
+	queue.push_back({ topicName, payload, qos, retain, token });
+	//A publish that may not be replaced must not be overtaken either, the next one starts a new entry behind it
+	topic->queued = conflatable;
+	topic->entry = std::prev(queue.end());
+	if (empty)
+	{
+		condition.notify_one();
+	}
+	return true;
+}
+
+uint64_t MQTTConflator::GetConflatedCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return conflatedCount;
+}
+
+uint64_t MQTTConflator::GetConflatedBytes()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return conflatedBytes;
+}
+
+std::size_t MQTTConflator::GetQueuedCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return queue.size();
+}
+
+MQTTConflator::Topic* MQTTConflator::GetTopic(const std::string &topicName)
+{
+	auto iterator = topics.find(topicName);
+	if (iterator != topics.end())
+	{
+		return &iterator->second;
+	}
+	//Only conflated topics are kept, others are matched against the filters on every publish
+	for (auto &topicFilter : topicFilters)
+	{
+		if (MQTTTopic::Matches(topicFilter.first, topicName))
+		{
+			Topic &topic = topics[topicName];
+			topic.maxQos = topicFilter.second;
+			topic.queued = false;
+			return &topic;
+		}
+	}
+	return nullptr;
+}
+
+void MQTTConflator::Run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (running || !queue.empty())
+	{
+		if (queue.empty())
+		{
+			condition.wait(lock);
+			continue;
+		}
+		Entry entry = std::move(queue.front());
+		Topic &topic = topics[entry.topicName];
+		if (topic.queued && (topic.entry == queue.begin()))
+		{
+			topic.queued = false;
+		}
+		queue.pop_front();
+		//Written without the lock so newer publishes keep replacing the queued ones meanwhile
+		lock.unlock();
+		conflateCallback(entry.topicName, entry.payload, entry.qos, entry.retain, entry.token);
+		lock.lock();
+	}
+}
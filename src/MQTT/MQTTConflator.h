@@ -0,0 +1,66 @@
+#ifndef _MQTT_CONFLATOR_H_
+#define _MQTT_CONFLATOR_H_
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "MQTTToken.h"
+
+//Sends one queued publish, blocking until it is written
+using MQTTConflateCallback = std::function<void(std::string &topicName, std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr &token)>;
+
+//Outbound queue of the publishes to conflated topics, written one at a time by a thread of the conflator so that, while the link is congested,
+//they wait here rather than in the socket. A publish to a topic that already has one waiting takes its place in the queue, the older one is never sent.
+//Only publishes up to the QoS given for the filter are conflated, others to the same topic queue behind them unchanged
+class MQTTConflator
+{
+	public:
+		MQTTConflator(MQTTConflateCallback conflateCallback);
+		~MQTTConflator();
+		MQTTConflator(MQTTConflator&) = delete;
+		MQTTConflator& operator=(MQTTConflator&) = delete;
+		//Policies are looked up in the order they were added, the first filter matching the topic wins
+		void AddTopicFilter(std::string topicFilter, uint8_t maxQos);
+		//Returns false when the topic is not conflated, the publish is then the caller's to send. replacedToken is set to the token
+		//of the publish this one replaced, if any
+		bool Add(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain, MQTTTokenPtr token, MQTTTokenPtr &replacedToken);
+		//Publishes replaced before being sent, and the payload bytes they would have taken
+		uint64_t GetConflatedCount();
+		uint64_t GetConflatedBytes();
+		std::size_t GetQueuedCount();
+	private:
+		struct Entry
+		{
+			std::string topicName;
+			std::string payload;
+			uint8_t qos;
+			bool retain;
+			MQTTTokenPtr token;
+		};
+		struct Topic
+		{
+			uint8_t maxQos;
+			bool queued; //entry is the newest publish queued for the topic and may still be replaced
+			std::list<Entry>::iterator entry;
+		};
+		Topic* GetTopic(const std::string &topicName);
+		void Run();
+	private:
+		MQTTConflateCallback conflateCallback;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::vector<std::pair<std::string, uint8_t>> topicFilters;
+		std::unordered_map<std::string, Topic> topics;
+		std::list<Entry> queue;
+		uint64_t conflatedCount;
+		uint64_t conflatedBytes;
+		bool running;
+		std::thread thread;
+};
+
+#endif //_MQTT_CONFLATOR_H_
@@ -44,4 +44,39 @@ void MQTTConnectOptions::SetLWT(std::string lastWillTopic, std::string lastWillM
 uint16_t MQTTConnectOptions::GetKeepAlive()
 {
 	return keepAlive;
+}
+
+bool MQTTConnectOptions::GetCleanSession()
+{
+	return cleanSession;
+}
+
+const std::string& MQTTConnectOptions::GetUsername()
+{
+	return username;
+}
+
+const std::string& MQTTConnectOptions::GetPassword()
+{
+	return password;
+}
+
+const std::string& MQTTConnectOptions::GetLastWillTopic()
+{
+	return lastWillTopic;
+}
+
+const std::string& MQTTConnectOptions::GetLastWillMessage()
+{
+	return lastWillMessage;
+}
+
+uint8_t MQTTConnectOptions::GetLastWillQos()
+{
+	return lastWillQos;
+}
+
+bool MQTTConnectOptions::GetLastWillRetain()
+{
+	return lastWillRetain;
 }
\ No newline at end of file
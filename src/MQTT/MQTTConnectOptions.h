@@ -15,6 +15,13 @@ class MQTTConnectOptions
 		void SetLWT(std::string lastWillTopic, std::string lastWillMessage, uint8_t lastWillQos, bool lastWillRetain);
 
 		uint16_t GetKeepAlive();
+		bool GetCleanSession();
+		const std::string& GetUsername();
+		const std::string& GetPassword();
+		const std::string& GetLastWillTopic();
+		const std::string& GetLastWillMessage();
+		uint8_t GetLastWillQos();
+		bool GetLastWillRetain();
 	private:
 		std::string username;
 		std::string password;
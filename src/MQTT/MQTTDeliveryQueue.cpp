@@ -0,0 +1,208 @@
+#include "MQTTDeliveryQueue.h"
+
+MQTTDeliveryQueue::MQTTDeliveryQueue(std::string topicFilter, uint32_t depth, MQTTOverflowPolicy overflowPolicy, MQTTDeliveryCallback deliveryCallback) : topicFilter(topicFilter),
+	overflowPolicy(overflowPolicy), deliveryCallback(deliveryCallback), capacity(2), limit(1), head(0), tail(0), enqueued(0), droppedOldest(0), droppedNewest(0), maxDepth(0), delivered(0), totalLatency(0), maxLatency(0),
+	consumerSleeping(false), producerSleeping(false), running(true)
+{
+	//Keeping the latest is dropping the oldest from a queue of one
+	if (overflowPolicy == MQTTOverflowPolicy::LATEST_ONLY)
+	{
+		this->overflowPolicy = MQTTOverflowPolicy::DROP_OLDEST;
+		depth = 1;
+	}
+	//Two slots at least, with one the sequence of a free slot would read as a full one
+	while (capacity < depth)
+	{
+		capacity <<= 1;
+	}
+	limit = (depth > 1) ? capacity : 1;
+	slots.reset(new Slot[capacity]);
+	for (uint64_t position = 0; position < capacity; ++position)
+	{
+		slots[position].sequence.store(position, std::memory_order_relaxed);
+	}
+	thread = std::thread(&MQTTDeliveryQueue::Run, this);
+}
+
+MQTTDeliveryQueue::~MQTTDeliveryQueue()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	consumerCondition.notify_all();
+	producerCondition.notify_all();
+	if (thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+const std::string& MQTTDeliveryQueue::GetTopicFilter()
+{
+	return topicFilter;
+}
+
+bool MQTTDeliveryQueue::Push(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	enqueued.fetch_add(1, std::memory_order_relaxed);
+	//Only this thread moves the tail
+	uint64_t position = tail.load(std::memory_order_relaxed);
+	while (running.load(std::memory_order_relaxed))
+	{
+		Slot &slot = slots[position & (capacity - 1)];
+		bool full = (position - head.load(std::memory_order_acquire) >= limit);
+		if (!full && (slot.sequence.load(std::memory_order_acquire) == position))
+		{
+			slot.topicName.assign(topicName, topicNameLength);
+			slot.payload.assign(reinterpret_cast<const char*>(payload), payloadLength);
+			slot.enqueueTime = now;
+			slot.sequence.store(position + 1, std::memory_order_release);
+			tail.store(position + 1, std::memory_order_relaxed);
+			uint32_t depth = static_cast<uint32_t>(position + 1 - head.load(std::memory_order_relaxed));
+			if (depth > maxDepth.load(std::memory_order_relaxed))
+			{
+				maxDepth.store(depth, std::memory_order_relaxed);
+			}
+			//Pairs with the fence of the consumer going to sleep, one of the two sees the other
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (consumerSleeping.load(std::memory_order_relaxed))
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				consumerCondition.notify_one();
+			}
+			return true;
+		}
+		//The queue has room but the consumer is still moving the oldest publish out of the slot, which takes an instant.
+		//Waiting for it drops nothing, whatever the policy
+		if (!full || (overflowPolicy == MQTTOverflowPolicy::BLOCK))
+		{
+			WaitForRoom(position);
+		}
+		else if (overflowPolicy == MQTTOverflowPolicy::DROP_OLDEST)
+		{
+			if (DiscardOldest())
+			{
+				droppedOldest.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+		else
+		{
+			break;
+		}
+	}
+	droppedNewest.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+MQTTDeliveryStatistics MQTTDeliveryQueue::GetStatistics()
+{
+	MQTTDeliveryStatistics statistics;
+	statistics.enqueued = enqueued.load(std::memory_order_relaxed);
+	statistics.delivered = delivered.load(std::memory_order_relaxed);
+	statistics.droppedOldest = droppedOldest.load(std::memory_order_relaxed);
+	statistics.droppedNewest = droppedNewest.load(std::memory_order_relaxed);
+	statistics.dropped = statistics.droppedOldest + statistics.droppedNewest;
+	uint64_t head = this->head.load(std::memory_order_relaxed);
+	uint64_t tail = this->tail.load(std::memory_order_relaxed);
+	statistics.depth = (tail > head) ? static_cast<uint32_t>(tail - head) : 0;
+	statistics.maxDepth = maxDepth.load(std::memory_order_relaxed);
+	statistics.averageLatency = std::chrono::microseconds((statistics.delivered > 0) ? (totalLatency.load(std::memory_order_relaxed) / statistics.delivered / 1000) : 0);
+	statistics.maxLatency = std::chrono::microseconds(maxLatency.load(std::memory_order_relaxed) / 1000);
+	return statistics;
+}
+
+bool MQTTDeliveryQueue::Pop(std::string &topicName, std::string &payload, std::chrono::steady_clock::time_point &enqueueTime)
+{
+	uint64_t position = head.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Slot &slot = slots[position & (capacity - 1)];
+		int64_t difference = static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) - (position + 1));
+		if (difference < 0)
+		{
+			return false;
+		}
+		if (difference > 0)
+		{
+			//The producer discarded it meanwhile
+			position = head.load(std::memory_order_relaxed);
+		}
+		else if (head.compare_exchange_weak(position, position + 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			topicName.swap(slot.topicName);
+			payload.swap(slot.payload);
+			enqueueTime = slot.enqueueTime;
+			slot.sequence.store(position + capacity, std::memory_order_release);
+			return true;
+		}
+	}
+}
+
+bool MQTTDeliveryQueue::DiscardOldest()
+{
+	uint64_t position = head.load(std::memory_order_relaxed);
+	Slot &slot = slots[position & (capacity - 1)];
+	if ((slot.sequence.load(std::memory_order_acquire) != position + 1) || !head.compare_exchange_strong(position, position + 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+	{
+		//The consumer took it first, which made room as well
+		return false;
+	}
+	//The strings stay in the slot, the next publish written there reuses their memory
+	slot.sequence.store(position + capacity, std::memory_order_release);
+	return true;
+}
+
+void MQTTDeliveryQueue::WaitForRoom(uint64_t position)
+{
+	Slot &slot = slots[position & (capacity - 1)];
+	std::unique_lock<std::mutex> lock(mutex);
+	producerSleeping = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	producerCondition.wait(lock, [&]()
+	{
+		return ((position - head.load(std::memory_order_acquire) < limit) && (slot.sequence.load(std::memory_order_acquire) == position)) || !running.load(std::memory_order_relaxed);
+	});
+	producerSleeping = false;
+}
+
+void MQTTDeliveryQueue::Run()
+{
+	std::string topicName;
+	std::string payload;
+	std::chrono::steady_clock::time_point enqueueTime;
+	while (running.load(std::memory_order_relaxed))
+	{
+		if (!Pop(topicName, payload, enqueueTime))
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			consumerSleeping = true;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			consumerCondition.wait(lock, [&]()
+			{
+				uint64_t position = head.load(std::memory_order_relaxed);
+				return (slots[position & (capacity - 1)].sequence.load(std::memory_order_acquire) == position + 1) || !running.load(std::memory_order_relaxed);
+			});
+			consumerSleeping = false;
+			continue;
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (producerSleeping.load(std::memory_order_relaxed))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			producerCondition.notify_one();
+		}
+		uint64_t latency = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - enqueueTime).count());
+		totalLatency.fetch_add(latency, std::memory_order_relaxed);
+		if (latency > maxLatency.load(std::memory_order_relaxed))
+		{
+			maxLatency.store(latency, std::memory_order_relaxed);
+		}
+		if (deliveryCallback)
+		{
+			deliveryCallback(std::move(topicName), std::move(payload));
+		}
+		delivered.fetch_add(1, std::memory_order_relaxed);
+	}
+}
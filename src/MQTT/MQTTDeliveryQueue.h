@@ -0,0 +1,92 @@
+#ifndef _MQTT_DELIVERY_QUEUE_H_
+#define _MQTT_DELIVERY_QUEUE_H_
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+//What the network thread does with a publish when the queue of its subscription is full
+enum class MQTTOverflowPolicy : uint8_t
+{
+	BLOCK = 0x01, //Wait for room. Reading stops for every topic of the connection, TCP then slows the broker down
+	DROP_OLDEST, //Discard the publish waiting the longest
+	DROP_NEWEST, //Discard the publish received
+	LATEST_ONLY //Keep one publish, a newer one replaces it. The depth is ignored
+};
+
+struct MQTTDeliveryStatistics
+{
+	uint64_t enqueued;
+	uint64_t delivered;
+	uint64_t dropped; //droppedOldest + droppedNewest
+	uint64_t droppedOldest; //Publishes discarded from the queue to make room
+	uint64_t droppedNewest; //Publishes received and not queued
+	uint32_t depth; //Publishes waiting now
+	uint32_t maxDepth;
+	//Time publishes waited in the queue before their callback started
+	std::chrono::microseconds averageLatency;
+	std::chrono::microseconds maxLatency;
+};
+
+using MQTTDeliveryCallback = std::function<void(std::string topic, std::string payload)>;
+
+//Bounded queue of the publishes received for one subscription, filled by the network thread and drained by a thread of the queue
+//that runs the callback, so a slow consumer holds back its own topics only. Slots carry a sequence number (as in D. Vyukov's bounded queue):
+//the consumer claims the oldest one with compare and swap, which lets the producer discard it as well when dropping the oldest.
+//Neither side takes a lock unless it has to sleep, and publishes are moved out of their slot to the callback rather than copied
+class MQTTDeliveryQueue
+{
+	public:
+		//depth is rounded up to a power of two
+		MQTTDeliveryQueue(std::string topicFilter, uint32_t depth, MQTTOverflowPolicy overflowPolicy, MQTTDeliveryCallback deliveryCallback);
+		~MQTTDeliveryQueue();
+		MQTTDeliveryQueue(MQTTDeliveryQueue&) = delete;
+		MQTTDeliveryQueue& operator=(MQTTDeliveryQueue&) = delete;
+		const std::string& GetTopicFilter();
+		//Called by the network thread only. Returns false when the publish was dropped
+		bool Push(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength);
+		MQTTDeliveryStatistics GetStatistics();
+	private:
+		struct Slot
+		{
+			//Position the slot can be written at, position + 1 once it holds a publish
+			std::atomic<uint64_t> sequence;
+			std::string topicName;
+			std::string payload;
+			std::chrono::steady_clock::time_point enqueueTime;
+		};
+		bool Pop(std::string &topicName, std::string &payload, std::chrono::steady_clock::time_point &enqueueTime);
+		bool DiscardOldest();
+		void WaitForRoom(uint64_t position);
+		void Run();
+	private:
+		std::string topicFilter;
+		MQTTOverflowPolicy overflowPolicy;
+		MQTTDeliveryCallback deliveryCallback;
+		uint64_t capacity;
+		uint64_t limit; //Publishes the queue may hold, below capacity only to keep the latest
+		std::unique_ptr<Slot[]> slots;
+		alignas(64) std::atomic<uint64_t> head;
+		alignas(64) std::atomic<uint64_t> tail;
+		std::atomic<uint64_t> enqueued;
+		std::atomic<uint64_t> droppedOldest;
+		std::atomic<uint64_t> droppedNewest;
+		std::atomic<uint32_t> maxDepth;
+		alignas(64) std::atomic<uint64_t> delivered;
+		std::atomic<uint64_t> totalLatency; //Nanoseconds
+		std::atomic<uint64_t> maxLatency;
+		std::mutex mutex;
+		std::condition_variable consumerCondition;
+		std::condition_variable producerCondition;
+		std::atomic<bool> consumerSleeping;
+		std::atomic<bool> producerSleeping;
+		std::atomic<bool> running;
+		std::thread thread;
+};
+
+#endif //_MQTT_DELIVERY_QUEUE_H_
@@ -0,0 +1,534 @@
+#include "MQTTFleet.h"
+#if defined(__linux__)
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include "Utils.h"
+
+#define MQTT_FLEET_POLL_TIMEOUT 200
+#define MQTT_FLEET_MAX_EVENTS 256
+//Frames are parsed in place from one shared read buffer, longer ones close their connection
+#define MQTT_FLEET_READ_LENGTH (64 * 1024)
+//Blocks kept for reuse once released, enough for bursts of partial frames without holding memory for every client
+#define MQTT_FLEET_MAX_FREE_BUFFERS 256
+
+MQTTFleet::MQTTFleet(std::string host, uint32_t port) : epollfd(-1), connectedCount(0), bufferPool(MQTT_MAX_MESSAGE_LENGTH, MQTT_FLEET_MAX_FREE_BUFFERS),
+	readBuffer(new uint8_t[MQTT_FLEET_READ_LENGTH]), tick(0), running(false)
+{
+	memset(&brokerAddress, 0, sizeof(brokerAddress));
+	brokerAddress.sin_family = AF_INET;
+	brokerAddress.sin_port = htons(port);
+	addressValid = inet_pton(AF_INET, host.c_str(), &brokerAddress.sin_addr.s_addr) > 0;
+	//Clients may be added before Start, they connect once the fleet runs
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	mqttConnectedCallback = nullptr;
+	mqttDisconnectedCallback = nullptr;
+	mqttDataCallback = nullptr;
+}
+
+MQTTFleet::~MQTTFleet()
+{
+	Stop();
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	for (uint32_t client = 0; client < connections.size(); ++client)
+	{
+		if (connections[client].state != MQTTFleetState::CLOSED)
+		{
+			Close(client, connections[client]);
+		}
+	}
+	if (epollfd != -1)
+	{
+		close(epollfd);
+	}
+}
+
+bool MQTTFleet::Start()
+{
+	if (!addressValid)
+	{
+		LOGI("Invalid address");
+		return false;
+	}
+	if (epollfd == -1)
+	{
+		LOGI("Create epoll fail");
+		return false;
+	}
+	running = true;
+	thread = std::thread(&MQTTFleet::Run, this);
+	return true;
+}
+
+void MQTTFleet::Stop()
+{
+	running = false;
+	if (thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+uint32_t MQTTFleet::AddClient(std::string clientID, MQTTConnectOptions mqttConnectOptions)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	uint32_t client = static_cast<uint32_t>(connections.size());
+	if (!addressValid || (epollfd == -1))
+	{
+		connections.push_back(Connection());
+		memset(&connections.back(), 0, sizeof(Connection));
+		connections.back().sockfd = -1;
+		connections.back().state = MQTTFleetState::CLOSED;
+		return client;
+	}
+	connections.push_back(Connection());
+	Connection &connection = connections.back();
+	memset(&connection, 0, sizeof(connection));
+	connection.state = MQTTFleetState::CONNECTING;
+	connection.keepAlive = mqttConnectOptions.GetKeepAlive();
+	connection.sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (connection.sockfd < 0)
+	{
+		LOGI("Create socket fail");
+		connection.state = MQTTFleetState::CLOSED;
+		return client;
+	}
+	if ((connect(connection.sockfd, (struct sockaddr*)&brokerAddress, sizeof(brokerAddress)) < 0) && (errno != EINPROGRESS))
+	{
+		LOGI("Failed to connect to server");
+		close(connection.sockfd);
+		connection.state = MQTTFleetState::CLOSED;
+		return client;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.u32 = client;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connection.sockfd, &event) < 0)
+	{
+		LOGI("Register socket fail");
+		close(connection.sockfd);
+		connection.state = MQTTFleetState::CLOSED;
+		return client;
+	}
+	connection.writeEnabled = true;
+	//Waits in the write buffer until the TCP handshake completes, the client ID is not kept
+	std::unique_ptr<MQTTMessage> mqttMessage = MQTTMessage::MQTTMessageConnect(clientID, mqttConnectOptions);
+	WriteMessage(client, connection, std::move(mqttMessage));
+	return client;
+}
+
+void MQTTFleet::Disconnect(uint32_t client)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	if ((client < connections.size()) && (connections[client].state != MQTTFleetState::CLOSED))
+	{
+		Close(client, connections[client]);
+	}
+}
+
+bool MQTTFleet::Publish(uint32_t client, const std::string &topicName, const std::string &payload, uint8_t qos, bool retain)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	if ((client >= connections.size()) || (connections[client].state != MQTTFleetState::CONNECTED))
+	{
+		return false;
+	}
+	Connection &connection = connections[client];
+	uint16_t packetIdentifier = (qos > 0) ? NextPacketIdentifier(connection) : 0;
+	return WriteMessage(client, connection, MQTTMessage::MQTTMessagePublish(topicName, payload, false, qos, retain, packetIdentifier));
+}
+
+bool MQTTFleet::Subscribe(uint32_t client, const std::string &topicFilter, uint8_t qos)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	if ((client >= connections.size()) || (connections[client].state != MQTTFleetState::CONNECTED))
+	{
+		return false;
+	}
+	Connection &connection = connections[client];
+	return WriteMessage(client, connection, MQTTMessage::MQTTMessageSubscribe(topicFilter, qos, NextPacketIdentifier(connection)));
+}
+
+bool MQTTFleet::IsConnected(uint32_t client)
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return (client < connections.size()) && (connections[client].state == MQTTFleetState::CONNECTED);
+}
+
+uint32_t MQTTFleet::GetClientCount()
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return static_cast<uint32_t>(connections.size());
+}
+
+uint32_t MQTTFleet::GetConnectedCount()
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return connectedCount;
+}
+
+uint32_t MQTTFleet::GetLeasedBuffers()
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return bufferPool.GetLeasedCount();
+}
+
+void MQTTFleet::MQTTOnConnected(MQTTFleetCallback mqttConnectedCallback)
+{
+	this->mqttConnectedCallback = mqttConnectedCallback;
+}
+
+void MQTTFleet::MQTTOnDisconnected(MQTTFleetCallback mqttDisconnectedCallback)
+{
+	this->mqttDisconnectedCallback = mqttDisconnectedCallback;
+}
+
+void MQTTFleet::MQTTOnReceivedPayload(MQTTFleetDataCallback mqttDataCallback)
+{
+	this->mqttDataCallback = mqttDataCallback;
+}
+
+void MQTTFleet::Run()
+{
+	struct epoll_event events[MQTT_FLEET_MAX_EVENTS];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (running)
+	{
+		int count = epoll_wait(epollfd, events, MQTT_FLEET_MAX_EVENTS, MQTT_FLEET_POLL_TIMEOUT);
+		if ((count < 0) && (errno != EINTR))
+		{
+			LOGI("Poll error");
+			break;
+		}
+		std::lock_guard<std::recursive_mutex> lock(mutex);
+		for (int i = 0; i < count; ++i)
+		{
+			uint32_t client = events[i].data.u32;
+			Connection &connection = connections[client];
+			if ((connection.state != MQTTFleetState::CLOSED) && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			{
+				HandleWritable(client, connection);
+			}
+			if ((connection.state != MQTTFleetState::CLOSED) && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			{
+				HandleReadable(client, connection);
+			}
+		}
+		uint32_t now = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count());
+		if (now != tick)
+		{
+			tick = now;
+			KeepAlive();
+		}
+	}
+}
+
+void MQTTFleet::HandleWritable(uint32_t client, Connection &connection)
+{
+	if (connection.state == MQTTFleetState::CONNECTING)
+	{
+		int error = 0;
+		socklen_t errorLength = sizeof(error);
+		if ((getsockopt(connection.sockfd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0) || (error != 0))
+		{
+			LOGI("Failed to connect to server");
+			Close(client, connection);
+			return;
+		}
+		connection.state = MQTTFleetState::WAIT_CONNACK;
+	}
+	while (connection.writeOffset < connection.writeLength)
+	{
+		ssize_t sent = send(connection.sockfd, connection.writeBuffer + connection.writeOffset, connection.writeLength - connection.writeOffset, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			{
+				return;
+			}
+			LOGI("Write data error");
+			Close(client, connection);
+			return;
+		}
+		connection.writeOffset += static_cast<uint32_t>(sent);
+	}
+	bufferPool.Release(connection.writeBuffer, connection.writeCapacity);
+	connection.writeBuffer = nullptr;
+	connection.writeCapacity = 0;
+	connection.writeOffset = 0;
+	connection.writeLength = 0;
+	SetWriteEnabled(client, connection, false);
+}
+
+void MQTTFleet::HandleReadable(uint32_t client, Connection &connection)
+{
+	//The start of a frame left by the previous read goes back in front of the new bytes
+	uint32_t total = connection.readLength;
+	if (total > 0)
+	{
+		memcpy(readBuffer.get(), connection.readBuffer, total);
+		bufferPool.Release(connection.readBuffer, connection.readCapacity);
+		connection.readBuffer = nullptr;
+		connection.readCapacity = 0;
+		connection.readLength = 0;
+	}
+	ssize_t received = recv(connection.sockfd, readBuffer.get() + total, MQTT_FLEET_READ_LENGTH - total, 0);
+	if (received <= 0)
+	{
+		if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+		{
+			received = 0;
+		}
+		else
+		{
+			LOGI("Read data fail");
+			Close(client, connection);
+			return;
+		}
+	}
+	total += static_cast<uint32_t>(received);
+	uint32_t offset = 0;
+	while (connection.state != MQTTFleetState::CLOSED)
+	{
+		uint8_t *frame = readBuffer.get() + offset;
+		uint32_t available = total - offset;
+		uint32_t remainingLength = 0;
+		uint32_t multiplier = 1;
+		uint32_t index = 1;
+		bool complete = false;
+		while ((index < available) && (index <= 4))
+		{
+			remainingLength += (frame[index] & 127) * multiplier;
+			multiplier *= 128;
+			if ((frame[index++] & 0x80) == 0)
+			{
+				complete = true;
+				break;
+			}
+		}
+		if (!complete)
+		{
+			if (index > 4)
+			{
+				LOGI("Malformed remaining length");
+				Close(client, connection);
+				return;
+			}
+			break;
+		}
+		uint32_t frameLength = index + remainingLength;
+		if (frameLength > MQTT_FLEET_READ_LENGTH)
+		{
+			LOGI("Frame of %u bytes is too long", frameLength);
+			Close(client, connection);
+			return;
+		}
+		if (available < frameLength)
+		{
+			break;
+		}
+		HandleFrame(client, connection, frame, frameLength);
+		offset += frameLength;
+	}
+	if ((connection.state != MQTTFleetState::CLOSED) && (offset < total))
+	{
+		connection.readLength = total - offset;
+		connection.readBuffer = bufferPool.Acquire(connection.readLength, connection.readCapacity);
+		memcpy(connection.readBuffer, readBuffer.get() + offset, connection.readLength);
+	}
+}
+
+void MQTTFleet::HandleFrame(uint32_t client, Connection &connection, uint8_t *frame, uint32_t frameLength)
+{
+	switch (MQTTMessage::GetMessageType(frame))
+	{
+		case MQTTMessageType::MQTT_MSG_CONNACK:
+		{
+			if (MQTTMessage::GetConnectReturnCode(frame) != MQTT_CONNECTION_ACCEPTED)
+			{
+				LOGI("Client %u not accepted by the broker", client);
+				Close(client, connection);
+				break;
+			}
+			connection.state = MQTTFleetState::CONNECTED;
+			++connectedCount;
+			if (mqttConnectedCallback)
+			{
+				mqttConnectedCallback(client);
+			}
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBLISH:
+		{
+			if (!MQTTMessage::IsWellFormedPublish(frame, frameLength))
+			{
+				LOGI("Malformed publish");
+				Close(client, connection);
+				break;
+			}
+			uint16_t topicLength;
+			const char *topicName = MQTTMessage::GetPublishTopicName(frame, topicLength);
+			uint32_t payloadLength;
+			const uint8_t *payload = MQTTMessage::GetPublishPayload(frame, payloadLength);
+			uint8_t qos = MQTTMessage::GetPublishQos(frame);
+			if (mqttDataCallback)
+			{
+				mqttDataCallback(client, topicName, topicLength, payload, payloadLength);
+			}
+			if ((qos == 1) && (connection.state != MQTTFleetState::CLOSED))
+			{
+				WriteMessage(client, connection, MQTTMessage::MQTTMessagePubAck(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			else if ((qos == 2) && (connection.state != MQTTFleetState::CLOSED))
+			{
+				WriteMessage(client, connection, MQTTMessage::MQTTMessagePubRec(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBREC:
+		{
+			WriteMessage(client, connection, MQTTMessage::MQTTMessagePubRel(MQTTMessage::GetPacketIdentifier(frame)));
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBREL:
+		{
+			WriteMessage(client, connection, MQTTMessage::MQTTMessagePubComp(MQTTMessage::GetPacketIdentifier(frame)));
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PINGREQ:
+		{
+			WriteMessage(client, connection, MQTTMessage::MQTTMessagePingResp());
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+bool MQTTFleet::Write(Connection &connection, const uint8_t *data, uint32_t dataLength)
+{
+	connection.lastSent = tick;
+	if ((connection.writeOffset == connection.writeLength) && (connection.state != MQTTFleetState::CONNECTING))
+	{
+		//Most writes go straight to the socket and never lease a buffer
+		ssize_t sent = send(connection.sockfd, data, dataLength, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				return false;
+			}
+			sent = 0;
+		}
+		data += sent;
+		dataLength -= static_cast<uint32_t>(sent);
+		if (dataLength == 0)
+		{
+			return true;
+		}
+	}
+	uint32_t pendingLength = connection.writeLength - connection.writeOffset;
+	if (connection.writeCapacity - connection.writeLength < dataLength)
+	{
+		uint32_t capacity;
+		uint8_t *buffer = bufferPool.Acquire(pendingLength + dataLength, capacity);
+		if (pendingLength > 0)
+		{
+			memcpy(buffer, connection.writeBuffer + connection.writeOffset, pendingLength);
+		}
+		bufferPool.Release(connection.writeBuffer, connection.writeCapacity);
+		connection.writeBuffer = buffer;
+		connection.writeCapacity = capacity;
+		connection.writeOffset = 0;
+		connection.writeLength = pendingLength;
+	}
+	memcpy(connection.writeBuffer + connection.writeLength, data, dataLength);
+	connection.writeLength += dataLength;
+	return true;
+}
+
+bool MQTTFleet::WriteMessage(uint32_t client, Connection &connection, std::unique_ptr<MQTTMessage> mqttMessage)
+{
+	if (!mqttMessage)
+	{
+		return false;
+	}
+	bool success = Write(connection, mqttMessage->GetMessageData(), static_cast<uint32_t>(mqttMessage->GetMessageLength()));
+	if (!success)
+	{
+		LOGI("Write data error");
+		Close(client, connection);
+		return false;
+	}
+	if (connection.writeOffset < connection.writeLength)
+	{
+		SetWriteEnabled(client, connection, true);
+	}
+	return true;
+}
+
+void MQTTFleet::SetWriteEnabled(uint32_t client, Connection &connection, bool enabled)
+{
+	if (connection.writeEnabled == enabled)
+	{
+		return;
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN | (enabled ? static_cast<uint32_t>(EPOLLOUT) : 0);
+	event.data.u32 = client;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, connection.sockfd, &event);
+	connection.writeEnabled = enabled;
+}
+
+void MQTTFleet::Close(uint32_t client, Connection &connection)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, connection.sockfd, nullptr);
+	close(connection.sockfd);
+	bufferPool.Release(connection.readBuffer, connection.readCapacity);
+	bufferPool.Release(connection.writeBuffer, connection.writeCapacity);
+	connection.readBuffer = nullptr;
+	connection.readCapacity = 0;
+	connection.readLength = 0;
+	connection.writeBuffer = nullptr;
+	connection.writeCapacity = 0;
+	connection.writeOffset = 0;
+	connection.writeLength = 0;
+	if (connection.state == MQTTFleetState::CONNECTED)
+	{
+		--connectedCount;
+	}
+	connection.state = MQTTFleetState::CLOSED;
+	if (mqttDisconnectedCallback)
+	{
+		mqttDisconnectedCallback(client);
+	}
+}
+
+void MQTTFleet::KeepAlive()
+{
+	//A ping is due once a client wrote nothing for its whole keep alive period
+	for (uint32_t client = 0; client < connections.size(); ++client)
+	{
+		Connection &connection = connections[client];
+		if ((connection.state == MQTTFleetState::CONNECTED) && (connection.keepAlive > 0) && (tick - connection.lastSent >= connection.keepAlive))
+		{
+			WriteMessage(client, connection, MQTTMessage::MQTTMessagePingReq());
+		}
+	}
+}
+
+uint16_t MQTTFleet::NextPacketIdentifier(Connection &connection)
+{
+	if (++connection.packetIdentifier == 0)
+	{
+		connection.packetIdentifier = 1;
+	}
+	return connection.packetIdentifier;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _MQTT_FLEET_H_
+#define _MQTT_FLEET_H_
+#if defined(__linux__)
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <netinet/in.h>
+#include "MQTTConnectOptions.h"
+#include "MQTTMessage.h"
+#include "MQTTBufferPool.h"
+
+enum class MQTTFleetState : uint8_t
+{
+	CONNECTING = 0x01, //TCP handshake in progress, CONNECT waits in the write buffer
+	WAIT_CONNACK,
+	CONNECTED,
+	CLOSED
+};
+
+using MQTTFleetCallback = std::function<void(uint32_t client)>;
+using MQTTFleetDataCallback = std::function<void(uint32_t client, const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength)>;
+
+//Many MQTT connections to one broker, all driven by one thread over epoll, to simulate device fleets.
+//A connection is a record of a few dozen bytes: it has no thread, no timer and no buffer of its own. Buffers come from a pool shared by
+//the fleet and are held only while a frame is partly read or partly written, keep alives are sent by one sweep over all the connections.
+//Clients are referred to by the index AddClient returns. Callbacks run on the fleet thread, the other calls may be made from any thread.
+//Acknowledgements are answered but not tracked, there is no retransmission or duplicate detection
+class MQTTFleet
+{
+	public:
+		MQTTFleet(std::string host, uint32_t port);
+		~MQTTFleet();
+		MQTTFleet(MQTTFleet&) = delete;
+		MQTTFleet& operator=(MQTTFleet&) = delete;
+		bool Start();
+		void Stop();
+		//Starts connecting right away, returns the index of the client
+		uint32_t AddClient(std::string clientID, MQTTConnectOptions mqttConnectOptions);
+		void Disconnect(uint32_t client);
+		bool Publish(uint32_t client, const std::string &topicName, const std::string &payload, uint8_t qos, bool retain);
+		bool Subscribe(uint32_t client, const std::string &topicFilter, uint8_t qos);
+		bool IsConnected(uint32_t client);
+		uint32_t GetClientCount();
+		uint32_t GetConnectedCount();
+		//Pool buffers currently held by connections with a frame in progress
+		uint32_t GetLeasedBuffers();
+
+		void MQTTOnConnected(MQTTFleetCallback mqttConnectedCallback);
+		void MQTTOnDisconnected(MQTTFleetCallback mqttDisconnectedCallback);
+		void MQTTOnReceivedPayload(MQTTFleetDataCallback mqttDataCallback);
+	private:
+		struct Connection
+		{
+			int sockfd;
+			MQTTFleetState state;
+			bool writeEnabled; //EPOLLOUT registered
+			uint16_t keepAlive;
+			uint16_t packetIdentifier;
+			uint32_t lastSent; //Fleet tick of the last frame written
+			uint8_t *readBuffer; //Start of a frame not fully received yet
+			uint32_t readCapacity;
+			uint32_t readLength;
+			uint8_t *writeBuffer; //Bytes the socket did not take yet
+			uint32_t writeCapacity;
+			uint32_t writeOffset;
+			uint32_t writeLength;
+		};
+		void Run();
+		void HandleWritable(uint32_t client, Connection &connection);
+		void HandleReadable(uint32_t client, Connection &connection);
+		void HandleFrame(uint32_t client, Connection &connection, uint8_t *frame, uint32_t frameLength);
+		bool Write(Connection &connection, const uint8_t *data, uint32_t dataLength);
+		bool WriteMessage(uint32_t client, Connection &connection, std::unique_ptr<MQTTMessage> mqttMessage);
+		void SetWriteEnabled(uint32_t client, Connection &connection, bool enabled);
+		void Close(uint32_t client, Connection &connection);
+		void KeepAlive();
+		uint16_t NextPacketIdentifier(Connection &connection);
+	private:
+		struct sockaddr_in brokerAddress;
+		bool addressValid;
+		int epollfd;
+		std::recursive_mutex mutex;
+		//Elements of a deque stay in place when clients are added from a callback
+		std::deque<Connection> connections;
+		uint32_t connectedCount;
+		MQTTBufferPool bufferPool;
+		std::unique_ptr<uint8_t[]> readBuffer; //Shared by all connections, frames are parsed in place
+		uint32_t tick;
+		std::atomic<bool> running;
+		std::thread thread;
+		MQTTFleetCallback mqttConnectedCallback;
+		MQTTFleetCallback mqttDisconnectedCallback;
+		MQTTFleetDataCallback mqttDataCallback;
+};
+
+#endif
+#endif //_MQTT_FLEET_H_
@@ -0,0 +1,632 @@
+#include "MQTTJournal.h"
+#if defined(__linux__)
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "MQTTConfig.h"
+#include "MQTTMessage.h"
+#include "MQTTTopic.h"
+#include "Utils.h"
+
+#define MQTT_JOURNAL_SEGMENT_PREFIX "journal-"
+#define MQTT_JOURNAL_SEGMENT_SUFFIX ".seg"
+#define MQTT_JOURNAL_INDEX_SUFFIX ".idx"
+//A segment is prepared under this name and renamed once preallocated, readers never see it half made
+#define MQTT_JOURNAL_TEMPORARY_SUFFIX ".tmp"
+
+static inline uint64_t AlignRecord(uint64_t length)
+{
+	return (length + 7) & ~static_cast<uint64_t>(7);
+}
+
+static inline uint64_t WallClockNanoseconds()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+static std::string GetJournalPath(const std::string &directory, uint64_t firstSequence, const char *suffix)
+{
+	char name[64];
+	snprintf(name, sizeof(name), MQTT_JOURNAL_SEGMENT_PREFIX "%020llu%s", static_cast<unsigned long long>(firstSequence), suffix);
+	return directory + "/" + name;
+}
+
+//First sequences of the segments in directory, oldest first
+static bool ListJournalSegments(const std::string &directory, std::vector<uint64_t> &sequences)
+{
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr)
+	{
+		return false;
+	}
+	std::size_t prefixLength = strlen(MQTT_JOURNAL_SEGMENT_PREFIX);
+	std::size_t suffixLength = strlen(MQTT_JOURNAL_SEGMENT_SUFFIX);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != nullptr)
+	{
+		std::string name(entry->d_name);
+		if ((name.size() > prefixLength + suffixLength) && (name.compare(0, prefixLength, MQTT_JOURNAL_SEGMENT_PREFIX) == 0) &&
+			(name.compare(name.size() - suffixLength, suffixLength, MQTT_JOURNAL_SEGMENT_SUFFIX) == 0))
+		{
+			sequences.push_back(strtoull(name.c_str() + prefixLength, nullptr, 10));
+		}
+	}
+	closedir(dir);
+	std::sort(sequences.begin(), sequences.end());
+	return true;
+}
+
+//Segments a crash left before their rename hold no record anyone can read
+static void RemoveTemporarySegments(const std::string &directory)
+{
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr)
+	{
+		return;
+	}
+	std::size_t prefixLength = strlen(MQTT_JOURNAL_SEGMENT_PREFIX);
+	std::string suffix = std::string(MQTT_JOURNAL_SEGMENT_SUFFIX) + MQTT_JOURNAL_TEMPORARY_SUFFIX;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != nullptr)
+	{
+		std::string name(entry->d_name);
+		if ((name.size() > prefixLength + suffix.size()) && (name.compare(0, prefixLength, MQTT_JOURNAL_SEGMENT_PREFIX) == 0) &&
+			(name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0))
+		{
+			unlink((directory + "/" + name).c_str());
+		}
+	}
+	closedir(dir);
+}
+
+static bool ReadSegmentHeader(const std::string &path, MQTTJournalSegmentHeader &header)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool valid = (pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header))) && (memcmp(header.magic, MQTT_JOURNAL_MAGIC, sizeof(header.magic)) == 0) &&
+		(header.version == MQTT_JOURNAL_VERSION);
+	close(fd);
+	return valid;
+}
+
+MQTTJournal::MQTTJournal() : segmentFd(-1), indexFd(-1), segment(nullptr), segmentCapacity(0), segmentLength(0), segmentStart(0), index(nullptr), indexCapacity(0),
+	indexCount(0), nextIndexOffset(0), nextSequence(0), lastTime(0), diskUsage(0), opened(false)
+{
+}
+
+MQTTJournal::~MQTTJournal()
+{
+	Close();
+}
+
+bool MQTTJournal::Open(MQTTJournalOptions journalOptions)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<uint64_t> sequences;
+	if (opened || !ListJournalSegments(journalOptions.directory, sequences))
+	{
+		LOGI("Cannot open journal directory %s", journalOptions.directory.c_str());
+		return false;
+	}
+	options = journalOptions;
+	RemoveTemporarySegments(options.directory);
+	segments.clear();
+	diskUsage = 0;
+	nextSequence = 0;
+	lastTime = 0;
+	for (uint64_t sequence : sequences)
+	{
+		std::string path = GetJournalPath(options.directory, sequence, MQTT_JOURNAL_SEGMENT_SUFFIX);
+		int fd = open(path.c_str(), O_RDWR);
+		struct stat fileStat;
+		if ((fd < 0) || (fstat(fd, &fileStat) != 0))
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			continue;
+		}
+		uint64_t fileLength = static_cast<uint64_t>(fileStat.st_size);
+		if (sequence == sequences.back())
+		{
+			//Sequences go on from the last record. A segment left by a crash still has its preallocated length, it is trimmed to its records
+			void *map = (fileLength >= sizeof(MQTTJournalSegmentHeader)) ? mmap(nullptr, fileLength, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+			if (map != MAP_FAILED)
+			{
+				const uint8_t *data = static_cast<const uint8_t*>(map);
+				uint64_t position = sizeof(MQTTJournalSegmentHeader);
+				nextSequence = sequence;
+				while (position + sizeof(MQTTJournalRecordHeader) <= fileLength)
+				{
+					const MQTTJournalRecordHeader *header = reinterpret_cast<const MQTTJournalRecordHeader*>(data + position);
+					uint64_t recordLength = AlignRecord(sizeof(MQTTJournalRecordHeader) + header->length);
+					if ((header->length == 0) || (position + recordLength > fileLength))
+					{
+						break;
+					}
+					nextSequence = header->sequence + 1;
+					lastTime = header->time;
+					position += recordLength;
+				}
+				munmap(map, fileLength);
+				if (position + sizeof(MQTTJournalRecordHeader) < fileLength)
+				{
+					fileLength = position + sizeof(MQTTJournalRecordHeader);
+					if (ftruncate(fd, static_cast<off_t>(fileLength)) != 0)
+					{
+						LOGI("Cannot trim journal segment %s", path.c_str());
+					}
+				}
+			}
+		}
+		close(fd);
+		segments.push_back(std::make_pair(sequence, fileLength));
+		diskUsage += fileLength;
+	}
+	opened = true;
+	LOGI("Journal %s opened, next sequence %llu", options.directory.c_str(), static_cast<unsigned long long>(nextSequence));
+	return true;
+}
+
+bool MQTTJournal::Append(const uint8_t *frame, uint32_t frameLength)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!opened || (frameLength == 0))
+	{
+		return false;
+	}
+	//Times never go backwards within the journal so that time scans can rely on the index, whatever the wall clock does
+	uint64_t time = std::max(WallClockNanoseconds(), lastTime);
+	uint64_t recordLength = AlignRecord(sizeof(MQTTJournalRecordHeader) + frameLength);
+	//A zero record header always stays after the last record, readers stop there
+	bool full = (segment == nullptr) || (segmentLength + recordLength + sizeof(MQTTJournalRecordHeader) > segmentCapacity);
+	bool old = (segment != nullptr) && (options.segmentAge > 0) && (time - segmentStart >= static_cast<uint64_t>(options.segmentAge) * 1000000000ULL);
+	if ((full || old) && !StartSegment(time, recordLength))
+	{
+		return false;
+	}
+	lastTime = time;
+	MQTTJournalRecordHeader *header = reinterpret_cast<MQTTJournalRecordHeader*>(segment + segmentLength);
+	header->sequence = nextSequence;
+	header->time = time;
+	memcpy(segment + segmentLength + sizeof(MQTTJournalRecordHeader), frame, frameLength);
+	__atomic_store_n(&header->length, frameLength, __ATOMIC_RELEASE);
+	if ((segmentLength >= nextIndexOffset) && (indexCount < indexCapacity))
+	{
+		MQTTJournalIndexEntry &entry = index[indexCount++];
+		entry.time = time;
+		entry.sequence = nextSequence;
+		__atomic_store_n(&entry.offset, segmentLength, __ATOMIC_RELEASE);
+		nextIndexOffset = segmentLength + MQTT_JOURNAL_INDEX_INTERVAL;
+	}
+	segmentLength += recordLength;
+	++nextSequence;
+	return true;
+}
+
+void MQTTJournal::Close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	FinishSegment();
+	opened = false;
+}
+
+uint64_t MQTTJournal::GetNextSequence()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return nextSequence;
+}
+
+bool MQTTJournal::StartSegment(uint64_t time, uint64_t recordLength)
+{
+	FinishSegment();
+	//A frame longer than a segment gets a segment of its own
+	uint64_t capacity = std::max(options.segmentLength, sizeof(MQTTJournalSegmentHeader) + recordLength + sizeof(MQTTJournalRecordHeader));
+	if (!segments.empty() && (segments.back().first == nextSequence))
+	{
+		//The last segment holds no record, the new one replaces it
+		diskUsage -= segments.back().second;
+		segments.pop_back();
+	}
+	EnforceDiskLimit(capacity);
+	std::string path = GetJournalPath(options.directory, nextSequence, MQTT_JOURNAL_SEGMENT_SUFFIX);
+	std::string temporaryPath = path + MQTT_JOURNAL_TEMPORARY_SUFFIX;
+	std::string indexPath = GetJournalPath(options.directory, nextSequence, MQTT_JOURNAL_INDEX_SUFFIX);
+	int fd = open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	//Preallocated so that running out of disk fails here rather than as a SIGBUS while writing into the mapping
+	void *map = ((fd >= 0) && (posix_fallocate(fd, 0, static_cast<off_t>(capacity)) == 0)) ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (map == MAP_FAILED)
+	{
+		LOGI("Cannot create journal segment %s", path.c_str());
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(temporaryPath.c_str());
+		}
+		return false;
+	}
+	MQTTJournalSegmentHeader *header = static_cast<MQTTJournalSegmentHeader*>(map);
+	memcpy(header->magic, MQTT_JOURNAL_MAGIC, sizeof(header->magic));
+	header->version = MQTT_JOURNAL_VERSION;
+	header->reserved = 0;
+	header->firstSequence = nextSequence;
+	header->firstTime = time;
+	if (rename(temporaryPath.c_str(), path.c_str()) != 0)
+	{
+		//Not a segment yet, nothing of it is counted
+		LOGI("Cannot create journal segment %s", path.c_str());
+		munmap(map, capacity);
+		close(fd);
+		unlink(temporaryPath.c_str());
+		return false;
+	}
+	//Index entries are few, the file is left sparse
+	uint64_t entries = capacity / MQTT_JOURNAL_INDEX_INTERVAL + 1;
+	indexFd = open(indexPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	void *indexMap = ((indexFd >= 0) && (ftruncate(indexFd, static_cast<off_t>(entries * sizeof(MQTTJournalIndexEntry))) == 0)) ?
+		mmap(nullptr, entries * sizeof(MQTTJournalIndexEntry), PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0) : MAP_FAILED;
+	if (indexMap == MAP_FAILED)
+	{
+		//Scans still work without the index, they walk the segment from its start
+		LOGI("Cannot create journal index %s", indexPath.c_str());
+		if (indexFd >= 0)
+		{
+			close(indexFd);
+			indexFd = -1;
+		}
+		index = nullptr;
+		indexCapacity = 0;
+	}
+	else
+	{
+		index = static_cast<MQTTJournalIndexEntry*>(indexMap);
+		indexCapacity = entries;
+	}
+	segmentFd = fd;
+	segment = static_cast<uint8_t*>(map);
+	segmentCapacity = capacity;
+	segmentLength = sizeof(MQTTJournalSegmentHeader);
+	segmentStart = time;
+	indexCount = 0;
+	nextIndexOffset = segmentLength;
+	segments.push_back(std::make_pair(nextSequence, capacity));
+	diskUsage += capacity;
+	return true;
+}
+
+void MQTTJournal::FinishSegment()
+{
+	if (index != nullptr)
+	{
+		//Not trimmed: a reader may have mapped the whole index
+		munmap(index, indexCapacity * sizeof(MQTTJournalIndexEntry));
+		index = nullptr;
+	}
+	if (indexFd >= 0)
+	{
+		close(indexFd);
+		indexFd = -1;
+	}
+	if (segment != nullptr)
+	{
+		munmap(segment, segmentCapacity);
+		segment = nullptr;
+		//Trimmed to its records and the zero header after them, which readers that mapped the whole segment may still read
+		uint64_t length = segmentLength + sizeof(MQTTJournalRecordHeader);
+		if (ftruncate(segmentFd, static_cast<off_t>(length)) != 0)
+		{
+			length = segmentCapacity;
+		}
+		if (!segments.empty())
+		{
+			diskUsage -= segments.back().second - length;
+			segments.back().second = length;
+		}
+		segmentLength = 0;
+		segmentCapacity = 0;
+	}
+	if (segmentFd >= 0)
+	{
+		close(segmentFd);
+		segmentFd = -1;
+	}
+}
+
+void MQTTJournal::EnforceDiskLimit(uint64_t length)
+{
+	while ((options.diskLimit > 0) && !segments.empty() && (diskUsage + length > options.diskLimit))
+	{
+		unlink(GetJournalPath(options.directory, segments.front().first, MQTT_JOURNAL_SEGMENT_SUFFIX).c_str());
+		unlink(GetJournalPath(options.directory, segments.front().first, MQTT_JOURNAL_INDEX_SUFFIX).c_str());
+		diskUsage -= segments.front().second;
+		segments.pop_front();
+	}
+}
+
+MQTTJournalReader::MQTTJournalReader() : segmentIndex(0), data(nullptr), dataLength(0), index(nullptr), indexLength(0), position(0), endTime(0), scanning(false)
+{
+}
+
+MQTTJournalReader::~MQTTJournalReader()
+{
+	Close();
+}
+
+bool MQTTJournalReader::Open(std::string directory)
+{
+	Close();
+	this->directory = directory;
+	if (!ListSegments())
+	{
+		LOGI("Cannot open journal directory %s", directory.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MQTTJournalReader::ScanTime(uint64_t startTime, uint64_t endTime, std::string topicFilter)
+{
+	ListSegments();
+	//The last segment started at or before startTime holds its first record, if any
+	std::size_t first = 0;
+	for (std::size_t i = 0; i < segments.size(); ++i)
+	{
+		if (segments[i].firstTime <= startTime)
+		{
+			first = i;
+		}
+	}
+	if (segments.empty() || !MapSegment(first))
+	{
+		scanning = false;
+		return false;
+	}
+	Seek(startTime, true);
+	this->endTime = endTime;
+	this->topicFilter = topicFilter;
+	scanning = true;
+	return true;
+}
+
+bool MQTTJournalReader::ScanSequence(uint64_t sequence, std::string topicFilter)
+{
+	ListSegments();
+	std::size_t first = 0;
+	for (std::size_t i = 0; i < segments.size(); ++i)
+	{
+		if (segments[i].firstSequence <= sequence)
+		{
+			first = i;
+		}
+	}
+	if (segments.empty() || !MapSegment(first))
+	{
+		scanning = false;
+		return false;
+	}
+	Seek(sequence, false);
+	this->endTime = UINT64_MAX;
+	this->topicFilter = topicFilter;
+	scanning = true;
+	return true;
+}
+
+bool MQTTJournalReader::Next(MQTTJournalRecord &record)
+{
+	while (scanning)
+	{
+		uint64_t recordLength = RecordLength(position);
+		if (recordLength == 0)
+		{
+			if (!NextSegment())
+			{
+				return false;
+			}
+			continue;
+		}
+		const MQTTJournalRecordHeader *header = reinterpret_cast<const MQTTJournalRecordHeader*>(data + position);
+		if (header->time >= endTime)
+		{
+			scanning = false;
+			return false;
+		}
+		position += recordLength;
+		uint8_t *frame = const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(header + 1));
+		if ((MQTTMessage::GetMessageType(frame) != MQTTMessageType::MQTT_MSG_PUBLISH) || !MQTTMessage::IsWellFormedPublish(frame, header->length))
+		{
+			continue;
+		}
+		record.topicName = MQTTMessage::GetPublishTopicName(frame, record.topicNameLength);
+		if (!topicFilter.empty() && !MQTTTopic::Matches(topicFilter.data(), topicFilter.size(), record.topicName, record.topicNameLength))
+		{
+			continue;
+		}
+		record.sequence = header->sequence;
+		record.time = header->time;
+		record.frame = frame;
+		record.frameLength = header->length;
+		record.payload = MQTTMessage::GetPublishPayload(frame, record.payloadLength);
+		return true;
+	}
+	return false;
+}
+
+void MQTTJournalReader::Close()
+{
+	UnmapSegment();
+	segments.clear();
+	segmentIndex = 0;
+	scanning = false;
+}
+
+bool MQTTJournalReader::ListSegments()
+{
+	std::vector<uint64_t> sequences;
+	if (!ListJournalSegments(directory, sequences))
+	{
+		return false;
+	}
+	//Segments the writer started since the last listing are added after those already known
+	for (uint64_t sequence : sequences)
+	{
+		MQTTJournalSegmentHeader header;
+		if ((segments.empty() || (sequence > segments.back().firstSequence)) && ReadSegmentHeader(GetJournalPath(directory, sequence, MQTT_JOURNAL_SEGMENT_SUFFIX), header))
+		{
+			Segment segment;
+			segment.firstSequence = header.firstSequence;
+			segment.firstTime = header.firstTime;
+			segments.push_back(segment);
+		}
+	}
+	return true;
+}
+
+uint64_t MQTTJournalReader::RecordLength(uint64_t position)
+{
+	if (position + sizeof(MQTTJournalRecordHeader) > dataLength)
+	{
+		return 0;
+	}
+	uint32_t length = __atomic_load_n(&reinterpret_cast<const MQTTJournalRecordHeader*>(data + position)->length, __ATOMIC_ACQUIRE);
+	uint64_t recordLength = AlignRecord(sizeof(MQTTJournalRecordHeader) + length);
+	return ((length == 0) || (position + recordLength > dataLength)) ? 0 : recordLength;
+}
+
+bool MQTTJournalReader::MapSegment(std::size_t segmentIndex)
+{
+	UnmapSegment();
+	this->segmentIndex = segmentIndex;
+	std::string path = GetJournalPath(directory, segments[segmentIndex].firstSequence, MQTT_JOURNAL_SEGMENT_SUFFIX);
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat fileStat;
+	if ((fd < 0) || (fstat(fd, &fileStat) != 0) || (static_cast<uint64_t>(fileStat.st_size) < sizeof(MQTTJournalSegmentHeader)))
+	{
+		LOGI("Cannot read journal segment %s", path.c_str());
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return false;
+	}
+	void *map = mmap(nullptr, static_cast<std::size_t>(fileStat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		LOGI("Cannot map journal segment %s", path.c_str());
+		return false;
+	}
+	data = static_cast<const uint8_t*>(map);
+	dataLength = static_cast<uint64_t>(fileStat.st_size);
+	position = sizeof(MQTTJournalSegmentHeader);
+	//A segment without its index is walked from the start
+	fd = open(GetJournalPath(directory, segments[segmentIndex].firstSequence, MQTT_JOURNAL_INDEX_SUFFIX).c_str(), O_RDONLY);
+	if ((fd >= 0) && (fstat(fd, &fileStat) == 0) && (fileStat.st_size >= static_cast<off_t>(sizeof(MQTTJournalIndexEntry))))
+	{
+		map = mmap(nullptr, static_cast<std::size_t>(fileStat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			index = static_cast<const MQTTJournalIndexEntry*>(map);
+			indexLength = static_cast<uint64_t>(fileStat.st_size);
+		}
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	return true;
+}
+
+void MQTTJournalReader::UnmapSegment()
+{
+	if (data != nullptr)
+	{
+		munmap(const_cast<uint8_t*>(data), dataLength);
+		data = nullptr;
+		dataLength = 0;
+	}
+	if (index != nullptr)
+	{
+		munmap(const_cast<MQTTJournalIndexEntry*>(index), indexLength);
+		index = nullptr;
+		indexLength = 0;
+	}
+	position = 0;
+}
+
+void MQTTJournalReader::Seek(uint64_t key, bool byTime)
+{
+	//Last index entry at or before key. Entries are written in order, those not written yet read as offset 0 and are treated as past the key
+	uint64_t low = 0;
+	uint64_t high = indexLength / sizeof(MQTTJournalIndexEntry);
+	while (low < high)
+	{
+		uint64_t middle = low + (high - low) / 2;
+		const MQTTJournalIndexEntry &entry = index[middle];
+		uint64_t offset = __atomic_load_n(&entry.offset, __ATOMIC_ACQUIRE);
+		if ((offset != 0) && ((byTime ? entry.time : entry.sequence) <= key))
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	if (low > 0)
+	{
+		position = index[low - 1].offset;
+	}
+	//Then record by record up to the first one at or past key
+	uint64_t recordLength;
+	while ((recordLength = RecordLength(position)) != 0)
+	{
+		const MQTTJournalRecordHeader *header = reinterpret_cast<const MQTTJournalRecordHeader*>(data + position);
+		if ((byTime ? header->time : header->sequence) >= key)
+		{
+			break;
+		}
+		position += recordLength;
+	}
+}
+
+bool MQTTJournalReader::NextSegment()
+{
+	if (segmentIndex + 1 >= segments.size())
+	{
+		ListSegments();
+		if (segmentIndex + 1 >= segments.size())
+		{
+			//Caught up with the writer, the position is kept for the next call
+			return false;
+		}
+	}
+	//The writer finishes a segment before it starts the next one: seen that one, a record still appearing here was appended just before
+	if (RecordLength(position) != 0)
+	{
+		return true;
+	}
+	//A segment the disk limit deleted meanwhile is skipped
+	while (!MapSegment(segmentIndex + 1))
+	{
+		if (segmentIndex + 1 >= segments.size())
+		{
+			scanning = false;
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef _MQTT_JOURNAL_H_
+#define _MQTT_JOURNAL_H_
+#if defined(__linux__)
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include "MQTTJournalOptions.h"
+
+//Journal layout, every field little endian and every record 8 byte aligned so mapped segments are walked in place:
+//  segment : header | records | zeros up to the preallocated length, file name journal-<first sequence>.seg
+//  header  : magic "MQTTJRN1" | uint32 version | uint32 reserved | uint64 sequence of the first record | uint64 time of the first record
+//  record  : uint32 frame length | uint32 reserved | uint64 sequence | uint64 wall clock in ns since epoch | PUBLISH frame as received | padding
+//  index   : uint64 time | uint64 sequence | uint64 record offset, one entry per MQTT_JOURNAL_INDEX_INTERVAL bytes of records, file journal-<first sequence>.idx
+//Times never go backwards within a journal. The frame length of a record is stored last, a reader stops at the first zero length
+#define MQTT_JOURNAL_MAGIC "MQTTJRN1"
+#define MQTT_JOURNAL_VERSION 1
+
+struct MQTTJournalSegmentHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t firstSequence;
+	uint64_t firstTime;
+};
+
+struct MQTTJournalRecordHeader
+{
+	uint32_t length;
+	uint32_t reserved;
+	uint64_t sequence;
+	uint64_t time;
+};
+
+struct MQTTJournalIndexEntry
+{
+	uint64_t time;
+	uint64_t sequence;
+	uint64_t offset; //Stored last, 0 for an entry not written yet
+};
+
+//A record as read from the journal. Pointers are into the mapped segment and valid until the next call of the reader
+struct MQTTJournalRecord
+{
+	uint64_t sequence;
+	uint64_t time;
+	const uint8_t *frame;
+	uint32_t frameLength;
+	const char *topicName;
+	uint16_t topicNameLength;
+	const uint8_t *payload;
+	uint32_t payloadLength;
+};
+
+//Append only journal of the PUBLISH frames received. Segments are preallocated and mapped, appending a frame is a single memcpy
+//into the mapping with no system call; the kernel writes the pages back. A crash of the process loses nothing already appended
+class MQTTJournal
+{
+	public:
+		MQTTJournal();
+		~MQTTJournal();
+		MQTTJournal(MQTTJournal&) = delete;
+		MQTTJournal& operator=(MQTTJournal&) = delete;
+		//Sequences go on from the segments already in the directory, appending always starts a new segment
+		bool Open(MQTTJournalOptions journalOptions);
+		//frame is a whole PUBLISH frame. Returns false when it could not be appended
+		bool Append(const uint8_t *frame, uint32_t frameLength);
+		void Close();
+		//Sequence the next appended frame gets
+		uint64_t GetNextSequence();
+	private:
+		bool StartSegment(uint64_t time, uint64_t recordLength);
+		void FinishSegment();
+		void EnforceDiskLimit(uint64_t length);
+	private:
+		std::mutex mutex;
+		MQTTJournalOptions options;
+		int segmentFd;
+		int indexFd;
+		uint8_t *segment;
+		uint64_t segmentCapacity;
+		uint64_t segmentLength;
+		uint64_t segmentStart;
+		MQTTJournalIndexEntry *index;
+		uint64_t indexCapacity;
+		uint64_t indexCount;
+		uint64_t nextIndexOffset;
+		uint64_t nextSequence;
+		uint64_t lastTime;
+		//First sequence and length on disk of the finished segments, oldest first
+		std::deque<std::pair<uint64_t, uint64_t>> segments;
+		uint64_t diskUsage;
+		bool opened;
+};
+
+//Reads a journal, also while it is appended to. A scan starts from the segment headers and the sparse index
+//and walks the records from there, following into the next segments
+class MQTTJournalReader
+{
+	public:
+		MQTTJournalReader();
+		~MQTTJournalReader();
+		MQTTJournalReader(MQTTJournalReader&) = delete;
+		MQTTJournalReader& operator=(MQTTJournalReader&) = delete;
+		bool Open(std::string directory);
+		//Records with startTime <= time < endTime, times in ns since epoch, on topics matching topicFilter
+		bool ScanTime(uint64_t startTime, uint64_t endTime, std::string topicFilter);
+		//Records from sequence on, on topics matching topicFilter
+		bool ScanSequence(uint64_t sequence, std::string topicFilter);
+		//Returns false at the end of the scan, or once caught up with the writer: calling again later returns the records appended meanwhile
+		bool Next(MQTTJournalRecord &record);
+		void Close();
+	private:
+		struct Segment
+		{
+			uint64_t firstSequence;
+			uint64_t firstTime;
+		};
+		bool ListSegments();
+		//Length of the record at position, 0 past the last one
+		uint64_t RecordLength(uint64_t position);
+		bool MapSegment(std::size_t segmentIndex);
+		void UnmapSegment();
+		void Seek(uint64_t key, bool byTime);
+		bool NextSegment();
+	private:
+		std::string directory;
+		std::vector<Segment> segments;
+		std::size_t segmentIndex;
+		const uint8_t *data;
+		uint64_t dataLength;
+		const MQTTJournalIndexEntry *index;
+		uint64_t indexLength;
+		uint64_t position;
+		uint64_t endTime;
+		std::string topicFilter;
+		bool scanning;
+};
+
+#endif
+#endif //_MQTT_JOURNAL_H_
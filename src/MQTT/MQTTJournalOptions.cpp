@@ -0,0 +1,26 @@
+#include "MQTTJournalOptions.h"
+#include "MQTTConfig.h"
+
+MQTTJournalOptions::MQTTJournalOptions()
+{
+	this->directory = std::string();
+	this->segmentLength = MQTT_JOURNAL_SEGMENT_LENGTH;
+	this->segmentAge = 0;
+	this->diskLimit = 0;
+}
+
+void MQTTJournalOptions::SetDirectory(std::string directory)
+{
+	this->directory = directory;
+}
+
+void MQTTJournalOptions::SetRotation(uint64_t segmentLength, uint32_t segmentAge)
+{
+	this->segmentLength = segmentLength;
+	this->segmentAge = segmentAge;
+}
+
+void MQTTJournalOptions::SetDiskLimit(uint64_t diskLimit)
+{
+	this->diskLimit = diskLimit;
+}
@@ -0,0 +1,25 @@
+#ifndef _MQTT_JOURNAL_OPTIONS_H_
+#define _MQTT_JOURNAL_OPTIONS_H_
+#include <stdint.h>
+#include <string>
+
+class MQTTJournalOptions
+{
+	friend class MQTTJournal;
+	public:
+		MQTTJournalOptions();
+		//Segment files are created in directory, which must exist
+		void SetDirectory(std::string directory);
+		//A new segment is started once the current one holds segmentLength bytes or, checked when a publish is appended, is segmentAge seconds old.
+		//A segmentAge of 0 rotates by size only
+		void SetRotation(uint64_t segmentLength, uint32_t segmentAge);
+		//The oldest segments are deleted once all of them take more than diskLimit bytes, 0 keeps every segment
+		void SetDiskLimit(uint64_t diskLimit);
+	private:
+		std::string directory;
+		uint64_t segmentLength;
+		uint32_t segmentAge;
+		uint64_t diskLimit;
+};
+
+#endif //_MQTT_JOURNAL_OPTIONS_H_
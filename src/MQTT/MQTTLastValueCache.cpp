@@ -0,0 +1,538 @@
+#include "MQTTLastValueCache.h"
+#include <string.h>
+#include "MQTTTopic.h"
+
+#define MQTT_CACHE_NOT_FOUND 0xFFFFFFFF
+
+MQTTLastValueCache::MQTTLastValueCache(uint32_t maxTopics, std::size_t memoryLimit, MQTTCacheEvictionPolicy evictionPolicy) :
+	maxTopics(maxTopics == 0 ? 1 : maxTopics), memoryLimit(memoryLimit), evictionPolicy(evictionPolicy), tableSequence(0), readEpoch(0), topicCount(0), slabBytes(0), retiredBytes(0), clockHand(0)
+{
+	activeReaders[0].store(0, std::memory_order_relaxed);
+	activeReaders[1].store(0, std::memory_order_relaxed);
+	//Keep the load factor at or below one half so probe sequences stay short and always end on an empty slot
+	uint32_t capacity = 16;
+	while (capacity < 2 * static_cast<uint64_t>(this->maxTopics))
+	{
+		capacity <<= 1;
+	}
+	capacityMask = capacity - 1;
+	entries.reset(new Entry[capacity]);
+	for (uint32_t i = 0; i < capacity; ++i)
+	{
+		entries[i].sequence.store(0, std::memory_order_relaxed);
+		entries[i].hash.store(0, std::memory_order_relaxed);
+		entries[i].slab.store(nullptr, std::memory_order_relaxed);
+		entries[i].payloadLength.store(0, std::memory_order_relaxed);
+		entries[i].topicNameLength.store(0, std::memory_order_relaxed);
+		entries[i].retained.store(false, std::memory_order_relaxed);
+		entries[i].referenced = false;
+	}
+}
+
+MQTTLastValueCache::~MQTTLastValueCache()
+{
+	for (uint32_t i = 0; i <= capacityMask; ++i)
+	{
+		delete[] entries[i].slab.load(std::memory_order_relaxed);
+	}
+	for (uint8_t *slab : retiredSlabs)
+	{
+		delete[] slab;
+	}
+	for (uint8_t *slab : waitingSlabs)
+	{
+		delete[] slab;
+	}
+}
+
+void MQTTLastValueCache::Update(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, bool retained)
+{
+	uint32_t hash = Hash(topicName, topicNameLength);
+	uint32_t slabLength = MQTT_CACHE_SLAB_HEADER_LENGTH + topicNameLength + payloadLength;
+	std::lock_guard<std::mutex> lock(writerMutex);
+	uint32_t index = Find(topicName, topicNameLength, hash);
+	if (SlabCapacityFor(slabLength) > memoryLimit)
+	{
+		//Too large for the cache at all, checked before another topic is evicted to make room
+		if (index != MQTT_CACHE_NOT_FOUND)
+		{
+			RemoveAt(index);
+		}
+		return;
+	}
+	if (index != MQTT_CACHE_NOT_FOUND)
+	{
+		Entry &entry = entries[index];
+		entry.referenced = true;
+		uint8_t *slab = entry.slab.load(std::memory_order_relaxed);
+		uint32_t capacity = SlabCapacity(slab);
+		//Update in place unless the payload outgrew the slab or shrank so much the slab wastes memory
+		if ((slabLength <= capacity) && ((capacity == MQTT_CACHE_SLAB_MIN_LENGTH) || (slabLength > capacity / 4)))
+		{
+			uint32_t sequence = entry.sequence.load(std::memory_order_relaxed);
+			entry.sequence.store(sequence + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			memcpy(slab + MQTT_CACHE_SLAB_HEADER_LENGTH + topicNameLength, payload, payloadLength);
+			entry.payloadLength.store(payloadLength, std::memory_order_relaxed);
+			entry.retained.store(retained, std::memory_order_relaxed);
+			entry.sequence.store(sequence + 2, std::memory_order_release);
+			return;
+		}
+	}
+	else if (topicCount.load(std::memory_order_relaxed) >= maxTopics)
+	{
+		if ((evictionPolicy == MQTTCacheEvictionPolicy::REJECT_NEW) || !EvictOne())
+		{
+			return;
+		}
+	}
+	uint8_t *slab = AllocateSlab(slabLength);
+	if (slab == nullptr)
+	{
+		//Better to forget the topic than to keep serving a value that is no longer the latest
+		index = Find(topicName, topicNameLength, hash);
+		if (index != MQTT_CACHE_NOT_FOUND)
+		{
+			RemoveAt(index);
+		}
+		return;
+	}
+	memcpy(slab + MQTT_CACHE_SLAB_HEADER_LENGTH, topicName, topicNameLength);
+	memcpy(slab + MQTT_CACHE_SLAB_HEADER_LENGTH + topicNameLength, payload, payloadLength);
+	//Making room may have evicted or moved the entry
+	index = Find(topicName, topicNameLength, hash);
+	if (index == MQTT_CACHE_NOT_FOUND)
+	{
+		index = hash & capacityMask;
+		while (entries[index].slab.load(std::memory_order_relaxed) != nullptr)
+		{
+			index = (index + 1) & capacityMask;
+		}
+		Entry &entry = entries[index];
+		uint32_t sequence = entry.sequence.load(std::memory_order_relaxed);
+		entry.sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		entry.hash.store(hash, std::memory_order_relaxed);
+		entry.topicNameLength.store(topicNameLength, std::memory_order_relaxed);
+		entry.payloadLength.store(payloadLength, std::memory_order_relaxed);
+		entry.retained.store(retained, std::memory_order_relaxed);
+		entry.slab.store(slab, std::memory_order_release);
+		entry.sequence.store(sequence + 2, std::memory_order_release);
+		entry.referenced = true;
+		topicCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		Entry &entry = entries[index];
+		uint32_t sequence = entry.sequence.load(std::memory_order_relaxed);
+		entry.sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		uint8_t *oldSlab = entry.slab.load(std::memory_order_relaxed);
+		entry.payloadLength.store(payloadLength, std::memory_order_relaxed);
+		entry.retained.store(retained, std::memory_order_relaxed);
+		entry.slab.store(slab, std::memory_order_release);
+		entry.sequence.store(sequence + 2, std::memory_order_release);
+		entry.referenced = true;
+		RetireSlab(oldSlab);
+	}
+}
+
+void MQTTLastValueCache::Remove(const std::string &topicName)
+{
+	std::lock_guard<std::mutex> lock(writerMutex);
+	uint32_t index = Find(topicName.data(), static_cast<uint16_t>(topicName.size()), Hash(topicName.data(), topicName.size()));
+	if (index != MQTT_CACHE_NOT_FOUND)
+	{
+		RemoveAt(index);
+	}
+}
+
+void MQTTLastValueCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(writerMutex);
+	uint32_t sequence = tableSequence.load(std::memory_order_relaxed);
+	tableSequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (uint32_t i = 0; i <= capacityMask; ++i)
+	{
+		uint8_t *slab = entries[i].slab.load(std::memory_order_relaxed);
+		if (slab != nullptr)
+		{
+			entries[i].slab.store(nullptr, std::memory_order_relaxed);
+			entries[i].referenced = false;
+			retiredSlabs.push_back(slab);
+			retiredBytes.fetch_add(SlabCapacity(slab), std::memory_order_relaxed);
+		}
+	}
+	topicCount.store(0, std::memory_order_relaxed);
+	tableSequence.store(sequence + 2, std::memory_order_release);
+	ReclaimSlabs();
+}
+
+bool MQTTLastValueCache::Get(const std::string &topicName, std::string &payload)
+{
+	MQTTCacheValue value;
+	if (!Get(topicName, value))
+	{
+		return false;
+	}
+	payload = std::move(value.payload);
+	return true;
+}
+
+bool MQTTLastValueCache::Get(const std::string &topicName, MQTTCacheValue &value)
+{
+	uint32_t hash = Hash(topicName.data(), topicName.size());
+	bool found = false;
+	uint32_t readerSlot = BeginRead();
+	bool done = false;
+	for (uint32_t attempt = 0; (attempt < MQTT_CACHE_READ_RETRIES) && !done; ++attempt)
+	{
+		done = TryGet(topicName, hash, value, found);
+	}
+	if (!done)
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		TryGet(topicName, hash, value, found);
+	}
+	EndRead(readerSlot);
+	if (found)
+	{
+		value.topicName = topicName;
+	}
+	return found;
+}
+
+uint32_t MQTTLastValueCache::Match(const std::string &topicFilter, std::vector<MQTTCacheValue> &values)
+{
+	std::size_t count = values.size();
+	uint32_t readerSlot = BeginRead();
+	bool done = false;
+	for (uint32_t attempt = 0; (attempt < MQTT_CACHE_READ_RETRIES) && !done; ++attempt)
+	{
+		done = TryMatch(topicFilter, values);
+		if (!done)
+		{
+			values.resize(count);
+		}
+	}
+	if (!done)
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		TryMatch(topicFilter, values);
+	}
+	EndRead(readerSlot);
+	return static_cast<uint32_t>(values.size() - count);
+}
+
+uint32_t MQTTLastValueCache::GetTopicCount()
+{
+	return topicCount.load(std::memory_order_relaxed);
+}
+
+std::size_t MQTTLastValueCache::GetMemoryUsage()
+{
+	return slabBytes.load(std::memory_order_relaxed);
+}
+
+std::size_t MQTTLastValueCache::GetRetiredMemoryUsage()
+{
+	return retiredBytes.load(std::memory_order_relaxed);
+}
+
+uint32_t MQTTLastValueCache::Hash(const char *data, std::size_t length)
+{
+	//FNV-1a
+	uint32_t hash = 2166136261u;
+	for (std::size_t i = 0; i < length; ++i)
+	{
+		hash ^= static_cast<uint8_t>(data[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t MQTTLastValueCache::SlabCapacity(const uint8_t *slab)
+{
+	uint32_t capacity;
+	memcpy(&capacity, slab, sizeof(capacity));
+	return capacity;
+}
+
+uint64_t MQTTLastValueCache::SlabCapacityFor(uint32_t length)
+{
+	uint64_t capacity = MQTT_CACHE_SLAB_MIN_LENGTH;
+	while (capacity < length)
+	{
+		capacity <<= 1;
+	}
+	return capacity;
+}
+
+uint32_t MQTTLastValueCache::Find(const char *topicName, uint16_t topicNameLength, uint32_t hash)
+{
+	for (uint32_t index = hash & capacityMask; ; index = (index + 1) & capacityMask)
+	{
+		Entry &entry = entries[index];
+		uint8_t *slab = entry.slab.load(std::memory_order_relaxed);
+		if (slab == nullptr)
+		{
+			return MQTT_CACHE_NOT_FOUND;
+		}
+		if ((entry.hash.load(std::memory_order_relaxed) == hash) && (entry.topicNameLength.load(std::memory_order_relaxed) == topicNameLength) &&
+			(memcmp(slab + MQTT_CACHE_SLAB_HEADER_LENGTH, topicName, topicNameLength) == 0))
+		{
+			return index;
+		}
+	}
+}
+
+uint8_t* MQTTLastValueCache::AllocateSlab(uint32_t length)
+{
+	uint64_t slabCapacity = SlabCapacityFor(length);
+	//Evicting for a slab that can never fit would only empty the cache
+	if ((slabCapacity > memoryLimit) || (slabCapacity > UINT32_MAX))
+	{
+		return nullptr;
+	}
+	uint32_t capacity = static_cast<uint32_t>(slabCapacity);
+	while (slabBytes.load(std::memory_order_relaxed) + capacity > memoryLimit)
+	{
+		ReclaimSlabs();
+		if (slabBytes.load(std::memory_order_relaxed) + capacity <= memoryLimit)
+		{
+			break;
+		}
+		if ((evictionPolicy == MQTTCacheEvictionPolicy::REJECT_NEW) || !EvictOne())
+		{
+			return nullptr;
+		}
+	}
+	uint8_t *slab = new uint8_t[capacity];
+	memcpy(slab, &capacity, sizeof(capacity));
+	slabBytes.fetch_add(capacity, std::memory_order_relaxed);
+	return slab;
+}
+
+void MQTTLastValueCache::RetireSlab(uint8_t *slab)
+{
+	retiredSlabs.push_back(slab);
+	retiredBytes.fetch_add(SlabCapacity(slab), std::memory_order_relaxed);
+	ReclaimSlabs();
+}
+
+void MQTTLastValueCache::ReclaimSlabs()
+{
+	//Two passes at most: free the waiting slabs, move the epoch on so the retired ones wait in turn, and free those too when no reader is active
+	for (uint32_t pass = 0; pass < 2; ++pass)
+	{
+		uint32_t epoch = readEpoch.load(std::memory_order_relaxed);
+		if (!waitingSlabs.empty())
+		{
+			//Pairs with the fence in BeginRead: a reader not counted here began after the epoch moved, when the slabs were already unlinked
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (activeReaders[(epoch - 1) & 1].load(std::memory_order_seq_cst) != 0)
+			{
+				return;
+			}
+			FreeSlabs(waitingSlabs);
+		}
+		if (retiredSlabs.empty())
+		{
+			return;
+		}
+		waitingSlabs.swap(retiredSlabs);
+		readEpoch.store(epoch + 1, std::memory_order_seq_cst);
+	}
+}
+
+void MQTTLastValueCache::FreeSlabs(std::vector<uint8_t*> &slabs)
+{
+	for (uint8_t *slab : slabs)
+	{
+		uint32_t capacity = SlabCapacity(slab);
+		slabBytes.fetch_sub(capacity, std::memory_order_relaxed);
+		retiredBytes.fetch_sub(capacity, std::memory_order_relaxed);
+		delete[] slab;
+	}
+	slabs.clear();
+}
+
+bool MQTTLastValueCache::EvictOne()
+{
+	for (uint32_t step = 0; step < 2 * (capacityMask + 1); ++step)
+	{
+		Entry &entry = entries[clockHand];
+		if (entry.slab.load(std::memory_order_relaxed) != nullptr)
+		{
+			if (!entry.referenced)
+			{
+				RemoveAt(clockHand);
+				return true;
+			}
+			//Second chance for topics updated since the hand last passed
+			entry.referenced = false;
+		}
+		clockHand = (clockHand + 1) & capacityMask;
+	}
+	return false;
+}
+
+void MQTTLastValueCache::RemoveAt(uint32_t index)
+{
+	//Entries move during the removal so every reader running meanwhile retries
+	uint32_t sequence = tableSequence.load(std::memory_order_relaxed);
+	tableSequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	uint8_t *removedSlab = entries[index].slab.load(std::memory_order_relaxed);
+	//Backward shift deletion: pull following entries of the cluster into the hole unless that would move them before their home slot
+	uint32_t hole = index;
+	for (uint32_t next = (hole + 1) & capacityMask; entries[next].slab.load(std::memory_order_relaxed) != nullptr; next = (next + 1) & capacityMask)
+	{
+		uint32_t home = entries[next].hash.load(std::memory_order_relaxed) & capacityMask;
+		if (((next - home) & capacityMask) >= ((next - hole) & capacityMask))
+		{
+			Entry &from = entries[next];
+			Entry &to = entries[hole];
+			to.sequence.fetch_add(2, std::memory_order_relaxed);
+			to.hash.store(from.hash.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.topicNameLength.store(from.topicNameLength.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.payloadLength.store(from.payloadLength.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.retained.store(from.retained.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.slab.store(from.slab.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			to.referenced = from.referenced;
+			hole = next;
+		}
+	}
+	entries[hole].sequence.fetch_add(2, std::memory_order_relaxed);
+	entries[hole].slab.store(nullptr, std::memory_order_relaxed);
+	entries[hole].referenced = false;
+	topicCount.fetch_sub(1, std::memory_order_relaxed);
+	tableSequence.store(sequence + 2, std::memory_order_release);
+	RetireSlab(removedSlab);
+}
+
+bool MQTTLastValueCache::ReadEntry(Entry &entry, std::string *topicName, std::string &payload, bool &retained)
+{
+	uint32_t sequence = entry.sequence.load(std::memory_order_acquire);
+	if ((sequence & 1) != 0)
+	{
+		return false;
+	}
+	uint8_t *slab = entry.slab.load(std::memory_order_acquire);
+	if (slab == nullptr)
+	{
+		return false;
+	}
+	uint32_t topicNameLength = entry.topicNameLength.load(std::memory_order_relaxed);
+	uint32_t payloadLength = entry.payloadLength.load(std::memory_order_relaxed);
+	retained = entry.retained.load(std::memory_order_relaxed);
+	//Lengths torn by a concurrent update must not send the copy past the end of the slab
+	if (MQTT_CACHE_SLAB_HEADER_LENGTH + topicNameLength + payloadLength > SlabCapacity(slab))
+	{
+		return false;
+	}
+	if (topicName != nullptr)
+	{
+		topicName->assign(reinterpret_cast<const char*>(slab + MQTT_CACHE_SLAB_HEADER_LENGTH), topicNameLength);
+	}
+	payload.assign(reinterpret_cast<const char*>(slab + MQTT_CACHE_SLAB_HEADER_LENGTH + topicNameLength), payloadLength);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return entry.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+bool MQTTLastValueCache::TryGet(const std::string &topicName, uint32_t hash, MQTTCacheValue &value, bool &found)
+{
+	uint32_t sequence = tableSequence.load(std::memory_order_acquire);
+	if ((sequence & 1) != 0)
+	{
+		return false;
+	}
+	found = false;
+	uint32_t index = hash & capacityMask;
+	for (uint32_t probes = 0; probes <= capacityMask; ++probes, index = (index + 1) & capacityMask)
+	{
+		Entry &entry = entries[index];
+		uint8_t *slab = entry.slab.load(std::memory_order_acquire);
+		if (slab == nullptr)
+		{
+			break;
+		}
+		if ((entry.hash.load(std::memory_order_relaxed) != hash) || (entry.topicNameLength.load(std::memory_order_relaxed) != topicName.size()) ||
+			(MQTT_CACHE_SLAB_HEADER_LENGTH + topicName.size() > SlabCapacity(slab)) ||
+			(memcmp(slab + MQTT_CACHE_SLAB_HEADER_LENGTH, topicName.data(), topicName.size()) != 0))
+		{
+			continue;
+		}
+		if (!ReadEntry(entry, nullptr, value.payload, value.retained))
+		{
+			return false;
+		}
+		found = true;
+		break;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return tableSequence.load(std::memory_order_relaxed) == sequence;
+}
+
+bool MQTTLastValueCache::TryMatch(const std::string &topicFilter, std::vector<MQTTCacheValue> &values)
+{
+	uint32_t sequence = tableSequence.load(std::memory_order_acquire);
+	if ((sequence & 1) != 0)
+	{
+		return false;
+	}
+	for (uint32_t index = 0; index <= capacityMask; ++index)
+	{
+		Entry &entry = entries[index];
+		uint8_t *slab = entry.slab.load(std::memory_order_acquire);
+		if (slab == nullptr)
+		{
+			continue;
+		}
+		uint32_t topicNameLength = entry.topicNameLength.load(std::memory_order_relaxed);
+		if (MQTT_CACHE_SLAB_HEADER_LENGTH + topicNameLength > SlabCapacity(slab))
+		{
+			return false;
+		}
+		if (!MQTTTopic::Matches(topicFilter.data(), topicFilter.size(), reinterpret_cast<const char*>(slab + MQTT_CACHE_SLAB_HEADER_LENGTH), topicNameLength))
+		{
+			continue;
+		}
+		MQTTCacheValue value;
+		bool consistent = false;
+		//A value update only touches this entry, retry it alone
+		for (uint32_t attempt = 0; (attempt < MQTT_CACHE_READ_RETRIES) && !consistent; ++attempt)
+		{
+			consistent = ReadEntry(entry, &value.topicName, value.payload, value.retained);
+		}
+		if (!consistent)
+		{
+			return false;
+		}
+		values.push_back(std::move(value));
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return tableSequence.load(std::memory_order_relaxed) == sequence;
+}
+
+uint32_t MQTTLastValueCache::BeginRead()
+{
+	for (;;)
+	{
+		uint32_t epoch = readEpoch.load(std::memory_order_seq_cst);
+		activeReaders[epoch & 1].fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		//Counted under an epoch the writer already moved past, the reader would be missed when the slabs retired from now on are freed
+		if (readEpoch.load(std::memory_order_seq_cst) == epoch)
+		{
+			return epoch & 1;
+		}
+		activeReaders[epoch & 1].fetch_sub(1, std::memory_order_release);
+	}
+}
+
+void MQTTLastValueCache::EndRead(uint32_t readerSlot)
+{
+	activeReaders[readerSlot].fetch_sub(1, std::memory_order_release);
+}
@@ -0,0 +1,102 @@
+#ifndef _MQTT_LAST_VALUE_CACHE_H_
+#define _MQTT_LAST_VALUE_CACHE_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+
+//Slabs hold a small header, the topic then the payload and are sized in powers of two so payloads of similar length are updated in place
+#define MQTT_CACHE_SLAB_HEADER_LENGTH 8
+#define MQTT_CACHE_SLAB_MIN_LENGTH 64
+//Readers falling behind this many concurrent updates finish their read under the writer lock
+#define MQTT_CACHE_READ_RETRIES 64
+
+enum class MQTTCacheEvictionPolicy: uint8_t
+{
+	EVICT_LEAST_RECENT = 0x01, //Evict topics not updated for the longest time, approximated with the clock algorithm
+	REJECT_NEW //Keep the cached topics and drop values of new topics once a limit is reached
+};
+
+struct MQTTCacheValue
+{
+	std::string topicName;
+	std::string payload;
+	bool retained;
+};
+
+//Latest payload of every topic received, filled by the I/O thread and read from any thread.
+//Topics live in a flat open addressing table with linear probing, each one owning a slab that holds its interned name and its payload.
+//Readers never lock: every slot carries a seqlock for value updates and the table carries one for entries moving on removal.
+//Slabs replaced while readers may still copy from them wait for the readers that began before them: readers register under one of two
+//read epochs, so the readers of the older epoch drain even while new ones keep arriving
+class MQTTLastValueCache
+{
+	public:
+		//maxTopics bounds the number of topics, memoryLimit the bytes held by the slabs
+		MQTTLastValueCache(uint32_t maxTopics, std::size_t memoryLimit, MQTTCacheEvictionPolicy evictionPolicy);
+		~MQTTLastValueCache();
+		MQTTLastValueCache(MQTTLastValueCache&) = delete;
+		MQTTLastValueCache& operator=(MQTTLastValueCache&) = delete;
+		void Update(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, bool retained);
+		void Remove(const std::string &topicName);
+		void Clear();
+		bool Get(const std::string &topicName, std::string &payload);
+		bool Get(const std::string &topicName, MQTTCacheValue &value);
+		//Appends the values of every topic matching the filter. Each value is consistent on its own, the set is not a snapshot of one instant
+		uint32_t Match(const std::string &topicFilter, std::vector<MQTTCacheValue> &values);
+		uint32_t GetTopicCount();
+		//Bytes of every slab allocated, the retired ones included
+		std::size_t GetMemoryUsage();
+		//Bytes of the slabs replaced or removed and not freed yet because a reader may still copy from them
+		std::size_t GetRetiredMemoryUsage();
+	private:
+		struct Entry
+		{
+			std::atomic<uint32_t> sequence;
+			std::atomic<uint32_t> hash;
+			std::atomic<uint8_t*> slab;
+			std::atomic<uint32_t> payloadLength;
+			std::atomic<uint16_t> topicNameLength;
+			std::atomic<bool> retained;
+			bool referenced; //Only touched by the writer
+		};
+		static uint32_t Hash(const char *data, std::size_t length);
+		static uint32_t SlabCapacity(const uint8_t *slab);
+		static uint64_t SlabCapacityFor(uint32_t length);
+		uint32_t Find(const char *topicName, uint16_t topicNameLength, uint32_t hash);
+		uint8_t* AllocateSlab(uint32_t length);
+		void RetireSlab(uint8_t *slab);
+		void ReclaimSlabs();
+		void FreeSlabs(std::vector<uint8_t*> &slabs);
+		bool EvictOne();
+		void RemoveAt(uint32_t index);
+		bool ReadEntry(Entry &entry, std::string *topicName, std::string &payload, bool &retained);
+		bool TryGet(const std::string &topicName, uint32_t hash, MQTTCacheValue &value, bool &found);
+		bool TryMatch(const std::string &topicFilter, std::vector<MQTTCacheValue> &values);
+		//Returns the reader slot to pass to EndRead
+		uint32_t BeginRead();
+		void EndRead(uint32_t readerSlot);
+	private:
+		std::mutex writerMutex;
+		std::unique_ptr<Entry[]> entries;
+		uint32_t capacityMask;
+		uint32_t maxTopics;
+		std::size_t memoryLimit;
+		MQTTCacheEvictionPolicy evictionPolicy;
+		std::atomic<uint32_t> tableSequence;
+		std::atomic<uint32_t> readEpoch;
+		//Readers in progress, by the parity of the epoch they began in
+		std::atomic<uint32_t> activeReaders[2];
+		std::atomic<uint32_t> topicCount;
+		std::atomic<std::size_t> slabBytes;
+		std::atomic<std::size_t> retiredBytes;
+		//Retired in the current epoch
+		std::vector<uint8_t*> retiredSlabs;
+		//Retired before the epoch last moved, reachable only by readers of the previous epoch
+		std::vector<uint8_t*> waitingSlabs;
+		uint32_t clockHand;
+};
+
+#endif //_MQTT_LAST_VALUE_CACHE_H_
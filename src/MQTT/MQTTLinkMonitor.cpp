@@ -0,0 +1,231 @@
+#include "MQTTLinkMonitor.h"
+#include <algorithm>
+#include "MQTTConfig.h"
+
+//Retransmit timeouts double at most this many times before a new sample
+#define MQTT_LINK_MAX_BACKOFF 16
+
+MQTTLinkMonitor::MQTTLinkMonitor() : keepAlive(0), lastSent(0), lastReceived(0), timedPacket(-1), timedSince(0), timedDeadline(0),
+	pingOutstanding(false), pingSent(false), pingSince(0), smoothedRtt(std::chrono::milliseconds(MQTT_LINK_INITIAL_RTT)), rttVariation(std::chrono::milliseconds(MQTT_LINK_INITIAL_RTT / 2)),
+	backoff(0), samples(0), pings(0)
+{
+}
+
+void MQTTLinkMonitor::Reset(std::chrono::nanoseconds now, std::chrono::nanoseconds keepAlive)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	this->keepAlive = keepAlive;
+	lastSent = now.count();
+	lastReceived = now.count();
+	timedPacket = -1;
+	pingOutstanding = false;
+	backoff = 0;
+}
+
+void MQTTLinkMonitor::OnSent(std::chrono::nanoseconds now)
+{
+	lastSent.store(now.count(), std::memory_order_relaxed);
+}
+
+void MQTTLinkMonitor::OnReceived(std::chrono::nanoseconds now)
+{
+	lastReceived.store(now.count(), std::memory_order_relaxed);
+}
+
+bool MQTTLinkMonitor::OnPublishSent(uint16_t packetIdentifier, std::chrono::nanoseconds now, std::chrono::nanoseconds &deadline)
+{
+	//One publish per round trip is enough for the estimate, the others do not take the lock
+	if (timedPacket.load(std::memory_order_relaxed) != -1)
+	{
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	if (timedPacket.load(std::memory_order_relaxed) != -1)
+	{
+		return false;
+	}
+	timedSince = now;
+	timedDeadline = now + RetransmitTimeout();
+	deadline = timedDeadline;
+	timedPacket.store(packetIdentifier, std::memory_order_release);
+	return true;
+}
+
+void MQTTLinkMonitor::OnAcknowledged(uint16_t packetIdentifier, std::chrono::nanoseconds now)
+{
+	if (timedPacket.load(std::memory_order_acquire) != packetIdentifier)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	if (timedPacket.load(std::memory_order_relaxed) == packetIdentifier)
+	{
+		timedPacket.store(-1, std::memory_order_relaxed);
+		Sample(now - timedSince);
+	}
+}
+
+void MQTTLinkMonitor::OnPingSent(std::chrono::nanoseconds now, std::chrono::nanoseconds &deadline)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	deadline = std::chrono::nanoseconds::max();
+	if (pingOutstanding && !pingSent)
+	{
+		pingSent = true;
+		pingSince = now;
+		deadline = pingSince + PingTimeout();
+	}
+}
+
+void MQTTLinkMonitor::OnPingResponse(std::chrono::nanoseconds now)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (pingOutstanding)
+	{
+		pingOutstanding = false;
+		//The response may be read before the writer is told its PINGREQ left, the round trip is then unknown
+		if (pingSent)
+		{
+			Sample(now - pingSince);
+		}
+	}
+}
+
+MQTTLinkAction MQTTLinkMonitor::Check(std::chrono::nanoseconds now, std::chrono::nanoseconds &nextCheck)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	MQTTLinkAction action = MQTTLinkAction::NONE;
+	std::chrono::nanoseconds idleSince(std::min(lastSent.load(std::memory_order_relaxed), lastReceived.load(std::memory_order_relaxed)));
+	bool timed = timedPacket.load(std::memory_order_relaxed) != -1;
+	if (pingOutstanding)
+	{
+		if (pingSent && (now >= pingSince + PingTimeout()))
+		{
+			nextCheck = std::chrono::nanoseconds::max();
+			return MQTTLinkAction::DEAD;
+		}
+	}
+	//Traffic both ways within the keep alive proves the link, the broker also needs nothing more from us
+	else if ((keepAlive.count() > 0) && (now - idleSince >= keepAlive))
+	{
+		action = MQTTLinkAction::PING;
+	}
+	else if (timed && (now >= timedDeadline))
+	{
+		//The publish is not retransmitted, TCP does that. The probe tells a slow broker from a dead link
+		backoff = std::min(backoff + 1, static_cast<uint32_t>(MQTT_LINK_MAX_BACKOFF));
+		timedDeadline = now + RetransmitTimeout();
+		action = MQTTLinkAction::PING;
+	}
+	if (action == MQTTLinkAction::PING)
+	{
+		pingOutstanding = true;
+		pingSent = false;
+		pingSince = now;
+		++pings;
+	}
+	if (pingOutstanding)
+	{
+		//Until the PINGREQ leaves OnPingSent gives the deadline
+		nextCheck = pingSent ? (pingSince + PingTimeout()) : std::chrono::nanoseconds::max();
+		return action;
+	}
+	nextCheck = std::chrono::nanoseconds::max();
+	if (keepAlive.count() > 0)
+	{
+		nextCheck = idleSince + keepAlive;
+	}
+	if (timed)
+	{
+		nextCheck = std::min(nextCheck, timedDeadline);
+	}
+	return action;
+}
+
+bool MQTTLinkMonitor::AddWakeup(std::chrono::nanoseconds due)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!wakeups.empty() && (*wakeups.begin() <= due.count()))
+	{
+		return false;
+	}
+	wakeups.insert(due.count());
+	return true;
+}
+
+void MQTTLinkMonitor::RemoveWakeup(std::chrono::nanoseconds due)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	wakeups.erase(due.count());
+}
+
+std::chrono::nanoseconds MQTTLinkMonitor::GetSmoothedRtt()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return smoothedRtt;
+}
+
+std::chrono::nanoseconds MQTTLinkMonitor::GetRttVariation()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return rttVariation;
+}
+
+std::chrono::nanoseconds MQTTLinkMonitor::GetRetransmitTimeout()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return RetransmitTimeout();
+}
+
+std::chrono::nanoseconds MQTTLinkMonitor::GetPingTimeout()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return PingTimeout();
+}
+
+uint64_t MQTTLinkMonitor::GetSampleCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return samples;
+}
+
+uint64_t MQTTLinkMonitor::GetPingCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return pings;
+}
+
+void MQTTLinkMonitor::Sample(std::chrono::nanoseconds rtt)
+{
+	if (samples == 0)
+	{
+		smoothedRtt = rtt;
+		rttVariation = rtt / 2;
+	}
+	else
+	{
+		std::chrono::nanoseconds error = (smoothedRtt > rtt) ? (smoothedRtt - rtt) : (rtt - smoothedRtt);
+		rttVariation = (3 * rttVariation + error) / 4;
+		smoothedRtt = (7 * smoothedRtt + rtt) / 8;
+	}
+	backoff = 0;
+	++samples;
+}
+
+std::chrono::nanoseconds MQTTLinkMonitor::RetransmitTimeout()
+{
+	std::chrono::nanoseconds timeout = smoothedRtt + 4 * rttVariation;
+	timeout = std::max(timeout, std::chrono::nanoseconds(std::chrono::milliseconds(MQTT_LINK_MIN_RTO)));
+	for (uint32_t i = 0; (i < backoff) && (timeout < std::chrono::milliseconds(MQTT_LINK_MAX_RTO)); ++i)
+	{
+		timeout *= 2;
+	}
+	return std::min(timeout, std::chrono::nanoseconds(std::chrono::milliseconds(MQTT_LINK_MAX_RTO)));
+}
+
+std::chrono::nanoseconds MQTTLinkMonitor::PingTimeout()
+{
+	std::chrono::nanoseconds timeout = 2 * smoothedRtt + std::max(4 * rttVariation, std::chrono::nanoseconds(std::chrono::milliseconds(MQTT_LINK_MARGIN)));
+	//A broker busy with other clients may answer late without the link being lost
+	return std::max(timeout, keepAlive / MQTT_LINK_MIN_PING_TIMEOUT_DIVISOR);
+}
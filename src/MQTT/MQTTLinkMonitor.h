@@ -0,0 +1,79 @@
+#ifndef _MQTT_LINK_MONITOR_H_
+#define _MQTT_LINK_MONITOR_H_
+#include <stdint.h>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <set>
+
+enum class MQTTLinkAction : uint8_t
+{
+	NONE = 0x00,
+	PING, //Send a PINGREQ, its response is now awaited
+	DEAD //No PINGRESP came before the deadline, the connection must be dropped
+};
+
+//Liveness of the connection to the broker, driven by the times frames are sent and received.
+//The round trip time is estimated as TCP does (RFC 6298): smoothed RTT and RTT variation from PINGREQ->PINGRESP and, one publish at a time,
+//PUBLISH->PUBACK samples, and a retransmit timeout of SRTT + 4 * RTTVAR bounded by MQTT_LINK_MIN_RTO and MQTT_LINK_MAX_RTO.
+//A PINGREQ is sent only when nothing was sent or nothing was received for a keep alive period, or as a probe when the timed publish is not
+//acknowledged within the retransmit timeout. The link is dead when the PINGRESP does not come within 2 * SRTT plus a margin, and never
+//less than keepAlive / MQTT_LINK_MIN_PING_TIMEOUT_DIVISOR, of the PINGREQ leaving: a PINGREQ queued behind large writes is not timed yet.
+//Times are those of the client clock. The frame hooks may be called from any thread, they only take the lock once per round trip
+class MQTTLinkMonitor
+{
+	public:
+		MQTTLinkMonitor();
+		~MQTTLinkMonitor() = default;
+		MQTTLinkMonitor(MQTTLinkMonitor&) = delete;
+		MQTTLinkMonitor& operator=(MQTTLinkMonitor&) = delete;
+		//A new connection was accepted. The RTT estimate is kept, the path to the broker is most likely the same.
+		//keepAlive 0 disables the idle pings, probes are still sent
+		void Reset(std::chrono::nanoseconds now, std::chrono::nanoseconds keepAlive);
+		void OnSent(std::chrono::nanoseconds now);
+		void OnReceived(std::chrono::nanoseconds now);
+		//Returns true when the publish is timed, its retransmit timeout then expires at deadline
+		bool OnPublishSent(uint16_t packetIdentifier, std::chrono::nanoseconds now, std::chrono::nanoseconds &deadline);
+		void OnAcknowledged(uint16_t packetIdentifier, std::chrono::nanoseconds now);
+		//The PINGREQ asked for by Check was handed to the kernel, the PINGRESP is due by deadline
+		void OnPingSent(std::chrono::nanoseconds now, std::chrono::nanoseconds &deadline);
+		void OnPingResponse(std::chrono::nanoseconds now);
+		//What the client has to do at now, and when to check again
+		MQTTLinkAction Check(std::chrono::nanoseconds now, std::chrono::nanoseconds &nextCheck);
+		//Wakeups of the client timer. Returns true when due is earlier than every wakeup already scheduled and one must be scheduled for it
+		bool AddWakeup(std::chrono::nanoseconds due);
+		void RemoveWakeup(std::chrono::nanoseconds due);
+
+		std::chrono::nanoseconds GetSmoothedRtt();
+		std::chrono::nanoseconds GetRttVariation();
+		std::chrono::nanoseconds GetRetransmitTimeout();
+		//Time allowed for a PINGRESP before the link is declared dead
+		std::chrono::nanoseconds GetPingTimeout();
+		uint64_t GetSampleCount();
+		uint64_t GetPingCount();
+	private:
+		void Sample(std::chrono::nanoseconds rtt);
+		std::chrono::nanoseconds RetransmitTimeout();
+		std::chrono::nanoseconds PingTimeout();
+	private:
+		std::mutex mutex;
+		std::chrono::nanoseconds keepAlive;
+		std::atomic<int64_t> lastSent;
+		std::atomic<int64_t> lastReceived;
+		//Packet identifier of the timed publish, -1 when none is timed
+		std::atomic<int32_t> timedPacket;
+		std::chrono::nanoseconds timedSince;
+		std::chrono::nanoseconds timedDeadline;
+		bool pingOutstanding;
+		//The outstanding PINGREQ left, pingSince is when
+		bool pingSent;
+		std::chrono::nanoseconds pingSince;
+		std::chrono::nanoseconds smoothedRtt;
+		std::chrono::nanoseconds rttVariation;
+		uint32_t backoff; //Doublings of the retransmit timeout since the last sample
+		uint64_t samples;
+		uint64_t pings;
+		std::set<int64_t> wakeups;
+};
+
+#endif //_MQTT_LINK_MONITOR_H_
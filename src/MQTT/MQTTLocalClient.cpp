@@ -0,0 +1,202 @@
+#include "MQTTLocalClient.h"
+#if !defined(WIN32) && !defined(WIN64)
+#include <string.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "MQTTTopic.h"
+#include "Utils.h"
+
+MQTTLocalClient::MQTTLocalClient() : sockfd(INVALID_SOCKET), memory(nullptr), memoryLength(0), mqttLocalDataCallback(nullptr)
+{
+}
+
+MQTTLocalClient::~MQTTLocalClient()
+{
+	Disconnect();
+}
+
+bool MQTTLocalClient::Connect(std::string socketPath)
+{
+	struct sockaddr_un address;
+	if ((sockfd != INVALID_SOCKET) || (socketPath.size() >= sizeof(address.sun_path)))
+	{
+		return false;
+	}
+	sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sockfd == INVALID_SOCKET)
+	{
+		LOGI("Create socket fail");
+		return false;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+	if (connect(sockfd, (struct sockaddr*)&address, sizeof(address)) < 0)
+	{
+		LOGI("Failed to connect to local daemon %s", socketPath.c_str());
+		close(sockfd);
+		sockfd = INVALID_SOCKET;
+		return false;
+	}
+	//The daemon answers with the shared memory segment holding both rings
+	uint8_t message[5];
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = sizeof(message);
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int shmfd = -1;
+	uint32_t ringLength = 0;
+	if ((recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) == static_cast<ssize_t>(sizeof(message))) && (message[0] == MQTT_LOCAL_ATTACH))
+	{
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if ((cmsg != nullptr) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+		{
+			memcpy(&shmfd, CMSG_DATA(cmsg), sizeof(int));
+		}
+		memcpy(&ringLength, message + 1, sizeof(ringLength));
+	}
+	if ((shmfd < 0) || (ringLength == 0) || ((ringLength & (ringLength - 1)) != 0))
+	{
+		LOGI("Local daemon did not attach");
+		if (shmfd >= 0)
+		{
+			close(shmfd);
+		}
+		close(sockfd);
+		sockfd = INVALID_SOCKET;
+		return false;
+	}
+	memoryLength = 2 * MQTTLocalRing::GetMemoryLength(ringLength);
+	void *map = mmap(nullptr, memoryLength, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+	close(shmfd);
+	if (map == MAP_FAILED)
+	{
+		LOGI("Cannot map shared memory");
+		close(sockfd);
+		sockfd = INVALID_SOCKET;
+		return false;
+	}
+	memory = static_cast<uint8_t*>(map);
+	inboundRing.Attach(memory, ringLength, false);
+	outboundRing.Attach(memory + MQTTLocalRing::GetMemoryLength(ringLength), ringLength, false);
+	thread = std::thread(&MQTTLocalClient::ReceiveLoop, this);
+	return true;
+}
+
+void MQTTLocalClient::Disconnect()
+{
+	if (sockfd == INVALID_SOCKET)
+	{
+		return;
+	}
+	//Wakes the receive thread up with an end of stream
+	shutdown(sockfd, SHUT_RDWR);
+	thread.join();
+	close(sockfd);
+	sockfd = INVALID_SOCKET;
+	munmap(memory, memoryLength);
+	memory = nullptr;
+}
+
+bool MQTTLocalClient::Publish(const std::string &topicName, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain)
+{
+	if ((sockfd == INVALID_SOCKET) || (qos > 2) || !MQTTTopic::IsValidTopicName(topicName))
+	{
+		return false;
+	}
+	std::vector<DataSegment> segments{ { payload, payloadLength } };
+	std::lock_guard<std::mutex> lock(publishMutex);
+	bool wakeConsumer;
+	if (!outboundRing.Push(topicName.data(), static_cast<uint16_t>(topicName.size()), segments, qos, retain, wakeConsumer))
+	{
+		return false;
+	}
+	if (wakeConsumer)
+	{
+		uint8_t command = MQTT_LOCAL_DOORBELL;
+		send(sockfd, &command, sizeof(command), MSG_NOSIGNAL);
+	}
+	return true;
+}
+
+bool MQTTLocalClient::Publish(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain)
+{
+	return Publish(topicName, reinterpret_cast<const uint8_t*>(payload.data()), static_cast<uint32_t>(payload.size()), qos, retain);
+}
+
+bool MQTTLocalClient::Subscribe(const std::string &topicFilter, uint8_t qos)
+{
+	if ((qos > 2) || !MQTTTopic::IsValidTopicFilter(topicFilter))
+	{
+		return false;
+	}
+	return SendCommand(MQTT_LOCAL_SUBSCRIBE, qos, topicFilter);
+}
+
+bool MQTTLocalClient::Unsubscribe(const std::string &topicFilter)
+{
+	if (!MQTTTopic::IsValidTopicFilter(topicFilter))
+	{
+		return false;
+	}
+	return SendCommand(MQTT_LOCAL_UNSUBSCRIBE, 0, topicFilter);
+}
+
+void MQTTLocalClient::OnReceivedPayload(MQTTLocalDataCallback mqttLocalDataCallback)
+{
+	this->mqttLocalDataCallback = mqttLocalDataCallback;
+}
+
+uint64_t MQTTLocalClient::GetDroppedCount()
+{
+	return (memory == nullptr) ? 0 : inboundRing.GetDropped();
+}
+
+bool MQTTLocalClient::SendCommand(uint8_t command, uint8_t qos, const std::string &topicFilter)
+{
+	if (sockfd == INVALID_SOCKET)
+	{
+		return false;
+	}
+	std::string message;
+	message.reserve(2 + topicFilter.size());
+	message.push_back(static_cast<char>(command));
+	message.push_back(static_cast<char>(qos));
+	message.append(topicFilter);
+	return send(sockfd, message.data(), message.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(message.size());
+}
+
+void MQTTLocalClient::ReceiveLoop()
+{
+	uint8_t command;
+	//Publishes may have been queued before the thread started
+	DrainInbound();
+	while (recv(sockfd, &command, sizeof(command), 0) > 0)
+	{
+		if (command == MQTT_LOCAL_DOORBELL)
+		{
+			DrainInbound();
+		}
+	}
+}
+
+void MQTTLocalClient::DrainInbound()
+{
+	MQTTLocalRecord record;
+	while (inboundRing.Peek(record))
+	{
+		if (mqttLocalDataCallback)
+		{
+			mqttLocalDataCallback(record.topicName, record.topicNameLength, record.payload, record.payloadLength, record.qos, record.retain);
+		}
+		inboundRing.Pop(record);
+	}
+}
+
+#endif
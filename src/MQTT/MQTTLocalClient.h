@@ -0,0 +1,49 @@
+#ifndef _MQTT_LOCAL_CLIENT_H_
+#define _MQTT_LOCAL_CLIENT_H_
+#if !defined(WIN32) && !defined(WIN64)
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include "MQTTLocalRing.h"
+
+//Topic and payload point into the shared ring and are only valid until the callback returns. qos and retain are those the daemon received
+using MQTTLocalDataCallback = std::function<void(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain)>;
+
+//Process side of MQTTLocalDaemon: publishes and subscriptions go through the daemon's broker connection
+class MQTTLocalClient
+{
+	public:
+		MQTTLocalClient();
+		~MQTTLocalClient();
+		MQTTLocalClient(MQTTLocalClient&) = delete;
+		MQTTLocalClient& operator=(MQTTLocalClient&) = delete;
+		bool Connect(std::string socketPath);
+		void Disconnect();
+		//Copies the publish into the shared ring, the daemon sends it upstream. Returns false when the ring is full
+		bool Publish(const std::string &topicName, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain);
+		bool Publish(const std::string &topicName, const std::string &payload, uint8_t qos, bool retain);
+		bool Subscribe(const std::string &topicFilter, uint8_t qos);
+		bool Unsubscribe(const std::string &topicFilter);
+		//Set before Connect. Called on the receive thread of this client
+		void OnReceivedPayload(MQTTLocalDataCallback mqttLocalDataCallback);
+		//Publishes the daemon dropped because this process did not drain its ring in time
+		uint64_t GetDroppedCount();
+	private:
+		bool SendCommand(uint8_t command, uint8_t qos, const std::string &topicFilter);
+		void ReceiveLoop();
+		void DrainInbound();
+	private:
+		int sockfd;
+		uint8_t *memory;
+		std::size_t memoryLength;
+		MQTTLocalRing inboundRing;
+		MQTTLocalRing outboundRing;
+		std::mutex publishMutex;
+		std::thread thread;
+		MQTTLocalDataCallback mqttLocalDataCallback;
+};
+
+#endif
+#endif //_MQTT_LOCAL_CLIENT_H_
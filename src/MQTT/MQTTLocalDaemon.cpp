@@ -0,0 +1,403 @@
+#include "MQTTLocalDaemon.h"
+#if !defined(WIN32) && !defined(WIN64)
+#include <string.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "MQTTTopic.h"
+#include "Utils.h"
+
+#define MQTT_LOCAL_POLL_TIMEOUT 200
+
+static bool SendAttach(int sockfd, int shmfd, uint32_t ringLength)
+{
+	uint8_t message[5];
+	message[0] = MQTT_LOCAL_ATTACH;
+	memcpy(message + 1, &ringLength, sizeof(ringLength));
+	struct iovec iov;
+	iov.iov_base = message;
+	iov.iov_len = sizeof(message);
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	//The segment is handed over as a descriptor, its name is unlinked before any client could open it
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shmfd, sizeof(int));
+	return sendmsg(sockfd, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(message));
+}
+
+static void SendDoorbell(int sockfd)
+{
+	//Never block the broker connection on a slow process, a pending doorbell is enough to wake it
+	uint8_t command = MQTT_LOCAL_DOORBELL;
+	send(sockfd, &command, sizeof(command), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+MQTTLocalDaemon::MQTTLocalDaemon(MQTTClient &mqttClient, std::string socketPath, uint32_t ringLength) :
+	mqttClient(mqttClient), socketPath(socketPath), listenfd(INVALID_SOCKET), running(false), segmentCounter(0)
+{
+	this->ringLength = 4096;
+	while (this->ringLength < ringLength)
+	{
+		this->ringLength <<= 1;
+	}
+}
+
+MQTTLocalDaemon::~MQTTLocalDaemon()
+{
+	Stop();
+}
+
+bool MQTTLocalDaemon::Start()
+{
+	struct sockaddr_un address;
+	if (socketPath.size() >= sizeof(address.sun_path))
+	{
+		LOGI("Socket path is too long %s", socketPath.c_str());
+		return false;
+	}
+	listenfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (listenfd == INVALID_SOCKET)
+	{
+		LOGI("Create socket fail");
+		return false;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+	unlink(socketPath.c_str());
+	if ((bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0) || (listen(listenfd, SOMAXCONN) < 0))
+	{
+		LOGI("Cannot listen on %s", socketPath.c_str());
+		close(listenfd);
+		listenfd = INVALID_SOCKET;
+		return false;
+	}
+	mqttClient.MQTTOnConnected(std::bind(&MQTTLocalDaemon::MQTTConnectedCallback, this));
+	//Publishes go from the read buffer of the client straight into the rings
+	mqttClient.MQTTOnReceivedPublish(std::bind(&MQTTLocalDaemon::MQTTReceivedCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6));
+	running = true;
+	thread = std::thread(&MQTTLocalDaemon::Run, this);
+	LOGI("Local daemon listening on %s", socketPath.c_str());
+	return true;
+}
+
+void MQTTLocalDaemon::Stop()
+{
+	if (!running)
+	{
+		return;
+	}
+	running = false;
+	thread.join();
+	mqttClient.MQTTOnConnected(nullptr);
+	mqttClient.MQTTOnReceivedPublish(nullptr);
+	close(listenfd);
+	listenfd = INVALID_SOCKET;
+	unlink(socketPath.c_str());
+	std::vector<int> sockfds;
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		for (auto &client : clients)
+		{
+			sockfds.push_back(client.first);
+		}
+	}
+	for (int sockfd : sockfds)
+	{
+		Detach(sockfd);
+	}
+}
+
+uint32_t MQTTLocalDaemon::GetClientCount()
+{
+	std::lock_guard<std::mutex> lock(clientsMutex);
+	return static_cast<uint32_t>(clients.size());
+}
+
+void MQTTLocalDaemon::Run()
+{
+	std::vector<struct pollfd> fds;
+	while (running)
+	{
+		fds.clear();
+		fds.push_back({ listenfd, POLLIN, 0 });
+		{
+			std::lock_guard<std::mutex> lock(clientsMutex);
+			for (auto &client : clients)
+			{
+				fds.push_back({ client.first, POLLIN, 0 });
+			}
+		}
+		if (poll(fds.data(), fds.size(), MQTT_LOCAL_POLL_TIMEOUT) <= 0)
+		{
+			continue;
+		}
+		if ((fds[0].revents & POLLIN) != 0)
+		{
+			Accept();
+		}
+		for (std::size_t i = 1; i < fds.size(); ++i)
+		{
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+			{
+				continue;
+			}
+			LocalClient *localClient;
+			{
+				std::lock_guard<std::mutex> lock(clientsMutex);
+				localClient = clients[fds[i].fd].get();
+			}
+			//Only this thread detaches so the client outlives the call
+			if (!HandleCommand(*localClient))
+			{
+				Detach(fds[i].fd);
+			}
+		}
+	}
+}
+
+void MQTTLocalDaemon::Accept()
+{
+	int sockfd = accept(listenfd, nullptr, nullptr);
+	if (sockfd == INVALID_SOCKET)
+	{
+		return;
+	}
+	std::unique_ptr<LocalClient> localClient = make_unique<LocalClient>();
+	localClient->sockfd = sockfd;
+	localClient->memoryLength = 2 * MQTTLocalRing::GetMemoryLength(ringLength);
+	std::string name = "/mqtt-local-" + std::to_string(getpid()) + "-" + std::to_string(segmentCounter++);
+	int shmfd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (shmfd < 0)
+	{
+		LOGI("Cannot create shared memory %s", name.c_str());
+		close(sockfd);
+		return;
+	}
+	shm_unlink(name.c_str());
+	void *memory = MAP_FAILED;
+	if (ftruncate(shmfd, localClient->memoryLength) == 0)
+	{
+		memory = mmap(nullptr, localClient->memoryLength, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+	}
+	if (memory == MAP_FAILED)
+	{
+		LOGI("Cannot map shared memory %s", name.c_str());
+		close(shmfd);
+		close(sockfd);
+		return;
+	}
+	localClient->memory = static_cast<uint8_t*>(memory);
+	localClient->inboundRing.Attach(localClient->memory, ringLength, true);
+	localClient->outboundRing.Attach(localClient->memory + MQTTLocalRing::GetMemoryLength(ringLength), ringLength, true);
+	bool attached = SendAttach(sockfd, shmfd, ringLength);
+	close(shmfd);
+	if (!attached)
+	{
+		munmap(localClient->memory, localClient->memoryLength);
+		close(sockfd);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(clientsMutex);
+	clients[sockfd] = std::move(localClient);
+	LOGI("Local client attached, %d clients", static_cast<int>(clients.size()));
+}
+
+bool MQTTLocalDaemon::HandleCommand(LocalClient &localClient)
+{
+	uint8_t message[3 + 65535];
+	ssize_t messageLength = recv(localClient.sockfd, message, sizeof(message), 0);
+	if (messageLength <= 0)
+	{
+		return false;
+	}
+	switch (message[0])
+	{
+		case MQTT_LOCAL_DOORBELL:
+		{
+			DrainOutbound(localClient);
+			break;
+		}
+		case MQTT_LOCAL_SUBSCRIBE:
+		{
+			if (messageLength < 3)
+			{
+				return false;
+			}
+			uint8_t qos = message[1];
+			std::string topicFilter(reinterpret_cast<char*>(message + 2), messageLength - 2);
+			if ((qos > 2) || !MQTTTopic::IsValidTopicFilter(topicFilter))
+			{
+				LOGI("Local client sent an invalid subscription");
+				return false;
+			}
+			{
+				std::lock_guard<std::mutex> lock(clientsMutex);
+				localClient.topicFilters.push_back(topicFilter);
+			}
+			AddTopicFilter(topicFilter, qos);
+			break;
+		}
+		case MQTT_LOCAL_UNSUBSCRIBE:
+		{
+			if (messageLength < 3)
+			{
+				return false;
+			}
+			std::string topicFilter(reinterpret_cast<char*>(message + 2), messageLength - 2);
+			bool subscribed = false;
+			{
+				std::lock_guard<std::mutex> lock(clientsMutex);
+				for (auto it = localClient.topicFilters.begin(); it != localClient.topicFilters.end(); ++it)
+				{
+					if (*it == topicFilter)
+					{
+						localClient.topicFilters.erase(it);
+						subscribed = true;
+						break;
+					}
+				}
+			}
+			if (subscribed)
+			{
+				RemoveTopicFilter(topicFilter);
+			}
+			break;
+		}
+		default:
+		{
+			LOGI("Local client sent unknown command %d", message[0]);
+			return false;
+		}
+	}
+	return true;
+}
+
+void MQTTLocalDaemon::Detach(int sockfd)
+{
+	std::unique_ptr<LocalClient> localClient;
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		auto client = clients.find(sockfd);
+		if (client == clients.end())
+		{
+			return;
+		}
+		localClient = std::move(client->second);
+		clients.erase(client);
+	}
+	close(localClient->sockfd);
+	munmap(localClient->memory, localClient->memoryLength);
+	for (const std::string &topicFilter : localClient->topicFilters)
+	{
+		RemoveTopicFilter(topicFilter);
+	}
+	LOGI("Local client detached");
+}
+
+void MQTTLocalDaemon::DrainOutbound(LocalClient &localClient)
+{
+	MQTTLocalRecord record;
+	while (localClient.outboundRing.Peek(record))
+	{
+		//The payload goes from the shared ring to the socket without an intermediate copy
+		std::vector<MQTTPayloadSegment> payload{ { record.payload, record.payloadLength } };
+		mqttClient.Publish(std::string(record.topicName, record.topicNameLength), payload, record.qos, record.retain);
+		localClient.outboundRing.Pop(record);
+	}
+}
+
+void MQTTLocalDaemon::AddTopicFilter(const std::string &topicFilter, uint8_t qos)
+{
+	bool subscribe = false;
+	{
+		std::lock_guard<std::mutex> lock(subscriptionsMutex);
+		Subscription &subscription = subscriptions[topicFilter];
+		//Upstream the filter is held at the highest QoS any local client asked for
+		if ((subscription.references == 0) || (qos > subscription.qos))
+		{
+			subscription.qos = qos;
+			subscribe = true;
+		}
+		++subscription.references;
+		qos = subscription.qos;
+	}
+	if (subscribe)
+	{
+		mqttClient.Subscribe(topicFilter, qos);
+	}
+}
+
+void MQTTLocalDaemon::RemoveTopicFilter(const std::string &topicFilter)
+{
+	bool unsubscribe = false;
+	{
+		std::lock_guard<std::mutex> lock(subscriptionsMutex);
+		auto subscription = subscriptions.find(topicFilter);
+		if ((subscription != subscriptions.end()) && (--subscription->second.references == 0))
+		{
+			subscriptions.erase(subscription);
+			unsubscribe = true;
+		}
+	}
+	if (unsubscribe)
+	{
+		mqttClient.Unsubscribe(topicFilter);
+	}
+}
+
+void MQTTLocalDaemon::MQTTConnectedCallback()
+{
+	//Local clients keep their filters across broker reconnections
+	std::vector<MQTTSubscription> topicFilters;
+	{
+		std::lock_guard<std::mutex> lock(subscriptionsMutex);
+		for (auto &subscription : subscriptions)
+		{
+			topicFilters.push_back(std::make_pair(subscription.first, subscription.second.qos));
+		}
+	}
+	if (!topicFilters.empty())
+	{
+		mqttClient.Subscribe(topicFilters);
+	}
+}
+
+void MQTTLocalDaemon::MQTTReceivedCallback(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain)
+{
+	std::vector<DataSegment> segments{ { payload, payloadLength } };
+	std::lock_guard<std::mutex> lock(clientsMutex);
+	for (auto &client : clients)
+	{
+		LocalClient &localClient = *client.second;
+		for (const std::string &topicFilter : localClient.topicFilters)
+		{
+			if (!MQTTTopic::Matches(topicFilter.data(), topicFilter.size(), topicName, topicNameLength))
+			{
+				continue;
+			}
+			bool wakeConsumer;
+			if (!localClient.inboundRing.Push(topicName, topicNameLength, segments, qos, retain, wakeConsumer))
+			{
+				//A process not keeping up loses messages instead of holding back every other one
+				localClient.inboundRing.CountDropped();
+			}
+			else if (wakeConsumer)
+			{
+				SendDoorbell(localClient.sockfd);
+			}
+			break;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _MQTT_LOCAL_DAEMON_H_
+#define _MQTT_LOCAL_DAEMON_H_
+#if !defined(WIN32) && !defined(WIN64)
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include "MQTTClient.h"
+#include "MQTTLocalRing.h"
+
+//Shares one broker connection between the processes of a host. Local clients attach through a Unix socket and get a shared memory
+//segment holding two rings: one the daemon fills with the publishes matching their filters, one they fill with publishes to send.
+//Filters of all clients are merged so each one is subscribed upstream once, and an inbound publish is read from the broker once whatever
+//the number of local clients interested in it. The daemon takes over the data and connected callbacks of mqttClient
+class MQTTLocalDaemon
+{
+	public:
+		MQTTLocalDaemon(MQTTClient &mqttClient, std::string socketPath, uint32_t ringLength);
+		~MQTTLocalDaemon();
+		MQTTLocalDaemon(MQTTLocalDaemon&) = delete;
+		MQTTLocalDaemon& operator=(MQTTLocalDaemon&) = delete;
+		bool Start();
+		void Stop();
+		uint32_t GetClientCount();
+	private:
+		struct LocalClient
+		{
+			int sockfd;
+			uint8_t *memory;
+			std::size_t memoryLength;
+			MQTTLocalRing inboundRing; //Daemon to client
+			MQTTLocalRing outboundRing; //Client to daemon
+			std::vector<std::string> topicFilters;
+		};
+		struct Subscription
+		{
+			uint32_t references;
+			uint8_t qos;
+		};
+		void Run();
+		void Accept();
+		bool HandleCommand(LocalClient &localClient);
+		void Detach(int sockfd);
+		void DrainOutbound(LocalClient &localClient);
+		void AddTopicFilter(const std::string &topicFilter, uint8_t qos);
+		void RemoveTopicFilter(const std::string &topicFilter);
+		void MQTTConnectedCallback();
+		void MQTTReceivedCallback(const char *topicName, uint16_t topicNameLength, const uint8_t *payload, uint32_t payloadLength, uint8_t qos, bool retain);
+	private:
+		MQTTClient &mqttClient;
+		std::string socketPath;
+		uint32_t ringLength;
+		int listenfd;
+		std::atomic<bool> running;
+		std::thread thread;
+		std::mutex clientsMutex;
+		std::unordered_map<int, std::unique_ptr<LocalClient>> clients;
+		std::mutex subscriptionsMutex;
+		std::map<std::string, Subscription> subscriptions;
+		uint32_t segmentCounter;
+};
+
+#endif
+#endif //_MQTT_LOCAL_DAEMON_H_
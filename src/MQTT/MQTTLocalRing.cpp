@@ -0,0 +1,142 @@
+#include "MQTTLocalRing.h"
+#include <string.h>
+#include <new>
+
+//Record header: uint32 record length | uint16 topic length | uint8 qos | uint8 flags | uint32 payload length | uint32 reserved
+static inline uint64_t AlignRecord(uint64_t length)
+{
+	return (length + 7) & ~static_cast<uint64_t>(7);
+}
+
+MQTTLocalRing::MQTTLocalRing() : header(nullptr), data(nullptr), capacity(0)
+{
+}
+
+std::size_t MQTTLocalRing::GetMemoryLength(uint32_t capacity)
+{
+	return sizeof(MQTTLocalRingHeader) + capacity;
+}
+
+void MQTTLocalRing::Attach(uint8_t *memory, uint32_t capacity, bool initialize)
+{
+	if (initialize)
+	{
+		header = new (memory) MQTTLocalRingHeader();
+		header->head.store(0, std::memory_order_relaxed);
+		header->tail.store(0, std::memory_order_relaxed);
+		header->dropped.store(0, std::memory_order_relaxed);
+	}
+	else
+	{
+		header = reinterpret_cast<MQTTLocalRingHeader*>(memory);
+	}
+	data = memory + sizeof(MQTTLocalRingHeader);
+	this->capacity = capacity;
+}
+
+bool MQTTLocalRing::Push(const char *topicName, uint16_t topicNameLength, const std::vector<DataSegment> &payload, uint8_t qos, bool retain, bool &wakeConsumer)
+{
+	wakeConsumer = false;
+	uint64_t payloadLength = 0;
+	for (const DataSegment &segment : payload)
+	{
+		payloadLength += segment.length;
+	}
+	uint64_t payloadOffset = AlignRecord(MQTT_LOCAL_RECORD_HEADER_LENGTH + topicNameLength);
+	uint64_t recordLength = AlignRecord(payloadOffset + payloadLength);
+	if (recordLength > capacity / 2)
+	{
+		return false;
+	}
+	uint64_t head = header->head.load(std::memory_order_relaxed);
+	uint64_t tail = header->tail.load(std::memory_order_acquire);
+	uint32_t offset = static_cast<uint32_t>(head & (capacity - 1));
+	uint32_t contiguous = capacity - offset;
+	uint64_t needed = (contiguous < recordLength) ? contiguous + recordLength : recordLength;
+	if (head + needed - tail > capacity)
+	{
+		return false;
+	}
+	uint64_t position = head;
+	if (contiguous < recordLength)
+	{
+		uint32_t wrap = contiguous | MQTT_LOCAL_WRAP_RECORD;
+		memcpy(data + offset, &wrap, sizeof(wrap));
+		position += contiguous;
+		offset = 0;
+	}
+	uint8_t *record = data + offset;
+	uint32_t length = static_cast<uint32_t>(recordLength);
+	uint32_t payloadLength32 = static_cast<uint32_t>(payloadLength);
+	uint32_t reserved = 0;
+	memcpy(record, &length, sizeof(length));
+	memcpy(record + 4, &topicNameLength, sizeof(topicNameLength));
+	record[6] = qos;
+	record[7] = retain ? MQTT_LOCAL_RETAIN : 0;
+	memcpy(record + 8, &payloadLength32, sizeof(payloadLength32));
+	memcpy(record + 12, &reserved, sizeof(reserved));
+	memcpy(record + MQTT_LOCAL_RECORD_HEADER_LENGTH, topicName, topicNameLength);
+	//Payloads start 8 byte aligned so consumers may overlay structures on them
+	uint8_t *ptr = record + payloadOffset;
+	for (const DataSegment &segment : payload)
+	{
+		memcpy(ptr, segment.data, segment.length);
+		ptr += segment.length;
+	}
+	header->head.store(position + recordLength, std::memory_order_seq_cst);
+	//Pairs with the consumer storing tail then loading head: either it sees the new record or we see it caught up with us
+	wakeConsumer = (header->tail.load(std::memory_order_seq_cst) == head);
+	return true;
+}
+
+bool MQTTLocalRing::Peek(MQTTLocalRecord &record)
+{
+	uint64_t tail = header->tail.load(std::memory_order_relaxed);
+	uint64_t head = header->head.load(std::memory_order_seq_cst);
+	while (tail != head)
+	{
+		uint8_t *ptr = data + (tail & (capacity - 1));
+		uint32_t length;
+		memcpy(&length, ptr, sizeof(length));
+		if ((length & MQTT_LOCAL_WRAP_RECORD) != 0)
+		{
+			if ((length & ~MQTT_LOCAL_WRAP_RECORD) != capacity - (tail & (capacity - 1)))
+			{
+				return false;
+			}
+			tail += length & ~MQTT_LOCAL_WRAP_RECORD;
+			header->tail.store(tail, std::memory_order_seq_cst);
+			continue;
+		}
+		memcpy(&record.topicNameLength, ptr + 4, sizeof(record.topicNameLength));
+		record.qos = ptr[6];
+		record.retain = (ptr[7] & MQTT_LOCAL_RETAIN) != 0;
+		record.topicName = reinterpret_cast<const char*>(ptr + MQTT_LOCAL_RECORD_HEADER_LENGTH);
+		memcpy(&record.payloadLength, ptr + 8, sizeof(record.payloadLength));
+		uint64_t payloadOffset = AlignRecord(MQTT_LOCAL_RECORD_HEADER_LENGTH + record.topicNameLength);
+		//The other side is another process, never trust it to keep records inside the ring
+		if ((length > capacity / 2) || ((tail & (capacity - 1)) + length > capacity) || (tail + length > head) || (payloadOffset + record.payloadLength > length) || (record.qos > 2))
+		{
+			return false;
+		}
+		record.payload = ptr + payloadOffset;
+		record.length = length;
+		return true;
+	}
+	return false;
+}
+
+void MQTTLocalRing::Pop(const MQTTLocalRecord &record)
+{
+	header->tail.fetch_add(record.length, std::memory_order_seq_cst);
+}
+
+void MQTTLocalRing::CountDropped()
+{
+	header->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t MQTTLocalRing::GetDropped()
+{
+	return header->dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,63 @@
+#ifndef _MQTT_LOCAL_RING_H_
+#define _MQTT_LOCAL_RING_H_
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "Socket.h"
+
+//Control channel messages between the local daemon and its clients, one SOCK_SEQPACKET message each.
+//Subscribe and unsubscribe are command | qos | topic filter, the others a single byte
+enum MQTTLocalCommand
+{
+	MQTT_LOCAL_ATTACH = 0x01, //daemon -> client, carries the shared memory fd and the ring length
+	MQTT_LOCAL_DOORBELL, //either way, the ring written by the sender went from empty to non empty
+	MQTT_LOCAL_SUBSCRIBE, //client -> daemon
+	MQTT_LOCAL_UNSUBSCRIBE //client -> daemon
+};
+
+#define MQTT_LOCAL_WRAP_RECORD 0x80000000
+#define MQTT_LOCAL_RECORD_HEADER_LENGTH 16
+#define MQTT_LOCAL_RETAIN 0x01
+
+//Counters live on their own cache lines so producer and consumer in different processes do not share one
+struct MQTTLocalRingHeader
+{
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	alignas(64) std::atomic<uint64_t> dropped;
+};
+
+//One publish inside a ring. Pointers stay valid until the record is popped
+struct MQTTLocalRecord
+{
+	const char *topicName;
+	uint16_t topicNameLength;
+	const uint8_t *payload;
+	uint32_t payloadLength;
+	uint8_t qos;
+	bool retain;
+	uint32_t length;
+};
+
+//Single producer single consumer ring of publishes placed in memory shared by two processes.
+//Records never wrap: one that does not fit before the end is preceded by a wrap record so consumers read every record in place
+class MQTTLocalRing
+{
+	public:
+		MQTTLocalRing();
+		static std::size_t GetMemoryLength(uint32_t capacity);
+		//capacity must be a power of two. The daemon initializes, clients only attach
+		void Attach(uint8_t *memory, uint32_t capacity, bool initialize);
+		//Returns false when the ring is full or the record larger than half the ring. wakeConsumer is set when the consumer may be asleep
+		bool Push(const char *topicName, uint16_t topicNameLength, const std::vector<DataSegment> &payload, uint8_t qos, bool retain, bool &wakeConsumer);
+		bool Peek(MQTTLocalRecord &record);
+		void Pop(const MQTTLocalRecord &record);
+		void CountDropped();
+		uint64_t GetDropped();
+	private:
+		MQTTLocalRingHeader *header;
+		uint8_t *data;
+		uint32_t capacity;
+};
+
+#endif //_MQTT_LOCAL_RING_H_
@@ -1,14 +1,14 @@
 #include "MQTTMessage.h"
+#include "MQTTTopic.h"
 #include "Utils.h"
 
-uint16_t MQTTMessage::packetIdentifier = 0;
-
 MQTTMessage::MQTTMessage() : message(nullptr), messageLength(0)
 {
 }
 
 MQTTMessage::~MQTTMessage()
 {
+	delete[] message;
 }	
 
 std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageConnect(std::string clientID, MQTTConnectOptions mqttConnectOptions)
@@ -36,7 +36,7 @@ std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageConnect(std::string clientI
 		flags.bits.lastWillRetain = mqttConnectOptions.lastWillRetain ? 1 : 0;
 	}
 	flags.bits.cleanSession = mqttConnectOptions.cleanSession ? 1 : 0;
-	uint32_t remainingLength = 6 /*protocol name*/ + 1 /*protocol level*/ + 1 /*connect flags*/ + 2 /*keep alive*/;
+	uint32_t remainingLength = 2 + (sizeof(PROTOCOL_NAME) - 1) /*protocol name*/ + 1 /*protocol level*/ + 1 /*connect flags*/ + 2 /*keep alive*/;
 	remainingLength += clientID.size() + 2;
 	if (flags.bits.lastWillFlag == 1)
 	{
@@ -82,20 +82,52 @@ std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageConnect(std::string clientI
 	return mqttMessage;
 }
 
-std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessagePublish(std::string topicName, std::string payload, bool dup, uint8_t qos, bool retain)
+std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessagePublish(std::string topicName, std::string payload, bool dup, uint8_t qos, bool retain, uint16_t packetIdentifier)
+{
+	uint8_t *ptr;
+	std::unique_ptr<MQTTMessage> mqttMessage = EncodePublish(topicName, static_cast<uint32_t>(payload.size()), dup, qos, retain, packetIdentifier, &ptr);
+	if (mqttMessage)
+	{
+		memcpy(ptr, payload.data(), payload.size());
+	}
+	return mqttMessage;
+}
+
+std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessagePublishHeader(std::string topicName, uint32_t payloadLength, bool dup, uint8_t qos, bool retain, uint16_t packetIdentifier)
+{
+	return EncodePublish(topicName, payloadLength, dup, qos, retain, packetIdentifier, nullptr);
+}
+
+std::unique_ptr<MQTTMessage> MQTTMessage::EncodePublish(std::string &topicName, uint32_t payloadLength, bool dup, uint8_t qos, bool retain, uint16_t packetIdentifier, uint8_t **payload)
 {
-	std::unique_ptr<MQTTMessage> mqttMessage(new MQTTMessage());
 	MessageHeader header;
 
+	if (!MQTTTopic::IsValidTopicName(topicName))
+	{
+		LOGI("Invalid topic name %s", topicName.c_str());
+		return nullptr;
+	}
 	header.byte = 0;
 	header.bits.type = MQTT_MSG_PUBLISH;
 	header.bits.dup = dup ? 1 : 0;
 	header.bits.qos = qos;
 	header.bits.retain = retain ? 1 : 0;
-	uint32_t remainingLength = topicName.size() + 2 /*topic name*/ + 2 /*package identifier*/ + payload.size() + 2 /*payload*/;
+	uint32_t variableHeaderLength = topicName.size() + 2 /*topic name*/ + ((qos == 0) ? 0 : 2) /*package identifier*/;
+	if (payloadLength > MQTT_MAX_REMAINING_LENGTH - variableHeaderLength)
+	{
+		LOGI("Publish payload is too large: %u bytes", payloadLength);
+		return nullptr;
+	}
+	uint32_t remainingLength = variableHeaderLength + payloadLength;
 	uint8_t remainingLenghtBytes[4];
 	uint8_t length = CalculateRemainingLengthBytes(remainingLenghtBytes, remainingLength);
 	uint32_t totalMessageLength = remainingLength + length + 1 /*header*/;
+	if (payload == nullptr)
+	{
+		//Payload is written by the caller straight to the network
+		totalMessageLength -= payloadLength;
+	}
+	std::unique_ptr<MQTTMessage> mqttMessage(new MQTTMessage());
 	mqttMessage->message = new uint8_t[totalMessageLength];
 	mqttMessage->messageLength = totalMessageLength;
 	uint8_t *ptr = mqttMessage->message;
@@ -105,20 +137,14 @@ std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessagePublish(std::string topicNa
 		WriteChar(&ptr, remainingLenghtBytes[i]);
 	}
 	WriteUTF(&ptr, topicName);
-	if (qos == 0)
+	if (qos != 0)
 	{
-		WriteShort(&ptr, 0);
+		WriteShort(&ptr, packetIdentifier);
 	}
-	else
+	if (payload != nullptr)
 	{
-		++packetIdentifier;
-		if (packetIdentifier == 0)
-		{
-			packetIdentifier = 1;
-		}
-		WriteShort(&ptr, packetIdentifier);
+		*payload = ptr;
 	}
-	WriteUTF(&ptr, payload);
 	return mqttMessage;
 }
 
@@ -186,14 +212,35 @@ std::unique_ptr<MQTTMessage>MQTTMessage::MQTTMessagePubComp(uint16_t packetIdent
 	return mqttMessage;
 }
 
-std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageSubscribe(std::string topicName, uint8_t qos)
+std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageSubscribe(std::string topicName, uint8_t qos, uint16_t packetIdentifier)
+{
+	return MQTTMessageSubscribe(std::vector<std::pair<std::string, uint8_t>>{ std::make_pair(topicName, qos) }, packetIdentifier);
+}
+
+std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageUnsubscribe(std::string topicName, uint16_t packetIdentifier)
 {
+	return MQTTMessageUnsubscribe(std::vector<std::string>{ topicName }, packetIdentifier);
+}
+
+std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageSubscribe(const std::vector<std::pair<std::string, uint8_t>> &topicFilters, uint16_t packetIdentifier)
+{
+	uint32_t remainingLength = 2 /*package identifier*/;
+	for (const auto &topicFilter : topicFilters)
+	{
+		if (!MQTTTopic::IsValidTopicFilter(topicFilter.first))
+		{
+			LOGI("Invalid topic filter %s", topicFilter.first.c_str());
+			return nullptr;
+		}
+		remainingLength += topicFilter.first.size() + 2 /*topic name*/ + 1 /*qos*/;
+	}
 	std::unique_ptr<MQTTMessage> mqttMessage(new MQTTMessage());
 	MessageHeader header;
 
 	header.byte = 0;
 	header.bits.type = MQTT_MSG_SUBSCRIBE;
-	uint32_t remainingLength =  2 /*package identifier*/ + topicName.size() + 2 /*topic name*/ + 1 /*qos*/;
+	//The reserved flags of SUBSCRIBE must be 0010
+	header.bits.qos = 1;
 	uint8_t remainingLenghtBytes[4];
 	uint8_t length = CalculateRemainingLengthBytes(remainingLenghtBytes, remainingLength);
 	uint32_t totalMessageLength = remainingLength + length + 1 /*header*/;
@@ -205,25 +252,34 @@ std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageSubscribe(std::string topic
 	{
 		WriteChar(&ptr, remainingLenghtBytes[i]);
 	}
-	++packetIdentifier;
-	if (packetIdentifier == 0)
+	WriteShort(&ptr, packetIdentifier);
+	for (const auto &topicFilter : topicFilters)
 	{
-		packetIdentifier = 1;
+		WriteUTF(&ptr, topicFilter.first);
+		WriteChar(&ptr, topicFilter.second);
 	}
-	WriteShort(&ptr, packetIdentifier);
-	WriteUTF(&ptr, topicName);
-	WriteChar(&ptr, qos);
 	return mqttMessage;
 }
 
-std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageUnsubscribe(std::string topicName)
+std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageUnsubscribe(const std::vector<std::string> &topicFilters, uint16_t packetIdentifier)
 {
+	uint32_t remainingLength = 2 /*package identifier*/;
+	for (const std::string &topicFilter : topicFilters)
+	{
+		if (!MQTTTopic::IsValidTopicFilter(topicFilter))
+		{
+			LOGI("Invalid topic filter %s", topicFilter.c_str());
+			return nullptr;
+		}
+		remainingLength += topicFilter.size() + 2 /*topic name*/;
+	}
 	std::unique_ptr<MQTTMessage> mqttMessage(new MQTTMessage());
 	MessageHeader header;
 
 	header.byte = 0;
 	header.bits.type = MQTT_MSG_UNSUBSCRIBE;
-	uint32_t remainingLength = 2 /*package identifier*/ + topicName.size() + 2 /*topic name*/;
+	//The reserved flags of UNSUBSCRIBE must be 0010
+	header.bits.qos = 1;
 	uint8_t remainingLenghtBytes[4];
 	uint8_t length = CalculateRemainingLengthBytes(remainingLenghtBytes, remainingLength);
 	uint32_t totalMessageLength = remainingLength + length + 1 /*header*/;
@@ -235,13 +291,11 @@ std::unique_ptr<MQTTMessage> MQTTMessage::MQTTMessageUnsubscribe(std::string top
 	{
 		WriteChar(&ptr, remainingLenghtBytes[i]);
 	}
-	++packetIdentifier;
-	if (packetIdentifier == 0)
+	WriteShort(&ptr, packetIdentifier);
+	for (const std::string &topicFilter : topicFilters)
 	{
-		packetIdentifier = 1;
+		WriteUTF(&ptr, topicFilter);
 	}
-	WriteShort(&ptr, packetIdentifier);
-	WriteUTF(&ptr, topicName);
 	return mqttMessage;
 }
 
@@ -2,6 +2,8 @@
 #define _MQTT_MESSAGE_H_
 #include <stdint.h>
 #include <memory>
+#include <string>
+#include <vector>
 #include <string.h>
 #include "MQTTConfig.h"
 #include "MQTTConnectOptions.h"
@@ -32,6 +34,8 @@ enum MQTTMessageType
 	MQTT_MSG_DISCONNECT
 };
 
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
 enum MQTTConnectReturnCode
 {
 	MQTT_CONNECTION_ACCEPTED = 0x00,
@@ -99,15 +103,29 @@ class MQTTMessage
 	public:
 		inline static MQTTMessageType GetMessageType(uint8_t* data) { return static_cast<MQTTMessageType>(data[0] >> 4); }
 		inline static MQTTConnectReturnCode GetConnectReturnCode(uint8_t* data) { return static_cast<MQTTConnectReturnCode>(data[3]); }
-		inline static MQTTSubscribeReturnCode GetSubscribeReturnCode(uint8_t* data) { return static_cast<MQTTSubscribeReturnCode>(data[4]); }
+		//MQTT 3.1.1 only, the byte is reserved in 3.1
+		inline static bool GetSessionPresent(uint8_t* data) { return (data[2] & 0x01) == 0x01; }
+		inline static MQTTSubscribeReturnCode GetSubscribeReturnCode(uint8_t* data)
+		{
+			uint32_t count;
+			return static_cast<MQTTSubscribeReturnCode>(*GetSubscribeReturnCodes(data, count));
+		}
+		//One return code per topic filter of the SUBSCRIBE, in the same order
+		inline static const uint8_t* GetSubscribeReturnCodes(uint8_t* data, uint32_t &count)
+		{
+			uint8_t remainingLengthBytes;
+			uint32_t remainingLength = GetRemainingLength(data, remainingLengthBytes);
+			count = (remainingLength > 2) ? remainingLength - 2 /*packet identifier*/ : 0;
+			return data + 1 /*header*/ + remainingLengthBytes + 2;
+		}
 		inline static uint8_t GetPublishQos(uint8_t* data) { return (data[0] >> 1) & 0x03; }
 		inline static uint16_t GetPacketIdentifier(uint8_t* data)
 		{
-			uint8_t index = 2;
+			uint32_t index = 1;
+			//A SUBACK for many topic filters has a remaining length of more than one byte
+			while ((data[index++] & 0x80) == 0x80);
 			if (MQTTMessage::GetMessageType(data) == MQTT_MSG_PUBLISH)
 			{
-				index = 1;
-				while ((data[index++] & 0x80) == 0x80);
 				uint16_t topicLength = data[index++];
 				topicLength <<= 8;
 				topicLength |= data[index++];
@@ -118,27 +136,63 @@ class MQTTMessage
 			packetIdentifier |= data[index + 1];
 			return packetIdentifier;
 		}
-		inline static std::string GetPublishTopicName(uint8_t* data)
+		inline static uint32_t GetRemainingLength(uint8_t* data, uint8_t &remainingLengthBytes)
+		{
+			uint32_t multiplier = 1;
+			uint32_t remainingLength = 0;
+			uint32_t index = 1; //Remainning length byte start at byte 1
+			do
+			{
+				remainingLength += (data[index] & 127) * multiplier;
+				multiplier *= 128;
+			} while ((data[index++] & 0x80) == 0x80);
+			remainingLengthBytes = static_cast<uint8_t>(index - 1);
+			return remainingLength;
+		}
+		//The remaining length fits in the dataLength bytes received and holds the topic name and packet identifier it announces.
+		//Checked before the getters below, which trust the lengths read from the frame
+		inline static bool IsWellFormedPublish(uint8_t* data, std::size_t dataLength)
+		{
+			uint32_t multiplier = 1;
+			uint32_t remainingLength = 0;
+			std::size_t index = 1;
+			do
+			{
+				if ((index >= dataLength) || (index > 4))
+				{
+					return false;
+				}
+				remainingLength += (data[index] & 127) * multiplier;
+				multiplier *= 128;
+			} while ((data[index++] & 0x80) == 0x80);
+			uint8_t qos = GetPublishQos(data);
+			if ((qos > 2) || (remainingLength < 2) || (remainingLength > dataLength - index))
+			{
+				return false;
+			}
+			uint32_t topicLength = (static_cast<uint32_t>(data[index]) << 8) | data[index + 1];
+			return 2 + topicLength + ((qos != 0) ? 2 /*Package Identifier*/ : 0) <= remainingLength;
+		}
+		inline static const char* GetPublishTopicName(uint8_t* data, uint16_t &topicLength)
 		{
 			uint32_t index = 1; //Remainning length byte start at byte 1
 			while ((data[index++] & 0x80) == 0x80);
-			uint16_t topicLength = 0;
 			topicLength = data[index++];
 			topicLength <<= 8;
 			topicLength |= data[index++];
-			char topicNameArray[MQTT_MAX_MESSAGE_LENGTH];
-#if defined(WIN32) || defined(WIN64)
-			memcpy_s(topicNameArray, MQTT_MAX_MESSAGE_LENGTH, &data[index], topicLength);
-#else
-			memcpy(topicNameArray, &data[index], topicLength);
-#endif
-			std::string topicName(topicNameArray, topicLength);
-			return topicName;
+			return reinterpret_cast<char*>(&data[index]);
 		}
-		inline static std::string GetPublishPayload(uint8_t* data)
+		inline static std::string GetPublishTopicName(uint8_t* data)
 		{
-			uint32_t index = 1; //Remainning length byte start at byte 1
-			while ((data[index++] & 0x80) == 0x80);
+			uint16_t topicLength;
+			const char *topicName = GetPublishTopicName(data, topicLength);
+			return std::string(topicName, topicLength);
+		}
+		inline static const uint8_t* GetPublishPayload(uint8_t* data, uint32_t &payloadLength)
+		{
+			uint8_t remainingLengthBytes;
+			uint32_t remainingLength = GetRemainingLength(data, remainingLengthBytes);
+			uint32_t index = 1 + remainingLengthBytes;
 			uint16_t topicLength = 0;
 			topicLength = data[index++];
 			topicLength <<= 8;
@@ -148,38 +202,44 @@ class MQTTMessage
 			{
 				index += 2; /*Package Identifier*/
 			}
-			uint16_t payloadLength = 0;
-			payloadLength = data[index++];
-			payloadLength <<= 8;
-			payloadLength |= data[index++];
-			char payloadArray[MQTT_MAX_MESSAGE_LENGTH];
-#if defined(WIN32) || defined(WIN64)
-			memcpy_s(payloadArray, MQTT_MAX_MESSAGE_LENGTH, &data[index], payloadLength);
-#else
-			memcpy(payloadArray, &data[index], payloadLength);
-#endif
-			std::string payload(payloadArray, payloadLength);	
-			return payload;
+			//The payload is not length prefixed, it takes the rest of the packet
+			payloadLength = 1 + remainingLengthBytes + remainingLength - index;
+			return &data[index];
+		}
+		inline static bool GetPublishRetain(uint8_t* data) { return (data[0] & 0x01) == 0x01; }
+		inline static std::string GetPublishPayload(uint8_t* data)
+		{
+			uint32_t payloadLength;
+			const uint8_t *payload = GetPublishPayload(data, payloadLength);
+			return std::string(reinterpret_cast<const char*>(payload), payloadLength);
 		}
 		static std::unique_ptr<MQTTMessage> MQTTMessageConnect(std::string clientID, MQTTConnectOptions mqttConnectOptions);
-		static std::unique_ptr<MQTTMessage> MQTTMessagePublish(std::string topicName, std::string payload, bool dup, uint8_t qos, bool retain);
+		static std::unique_ptr<MQTTMessage> MQTTMessagePublish(std::string topicName, std::string payload, bool dup, uint8_t qos, bool retain, uint16_t packetIdentifier);
+		//Fixed header, topic name and packet identifier of a PUBLISH whose payloadLength bytes are sent separately
+		static std::unique_ptr<MQTTMessage> MQTTMessagePublishHeader(std::string topicName, uint32_t payloadLength, bool dup, uint8_t qos, bool retain, uint16_t packetIdentifier);
 		static std::unique_ptr<MQTTMessage> MQTTMessagePubAck(uint16_t packetIdentifier);
 		static std::unique_ptr<MQTTMessage> MQTTMessagePubRec(uint16_t packetIdentifier);
 		static std::unique_ptr<MQTTMessage> MQTTMessagePubRel(uint16_t packetIdentifier);
 		static std::unique_ptr<MQTTMessage> MQTTMessagePubComp(uint16_t packetIdentifier);
-		static std::unique_ptr<MQTTMessage> MQTTMessageSubscribe(std::string topicName, uint8_t qos);
-		static std::unique_ptr<MQTTMessage> MQTTMessageUnsubscribe(std::string topicName);
+		static std::unique_ptr<MQTTMessage> MQTTMessageSubscribe(std::string topicName, uint8_t qos, uint16_t packetIdentifier);
+		static std::unique_ptr<MQTTMessage> MQTTMessageUnsubscribe(std::string topicName, uint16_t packetIdentifier);
+		//Several topic filters in one packet, returns nullptr when one of them is invalid
+		static std::unique_ptr<MQTTMessage> MQTTMessageSubscribe(const std::vector<std::pair<std::string, uint8_t>> &topicFilters, uint16_t packetIdentifier);
+		static std::unique_ptr<MQTTMessage> MQTTMessageUnsubscribe(const std::vector<std::string> &topicFilters, uint16_t packetIdentifier);
 		static std::unique_ptr<MQTTMessage> MQTTMessagePingReq();
 		static std::unique_ptr<MQTTMessage> MQTTMessagePingResp();
 		~MQTTMessage();
+		//The frame is freed with the message unless released: the socket writers take it over and free it once written.
+		//The length stays readable after the release
+		inline std::unique_ptr<uint8_t[]> ReleaseMessageData() { uint8_t *data = message; message = nullptr; return std::unique_ptr<uint8_t[]>(data); }
 		inline uint8_t *GetMessageData() { return message; }
 		inline std::size_t GetMessageLength() { return messageLength; }
 	private:
 		MQTTMessage();
 		static uint8_t CalculateRemainingLengthBytes(uint8_t* buffer, uint32_t length);
+		static std::unique_ptr<MQTTMessage> EncodePublish(std::string &topicName, uint32_t payloadLength, bool dup, uint8_t qos, bool retain, uint16_t packetIdentifier, uint8_t **payload);
 	private:
 		uint8_t *message;
 		std::size_t messageLength;
-		static uint16_t packetIdentifier;
 };
 #endif //_MQTT_MESSAGE_H_
@@ -0,0 +1,478 @@
+#include "MQTTOfflineBuffer.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#endif
+#include "MQTTTopic.h"
+#include "Utils.h"
+
+#define MQTT_OFFLINE_SEGMENT_PREFIX "mqtt-offline-"
+#define MQTT_OFFLINE_SEGMENT_SUFFIX ".log"
+
+MQTTOfflineBuffer::MQTTOfflineBuffer(MQTTOfflineBufferOptions options) :
+	options(options), memoryUsage(0), nextEntrySequence(0), loadedCount(0), diskUsage(0), nextSequence(0), segmentfd(-1), dropped(0)
+{
+}
+
+MQTTOfflineBuffer::~MQTTOfflineBuffer()
+{
+	CloseSegment();
+}
+
+bool MQTTOfflineBuffer::Open()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (options.directory.empty() || (options.diskLimit == 0))
+	{
+		return true;
+	}
+#if defined(WIN32) || defined(WIN64)
+	int result = _mkdir(options.directory.c_str());
+#else
+	int result = mkdir(options.directory.c_str(), 0755);
+#endif
+	if ((result != 0) && (errno != EEXIST))
+	{
+		LOGI("Cannot create offline buffer directory %s", options.directory.c_str());
+		return false;
+	}
+	std::vector<uint64_t> sequences;
+	std::size_t prefixLength = strlen(MQTT_OFFLINE_SEGMENT_PREFIX);
+#if defined(WIN32) || defined(WIN64)
+	struct _finddata_t fileInfo;
+	intptr_t handle = _findfirst((options.directory + "/" MQTT_OFFLINE_SEGMENT_PREFIX "*" MQTT_OFFLINE_SEGMENT_SUFFIX).c_str(), &fileInfo);
+	if (handle != -1)
+	{
+		do
+		{
+			sequences.push_back(strtoull(fileInfo.name + prefixLength, nullptr, 10));
+		} while (_findnext(handle, &fileInfo) == 0);
+		_findclose(handle);
+	}
+#else
+	DIR *directory = opendir(options.directory.c_str());
+	if (directory != nullptr)
+	{
+		struct dirent *entry;
+		while ((entry = readdir(directory)) != nullptr)
+		{
+			std::string name(entry->d_name);
+			if ((name.compare(0, prefixLength, MQTT_OFFLINE_SEGMENT_PREFIX) == 0) && (name.size() > prefixLength + strlen(MQTT_OFFLINE_SEGMENT_SUFFIX)))
+			{
+				sequences.push_back(strtoull(name.c_str() + prefixLength, nullptr, 10));
+			}
+		}
+		closedir(directory);
+	}
+#endif
+	std::sort(sequences.begin(), sequences.end());
+	for (uint64_t sequence : sequences)
+	{
+		//Left by a previous run: counted now so drops stay accurate, read again when their turn comes
+		std::deque<std::string> records;
+		Segment segment = { sequence, 0, 0 };
+		if (ReadSegment(sequence, records, segment.length) && !records.empty())
+		{
+			segment.count = records.size();
+			segments.push_back(segment);
+			diskUsage += segment.length;
+		}
+		nextSequence = sequence + 1;
+	}
+	if (!segments.empty())
+	{
+		LOGI("Recovered %d offline buffer segments", static_cast<int>(segments.size()));
+	}
+	return true;
+}
+
+bool MQTTOfflineBuffer::Push(const MQTTOfflineRequest &request)
+{
+	std::string record = Serialize(request);
+	std::lock_guard<std::mutex> lock(mutex);
+	if (Store(record))
+	{
+		return true;
+	}
+	MQTTDropPolicy dropPolicy = GetDropPolicy(request);
+	if (record.size() > std::max<uint64_t>(options.memoryLimit, options.diskLimit))
+	{
+		dropPolicy = MQTTDropPolicy::DROP_NEWEST;
+	}
+	switch (dropPolicy)
+	{
+		case MQTTDropPolicy::QOS0_FIRST:
+		{
+			if ((request.type == MQTT_OFFLINE_PUBLISH) && (request.qos == 0))
+			{
+				break;
+			}
+			while (DiscardOldest(true))
+			{
+				if (Store(record))
+				{
+					return true;
+				}
+			}
+			//No QoS0 publish left to drop, fall back to the oldest requests
+			while (DiscardOldest(false))
+			{
+				if (Store(record))
+				{
+					return true;
+				}
+			}
+			break;
+		}
+		case MQTTDropPolicy::DROP_OLDEST:
+		{
+			while (DiscardOldest(false))
+			{
+				if (Store(record))
+				{
+					return true;
+				}
+			}
+			break;
+		}
+		case MQTTDropPolicy::DROP_NEWEST:
+		{
+			break;
+		}
+	}
+	++dropped;
+	return false;
+}
+
+bool MQTTOfflineBuffer::Peek(MQTTOfflineRequest &request, uint64_t &sequence)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	while (!memoryQueue.empty() || LoadSegment())
+	{
+		if (Deserialize(memoryQueue.front().record, request))
+		{
+			sequence = memoryQueue.front().sequence;
+			return true;
+		}
+		Erase(memoryQueue.begin());
+	}
+	return false;
+}
+
+bool MQTTOfflineBuffer::PeekNext(uint64_t previous, MQTTOfflineRequest &request, uint64_t &sequence)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	while (true)
+	{
+		auto entry = std::upper_bound(memoryQueue.begin(), memoryQueue.end(), previous, [](uint64_t previous, const Entry &entry)
+		{
+			return previous < entry.sequence;
+		});
+		if (entry == memoryQueue.end())
+		{
+			return false;
+		}
+		if (Deserialize(entry->record, request))
+		{
+			sequence = entry->sequence;
+			return true;
+		}
+		Erase(entry);
+	}
+}
+
+void MQTTOfflineBuffer::Pop(uint64_t sequence)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	//Requests only leave from the front or are discarded, so the peeked one is at the front or gone
+	if (!memoryQueue.empty() && (memoryQueue.front().sequence == sequence))
+	{
+		Erase(memoryQueue.begin());
+	}
+}
+
+bool MQTTOfflineBuffer::IsEmpty()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return memoryQueue.empty() && segments.empty();
+}
+
+std::size_t MQTTOfflineBuffer::GetMemoryUsage()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return memoryUsage;
+}
+
+uint64_t MQTTOfflineBuffer::GetDiskUsage()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return diskUsage;
+}
+
+uint64_t MQTTOfflineBuffer::GetDroppedCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return dropped;
+}
+
+std::string MQTTOfflineBuffer::Serialize(const MQTTOfflineRequest &request)
+{
+	std::string record(MQTT_OFFLINE_RECORD_HEADER_LENGTH, '\0');
+	uint32_t length = static_cast<uint32_t>(MQTT_OFFLINE_RECORD_HEADER_LENGTH - sizeof(uint32_t) + request.topicName.size() + request.payload.size());
+	uint16_t topicNameLength = static_cast<uint16_t>(request.topicName.size());
+	memcpy(&record[0], &length, sizeof(length));
+	record[4] = static_cast<char>(request.type);
+	record[5] = static_cast<char>(request.qos);
+	record[6] = request.retain ? 1 : 0;
+	memcpy(&record[8], &topicNameLength, sizeof(topicNameLength));
+	record.append(request.topicName);
+	record.append(request.payload);
+	return record;
+}
+
+bool MQTTOfflineBuffer::Deserialize(const std::string &record, MQTTOfflineRequest &request)
+{
+	if (record.size() < MQTT_OFFLINE_RECORD_HEADER_LENGTH)
+	{
+		return false;
+	}
+	uint16_t topicNameLength;
+	memcpy(&topicNameLength, &record[8], sizeof(topicNameLength));
+	if ((static_cast<std::size_t>(MQTT_OFFLINE_RECORD_HEADER_LENGTH + topicNameLength) > record.size()) || (record[4] < MQTT_OFFLINE_PUBLISH) || (record[4] > MQTT_OFFLINE_UNSUBSCRIBE))
+	{
+		return false;
+	}
+	request.type = static_cast<MQTTOfflineRequestType>(record[4]);
+	request.qos = static_cast<uint8_t>(record[5]);
+	request.retain = (record[6] != 0);
+	request.topicName.assign(record, MQTT_OFFLINE_RECORD_HEADER_LENGTH, topicNameLength);
+	request.payload.assign(record, MQTT_OFFLINE_RECORD_HEADER_LENGTH + topicNameLength, std::string::npos);
+	return true;
+}
+
+MQTTDropPolicy MQTTOfflineBuffer::GetDropPolicy(const MQTTOfflineRequest &request)
+{
+	if (request.type == MQTT_OFFLINE_PUBLISH)
+	{
+		for (auto &dropPolicy : options.dropPolicies)
+		{
+			if (MQTTTopic::Matches(dropPolicy.first, request.topicName))
+			{
+				return dropPolicy.second;
+			}
+		}
+	}
+	return options.defaultDropPolicy;
+}
+
+bool MQTTOfflineBuffer::Store(const std::string &record)
+{
+	//Once something went to disk everything after it has to follow, otherwise it would be sent first
+	if (segments.empty() && (memoryUsage + record.size() <= options.memoryLimit))
+	{
+		memoryQueue.push_back(Entry{ nextEntrySequence++, record, false });
+		memoryUsage += record.size();
+		return true;
+	}
+	if (!options.directory.empty() && (diskUsage + record.size() <= options.diskLimit))
+	{
+		return Append(record);
+	}
+	return false;
+}
+
+bool MQTTOfflineBuffer::Append(const std::string &record)
+{
+	if ((segmentfd < 0) || ((segments.back().length > 0) && (segments.back().length + record.size() > options.segmentLength)))
+	{
+		CloseSegment();
+		Segment segment = { nextSequence++, 0, 0 };
+		std::string path = GetSegmentPath(segment.sequence);
+#if defined(WIN32) || defined(WIN64)
+		segmentfd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+		segmentfd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+#endif
+		if (segmentfd < 0)
+		{
+			LOGI("Cannot create offline buffer segment %s", path.c_str());
+			return false;
+		}
+		segments.push_back(segment);
+	}
+	const char *data = record.data();
+	std::size_t remaining = record.size();
+	while (remaining > 0)
+	{
+#if defined(WIN32) || defined(WIN64)
+		int written = _write(segmentfd, data, static_cast<unsigned int>(remaining));
+#else
+		ssize_t written = write(segmentfd, data, remaining);
+#endif
+		if (written <= 0)
+		{
+			LOGI("Write offline buffer segment error");
+			return false;
+		}
+		data += written;
+		remaining -= written;
+	}
+	segments.back().length += record.size();
+	++segments.back().count;
+	diskUsage += record.size();
+	return true;
+}
+
+bool MQTTOfflineBuffer::DiscardOldest(bool qos0Only)
+{
+	//In queue order: memory holds the oldest requests, segments only what came after them
+	if (qos0Only)
+	{
+		for (auto entry = memoryQueue.begin(); entry != memoryQueue.end(); ++entry)
+		{
+			if ((entry->record[4] == MQTT_OFFLINE_PUBLISH) && (entry->record[5] == 0))
+			{
+				Erase(entry);
+				++dropped;
+				return true;
+			}
+		}
+		//Segments are never rewritten
+		return false;
+	}
+	if (!memoryQueue.empty())
+	{
+		Erase(memoryQueue.begin());
+		++dropped;
+		return true;
+	}
+	if (!segments.empty())
+	{
+		//Disk space is reclaimed a whole segment at a time
+		Segment segment = segments.front();
+		if (segments.size() == 1)
+		{
+			CloseSegment();
+		}
+		segments.pop_front();
+		diskUsage -= segment.length;
+		dropped += segment.count;
+		remove(GetSegmentPath(segment.sequence).c_str());
+		return true;
+	}
+	return false;
+}
+
+void MQTTOfflineBuffer::Erase(std::deque<Entry>::iterator entry)
+{
+	memoryUsage -= entry->record.size();
+	if (entry->loaded && (--loadedCount == 0))
+	{
+		//Every request of the segment was sent or dropped, until now a crash would have kept them
+		diskUsage -= loadedSegment.length;
+		remove(GetSegmentPath(loadedSegment.sequence).c_str());
+	}
+	memoryQueue.erase(entry);
+}
+
+bool MQTTOfflineBuffer::LoadSegment()
+{
+	while (!segments.empty())
+	{
+		Segment segment = segments.front();
+		if (segments.size() == 1)
+		{
+			CloseSegment();
+		}
+		segments.pop_front();
+		uint64_t length;
+		std::deque<std::string> records;
+		ReadSegment(segment.sequence, records, length);
+		if (records.empty())
+		{
+			diskUsage -= segment.length;
+			remove(GetSegmentPath(segment.sequence).c_str());
+			continue;
+		}
+		//Only called once memory is empty, so the previous loaded segment is already removed.
+		//The file stays until its last request is popped, the disk usage with it
+		loadedSegment = segment;
+		loadedCount = records.size();
+		for (std::string &record : records)
+		{
+			memoryUsage += record.size();
+			memoryQueue.push_back(Entry{ nextEntrySequence++, std::move(record), true });
+		}
+		return true;
+	}
+	return false;
+}
+
+bool MQTTOfflineBuffer::ReadSegment(uint64_t sequence, std::deque<std::string> &records, uint64_t &length)
+{
+	length = 0;
+	std::string path = GetSegmentPath(sequence);
+	int fd = OpenFile(path);
+	if (fd < 0)
+	{
+		LOGI("Cannot open offline buffer segment %s", path.c_str());
+		return false;
+	}
+	std::string content;
+	char chunk[64 * 1024];
+	while (true)
+	{
+#if defined(WIN32) || defined(WIN64)
+		int bytesRead = _read(fd, chunk, sizeof(chunk));
+#else
+		ssize_t bytesRead = read(fd, chunk, sizeof(chunk));
+#endif
+		if (bytesRead <= 0)
+		{
+			break;
+		}
+		content.append(chunk, bytesRead);
+	}
+	CloseFile(fd);
+	std::size_t offset = 0;
+	while (offset + sizeof(uint32_t) <= content.size())
+	{
+		uint32_t recordLength;
+		memcpy(&recordLength, &content[offset], sizeof(recordLength));
+		//A record cut short by a crash ends the segment
+		if (offset + sizeof(uint32_t) + recordLength > content.size())
+		{
+			break;
+		}
+		records.push_back(content.substr(offset, sizeof(uint32_t) + recordLength));
+		offset += sizeof(uint32_t) + recordLength;
+	}
+	length = content.size();
+	return true;
+}
+
+std::string MQTTOfflineBuffer::GetSegmentPath(uint64_t sequence)
+{
+	char name[64];
+	snprintf(name, sizeof(name), MQTT_OFFLINE_SEGMENT_PREFIX "%020llu" MQTT_OFFLINE_SEGMENT_SUFFIX, static_cast<unsigned long long>(sequence));
+	return options.directory + "/" + name;
+}
+
+void MQTTOfflineBuffer::CloseSegment()
+{
+	if (segmentfd >= 0)
+	{
+		CloseFile(segmentfd);
+		segmentfd = -1;
+	}
+}
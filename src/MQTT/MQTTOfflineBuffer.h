@@ -0,0 +1,91 @@
+#ifndef _MQTT_OFFLINE_BUFFER_H_
+#define _MQTT_OFFLINE_BUFFER_H_
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include "MQTTOfflineBufferOptions.h"
+
+enum MQTTOfflineRequestType
+{
+	MQTT_OFFLINE_PUBLISH = 0x01,
+	MQTT_OFFLINE_SUBSCRIBE,
+	MQTT_OFFLINE_UNSUBSCRIBE
+};
+
+struct MQTTOfflineRequest
+{
+	MQTTOfflineRequestType type;
+	uint8_t qos;
+	bool retain;
+	std::string topicName;
+	std::string payload;
+};
+
+//uint32 length of the rest | uint8 type | uint8 qos | uint8 retain | uint8 reserved | uint16 topic length | topic | payload
+#define MQTT_OFFLINE_RECORD_HEADER_LENGTH 10
+
+//Requests made while disconnected, kept in order. They stay in memory up to the memory limit, then go to append only segment files
+//that are read back whole, oldest first, once memory is empty. Segments left by a previous run are picked up when the buffer is opened
+class MQTTOfflineBuffer
+{
+	public:
+		MQTTOfflineBuffer(MQTTOfflineBufferOptions options);
+		~MQTTOfflineBuffer();
+		MQTTOfflineBuffer(MQTTOfflineBuffer&) = delete;
+		MQTTOfflineBuffer& operator=(MQTTOfflineBuffer&) = delete;
+		bool Open();
+		//Returns false when the drop policy discarded the request itself
+		bool Push(const MQTTOfflineRequest &request);
+		//The oldest request stays buffered until Pop, so one interrupted by a disconnection is sent again. sequence names it for Pop
+		bool Peek(MQTTOfflineRequest &request, uint64_t &sequence);
+		//The request after previous, while both are in memory: requests on disk are only read back once memory is empty
+		bool PeekNext(uint64_t previous, MQTTOfflineRequest &request, uint64_t &sequence);
+		//Removes the oldest request when Peek returned it as sequence, unless the drop policy already discarded it
+		void Pop(uint64_t sequence);
+		bool IsEmpty();
+		std::size_t GetMemoryUsage();
+		uint64_t GetDiskUsage();
+		uint64_t GetDroppedCount();
+	private:
+		struct Segment
+		{
+			uint64_t sequence;
+			uint64_t length;
+			uint64_t count;
+		};
+		struct Entry
+		{
+			uint64_t sequence;
+			std::string record;
+			bool loaded; //Read back from loadedSegment
+		};
+		static std::string Serialize(const MQTTOfflineRequest &request);
+		static bool Deserialize(const std::string &record, MQTTOfflineRequest &request);
+		MQTTDropPolicy GetDropPolicy(const MQTTOfflineRequest &request);
+		bool Store(const std::string &record);
+		bool Append(const std::string &record);
+		bool DiscardOldest(bool qos0Only);
+		void Erase(std::deque<Entry>::iterator entry);
+		bool LoadSegment();
+		bool ReadSegment(uint64_t sequence, std::deque<std::string> &records, uint64_t &length);
+		std::string GetSegmentPath(uint64_t sequence);
+		void CloseSegment();
+	private:
+		std::mutex mutex;
+		MQTTOfflineBufferOptions options;
+		std::deque<Entry> memoryQueue;
+		std::size_t memoryUsage;
+		uint64_t nextEntrySequence;
+		std::deque<Segment> segments;
+		//Segment read back into memory, its file is removed once the last of its requests is gone. loadedCount 0 when none
+		Segment loadedSegment;
+		uint64_t loadedCount;
+		uint64_t diskUsage;
+		uint64_t nextSequence;
+		int segmentfd; //Last segment, open for appending
+		uint64_t dropped;
+};
+
+#endif //_MQTT_OFFLINE_BUFFER_H_
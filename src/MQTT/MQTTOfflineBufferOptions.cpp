@@ -0,0 +1,44 @@
+#include "MQTTOfflineBufferOptions.h"
+#include "MQTTConfig.h"
+
+MQTTOfflineBufferOptions::MQTTOfflineBufferOptions()
+{
+	this->memoryLimit = MQTT_OFFLINE_MEMORY_LIMIT;
+	this->directory = std::string();
+	this->diskLimit = 0;
+	this->segmentLength = MQTT_OFFLINE_SEGMENT_LENGTH;
+	this->drainRate = 0;
+	this->defaultDropPolicy = MQTTDropPolicy::DROP_OLDEST;
+}
+
+void MQTTOfflineBufferOptions::SetMemoryLimit(std::size_t memoryLimit)
+{
+	this->memoryLimit = memoryLimit;
+}
+
+void MQTTOfflineBufferOptions::SetDisk(std::string directory, uint64_t diskLimit, uint32_t segmentLength)
+{
+	this->directory = directory;
+	this->diskLimit = diskLimit;
+	this->segmentLength = segmentLength;
+}
+
+void MQTTOfflineBufferOptions::SetDrainRate(uint32_t drainRate)
+{
+	this->drainRate = drainRate;
+}
+
+void MQTTOfflineBufferOptions::SetDefaultDropPolicy(MQTTDropPolicy dropPolicy)
+{
+	this->defaultDropPolicy = dropPolicy;
+}
+
+void MQTTOfflineBufferOptions::SetDropPolicy(std::string topicFilter, MQTTDropPolicy dropPolicy)
+{
+	this->dropPolicies.push_back(std::make_pair(topicFilter, dropPolicy));
+}
+
+uint32_t MQTTOfflineBufferOptions::GetDrainRate()
+{
+	return drainRate;
+}
@@ -0,0 +1,40 @@
+#ifndef _MQTT_OFFLINE_BUFFER_OPTIONS_H_
+#define _MQTT_OFFLINE_BUFFER_OPTIONS_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//What gives way once the buffer is full, chosen by the topic of the incoming publish
+enum class MQTTDropPolicy: uint8_t
+{
+	DROP_OLDEST = 0x01, //Discard the oldest buffered requests until the new one fits
+	DROP_NEWEST, //Discard the incoming request
+	QOS0_FIRST //Discard an incoming QoS0 publish, otherwise the oldest buffered QoS0 publishes and then the oldest requests
+};
+
+class MQTTOfflineBufferOptions
+{
+	friend class MQTTOfflineBuffer;
+	public:
+		MQTTOfflineBufferOptions();
+		void SetMemoryLimit(std::size_t memoryLimit);
+		//Spill to segment files in directory once memory is full. A diskLimit of 0 keeps everything in memory
+		void SetDisk(std::string directory, uint64_t diskLimit, uint32_t segmentLength);
+		//Requests sent per second when draining after a reconnection, 0 for as fast as the link allows
+		void SetDrainRate(uint32_t drainRate);
+		void SetDefaultDropPolicy(MQTTDropPolicy dropPolicy);
+		//Policies are looked up in the order they were added, the first filter matching the topic wins
+		void SetDropPolicy(std::string topicFilter, MQTTDropPolicy dropPolicy);
+
+		uint32_t GetDrainRate();
+	private:
+		std::size_t memoryLimit;
+		std::string directory;
+		uint64_t diskLimit;
+		uint32_t segmentLength;
+		uint32_t drainRate;
+		MQTTDropPolicy defaultDropPolicy;
+		std::vector<std::pair<std::string, MQTTDropPolicy>> dropPolicies;
+};
+
+#endif //_MQTT_OFFLINE_BUFFER_OPTIONS_H_
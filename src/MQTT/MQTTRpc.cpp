@@ -0,0 +1,213 @@
+#include "MQTTRpc.h"
+#include <string.h>
+#include "MQTTConfig.h"
+
+#define MQTT_RPC_SLOT_BUSY UINT64_MAX
+#define MQTT_RPC_CORRELATION_LENGTH 8
+
+static void WriteCorrelationId(std::string &payload, uint64_t correlationId)
+{
+	for (int shift = 56; shift >= 0; shift -= 8)
+	{
+		payload.push_back(static_cast<char>((correlationId >> shift) & 0xFF));
+	}
+}
+
+static uint64_t ReadCorrelationId(const uint8_t *data)
+{
+	uint64_t correlationId = 0;
+	for (int i = 0; i < MQTT_RPC_CORRELATION_LENGTH; ++i)
+	{
+		correlationId = (correlationId << 8) | data[i];
+	}
+	return correlationId;
+}
+
+MQTTRpcCall::MQTTRpcCall()
+{
+	future = promise.get_future().share();
+	startTime = std::chrono::steady_clock::now();
+}
+
+std::shared_future<MQTTRpcResult> MQTTRpcCall::GetFuture()
+{
+	return future;
+}
+
+std::shared_ptr<MQTTRpcCall> MQTTRpcCall::Failed()
+{
+	std::shared_ptr<MQTTRpcCall> call = std::make_shared<MQTTRpcCall>();
+	call->Complete(MQTT_RESULT_FAILURE, nullptr, 0);
+	return call;
+}
+
+void MQTTRpcCall::Complete(uint8_t returnCode, const uint8_t *payload, uint32_t payloadLength)
+{
+	MQTTRpcResult result;
+	result.returnCode = returnCode;
+	if (payloadLength > 0)
+	{
+		result.payload.assign(reinterpret_cast<const char*>(payload), payloadLength);
+	}
+	result.latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+	promise.set_value(result);
+}
+
+MQTTRpc::MQTTRpc(std::string replyTopic) : replyTopic(replyTopic), waiters(new Waiter[MQTT_RPC_MAX_IN_FLIGHT]), nextCorrelationId(1), inFlight(0)
+{
+	for (uint32_t i = 0; i < MQTT_RPC_MAX_IN_FLIGHT; ++i)
+	{
+		waiters[i].correlationId = 0;
+		waiters[i].deadline = 0;
+	}
+}
+
+MQTTRpc::~MQTTRpc()
+{
+	//Nobody will answer the calls still waiting
+	for (uint32_t i = 0; i < MQTT_RPC_MAX_IN_FLIGHT; ++i)
+	{
+		uint64_t correlationId = waiters[i].correlationId.load(std::memory_order_acquire);
+		if ((correlationId != 0) && (correlationId != MQTT_RPC_SLOT_BUSY))
+		{
+			Complete(correlationId, MQTT_RESULT_FAILURE, nullptr, 0);
+		}
+	}
+}
+
+const std::string& MQTTRpc::GetReplyTopic()
+{
+	return replyTopic;
+}
+
+MQTTRpcCallPtr MQTTRpc::Begin(std::chrono::nanoseconds deadline, uint64_t &correlationId)
+{
+	if (inFlight.fetch_add(1, std::memory_order_relaxed) >= MQTT_RPC_MAX_IN_FLIGHT)
+	{
+		inFlight.fetch_sub(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	//There is a free slot, but the next ids may land on slots held by older calls: skip to the next id until one is free
+	while (true)
+	{
+		correlationId = nextCorrelationId.fetch_add(1, std::memory_order_relaxed);
+		Waiter &waiter = waiters[correlationId & (MQTT_RPC_MAX_IN_FLIGHT - 1)];
+		uint64_t expected = 0;
+		if (waiter.correlationId.compare_exchange_strong(expected, MQTT_RPC_SLOT_BUSY, std::memory_order_acquire))
+		{
+			MQTTRpcCallPtr call = std::make_shared<MQTTRpcCall>();
+			waiter.call = call;
+			waiter.deadline.store(deadline.count(), std::memory_order_relaxed);
+			waiter.correlationId.store(correlationId, std::memory_order_release);
+			return call;
+		}
+	}
+}
+
+bool MQTTRpc::Complete(uint64_t correlationId, uint8_t returnCode, const uint8_t *payload, uint32_t payloadLength)
+{
+	if ((correlationId == 0) || (correlationId == MQTT_RPC_SLOT_BUSY))
+	{
+		return false;
+	}
+	MQTTRpcCallPtr call = Claim(waiters[correlationId & (MQTT_RPC_MAX_IN_FLIGHT - 1)], correlationId);
+	if (!call)
+	{
+		return false;
+	}
+	call->Complete(returnCode, payload, payloadLength);
+	return true;
+}
+
+void MQTTRpc::Expire(std::chrono::nanoseconds now)
+{
+	for (uint32_t i = 0; i < MQTT_RPC_MAX_IN_FLIGHT; ++i)
+	{
+		Waiter &waiter = waiters[i];
+		uint64_t correlationId = waiter.correlationId.load(std::memory_order_acquire);
+		if ((correlationId == 0) || (correlationId == MQTT_RPC_SLOT_BUSY) || (waiter.deadline.load(std::memory_order_relaxed) > now.count()))
+		{
+			continue;
+		}
+		//The slot may have been answered and taken again since it was read, the claim then fails on the correlation id
+		MQTTRpcCallPtr call = Claim(waiter, correlationId);
+		if (call)
+		{
+			call->Complete(MQTT_RESULT_TIMEOUT, nullptr, 0);
+		}
+	}
+}
+
+uint32_t MQTTRpc::GetInFlightCount()
+{
+	return inFlight.load(std::memory_order_relaxed);
+}
+
+MQTTRpcCallPtr MQTTRpc::Claim(Waiter &waiter, uint64_t correlationId)
+{
+	uint64_t expected = correlationId;
+	if (!waiter.correlationId.compare_exchange_strong(expected, MQTT_RPC_SLOT_BUSY, std::memory_order_acquire))
+	{
+		return nullptr;
+	}
+	MQTTRpcCallPtr call;
+	call.swap(waiter.call);
+	waiter.correlationId.store(0, std::memory_order_release);
+	inFlight.fetch_sub(1, std::memory_order_relaxed);
+	return call;
+}
+
+std::string MQTTRpc::EncodeRequest(const std::string &replyTopic, uint64_t correlationId, const std::string &payload)
+{
+	std::string request;
+	request.reserve(MQTT_RPC_MAGIC_LENGTH + MQTT_RPC_CORRELATION_LENGTH + 2 + replyTopic.size() + payload.size());
+	request.append(MQTT_RPC_REQUEST_MAGIC, MQTT_RPC_MAGIC_LENGTH);
+	WriteCorrelationId(request, correlationId);
+	request.push_back(static_cast<char>(replyTopic.size() >> 8));
+	request.push_back(static_cast<char>(replyTopic.size() & 0xFF));
+	request.append(replyTopic);
+	request.append(payload);
+	return request;
+}
+
+bool MQTTRpc::DecodeRequest(const uint8_t *payload, uint32_t payloadLength, std::string &replyTopic, uint64_t &correlationId, const uint8_t *&body, uint32_t &bodyLength)
+{
+	uint32_t headerLength = MQTT_RPC_MAGIC_LENGTH + MQTT_RPC_CORRELATION_LENGTH + 2;
+	if ((payloadLength < headerLength) || (memcmp(payload, MQTT_RPC_REQUEST_MAGIC, MQTT_RPC_MAGIC_LENGTH) != 0))
+	{
+		return false;
+	}
+	correlationId = ReadCorrelationId(payload + MQTT_RPC_MAGIC_LENGTH);
+	uint16_t replyTopicLength = static_cast<uint16_t>((payload[headerLength - 2] << 8) | payload[headerLength - 1]);
+	if ((replyTopicLength == 0) || (payloadLength - headerLength < replyTopicLength))
+	{
+		return false;
+	}
+	replyTopic.assign(reinterpret_cast<const char*>(payload + headerLength), replyTopicLength);
+	body = payload + headerLength + replyTopicLength;
+	bodyLength = payloadLength - headerLength - replyTopicLength;
+	return true;
+}
+
+std::string MQTTRpc::EncodeResponse(uint64_t correlationId, const std::string &payload)
+{
+	std::string response;
+	response.reserve(MQTT_RPC_MAGIC_LENGTH + MQTT_RPC_CORRELATION_LENGTH + payload.size());
+	response.append(MQTT_RPC_RESPONSE_MAGIC, MQTT_RPC_MAGIC_LENGTH);
+	WriteCorrelationId(response, correlationId);
+	response.append(payload);
+	return response;
+}
+
+bool MQTTRpc::DecodeResponse(const uint8_t *payload, uint32_t payloadLength, uint64_t &correlationId, const uint8_t *&body, uint32_t &bodyLength)
+{
+	uint32_t headerLength = MQTT_RPC_MAGIC_LENGTH + MQTT_RPC_CORRELATION_LENGTH;
+	if ((payloadLength < headerLength) || (memcmp(payload, MQTT_RPC_RESPONSE_MAGIC, MQTT_RPC_MAGIC_LENGTH) != 0))
+	{
+		return false;
+	}
+	correlationId = ReadCorrelationId(payload + MQTT_RPC_MAGIC_LENGTH);
+	body = payload + headerLength;
+	bodyLength = payloadLength - headerLength;
+	return true;
+}
@@ -0,0 +1,89 @@
+#ifndef _MQTT_RPC_H_
+#define _MQTT_RPC_H_
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <functional>
+#include "MQTTToken.h"
+
+//MQTT 3.1.1 has no Response Topic or Correlation Data properties, they travel in front of the payload instead.
+//A request is the request magic, the correlation id (8 bytes, big endian), the reply topic as an MQTT string then the body.
+//A response is the response magic, the correlation id then the body
+#define MQTT_RPC_REQUEST_MAGIC "\xA6MQQ"
+#define MQTT_RPC_RESPONSE_MAGIC "\xA6MQP"
+#define MQTT_RPC_MAGIC_LENGTH 4
+
+struct MQTTRpcResult
+{
+	//MQTT_RESULT_SUCCESS with the response, MQTT_RESULT_TIMEOUT or MQTT_RESULT_FAILURE when the request could not be sent
+	uint8_t returnCode;
+	std::string payload;
+	//Time between sending the request and receiving its response
+	std::chrono::microseconds latency;
+};
+
+//Answer of a request handler, sent back to the reply topic of the request
+using MQTTRequestCallback = std::function<std::string(std::string topic, std::string payload)>;
+
+class MQTTRpcCall
+{
+	friend class MQTTRpc;
+	public:
+		MQTTRpcCall();
+		~MQTTRpcCall() = default;
+		MQTTRpcCall(MQTTRpcCall&) = delete;
+		MQTTRpcCall& operator=(MQTTRpcCall&) = delete;
+		std::shared_future<MQTTRpcResult> GetFuture();
+		static std::shared_ptr<MQTTRpcCall> Failed();
+	private:
+		void Complete(uint8_t returnCode, const uint8_t *payload, uint32_t payloadLength);
+	private:
+		std::promise<MQTTRpcResult> promise;
+		std::shared_future<MQTTRpcResult> future;
+		std::chrono::steady_clock::time_point startTime;
+};
+
+using MQTTRpcCallPtr = std::shared_ptr<MQTTRpcCall>;
+
+//Calls waiting for their response, in a table of MQTT_RPC_MAX_IN_FLIGHT slots indexed by the low bits of the correlation id.
+//A slot is taken, answered and expired with compare and swap on its correlation id, so requests, responses and the expiry sweep never wait on each other
+class MQTTRpc
+{
+	public:
+		MQTTRpc(std::string replyTopic);
+		~MQTTRpc();
+		MQTTRpc(MQTTRpc&) = delete;
+		MQTTRpc& operator=(MQTTRpc&) = delete;
+		const std::string& GetReplyTopic();
+		//Registers a call expiring at deadline. Returns nullptr when every slot is taken
+		MQTTRpcCallPtr Begin(std::chrono::nanoseconds deadline, uint64_t &correlationId);
+		//Returns false when no call waits for correlationId: it was answered or expired already, or is not ours
+		bool Complete(uint64_t correlationId, uint8_t returnCode, const uint8_t *payload, uint32_t payloadLength);
+		//Completes with MQTT_RESULT_TIMEOUT the calls whose deadline is not after now
+		void Expire(std::chrono::nanoseconds now);
+		uint32_t GetInFlightCount();
+
+		static std::string EncodeRequest(const std::string &replyTopic, uint64_t correlationId, const std::string &payload);
+		static bool DecodeRequest(const uint8_t *payload, uint32_t payloadLength, std::string &replyTopic, uint64_t &correlationId, const uint8_t *&body, uint32_t &bodyLength);
+		static std::string EncodeResponse(uint64_t correlationId, const std::string &payload);
+		static bool DecodeResponse(const uint8_t *payload, uint32_t payloadLength, uint64_t &correlationId, const uint8_t *&body, uint32_t &bodyLength);
+	private:
+		struct Waiter
+		{
+			//0 when free, MQTT_RPC_SLOT_BUSY while its owner fills or empties it
+			std::atomic<uint64_t> correlationId;
+			std::atomic<int64_t> deadline;
+			MQTTRpcCallPtr call;
+		};
+		MQTTRpcCallPtr Claim(Waiter &waiter, uint64_t correlationId);
+	private:
+		std::string replyTopic;
+		std::unique_ptr<Waiter[]> waiters;
+		std::atomic<uint64_t> nextCorrelationId;
+		std::atomic<uint32_t> inFlight;
+};
+
+#endif //_MQTT_RPC_H_
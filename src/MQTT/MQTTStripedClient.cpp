@@ -0,0 +1,181 @@
+#include "MQTTStripedClient.h"
+#include "Utils.h"
+
+//FNV-1a, topics of a common prefix still spread evenly
+static uint32_t HashTopic(const std::string &topicName)
+{
+	uint32_t hash = 2166136261u;
+	for (char c : topicName)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+MQTTStripedClient::MQTTStripedClient(std::string host, uint32_t port, std::string clientID, uint32_t stripes) : connectedCount(0)
+{
+	stripes = (stripes > 0) ? stripes : 1;
+	connected.assign(stripes, false);
+	for (uint32_t stripe = 0; stripe < stripes; ++stripe)
+	{
+		clients.push_back(::make_unique<MQTTClient>(host, port, clientID + "-" + std::to_string(stripe)));
+		clients.back()->MQTTOnConnected([this, stripe]()
+		{
+			StripeConnected(stripe);
+		});
+		clients.back()->MQTTOnDisconnected([this, stripe]()
+		{
+			StripeDisconnected(stripe);
+		});
+	}
+	mqttConnectedCallback = nullptr;
+	mqttDisconnectedCallback = nullptr;
+}
+
+void MQTTStripedClient::Connect(MQTTConnectOptions mqttConnectOptions, bool security)
+{
+	for (std::unique_ptr<MQTTClient> &client : clients)
+	{
+		client->Connect(mqttConnectOptions, security);
+	}
+}
+
+MQTTTokenPtr MQTTStripedClient::Publish(std::string topicName, std::string payload, uint8_t qos, bool retain)
+{
+	return clients[GetStripe(topicName)]->Publish(std::move(topicName), std::move(payload), qos, retain);
+}
+
+MQTTTokenPtr MQTTStripedClient::Publish(std::string topicName, const std::vector<MQTTPayloadSegment> &payload, uint8_t qos, bool retain)
+{
+	return clients[GetStripe(topicName)]->Publish(std::move(topicName), payload, qos, retain);
+}
+
+MQTTTokenPtr MQTTStripedClient::Subscribe(std::string topicFilter, uint8_t qos)
+{
+	return Subscribe(HashTopic(topicFilter) % static_cast<uint32_t>(clients.size()), topicFilter, qos);
+}
+
+MQTTTokenPtr MQTTStripedClient::Subscribe(uint32_t stripe, std::string topicFilter, uint8_t qos)
+{
+	if (stripe >= clients.size())
+	{
+		LOGI("Invalid stripe %u", stripe);
+		return MQTTToken::Failed();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		subscriptions[topicFilter] = stripe;
+	}
+	return clients[stripe]->Subscribe(topicFilter, qos);
+}
+
+MQTTTokenPtr MQTTStripedClient::Unsubscribe(std::string topicFilter)
+{
+	uint32_t stripe = HashTopic(topicFilter) % static_cast<uint32_t>(clients.size());
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unordered_map<std::string, uint32_t>::iterator subscription = subscriptions.find(topicFilter);
+		if (subscription != subscriptions.end())
+		{
+			stripe = subscription->second;
+			subscriptions.erase(subscription);
+		}
+	}
+	return clients[stripe]->Unsubscribe(topicFilter);
+}
+
+uint32_t MQTTStripedClient::GetStripeCount()
+{
+	return static_cast<uint32_t>(clients.size());
+}
+
+uint32_t MQTTStripedClient::GetStripe(const std::string &topicName)
+{
+	return HashTopic(topicName) % static_cast<uint32_t>(clients.size());
+}
+
+MQTTClient& MQTTStripedClient::GetStripeClient(uint32_t stripe)
+{
+	return *clients[stripe];
+}
+
+uint32_t MQTTStripedClient::GetPacketIdentifiersInUse()
+{
+	uint32_t packetIdentifiers = 0;
+	for (std::unique_ptr<MQTTClient> &client : clients)
+	{
+		packetIdentifiers += client->GetPacketIdentifiersInUse();
+	}
+	return packetIdentifiers;
+}
+
+void MQTTStripedClient::MQTTOnConnected(MQTTCallback mqttConnectedCallback)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	this->mqttConnectedCallback = mqttConnectedCallback;
+}
+
+void MQTTStripedClient::MQTTOnDisconnected(MQTTCallback mqttDisconnectedCallback)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	this->mqttDisconnectedCallback = mqttDisconnectedCallback;
+}
+
+void MQTTStripedClient::MQTTOnPublished(MQTTCallback mqttPublishedCallback)
+{
+	for (std::unique_ptr<MQTTClient> &client : clients)
+	{
+		client->MQTTOnPublished(mqttPublishedCallback);
+	}
+}
+
+void MQTTStripedClient::MQTTOnReceivedPayload(MQTTDataCallback mqttDataCallback)
+{
+	for (std::unique_ptr<MQTTClient> &client : clients)
+	{
+		client->MQTTOnReceivedPayload(mqttDataCallback);
+	}
+}
+
+void MQTTStripedClient::StripeConnected(uint32_t stripe)
+{
+	MQTTCallback callback;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (connected[stripe])
+		{
+			return;
+		}
+		connected[stripe] = true;
+		if (++connectedCount == clients.size())
+		{
+			callback = mqttConnectedCallback;
+		}
+	}
+	if (callback)
+	{
+		callback();
+	}
+}
+
+void MQTTStripedClient::StripeDisconnected(uint32_t stripe)
+{
+	MQTTCallback callback;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!connected[stripe])
+		{
+			return;
+		}
+		connected[stripe] = false;
+		if (connectedCount-- == clients.size())
+		{
+			callback = mqttDisconnectedCallback;
+		}
+	}
+	if (callback)
+	{
+		callback();
+	}
+}
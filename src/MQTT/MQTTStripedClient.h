@@ -0,0 +1,60 @@
+#ifndef _MQTT_STRIPED_CLIENT_H_
+#define _MQTT_STRIPED_CLIENT_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "MQTTClient.h"
+
+//One logical client over several connections to the broker, its stripes, each an MQTTClient with its own socket and I/O thread
+//and the client id clientID-<stripe>. Publishes go to the stripe of their topic (a hash of the topic name) so the publishes of a topic
+//keep their order while different topics are sent, acknowledged and recovered from loss in parallel, and the broker works on them concurrently.
+//A subscription is made on one stripe only, the broker would otherwise deliver every publish once per stripe
+class MQTTStripedClient
+{
+	public:
+		MQTTStripedClient(std::string host, uint32_t port, std::string clientID, uint32_t stripes);
+		~MQTTStripedClient() = default;
+		MQTTStripedClient(MQTTStripedClient&) = delete;
+		MQTTStripedClient& operator=(MQTTStripedClient&) = delete;
+		void Connect(MQTTConnectOptions mqttConnectOptions, bool security);
+		MQTTTokenPtr Publish(std::string topicName, std::string payload, uint8_t qos, bool retain);
+		MQTTTokenPtr Publish(std::string topicName, const std::vector<MQTTPayloadSegment> &payload, uint8_t qos, bool retain);
+		//On the stripe of the hash of topicFilter
+		MQTTTokenPtr Subscribe(std::string topicFilter, uint8_t qos);
+		//On a chosen stripe, for instance to give a busy filter a connection of its own
+		MQTTTokenPtr Subscribe(uint32_t stripe, std::string topicFilter, uint8_t qos);
+		//On the stripe the filter was subscribed on
+		MQTTTokenPtr Unsubscribe(std::string topicFilter);
+
+		uint32_t GetStripeCount();
+		//Stripe the publishes to topicName go through
+		uint32_t GetStripe(const std::string &topicName);
+		//For the settings made per connection, such as EnableBusyPoll or SetSocketFactory. Call before Connect
+		MQTTClient& GetStripeClient(uint32_t stripe);
+		uint32_t GetPacketIdentifiersInUse();
+
+		//Called once every stripe is connected
+		void MQTTOnConnected(MQTTCallback mqttConnectedCallback);
+		//Called when a stripe is lost while all of them were connected
+		void MQTTOnDisconnected(MQTTCallback mqttDisconnectedCallback);
+		//The callbacks below run on the I/O thread of the stripe that received the packet, those of different stripes concurrently
+		void MQTTOnPublished(MQTTCallback mqttPublishedCallback);
+		void MQTTOnReceivedPayload(MQTTDataCallback mqttDataCallback);
+	private:
+		void StripeConnected(uint32_t stripe);
+		void StripeDisconnected(uint32_t stripe);
+	private:
+		std::vector<std::unique_ptr<MQTTClient>> clients;
+		std::mutex mutex;
+		std::vector<bool> connected;
+		uint32_t connectedCount;
+		//Stripe of every subscribed topic filter, for Unsubscribe
+		std::unordered_map<std::string, uint32_t> subscriptions;
+		MQTTCallback mqttConnectedCallback;
+		MQTTCallback mqttDisconnectedCallback;
+};
+
+#endif //_MQTT_STRIPED_CLIENT_H_
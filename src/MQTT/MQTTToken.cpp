@@ -0,0 +1,94 @@
+#include "MQTTToken.h"
+
+MQTTToken::MQTTToken() : complete(false)
+{
+	future = promise.get_future().share();
+	result.packetIdentifier = 0;
+	result.returnCode = MQTT_RESULT_FAILURE;
+	result.latency = std::chrono::microseconds(0);
+	startTime = std::chrono::steady_clock::now();
+}
+
+std::shared_future<MQTTResult> MQTTToken::GetFuture()
+{
+	return future;
+}
+
+void MQTTToken::OnComplete(MQTTTokenCallback callback, void *context)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!complete)
+		{
+			callbacks.push_back(std::make_pair(callback, context));
+			return;
+		}
+	}
+	callback(result, context);
+}
+
+bool MQTTToken::IsComplete()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return complete;
+}
+
+#if defined(MQTT_COROUTINES)
+bool MQTTToken::AddWaiter(std::coroutine_handle<> handle)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (complete)
+	{
+		return false;
+	}
+	waiters.push_back(handle);
+	return true;
+}
+#endif
+
+void MQTTToken::Start(uint16_t packetIdentifier)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	result.packetIdentifier = packetIdentifier;
+	startTime = std::chrono::steady_clock::now();
+}
+
+void MQTTToken::Complete(uint8_t returnCode)
+{
+	std::vector<std::pair<MQTTTokenCallback, void*>> completedCallbacks;
+#if defined(MQTT_COROUTINES)
+	std::vector<std::coroutine_handle<>> completedWaiters;
+#endif
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (complete)
+		{
+			return;
+		}
+		complete = true;
+		result.returnCode = returnCode;
+		result.latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+		completedCallbacks.swap(callbacks);
+#if defined(MQTT_COROUTINES)
+		completedWaiters.swap(waiters);
+#endif
+	}
+	promise.set_value(result);
+	for (auto &callback : completedCallbacks)
+	{
+		callback.first(result, callback.second);
+	}
+#if defined(MQTT_COROUTINES)
+	for (auto &waiter : completedWaiters)
+	{
+		waiter.resume();
+	}
+#endif
+}
+
+std::shared_ptr<MQTTToken> MQTTToken::Failed()
+{
+	std::shared_ptr<MQTTToken> token = std::make_shared<MQTTToken>();
+	token->Complete(MQTT_RESULT_FAILURE);
+	return token;
+}
@@ -0,0 +1,88 @@
+#ifndef _MQTT_TOKEN_H_
+#define _MQTT_TOKEN_H_
+#include <stdint.h>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define MQTT_COROUTINES
+#endif
+
+#define MQTT_RESULT_SUCCESS 0x00
+#define MQTT_RESULT_FAILURE 0x80
+//Kept by the offline buffer until the client is connected again, no acknowledgement will be reported for it
+#define MQTT_RESULT_BUFFERED 0x40
+//Replaced in the outbound queue by a newer publish to the same topic, it was never sent
+#define MQTT_RESULT_CONFLATED 0x41
+//No response came before the deadline of a request
+#define MQTT_RESULT_TIMEOUT 0x42
+
+struct MQTTResult
+{
+	uint16_t packetIdentifier;
+	//MQTT_RESULT_SUCCESS for PUBACK, PUBCOMP and UNSUBACK, the SUBACK return code for a subscribe and MQTT_RESULT_FAILURE when the request never reached the broker
+	uint8_t returnCode;
+	//Time between handing the packet to the network and receiving its acknowledgement
+	std::chrono::microseconds latency;
+};
+
+using MQTTTokenCallback = void(*)(const MQTTResult &result, void *context);
+
+//Completion of one publish, subscribe or unsubscribe. It can be waited on as a std::future, observed through a callback or awaited from a C++20 coroutine.
+//Callbacks and coroutines are resumed on the thread that receives the acknowledgement, so they should not block
+class MQTTToken
+{
+	friend class MQTTClient;
+	friend class MQTTStripedClient;
+	public:
+		MQTTToken();
+		~MQTTToken() = default;
+		MQTTToken(MQTTToken&) = delete;
+		MQTTToken& operator=(MQTTToken&) = delete;
+		std::shared_future<MQTTResult> GetFuture();
+		//The callback runs right away when the token is already complete
+		void OnComplete(MQTTTokenCallback callback, void *context);
+		bool IsComplete();
+#if defined(MQTT_COROUTINES)
+		//Returns false when the token completed meanwhile and the coroutine must not suspend
+		bool AddWaiter(std::coroutine_handle<> handle);
+#endif
+	private:
+		void Start(uint16_t packetIdentifier);
+		void Complete(uint8_t returnCode);
+		static std::shared_ptr<MQTTToken> Failed();
+	private:
+		std::mutex mutex;
+		std::promise<MQTTResult> promise;
+		std::shared_future<MQTTResult> future;
+		bool complete;
+		MQTTResult result;
+		std::chrono::steady_clock::time_point startTime;
+		std::vector<std::pair<MQTTTokenCallback, void*>> callbacks;
+#if defined(MQTT_COROUTINES)
+		std::vector<std::coroutine_handle<>> waiters;
+#endif
+};
+
+using MQTTTokenPtr = std::shared_ptr<MQTTToken>;
+
+#if defined(MQTT_COROUTINES)
+//Keeps the token alive while the coroutine is suspended on it
+struct MQTTTokenAwaiter
+{
+	MQTTTokenPtr token;
+	bool await_ready() { return token->IsComplete(); }
+	bool await_suspend(std::coroutine_handle<> handle) { return token->AddWaiter(handle); }
+	MQTTResult await_resume() { return token->GetFuture().get(); }
+};
+
+inline MQTTTokenAwaiter operator co_await(MQTTTokenPtr token)
+{
+	return MQTTTokenAwaiter{ token };
+}
+#endif
+
+#endif //_MQTT_TOKEN_H_
@@ -0,0 +1,291 @@
+#include "MQTTTopic.h"
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MQTT_TOPIC_X86
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define MQTT_MAX_TOPIC_LENGTH 65535
+
+//Finders return the index of the first byte the scalar path has to look at: non ASCII, NUL, '+' or '#'.
+//Topics are mostly plain ASCII so the vector loops skip almost everything and the scalar code only runs around those bytes
+using SpecialByteFinder = std::size_t(*)(const uint8_t *data, std::size_t length);
+
+static inline bool IsSpecialByte(uint8_t byte)
+{
+	return (byte >= 0x80) || (byte == 0) || (byte == '+') || (byte == '#');
+}
+
+static std::size_t FindSpecialByteScalar(const uint8_t *data, std::size_t length)
+{
+	std::size_t i = 0;
+	while ((i < length) && !IsSpecialByte(data[i]))
+	{
+		++i;
+	}
+	return i;
+}
+
+#if defined(MQTT_TOPIC_X86)
+static inline unsigned int CountTrailingZeros(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static std::size_t FindSpecialByteSSE2(const uint8_t *data, std::size_t length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i hash = _mm_set1_epi8('#');
+	std::size_t i = 0;
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, zero), _mm_or_si128(_mm_cmpeq_epi8(chunk, plus), _mm_cmpeq_epi8(chunk, hash)));
+		//The sign bit of the chunk itself flags the non ASCII bytes
+		uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(special, chunk)));
+		if (mask != 0)
+		{
+			return i + CountTrailingZeros(mask);
+		}
+	}
+	return i + FindSpecialByteScalar(data + i, length - i);
+}
+
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+static std::size_t FindSpecialByteAVX2(const uint8_t *data, std::size_t length)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i plus = _mm256_set1_epi8('+');
+	const __m256i hash = _mm256_set1_epi8('#');
+	std::size_t i = 0;
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		__m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, zero), _mm256_or_si256(_mm256_cmpeq_epi8(chunk, plus), _mm256_cmpeq_epi8(chunk, hash)));
+		uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(special, chunk)));
+		if (mask != 0)
+		{
+			return i + CountTrailingZeros(mask);
+		}
+	}
+	return i + FindSpecialByteSSE2(data + i, length - i);
+}
+#endif
+#endif
+
+static SpecialByteFinder SelectSpecialByteFinder()
+{
+#if defined(MQTT_TOPIC_X86) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return FindSpecialByteAVX2;
+	}
+#endif
+#if defined(MQTT_TOPIC_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	return FindSpecialByteSSE2;
+#else
+	return FindSpecialByteScalar;
+#endif
+}
+
+static const SpecialByteFinder FindSpecialByte = SelectSpecialByteFinder();
+
+bool MQTTTopic::IsValidUTF8(const char *data, std::size_t length)
+{
+	const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+	std::size_t i = 0;
+	while (i < length)
+	{
+		i += FindSpecialByte(bytes + i, length - i);
+		if (i == length)
+		{
+			break;
+		}
+		if ((bytes[i] == '+') || (bytes[i] == '#'))
+		{
+			++i;
+			continue;
+		}
+		std::size_t sequenceLength = DecodeUTF8(bytes + i, length - i);
+		if (sequenceLength == 0)
+		{
+			return false;
+		}
+		i += sequenceLength;
+	}
+	return true;
+}
+
+bool MQTTTopic::IsValidTopicName(const char *data, std::size_t length)
+{
+	return Validate(reinterpret_cast<const uint8_t*>(data), length, false);
+}
+
+bool MQTTTopic::IsValidTopicFilter(const char *data, std::size_t length)
+{
+	return Validate(reinterpret_cast<const uint8_t*>(data), length, true);
+}
+
+bool MQTTTopic::Matches(const char *topicFilter, std::size_t topicFilterLength, const char *topicName, std::size_t topicNameLength)
+{
+	if ((topicNameLength > 0) && (topicName[0] == '$') && (topicFilterLength > 0) && ((topicFilter[0] == '+') || (topicFilter[0] == '#')))
+	{
+		return false;
+	}
+	std::size_t filterIndex = 0;
+	std::size_t nameIndex = 0;
+	while (filterIndex < topicFilterLength)
+	{
+		if (topicFilter[filterIndex] == '#')
+		{
+			return true;
+		}
+		if (topicFilter[filterIndex] == '+')
+		{
+			//Consume one whole level, possibly empty
+			while ((nameIndex < topicNameLength) && (topicName[nameIndex] != '/'))
+			{
+				++nameIndex;
+			}
+			++filterIndex;
+		}
+		else if ((nameIndex < topicNameLength) && (topicName[nameIndex] == topicFilter[filterIndex]))
+		{
+			++filterIndex;
+			++nameIndex;
+		}
+		else
+		{
+			//"sport/#" also matches the parent level "sport"
+			return (nameIndex == topicNameLength) && (filterIndex + 2 == topicFilterLength) && (topicFilter[filterIndex] == '/') && (topicFilter[filterIndex + 1] == '#');
+		}
+	}
+	return nameIndex == topicNameLength;
+}
+
+bool MQTTTopic::Validate(const uint8_t *data, std::size_t length, bool allowWildcards)
+{
+	if ((length > MQTT_MAX_TOPIC_LENGTH) || (length == 0))
+	{
+		return false;
+	}
+	std::size_t i = 0;
+	while (i < length)
+	{
+		i += FindSpecialByte(data + i, length - i);
+		if (i == length)
+		{
+			break;
+		}
+		uint8_t byte = data[i];
+		if ((byte == '+') || (byte == '#'))
+		{
+			if (!allowWildcards)
+			{
+				return false;
+			}
+			//A wildcard must occupy an entire topic level
+			if ((i > 0) && (data[i - 1] != '/'))
+			{
+				return false;
+			}
+			if (byte == '#')
+			{
+				//The multi level wildcard must be the last character of the filter
+				if (i + 1 != length)
+				{
+					return false;
+				}
+			}
+			else if ((i + 1 < length) && (data[i + 1] != '/'))
+			{
+				return false;
+			}
+			++i;
+			continue;
+		}
+		//NUL or the lead byte of a multibyte sequence
+		std::size_t sequenceLength = DecodeUTF8(data + i, length - i);
+		if (sequenceLength == 0)
+		{
+			return false;
+		}
+		i += sequenceLength;
+	}
+	return true;
+}
+
+std::size_t MQTTTopic::DecodeUTF8(const uint8_t *data, std::size_t length)
+{
+	//Returns the length of the well formed sequence at data or 0 when it is ill formed or encodes U+0000
+	uint8_t lead = data[0];
+	if (lead < 0x80)
+	{
+		return (lead == 0) ? 0 : 1;
+	}
+	std::size_t sequenceLength;
+	uint8_t lower = 0x80;
+	uint8_t upper = 0xBF;
+	if ((lead >= 0xC2) && (lead <= 0xDF))
+	{
+		sequenceLength = 2;
+	}
+	else if ((lead >= 0xE0) && (lead <= 0xEF))
+	{
+		sequenceLength = 3;
+		if (lead == 0xE0)
+		{
+			lower = 0xA0; //Overlong encoding
+		}
+		else if (lead == 0xED)
+		{
+			upper = 0x9F; //UTF-16 surrogates U+D800 to U+DFFF
+		}
+	}
+	else if ((lead >= 0xF0) && (lead <= 0xF4))
+	{
+		sequenceLength = 4;
+		if (lead == 0xF0)
+		{
+			lower = 0x90; //Overlong encoding
+		}
+		else if (lead == 0xF4)
+		{
+			upper = 0x8F; //Above U+10FFFF
+		}
+	}
+	else
+	{
+		return 0;
+	}
+	if (sequenceLength > length)
+	{
+		return 0;
+	}
+	if ((data[1] < lower) || (data[1] > upper))
+	{
+		return 0;
+	}
+	for (std::size_t i = 2; i < sequenceLength; ++i)
+	{
+		if ((data[i] < 0x80) || (data[i] > 0xBF))
+		{
+			return 0;
+		}
+	}
+	return sequenceLength;
+}
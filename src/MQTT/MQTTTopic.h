@@ -0,0 +1,26 @@
+#ifndef _MQTT_TOPIC_H_
+#define _MQTT_TOPIC_H_
+#include <stdint.h>
+#include <string>
+
+//Topic checks required by MQTT 3.1.1 sections 1.5.3 and 4.7: well formed UTF-8 without U+0000, 1 to 65535 bytes,
+//no wildcard in topic names and wildcards occupying whole levels in topic filters
+class MQTTTopic
+{
+	public:
+		MQTTTopic() = delete;
+		~MQTTTopic() = delete;
+		static bool IsValidUTF8(const char *data, std::size_t length);
+		static bool IsValidTopicName(const char *data, std::size_t length);
+		static bool IsValidTopicFilter(const char *data, std::size_t length);
+		//Both arguments must be valid. Topics starting with '$' are only matched by filters that do not start with a wildcard (section 4.7.2)
+		static bool Matches(const char *topicFilter, std::size_t topicFilterLength, const char *topicName, std::size_t topicNameLength);
+		inline static bool Matches(const std::string &topicFilter, const std::string &topicName) { return Matches(topicFilter.data(), topicFilter.size(), topicName.data(), topicName.size()); }
+		inline static bool IsValidTopicName(const std::string &topicName) { return IsValidTopicName(topicName.data(), topicName.size()); }
+		inline static bool IsValidTopicFilter(const std::string &topicFilter) { return IsValidTopicFilter(topicFilter.data(), topicFilter.size()); }
+	private:
+		static bool Validate(const uint8_t *data, std::size_t length, bool allowWildcards);
+		static std::size_t DecodeUTF8(const uint8_t *data, std::size_t length);
+};
+
+#endif //_MQTT_TOPIC_H_
@@ -0,0 +1,103 @@
+#ifndef _MQTT_TRANSPORT_H_
+#define _MQTT_TRANSPORT_H_
+#if defined(__linux__)
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+//Transport policy of BasicMQTTClient: a blocking TCP socket driven by the thread calling the client.
+//A transport policy has no base class, BasicMQTTClient calls these methods directly so they are inlined into it.
+//Any class with the same four methods may take its place, a TLS session or an in memory pipe for tests and benchmarks
+class MQTTPlainTransport
+{
+	public:
+		MQTTPlainTransport() : sockfd(-1) {}
+		~MQTTPlainTransport() { Close(); }
+		MQTTPlainTransport(MQTTPlainTransport&) = delete;
+		MQTTPlainTransport& operator=(MQTTPlainTransport&) = delete;
+		inline bool Connect(const std::string &host, uint32_t port)
+		{
+			struct sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			if (inet_pton(AF_INET, host.c_str(), &address.sin_addr.s_addr) <= 0)
+			{
+				return false;
+			}
+			Close();
+			sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (sockfd == -1)
+			{
+				return false;
+			}
+			if (connect(sockfd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1)
+			{
+				Close();
+				return false;
+			}
+			//Frames are written whole, there is nothing for Nagle to coalesce
+			int enable = 1;
+			setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+			return true;
+		}
+		//Returns once every byte has been written
+		inline bool Send(const uint8_t *data, uint32_t dataLength)
+		{
+			while (dataLength > 0)
+			{
+				ssize_t sent = send(sockfd, data, dataLength, MSG_NOSIGNAL);
+				if (sent < 0)
+				{
+					if (errno == EINTR)
+					{
+						continue;
+					}
+					return false;
+				}
+				data += sent;
+				dataLength -= static_cast<uint32_t>(sent);
+			}
+			return true;
+		}
+		//Returns the number of bytes read, 0 when nothing arrived within timeout ms and -1 once the connection is closed
+		inline int32_t Receive(uint8_t *buffer, uint32_t bufferLength, int32_t timeout)
+		{
+			struct pollfd pollEvent = { sockfd, POLLIN, 0 };
+			int ready = poll(&pollEvent, 1, timeout);
+			if (ready == 0 || (ready < 0 && errno == EINTR))
+			{
+				return 0;
+			}
+			if (ready < 0)
+			{
+				return -1;
+			}
+			ssize_t received = recv(sockfd, buffer, bufferLength, 0);
+			if (received < 0 && (errno == EINTR || errno == EAGAIN))
+			{
+				return 0;
+			}
+			return (received > 0) ? static_cast<int32_t>(received) : -1;
+		}
+		inline void Close()
+		{
+			if (sockfd != -1)
+			{
+				close(sockfd);
+				sockfd = -1;
+			}
+		}
+	private:
+		int sockfd;
+};
+
+#endif
+#endif //_MQTT_TRANSPORT_H_
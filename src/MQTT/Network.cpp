@@ -1,119 +1,294 @@
 #include "Network.h"
 #include <iostream>
+#include <string.h>
 #include "Utils.h"
 
-Network::Network() : connectedCallback(nullptr), disconnectedCallback(nullptr), receivedCallback(nullptr), sentCallback(nullptr), socket(nullptr)
+Network::Network() : busyPollEnabled(false), busyPollCpu(-1), unsentLimit(0)
 {
 }
 
+Network::~Network()
+{
+	std::shared_ptr<Connection> connection = std::atomic_load(&this->connection);
+	if (connection && (connection->state.exchange(Connection::State::LOST) != Connection::State::LOST))
+	{
+		connection->socket->Close();
+	}
+}
+
 void Network::Connect(std::string host, uint32_t port, bool security)
 {
-	if (security)
+	std::lock_guard<std::mutex> lock(connectMutex);
+	std::shared_ptr<Connection> previous = std::atomic_load(&connection);
+	if (previous)
+	{
+		Lose(previous, false);
+	}
+	std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+	connection->state = Connection::State::CONNECTING;
+	connection->bufferIndex = 0;
+	connection->readDone = false;
+	if (socketFactory)
+	{
+		connection->socket = socketFactory();
+	}
+	else if (host.compare(0, strlen(UNIX_SOCKET_SCHEME), UNIX_SOCKET_SCHEME) == 0)
+	{
+		//unix:///path, the broker is on this host and nothing leaves it so security is not used
+		connection->socket = std::make_shared<UnixSocket>();
+		host = host.substr(strlen(UNIX_SOCKET_SCHEME));
+	}
+	else if (security)
+	{
+		connection->socket = std::make_shared<SSLSocket>();
+	}
+	else if (busyPollEnabled)
 	{
-		socket = make_unique<SSLSocket>();
+		connection->socket = std::make_shared<BusyPollSocket>(busyPollCpu);
 	}
 	else
 	{
-		socket = make_unique<TCPSocket>();
+		connection->socket = std::make_shared<TCPSocket>();
 	}
-	if (socket->Initialize())
-	{	
-		socket->Connect(host, port, std::bind(&Network::ConnectHandler, this, std::placeholders::_1));
+	std::atomic_store(&this->connection, connection);
+	if (connection->socket->Initialize())
+	{
+		std::weak_ptr<Network> network = shared_from_this();
+		connection->socket->Connect(host, port, [network, connection](bool error)
+		{
+			std::shared_ptr<Network> self = network.lock();
+			if (self)
+			{
+				self->ConnectHandler(connection, error);
+			}
+		});
 	}
 }
 
 void Network::Disconnect()
 {
-	socket->Close();
-	if (disconnectedCallback)
+	std::shared_ptr<Connection> connection = std::atomic_load(&this->connection);
+	if (connection)
+	{
+		Lose(connection, false);
+	}
+}
+
+void Network::WriteData(std::unique_ptr<uint8_t[]> data, std::size_t dataLength, std::function<void(bool)> writtenCallback)
+{
+	std::shared_ptr<Connection> connection = std::atomic_load(&this->connection);
+	if (!connection || (connection->state == Connection::State::LOST))
+	{
+		//Not connected, or replaying a capture: there is no peer to answer
+		if (writtenCallback)
+		{
+			writtenCallback(FAIL);
+		}
+		return;
+	}
+	std::shared_ptr<MQTTCaptureWriter> capture = std::atomic_load(&this->capture);
+	if (capture)
+	{
+		capture->Record(MQTT_CAPTURE_OUTBOUND, data.get(), dataLength);
+	}
+	connection->socket->WriteData(std::move(data), dataLength, BindWriteHandler(connection, writtenCallback));
+}
+
+bool Network::WriteSegments(const std::vector<DataSegment> &segments)
+{
+	std::shared_ptr<Connection> connection = std::atomic_load(&this->connection);
+	if (!connection || (connection->state == Connection::State::LOST))
 	{
-		disconnectedCallback();
+		return false;
 	}
+	std::shared_ptr<MQTTCaptureWriter> capture = std::atomic_load(&this->capture);
+	if (capture)
+	{
+		capture->Record(MQTT_CAPTURE_OUTBOUND, segments, 0);
+	}
+	std::size_t bytesTransferred;
+	bool success = connection->socket->WriteSegments(segments, bytesTransferred);
+	WriteHandler(connection, success ? SUCCESS : FAIL, bytesTransferred, nullptr);
+	return success;
 }
 
-void Network::WriteData(uint8_t *data, std::size_t dataLength)
+void Network::WriteFile(std::unique_ptr<uint8_t[]> header, std::size_t headerLength, int fd, uint64_t offset, uint64_t length, bool closeFile, std::function<void(bool)> writtenCallback)
 {
-	socket->WriteData(data, dataLength, std::bind(&Network::WriteHandler, this, std::placeholders::_1, std::placeholders::_2));
+	std::shared_ptr<Connection> connection = std::atomic_load(&this->connection);
+	if (!connection || (connection->state == Connection::State::LOST))
+	{
+		if (closeFile)
+		{
+			CloseFile(fd);
+		}
+		if (writtenCallback)
+		{
+			writtenCallback(FAIL);
+		}
+		return;
+	}
+	std::shared_ptr<MQTTCaptureWriter> capture = std::atomic_load(&this->capture);
+	if (capture)
+	{
+		//The file content is not copied into the capture, only the publish header is kept
+		capture->Record(MQTT_CAPTURE_OUTBOUND, std::vector<DataSegment>{ { header.get(), headerLength } }, MQTT_CAPTURE_FLAG_TRUNCATED);
+	}
+	std::function<void(bool, std::size_t)> writeHandler = BindWriteHandler(connection, writtenCallback);
+	connection->socket->WriteFile(std::move(header), headerLength, fd, offset, length, [writeHandler, fd, closeFile](bool error, std::size_t bytesTransferred)
+	{
+		if (closeFile)
+		{
+			CloseFile(fd);
+		}
+		writeHandler(error, bytesTransferred);
+	});
 }
 
 void Network::RegisterConnectedCallback(std::function<void()> connectedCallback)
 {
-	this->connectedCallback = connectedCallback;
+	std::atomic_store(&this->connectedCallback, connectedCallback ? std::make_shared<std::function<void()>>(connectedCallback) : std::shared_ptr<std::function<void()>>());
 }
 
 void Network::RegisterDisconnectedCallback(std::function<void()> disconnectedCallback)
 {
-	this->disconnectedCallback = disconnectedCallback;
+	std::atomic_store(&this->disconnectedCallback, disconnectedCallback ? std::make_shared<std::function<void()>>(disconnectedCallback) : std::shared_ptr<std::function<void()>>());
 }
 
 void Network::RegisterReceivedCallback(std::function<void(uint8_t*, std::size_t)> receivedCallback)
 {
-	this->receivedCallback = receivedCallback;
+	std::atomic_store(&this->receivedCallback, receivedCallback ? std::make_shared<std::function<void(uint8_t*, std::size_t)>>(receivedCallback) : std::shared_ptr<std::function<void(uint8_t*, std::size_t)>>());
 }
 
 void Network::RegisterSentCallback(std::function<void(std::size_t)> sentCallback)
 {
-	this->sentCallback = sentCallback;
+	std::atomic_store(&this->sentCallback, sentCallback ? std::make_shared<std::function<void(std::size_t)>>(sentCallback) : std::shared_ptr<std::function<void(std::size_t)>>());
+}
+
+void Network::SetBusyPoll(bool enabled, int cpu)
+{
+	std::lock_guard<std::mutex> lock(connectMutex);
+	busyPollEnabled = enabled;
+	busyPollCpu = cpu;
+}
+
+void Network::SetUnsentLimit(uint32_t bytes)
+{
+	unsentLimit = bytes;
 }
 
-void Network::ConnectHandler(bool error)
+void Network::SetSocketFactory(std::function<std::unique_ptr<Socket>()> socketFactory)
+{
+	std::lock_guard<std::mutex> lock(connectMutex);
+	this->socketFactory = socketFactory;
+}
+
+void Network::SetCapture(std::shared_ptr<MQTTCaptureWriter> capture)
+{
+	std::atomic_store(&this->capture, capture);
+}
+
+void Network::ConnectHandler(std::shared_ptr<Connection> connection, bool error)
 {
 	if (!error)
 	{
+		Connection::State connecting = Connection::State::CONNECTING;
+		if (!connection->state.compare_exchange_strong(connecting, Connection::State::CONNECTED))
+		{
+			//Dropped while connecting, by Disconnect or a newer Connect
+			connection->socket->Close();
+			return;
+		}
+		if (unsentLimit > 0)
+		{
+			connection->socket->SetUnsentLimit(unsentLimit);
+		}
+		std::shared_ptr<std::function<void()>> connectedCallback = std::atomic_load(&this->connectedCallback);
 		if (connectedCallback)
 		{
-			connectedCallback();
+			(*connectedCallback)();
 		}
-		bufferIndex = 0;
-		readDone = false;
-		socket->ReadData(readBuffer, 1, std::bind(&Network::ReadHandler, this, std::placeholders::_1, std::placeholders::_2));
+		connection->bufferIndex = 0;
+		connection->readDone = false;
+		Read(connection, 1);
 	}
 	else
 	{
 		LOGI("Connect error");
-		Disconnect();
+		Lose(connection, true);
 	}
 }
 
-void Network::WriteHandler(bool error, std::size_t bytesTransferred)
+void Network::WriteHandler(std::shared_ptr<Connection> connection, bool error, std::size_t bytesTransferred, std::function<void(bool)> writtenCallback)
 {
+	if (connection->state == Connection::State::LOST)
+	{
+		//Dropped meanwhile, the frame may not have reached the peer
+		if (writtenCallback)
+		{
+			writtenCallback(FAIL);
+		}
+		return;
+	}
 	if (!error)
 	{
+		std::shared_ptr<std::function<void(std::size_t)>> sentCallback = std::atomic_load(&this->sentCallback);
 		if (sentCallback)
 		{
-			sentCallback(bytesTransferred);
+			(*sentCallback)(bytesTransferred);
+		}
+		if (writtenCallback)
+		{
+			writtenCallback(SUCCESS);
 		}
 	}
 	else
 	{
 		LOGI("Write data error");
-		Disconnect();
+		Lose(connection, true);
+		if (writtenCallback)
+		{
+			writtenCallback(FAIL);
+		}
 	}
 }
 
-void Network::ReadHandler(bool error, std::size_t bytesTransferred)
+void Network::ReadHandler(std::shared_ptr<Connection> connection, bool error, std::size_t bytesTransferred)
 {
+	if (connection->state == Connection::State::LOST)
+	{
+		//The read of a dropped socket, woken up by its close
+		return;
+	}
 	if (!error)
 	{
-		if (readDone)
+		std::shared_ptr<MQTTCaptureWriter> capture = std::atomic_load(&this->capture);
+		std::shared_ptr<std::function<void(uint8_t*, std::size_t)>> receivedCallback = std::atomic_load(&this->receivedCallback);
+		uint8_t *readBuffer = connection->readBuffer;
+		uint8_t *buffer = connection->buffer;
+		uint32_t &bufferIndex = connection->bufferIndex;
+		if (connection->readDone)
 		{
 			// Read variable header and payload done. Send it to receivedCallback
 			for (std::size_t i = 0; i < bytesTransferred; ++i)
 			{
 				buffer[bufferIndex++] = readBuffer[i];
 			}
+			if (capture)
+			{
+				capture->Record(MQTT_CAPTURE_INBOUND, buffer, bufferIndex);
+			}
 			if (receivedCallback)
 			{
-				receivedCallback(buffer, bufferIndex);
+				(*receivedCallback)(buffer, bufferIndex);
 			}
 			bufferIndex = 0;
-			readDone = false;
-			socket->ReadData(readBuffer, 1, std::bind(&Network::ReadHandler, this, std::placeholders::_1, std::placeholders::_2));
+			connection->readDone = false;
+			Read(connection, 1);
 		}
 		else if (!bufferIndex)
 		{
 			buffer[bufferIndex++] = readBuffer[0]; 
-			socket->ReadData(readBuffer, 1, std::bind(&Network::ReadHandler, this, std::placeholders::_1, std::placeholders::_2));
+			Read(connection, 1);
 		}
 		else
 		{
@@ -121,17 +296,21 @@ void Network::ReadHandler(bool error, std::size_t bytesTransferred)
 			if (readBuffer[0] == 0)
 			{
 				//Some MQTT message has no variable header and payload
+				if (capture)
+				{
+					capture->Record(MQTT_CAPTURE_INBOUND, buffer, bufferIndex);
+				}
 				if (receivedCallback)
 				{
-					receivedCallback(buffer, bufferIndex);
+					(*receivedCallback)(buffer, bufferIndex);
 				}
 				bufferIndex = 0;
-				socket->ReadData(readBuffer, 1, std::bind(&Network::ReadHandler, this, std::placeholders::_1, std::placeholders::_2));
+				Read(connection, 1);
 			}
 			else if ((readBuffer[0] & 0x80) != 0x80)
 			{
 				//Reading reamaining length bytes done
-				readDone = true;
+				connection->readDone = true;
 				uint32_t multiplier = 1;
 				uint32_t remainingLength = 0;
 				for (uint8_t i = 1; i < bufferIndex; ++i)
@@ -139,19 +318,77 @@ void Network::ReadHandler(bool error, std::size_t bytesTransferred)
 					remainingLength += (buffer[i] & 127) * multiplier;
 					multiplier *= 128;
 				}
+				if (remainingLength > MQTT_MAX_MESSAGE_LENGTH - bufferIndex)
+				{
+					//Longer than the frame buffer, the rest of the stream cannot be parsed either
+					LOGI("Frame of %u bytes is longer than the receive buffer", static_cast<unsigned int>(remainingLength + bufferIndex));
+					Lose(connection, true);
+					return;
+				}
 				//Try to read variable header and payload
-				socket->ReadData(readBuffer, remainingLength, std::bind(&Network::ReadHandler, this, std::placeholders::_1, std::placeholders::_2));
+				Read(connection, remainingLength);
+			}
+			else if (bufferIndex == 5)
+			{
+				LOGI("Malformed remaining length");
+				Lose(connection, true);
 			}
 			else
 			{
 				//Continue read remaining length bytes
-				socket->ReadData(readBuffer, 1, std::bind(&Network::ReadHandler, this, std::placeholders::_1, std::placeholders::_2));
+				Read(connection, 1);
 			}
 		}
 	}
 	else
 	{		
 		LOGI("Read data error %d", static_cast<int>(bytesTransferred));
-		Disconnect();
+		Lose(connection, true);
+	}
+}
+
+void Network::Read(std::shared_ptr<Connection> connection, std::size_t bytes)
+{
+	std::weak_ptr<Network> network = shared_from_this();
+	connection->socket->ReadData(connection->readBuffer, bytes, [network, connection](bool error, std::size_t bytesTransferred)
+	{
+		std::shared_ptr<Network> self = network.lock();
+		if (self)
+		{
+			self->ReadHandler(connection, error, bytesTransferred);
+		}
+	});
+}
+
+std::function<void(bool, std::size_t)> Network::BindWriteHandler(std::shared_ptr<Connection> connection, std::function<void(bool)> writtenCallback)
+{
+	std::weak_ptr<Network> network = shared_from_this();
+	return [network, connection, writtenCallback](bool error, std::size_t bytesTransferred)
+	{
+		std::shared_ptr<Network> self = network.lock();
+		if (self)
+		{
+			self->WriteHandler(connection, error, bytesTransferred, writtenCallback);
+		}
+		else if (writtenCallback)
+		{
+			writtenCallback(FAIL);
+		}
+	};
+}
+
+void Network::Lose(std::shared_ptr<Connection> connection, bool notifyPending)
+{
+	Connection::State state = connection->state.exchange(Connection::State::LOST);
+	if (state == Connection::State::LOST)
+	{
+		return;
+	}
+	//Only wakes up the I/O threads of the socket, its descriptor is released with the socket once they let go of it
+	connection->socket->Close();
+	std::shared_ptr<std::function<void()>> disconnectedCallback = std::atomic_load(&this->disconnectedCallback);
+	if (((state == Connection::State::CONNECTED) || notifyPending) && disconnectedCallback)
+	{
+		(*disconnectedCallback)();
 	}
 }
@@ -1,38 +1,79 @@
 #ifndef _NETWORK_H_
 #define _NETWORK_H_
 #include <stdint.h>
+#include <memory>
+#include <atomic>
+#include <mutex>
 #include "TCPSocket.h"
 #include "SSLSocket.h"
+#include "UnixSocket.h"
+#include "BusyPollSocket.h"
 #include "MQTTConfig.h"
 #include "Utils.h"
+#include "MQTTCapture.h"
 
-class Network
+//Connection to the broker, one socket at a time. Connect drops the current socket before opening the next one, and the callbacks of a
+//dropped socket still running on its I/O threads are ignored: the disconnected callback fires exactly once per connection lost.
+//Create it with std::make_shared, the I/O threads only hold it weakly
+class Network : public std::enable_shared_from_this<Network>
 {
 	public:
 		Network();
-		~Network() = default;
+		~Network();
 		Network(Network&) = delete;
 		Network& operator=(Network&) = delete;
 		void Connect(std::string host, uint32_t port, bool security);
 		void Disconnect();
-		void WriteData(uint8_t *data, std::size_t dataLength);
+		//writtenCallback, if any, is called with SUCCESS once the whole frame is handed to the kernel, with FAIL when it never will be
+		void WriteData(std::unique_ptr<uint8_t[]> data, std::size_t dataLength, std::function<void(bool)> writtenCallback = nullptr);
+		//Returns once written, false when the frame did not reach the kernel
+		bool WriteSegments(const std::vector<DataSegment> &segments);
+		void WriteFile(std::unique_ptr<uint8_t[]> header, std::size_t headerLength, int fd, uint64_t offset, uint64_t length, bool closeFile, std::function<void(bool)> writtenCallback = nullptr);
+		//Pass nullptr to clear a callback, the I/O threads stop calling it but one already running is not waited for
 		void RegisterConnectedCallback(std::function<void()> connectedCallback);
 		void RegisterDisconnectedCallback(std::function<void()> disconnectedCallback);
 		void RegisterReceivedCallback(std::function<void(uint8_t*, std::size_t)> receivedCallback);
 		void RegisterSentCallback(std::function<void(std::size_t)> sentCallback);
+		//Serve the next plain TCP connection from one spinning I/O thread pinned to cpu (-1 leaves it unpinned). Call before Connect
+		void SetBusyPoll(bool enabled, int cpu);
+		//Make the sockets of the next connections with socketFactory instead of picking one from the host and security. Pass nullptr to go back
+		void SetSocketFactory(std::function<std::unique_ptr<Socket>()> socketFactory);
+		//Bound the bytes the kernel holds unsent on the next connections, 0 leaves the kernel default
+		void SetUnsentLimit(uint32_t bytes);
+		//Record every frame read or written from now on. Pass nullptr to stop recording
+		void SetCapture(std::shared_ptr<MQTTCaptureWriter> capture);
 	private:
-		void ConnectHandler(bool error);
-		void WriteHandler(bool error, std::size_t bytesTransferred);
-		void ReadHandler(bool error, std::size_t bytesTransferred);	
-	private:	
-		std::unique_ptr<Socket> socket;
-		std::function<void()> connectedCallback;
-		std::function<void()> disconnectedCallback;
-		std::function<void(uint8_t*, std::size_t)> receivedCallback;
-		std::function<void(std::size_t)> sentCallback;
-		uint8_t readBuffer[MQTT_MAX_MESSAGE_LENGTH];
-		uint8_t buffer[MQTT_MAX_MESSAGE_LENGTH];
-		uint32_t bufferIndex;
-		bool readDone;
+		//One socket from Connect until it is lost. Reads go to buffers of its own, a dropped socket may still complete a read
+		struct Connection
+		{
+			enum class State { CONNECTING, CONNECTED, LOST };
+			std::shared_ptr<Socket> socket;
+			std::atomic<State> state;
+			uint8_t readBuffer[MQTT_MAX_MESSAGE_LENGTH];
+			uint8_t buffer[MQTT_MAX_MESSAGE_LENGTH];
+			uint32_t bufferIndex;
+			bool readDone;
+		};
+		void ConnectHandler(std::shared_ptr<Connection> connection, bool error);
+		void WriteHandler(std::shared_ptr<Connection> connection, bool error, std::size_t bytesTransferred, std::function<void(bool)> writtenCallback);
+		void ReadHandler(std::shared_ptr<Connection> connection, bool error, std::size_t bytesTransferred);
+		void Read(std::shared_ptr<Connection> connection, std::size_t bytes);
+		std::function<void(bool, std::size_t)> BindWriteHandler(std::shared_ptr<Connection> connection, std::function<void(bool)> writtenCallback);
+		//Closes the socket of connection and, the first time only, fires the disconnected callback. A connect still pending
+		//only counts as lost when notifyPending is set, when it failed rather than being given up by Disconnect or a newer Connect
+		void Lose(std::shared_ptr<Connection> connection, bool notifyPending);
+	private:
+		std::mutex connectMutex;
+		std::shared_ptr<Connection> connection;
+		//Swapped atomically, a callback may be registered again or cleared while the I/O threads run
+		std::shared_ptr<std::function<void()>> connectedCallback;
+		std::shared_ptr<std::function<void()>> disconnectedCallback;
+		std::shared_ptr<std::function<void(uint8_t*, std::size_t)>> receivedCallback;
+		std::shared_ptr<std::function<void(std::size_t)>> sentCallback;
+		std::function<std::unique_ptr<Socket>()> socketFactory;
+		std::shared_ptr<MQTTCaptureWriter> capture;
+		bool busyPollEnabled;
+		int busyPollCpu;
+		std::atomic<uint32_t> unsentLimit;
 };
 #endif //_NETWORK_H_
\ No newline at end of file
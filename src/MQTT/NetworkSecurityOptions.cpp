@@ -4,4 +4,5 @@ std::string NetworkSecurityOptions::certificateAuthority = std::string();
 std::string NetworkSecurityOptions::clientCertificate = std::string();
 std::string NetworkSecurityOptions::clientPrivateKey = std::string();
 std::string NetworkSecurityOptions::clientPrivateKeyPassword = std::string();
-bool NetworkSecurityOptions::enableServerCertificate = true;
\ No newline at end of file
+bool NetworkSecurityOptions::enableServerCertificate = true;
+bool NetworkSecurityOptions::enableKernelTLS = false;
\ No newline at end of file
@@ -18,6 +18,8 @@ class NetworkSecurityOptions
 		static std::string clientPrivateKeyPassword;
 		//Enable verification of the server certificate 
 		static bool enableServerCertificate;
+		//Switch the connection to kernel TLS after the handshake so that records are encrypted by the kernel. Falls back to OpenSSL when the cipher or kernel does not support it
+		static bool enableKernelTLS;
 };
 
 #endif //_NETWORK_SECURITY_OPTIONS_H_
\ No newline at end of file
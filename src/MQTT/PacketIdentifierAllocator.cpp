@@ -0,0 +1,89 @@
+#include "PacketIdentifierAllocator.h"
+#include <string.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static inline uint32_t FindFirstSet(uint64_t word)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, static_cast<uint32_t>(word)))
+	{
+		return index;
+	}
+	_BitScanForward(&index, static_cast<uint32_t>(word >> 32));
+	return index + 32;
+#else
+	return static_cast<uint32_t>(__builtin_ctzll(word));
+#endif
+}
+
+PacketIdentifierAllocator::PacketIdentifierAllocator()
+{
+	Reset();
+}
+
+uint16_t PacketIdentifierAllocator::Allocate()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint32_t wordIndex = cursor / 64;
+	//Only look at the bits after the cursor in its own word, the bits before it are reached again after wrapping around
+	uint64_t freeBits = ~words[wordIndex] & (~0ULL << (cursor % 64));
+	for (uint32_t i = 0; i <= PACKET_IDENTIFIER_WORDS; ++i)
+	{
+		if (freeBits != 0)
+		{
+			uint32_t bit = FindFirstSet(freeBits);
+			words[wordIndex] |= (1ULL << bit);
+			++inUseCount;
+			uint32_t packetIdentifier = wordIndex * 64 + bit;
+			cursor = (packetIdentifier + 1) % 65536;
+			return static_cast<uint16_t>(packetIdentifier);
+		}
+		wordIndex = (wordIndex + 1) % PACKET_IDENTIFIER_WORDS;
+		freeBits = ~words[wordIndex];
+	}
+	return 0;
+}
+
+void PacketIdentifierAllocator::Release(uint16_t packetIdentifier)
+{
+	if (packetIdentifier == 0)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t mask = 1ULL << (packetIdentifier % 64);
+	if (words[packetIdentifier / 64] & mask)
+	{
+		words[packetIdentifier / 64] &= ~mask;
+		--inUseCount;
+	}
+}
+
+bool PacketIdentifierAllocator::IsInUse(uint16_t packetIdentifier)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return (words[packetIdentifier / 64] & (1ULL << (packetIdentifier % 64))) != 0;
+}
+
+uint32_t PacketIdentifierAllocator::GetInUseCount()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return inUseCount;
+}
+
+void PacketIdentifierAllocator::Reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	memset(words, 0, sizeof(words));
+	//Packet identifier 0 is not a valid identifier, keep it permanently reserved
+	words[0] = 1;
+	cursor = 1;
+	inUseCount = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _PACKET_IDENTIFIER_ALLOCATOR_H_
+#define _PACKET_IDENTIFIER_ALLOCATOR_H_
+#include <stdint.h>
+#include <mutex>
+
+#define PACKET_IDENTIFIER_WORDS (65536 / 64)
+
+//Tracks the packet identifiers of one connection in a 65536 bit bitmap so an identifier is never reused while its packet is unacknowledged.
+//Allocation scans a word at a time from a rolling cursor, which keeps recently released identifiers cold and makes allocate and release O(1) amortized
+class PacketIdentifierAllocator
+{
+	public:
+		PacketIdentifierAllocator();
+		~PacketIdentifierAllocator() = default;
+		PacketIdentifierAllocator(PacketIdentifierAllocator&) = delete;
+		PacketIdentifierAllocator& operator=(PacketIdentifierAllocator&) = delete;
+		//Returns 0 when all 65535 identifiers are in use
+		uint16_t Allocate();
+		void Release(uint16_t packetIdentifier);
+		bool IsInUse(uint16_t packetIdentifier);
+		uint32_t GetInUseCount();
+		void Reset();
+	private:
+		std::mutex mutex;
+		uint64_t words[PACKET_IDENTIFIER_WORDS];
+		uint32_t cursor;
+		uint32_t inUseCount;
+};
+
+#endif //_PACKET_IDENTIFIER_ALLOCATOR_H_
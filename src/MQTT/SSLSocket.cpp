@@ -3,7 +3,7 @@
 #include "Utils.h"
 #include "NetworkSecurityOptions.h"
 
-SSLSocket::SSLSocket() :sslContext(nullptr), ssl(nullptr)
+SSLSocket::SSLSocket() :sslContext(nullptr), ssl(nullptr), kernelTLSSend(false), kernelTLSReceive(false)
 {
 }
 
@@ -112,6 +112,15 @@ bool SSLSocket::Initialize()
 		return false;
 	}
 	SSL_CTX_set_mode(sslContext, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+	if (NetworkSecurityOptions::enableKernelTLS)
+	{
+#if defined(SSL_OP_ENABLE_KTLS)
+		//OpenSSL installs the "tls" TCP ULP and pushes the session keys to the kernel once SSL_connect succeeds
+		SSL_CTX_set_options(sslContext, SSL_OP_ENABLE_KTLS);
+#else
+		LOGI("Kernel TLS is not supported by this OpenSSL version");
+#endif
+	}
 	if (NetworkSecurityOptions::enableServerCertificate)
 	{
 		SSL_CTX_set_verify(sslContext, SSL_VERIFY_PEER, nullptr);
@@ -206,6 +215,7 @@ void SSLSocket::Connect(std::string host, uint32_t port, std::function<void(bool
 		}       
 		LOGI("SSL connection using %s\n", SSL_get_cipher(ssl));
 		LOGI("Connected to server");
+		EnableKernelTLS();
 		//Set socket nonblocking
 		if (!SetSocketBlockingEnabled(false))
 		{
@@ -224,68 +234,60 @@ void SSLSocket::Connect(std::string host, uint32_t port, std::function<void(bool
 	}).detach();
 }
 
-void SSLSocket::WriteData(uint8_t *data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback)
+bool SSLSocket::SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred)
 {
-	if (dataLength == 0)
+	if (kernelTLSSend)
 	{
-		return;
+		//The kernel encrypts the records so the plaintext goes straight to send() without passing through OpenSSL
+		return Socket::SendData(data, dataLength, bytesTransferred);
 	}
-	std::thread([&, data, dataLength, sentCallback]
+	fd_set writefds;
+	fd_set readfds;
+	bool writeBlockedOnRead = false;
+	std::size_t bytesLeft = dataLength;
+	int written;
+	int activity;
+	bytesTransferred = 0;
+	while (bytesTransferred < dataLength)
 	{
-		fd_set writefds;
-		fd_set readfds;
-		bool writeBlockedOnRead = false;
-		std::size_t total = 0;
-		std::size_t bytesLeft = dataLength;
-		std::size_t bytesTransferred;
-		int activity;
-		while (total < dataLength)
+		FD_ZERO(&writefds);
+		FD_ZERO(&readfds);
+		FD_SET(sockfd, &writefds);
+		FD_SET(sockfd, &readfds);
+		activity = select(sockfd + 1, &readfds, &writefds, nullptr, nullptr);
+		if ((activity < 0) && (errno != EINTR/*A signal was caught*/))
 		{
-			FD_ZERO(&writefds);
-			FD_ZERO(&readfds);
-			FD_SET(sockfd, &writefds);
-			FD_SET(sockfd, &readfds);
-			activity = select(sockfd + 1, &readfds, &writefds, nullptr, nullptr);
-			if ((activity < 0) && (errno != EINTR/*A signal was caught*/))
-			{
-				LOGI("Select error");
-				if (sentCallback)
-				{
-					sentCallback(FAIL, 0);
-				}
-				return;
-			}
-			if ((FD_ISSET(sockfd, &writefds)) || (writeBlockedOnRead && FD_ISSET(sockfd, &readfds)))
-			{
-				writeBlockedOnRead = false;
-				bytesTransferred = SSL_write(ssl, (char*)data + total, bytesLeft);
-				switch (SSL_get_error(ssl, bytesTransferred))
-				{
-				case SSL_ERROR_NONE:
-					total += bytesTransferred;
-					bytesLeft -= bytesTransferred;
-					break;
-				case SSL_ERROR_WANT_WRITE:
-					break;
-				case SSL_ERROR_WANT_READ:
-					writeBlockedOnRead = true;
-					break;
-				default:
-					LOGI("SSL_write error");
-					LOGI("%s\n", ERR_error_string(ERR_get_error(), NULL));
-					if (sentCallback)
-					{
-						sentCallback(FAIL, total);
-					}
-					break;
-				}
-			}
+			LOGI("Select error");
+			return false;
 		}
-		if (sentCallback)
+		if ((FD_ISSET(sockfd, &writefds)) || (writeBlockedOnRead && FD_ISSET(sockfd, &readfds)))
 		{
-			sentCallback(SUCCESS, total);
+			writeBlockedOnRead = false;
+			written = SSL_write(ssl, (char*)data + bytesTransferred, static_cast<int>(bytesLeft));
+			switch (SSL_get_error(ssl, written))
+			{
+			case SSL_ERROR_NONE:
+				bytesTransferred += written;
+				bytesLeft -= written;
+				break;
+			case SSL_ERROR_WANT_WRITE:
+				break;
+			case SSL_ERROR_WANT_READ:
+				writeBlockedOnRead = true;
+				break;
+			default:
+				LOGI("SSL_write error");
+				LOGI("%s\n", ERR_error_string(ERR_get_error(), NULL));
+				return false;
+			}
 		}
-	}).detach();
+	}
+	return true;
+}
+
+bool SSLSocket::DirectWriteEnabled()
+{
+	return kernelTLSSend;
 }
 
 void SSLSocket::ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback)
@@ -374,8 +376,38 @@ void SSLSocket::ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(
 	}).detach();
 }
 
+void SSLSocket::EnableKernelTLS()
+{
+	kernelTLSSend = false;
+	kernelTLSReceive = false;
+	if (!NetworkSecurityOptions::enableKernelTLS)
+	{
+		return;
+	}
+#if defined(SSL_OP_ENABLE_KTLS)
+	kernelTLSSend = (BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0);
+	kernelTLSReceive = (BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0);
+#endif
+	if (kernelTLSSend)
+	{
+		LOGI("Kernel TLS send enabled");
+	}
+	else
+	{
+		LOGI("Kernel TLS send unavailable for %s, falling back to OpenSSL", SSL_get_cipher(ssl));
+	}
+	if (kernelTLSReceive)
+	{
+		//Records are decrypted by the kernel. SSL_read is kept on the receive side because it also handles the non application data records (alerts, session tickets) that a plain recv() would fail on
+		LOGI("Kernel TLS receive enabled");
+	}
+}
+
 void SSLSocket::Close()
 {
-	SSL_shutdown(ssl);
+	if (ssl)
+	{
+		SSL_shutdown(ssl);
+	}
 	Socket::Close();
 }
\ No newline at end of file
@@ -23,12 +23,18 @@ class SSLSocket : public Socket
 		~SSLSocket();
 		bool Initialize() override;
 		void Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback) override;
-		void WriteData(uint8_t *data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback) override;
 		void ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback) override;
 		void Close() override;
+protected:
+		bool SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred) override;
+		bool DirectWriteEnabled() override;
+private:
+		void EnableKernelTLS();
 private:
 		SSL_CTX *sslContext;
 		SSL *ssl;
+		bool kernelTLSSend;
+		bool kernelTLSReceive;
 };
 
 #endif //_SSL_SOCKET_H_
\ No newline at end of file
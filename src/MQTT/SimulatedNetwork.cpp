@@ -0,0 +1,353 @@
+#include "SimulatedNetwork.h"
+#include <string.h>
+#include <algorithm>
+#include "SimulatedSocket.h"
+#include "MQTTTopic.h"
+#include "Utils.h"
+
+SimulatedLink::SimulatedLink(MQTTVirtualClock &clock, std::mt19937_64 &random) : clock(clock), random(random), busyUntil(0), lastArrival(0), generation(0)
+{
+	memset(&profile, 0, sizeof(profile));
+	memset(&statistics, 0, sizeof(statistics));
+}
+
+void SimulatedLink::SetProfile(const SimulatedLinkProfile &profile)
+{
+	this->profile = profile;
+}
+
+void SimulatedLink::SetReceiver(std::function<void(const uint8_t*, std::size_t)> receiver)
+{
+	this->receiver = receiver;
+}
+
+void SimulatedLink::Send(const uint8_t *data, std::size_t length)
+{
+	std::chrono::nanoseconds now = clock.Now();
+	for (std::size_t offset = 0; offset < length; offset += SIMULATED_SEGMENT_LENGTH)
+	{
+		std::size_t segmentLength = std::min<std::size_t>(SIMULATED_SEGMENT_LENGTH, length - offset);
+		//Segments queue behind each other on the wire
+		std::chrono::nanoseconds start = std::max(now, busyUntil);
+		std::chrono::nanoseconds transmission(0);
+		if (profile.bandwidth > 0)
+		{
+			transmission = std::chrono::nanoseconds(segmentLength * 1000000000ULL / profile.bandwidth);
+		}
+		busyUntil = start + transmission;
+		std::chrono::nanoseconds arrival = busyUntil + profile.latency + Draw(profile.jitter);
+		std::uniform_real_distribution<double> probability(0.0, 1.0);
+		while ((profile.loss > 0) && (probability(random) < profile.loss))
+		{
+			arrival += profile.retransmitTimeout;
+			++statistics.retransmissions;
+		}
+		if ((profile.reorder > 0) && (probability(random) < profile.reorder))
+		{
+			arrival += Draw(profile.latency);
+		}
+		//The stream hands bytes over in order, a late segment holds back those behind it
+		arrival = std::max(arrival, lastArrival);
+		lastArrival = arrival;
+		statistics.bytes += segmentLength;
+		++statistics.segments;
+		std::shared_ptr<std::vector<uint8_t>> segment = std::make_shared<std::vector<uint8_t>>(data + offset, data + offset + segmentLength);
+		uint64_t segmentGeneration = generation;
+		clock.Schedule(arrival - now, [this, segment, segmentGeneration]()
+		{
+			if ((segmentGeneration == generation) && receiver)
+			{
+				receiver(segment->data(), segment->size());
+			}
+		});
+	}
+}
+
+void SimulatedLink::Reset()
+{
+	++generation;
+	busyUntil = std::chrono::nanoseconds(0);
+	lastArrival = std::chrono::nanoseconds(0);
+}
+
+SimulatedLinkStatistics SimulatedLink::GetStatistics()
+{
+	return statistics;
+}
+
+std::chrono::nanoseconds SimulatedLink::Draw(std::chrono::nanoseconds limit)
+{
+	if (limit.count() <= 0)
+	{
+		return std::chrono::nanoseconds(0);
+	}
+	std::uniform_int_distribution<int64_t> distribution(0, limit.count() - 1);
+	return std::chrono::nanoseconds(distribution(random));
+}
+
+SimulatedBroker::SimulatedBroker(SimulatedLink &downlink) : downlink(downlink), packetIdentifier(0), connectCount(0), pingCount(0), publishCount(0)
+{
+}
+
+void SimulatedBroker::Receive(const uint8_t *data, std::size_t length)
+{
+	pending.insert(pending.end(), data, data + length);
+	std::size_t offset = 0;
+	while (pending.size() - offset >= 2)
+	{
+		uint8_t *frame = pending.data() + offset;
+		std::size_t available = pending.size() - offset;
+		uint32_t remainingLength = 0;
+		uint32_t multiplier = 1;
+		std::size_t index = 1;
+		bool complete = false;
+		while ((index < available) && (index <= 4))
+		{
+			remainingLength += (frame[index] & 127) * multiplier;
+			multiplier *= 128;
+			if ((frame[index++] & 0x80) == 0)
+			{
+				complete = true;
+				break;
+			}
+		}
+		if (!complete || (available < index + remainingLength))
+		{
+			break;
+		}
+		HandleFrame(frame);
+		offset += index + remainingLength;
+	}
+	pending.erase(pending.begin(), pending.begin() + offset);
+}
+
+void SimulatedBroker::Reset()
+{
+	pending.clear();
+	subscriptions.clear();
+}
+
+uint64_t SimulatedBroker::GetConnectCount()
+{
+	return connectCount;
+}
+
+uint64_t SimulatedBroker::GetPingCount()
+{
+	return pingCount;
+}
+
+uint64_t SimulatedBroker::GetPublishCount()
+{
+	return publishCount;
+}
+
+void SimulatedBroker::HandleFrame(uint8_t *frame)
+{
+	switch (MQTTMessage::GetMessageType(frame))
+	{
+		case MQTTMessageType::MQTT_MSG_CONNECT:
+		{
+			++connectCount;
+			uint8_t connack[4] = { MQTT_MSG_CONNACK << 4, 2, 0, MQTT_CONNECTION_ACCEPTED };
+			Send(connack, sizeof(connack));
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBLISH:
+		{
+			++publishCount;
+			uint8_t qos = MQTTMessage::GetPublishQos(frame);
+			if (qos == 1)
+			{
+				Send(MQTTMessage::MQTTMessagePubAck(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			else if (qos == 2)
+			{
+				Send(MQTTMessage::MQTTMessagePubRec(MQTTMessage::GetPacketIdentifier(frame)));
+			}
+			std::string topicName = MQTTMessage::GetPublishTopicName(frame);
+			for (auto &subscription : subscriptions)
+			{
+				if (MQTTTopic::Matches(subscription.first, topicName))
+				{
+					uint8_t deliveryQos = std::min(qos, subscription.second);
+					uint16_t deliveryIdentifier = 0;
+					if (deliveryQos > 0)
+					{
+						deliveryIdentifier = ++packetIdentifier ? packetIdentifier : ++packetIdentifier;
+					}
+					Send(MQTTMessage::MQTTMessagePublish(topicName, MQTTMessage::GetPublishPayload(frame), false, deliveryQos, false, deliveryIdentifier));
+					break;
+				}
+			}
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBREC:
+		{
+			Send(MQTTMessage::MQTTMessagePubRel(MQTTMessage::GetPacketIdentifier(frame)));
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PUBREL:
+		{
+			Send(MQTTMessage::MQTTMessagePubComp(MQTTMessage::GetPacketIdentifier(frame)));
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_SUBSCRIBE:
+		case MQTTMessageType::MQTT_MSG_UNSUBSCRIBE:
+		{
+			bool subscribe = MQTTMessage::GetMessageType(frame) == MQTT_MSG_SUBSCRIBE;
+			uint8_t remainingLengthBytes;
+			uint32_t remainingLength = MQTTMessage::GetRemainingLength(frame, remainingLengthBytes);
+			uint8_t *data = frame + 1 + remainingLengthBytes;
+			uint8_t *end = data + remainingLength;
+			std::vector<uint8_t> reply{ static_cast<uint8_t>((subscribe ? MQTT_MSG_SUBACK : MQTT_MSG_UNSUBACK) << 4), 0, data[0], data[1] };
+			for (data += 2; data + 2 <= end;)
+			{
+				uint16_t topicLength = static_cast<uint16_t>((data[0] << 8) | data[1]);
+				std::string topicFilter(reinterpret_cast<char*>(data + 2), topicLength);
+				data += 2 + topicLength;
+				if (subscribe)
+				{
+					uint8_t qos = *data++;
+					subscriptions.push_back(std::make_pair(topicFilter, qos));
+					reply.push_back(qos);
+				}
+				else
+				{
+					subscriptions.erase(std::remove_if(subscriptions.begin(), subscriptions.end(), [&topicFilter](const std::pair<std::string, uint8_t> &subscription)
+					{
+						return subscription.first == topicFilter;
+					}), subscriptions.end());
+				}
+			}
+			//Return codes of a long SUBACK need a longer remaining length
+			std::vector<uint8_t> length;
+			uint32_t value = static_cast<uint32_t>(reply.size() - 2);
+			do
+			{
+				uint8_t byte = value & 0x7F;
+				value >>= 7;
+				length.push_back(byte | (value > 0 ? 0x80 : 0));
+			} while (value > 0);
+			reply.erase(reply.begin() + 1);
+			reply.insert(reply.begin() + 1, length.begin(), length.end());
+			Send(reply.data(), reply.size());
+			break;
+		}
+		case MQTTMessageType::MQTT_MSG_PINGREQ:
+		{
+			++pingCount;
+			Send(MQTTMessage::MQTTMessagePingResp());
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void SimulatedBroker::Send(const uint8_t *data, std::size_t length)
+{
+	downlink.Send(data, length);
+}
+
+void SimulatedBroker::Send(std::unique_ptr<MQTTMessage> mqttMessage)
+{
+	//The link copies the bytes
+	Send(mqttMessage->GetMessageData(), mqttMessage->GetMessageLength());
+}
+
+SimulatedNetwork::SimulatedNetwork(MQTTVirtualClock &clock, uint64_t seed) : clock(clock), random(seed), uplink(clock, random), downlink(clock, random), broker(downlink), socket(nullptr)
+{
+	memset(&uplinkProfile, 0, sizeof(uplinkProfile));
+	uplink.SetReceiver(std::bind(&SimulatedBroker::Receive, &broker, std::placeholders::_1, std::placeholders::_2));
+	downlink.SetReceiver([this](const uint8_t *data, std::size_t length)
+	{
+		if (socket)
+		{
+			socket->Receive(data, length);
+		}
+	});
+}
+
+SimulatedNetwork::~SimulatedNetwork()
+{
+	if (socket)
+	{
+		socket->attached = false;
+	}
+	uplink.Reset();
+	downlink.Reset();
+}
+
+void SimulatedNetwork::SetProfile(const SimulatedLinkProfile &profile)
+{
+	SetProfile(profile, profile);
+}
+
+void SimulatedNetwork::SetProfile(const SimulatedLinkProfile &uplinkProfile, const SimulatedLinkProfile &downlinkProfile)
+{
+	this->uplinkProfile = uplinkProfile;
+	uplink.SetProfile(uplinkProfile);
+	downlink.SetProfile(downlinkProfile);
+}
+
+std::unique_ptr<Socket> SimulatedNetwork::CreateSocket()
+{
+	return make_unique<SimulatedSocket>(*this);
+}
+
+void SimulatedNetwork::Disconnect()
+{
+	SimulatedSocket *current = socket;
+	Detach(current);
+	if (current)
+	{
+		current->Fail();
+	}
+}
+
+MQTTVirtualClock& SimulatedNetwork::GetClock()
+{
+	return clock;
+}
+
+SimulatedBroker& SimulatedNetwork::GetBroker()
+{
+	return broker;
+}
+
+SimulatedLinkStatistics SimulatedNetwork::GetUplinkStatistics()
+{
+	return uplink.GetStatistics();
+}
+
+SimulatedLinkStatistics SimulatedNetwork::GetDownlinkStatistics()
+{
+	return downlink.GetStatistics();
+}
+
+void SimulatedNetwork::Attach(SimulatedSocket *socket)
+{
+	if (this->socket && (this->socket != socket))
+	{
+		//One connection at a time, a new one replaces the previous as a broker takes over a client ID
+		SimulatedSocket *previous = this->socket;
+		Detach(previous);
+		previous->Fail();
+	}
+	this->socket = socket;
+	socket->attached = true;
+}
+
+void SimulatedNetwork::Detach(SimulatedSocket *socket)
+{
+	if ((socket == nullptr) || (this->socket != socket))
+	{
+		return;
+	}
+	this->socket = nullptr;
+	socket->attached = false;
+	uplink.Reset();
+	downlink.Reset();
+	broker.Reset();
+}
@@ -0,0 +1,122 @@
+#ifndef _SIMULATED_NETWORK_H_
+#define _SIMULATED_NETWORK_H_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <functional>
+#include "MQTTClock.h"
+#include "Socket.h"
+#include "MQTTMessage.h"
+
+//Segments a write is cut into, each one is delayed, lost and reordered on its own
+#define SIMULATED_SEGMENT_LENGTH 1460
+
+struct SimulatedLinkProfile
+{
+	std::chrono::nanoseconds latency; //One way propagation delay
+	std::chrono::nanoseconds jitter; //Extra delay drawn uniformly below it
+	uint64_t bandwidth; //Bytes per second, 0 for unlimited
+	double loss; //Probability a transmission of a segment is lost, it is sent again retransmitTimeout later
+	double reorder; //Probability a segment is held back up to one more latency, later segments wait for it as TCP would
+	std::chrono::nanoseconds retransmitTimeout;
+};
+
+struct SimulatedLinkStatistics
+{
+	uint64_t bytes;
+	uint64_t segments;
+	uint64_t retransmissions;
+};
+
+//One direction of a simulated TCP connection. Bytes always arrive whole and in order: loss and reordering show up as the delay
+//a real stream would add while recovering from them
+class SimulatedLink
+{
+	public:
+		SimulatedLink(MQTTVirtualClock &clock, std::mt19937_64 &random);
+		SimulatedLink(SimulatedLink&) = delete;
+		SimulatedLink& operator=(SimulatedLink&) = delete;
+		void SetProfile(const SimulatedLinkProfile &profile);
+		void SetReceiver(std::function<void(const uint8_t*, std::size_t)> receiver);
+		void Send(const uint8_t *data, std::size_t length);
+		//Forget the bytes in flight, as when the connection is torn down
+		void Reset();
+		SimulatedLinkStatistics GetStatistics();
+	private:
+		std::chrono::nanoseconds Draw(std::chrono::nanoseconds limit);
+	private:
+		MQTTVirtualClock &clock;
+		std::mt19937_64 &random;
+		SimulatedLinkProfile profile;
+		std::function<void(const uint8_t*, std::size_t)> receiver;
+		std::chrono::nanoseconds busyUntil; //End of the transmission of the last segment
+		std::chrono::nanoseconds lastArrival;
+		uint64_t generation;
+		SimulatedLinkStatistics statistics;
+};
+
+//Broker at the far end of a simulated network: acknowledges connects, subscribes, unsubscribes, pings and publishes, and sends back
+//publishes matching the filters subscribed on the connection
+class SimulatedBroker
+{
+	public:
+		SimulatedBroker(SimulatedLink &downlink);
+		SimulatedBroker(SimulatedBroker&) = delete;
+		SimulatedBroker& operator=(SimulatedBroker&) = delete;
+		void Receive(const uint8_t *data, std::size_t length);
+		void Reset();
+		uint64_t GetConnectCount();
+		uint64_t GetPingCount();
+		uint64_t GetPublishCount();
+	private:
+		void HandleFrame(uint8_t *frame);
+		void Send(const uint8_t *data, std::size_t length);
+		void Send(std::unique_ptr<MQTTMessage> mqttMessage);
+	private:
+		SimulatedLink &downlink;
+		std::vector<uint8_t> pending;
+		std::vector<std::pair<std::string, uint8_t>> subscriptions;
+		uint16_t packetIdentifier;
+		uint64_t connectCount;
+		uint64_t pingCount;
+		uint64_t publishCount;
+};
+
+class SimulatedSocket;
+
+//A simulated link in each direction between one client socket and a SimulatedBroker, driven by a virtual clock.
+//Every random draw comes from one generator seeded here, so a run is the same for the same seed
+class SimulatedNetwork
+{
+	friend class SimulatedSocket;
+	public:
+		SimulatedNetwork(MQTTVirtualClock &clock, uint64_t seed);
+		~SimulatedNetwork();
+		SimulatedNetwork(SimulatedNetwork&) = delete;
+		SimulatedNetwork& operator=(SimulatedNetwork&) = delete;
+		void SetProfile(const SimulatedLinkProfile &profile);
+		void SetProfile(const SimulatedLinkProfile &uplinkProfile, const SimulatedLinkProfile &downlinkProfile);
+		//Socket factory for MQTTClient::SetSocketFactory
+		std::unique_ptr<Socket> CreateSocket();
+		//The broker side drops the connection, the client sees a read error
+		void Disconnect();
+		MQTTVirtualClock& GetClock();
+		SimulatedBroker& GetBroker();
+		SimulatedLinkStatistics GetUplinkStatistics();
+		SimulatedLinkStatistics GetDownlinkStatistics();
+	private:
+		void Attach(SimulatedSocket *socket);
+		void Detach(SimulatedSocket *socket);
+	private:
+		MQTTVirtualClock &clock;
+		std::mt19937_64 random;
+		SimulatedLink uplink;
+		SimulatedLink downlink;
+		SimulatedBroker broker;
+		SimulatedSocket *socket;
+		SimulatedLinkProfile uplinkProfile;
+};
+
+#endif //_SIMULATED_NETWORK_H_
@@ -0,0 +1,126 @@
+#include "SimulatedSocket.h"
+#include <string.h>
+#include "Utils.h"
+
+SimulatedSocket::SimulatedSocket(SimulatedNetwork &simulatedNetwork) : simulatedNetwork(simulatedNetwork), attached(false), connected(false), pumping(false), inboundOffset(0), readBuffer(nullptr), readLength(0)
+{
+}
+
+SimulatedSocket::~SimulatedSocket()
+{
+	simulatedNetwork.Detach(this);
+}
+
+void SimulatedSocket::Connect(std::string /*host*/, uint32_t /*port*/, std::function<void(bool)> connectedCallback)
+{
+	simulatedNetwork.Attach(this);
+	//The handshake takes a round trip before the first byte may be sent
+	simulatedNetwork.clock.Schedule(simulatedNetwork.uplinkProfile.latency * 2, [this, connectedCallback]()
+	{
+		if (!attached)
+		{
+			connectedCallback(FAIL);
+			return;
+		}
+		connected = true;
+		connectedCallback(SUCCESS);
+		Pump();
+	});
+}
+
+void SimulatedSocket::WriteData(std::unique_ptr<uint8_t[]> data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback)
+{
+	std::size_t bytesTransferred = 0;
+	bool success = SendData(data.get(), dataLength, bytesTransferred);
+	if (sentCallback)
+	{
+		sentCallback(success ? SUCCESS : FAIL, bytesTransferred);
+	}
+}
+
+void SimulatedSocket::WriteFile(std::unique_ptr<uint8_t[]> /*header*/, std::size_t /*headerLength*/, int /*fd*/, uint64_t /*offset*/, uint64_t /*length*/, std::function<void(bool, std::size_t)> sentCallback)
+{
+	LOGI("File bodies are not supported on a simulated socket");
+	if (sentCallback)
+	{
+		sentCallback(FAIL, 0);
+	}
+}
+
+void SimulatedSocket::ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback)
+{
+	readBuffer = buffer;
+	readLength = bytes;
+	readCallback = receivedCallback;
+	if (!attached)
+	{
+		Fail();
+		return;
+	}
+	//Called again from a read callback, the loop in Pump picks the read up
+	if (!pumping)
+	{
+		Pump();
+	}
+}
+
+void SimulatedSocket::Close()
+{
+	connected = false;
+	simulatedNetwork.Detach(this);
+	//The pending read callback holds the owner of this socket
+	std::function<void(bool, std::size_t)> receivedCallback;
+	receivedCallback.swap(readCallback);
+}
+
+bool SimulatedSocket::SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred)
+{
+	bytesTransferred = 0;
+	if (!attached || !connected)
+	{
+		return false;
+	}
+	simulatedNetwork.uplink.Send(data, dataLength);
+	bytesTransferred = dataLength;
+	return true;
+}
+
+void SimulatedSocket::Receive(const uint8_t *data, std::size_t length)
+{
+	inbound.insert(inbound.end(), data, data + length);
+	if (!pumping)
+	{
+		Pump();
+	}
+}
+
+void SimulatedSocket::Fail()
+{
+	connected = false;
+	std::function<void(bool, std::size_t)> receivedCallback;
+	receivedCallback.swap(readCallback);
+	if (receivedCallback)
+	{
+		receivedCallback(FAIL, 0);
+	}
+}
+
+void SimulatedSocket::Pump()
+{
+	pumping = true;
+	while (connected && readCallback && (inbound.size() - inboundOffset >= readLength))
+	{
+		memcpy(readBuffer, inbound.data() + inboundOffset, readLength);
+		inboundOffset += readLength;
+		std::size_t bytes = readLength;
+		std::function<void(bool, std::size_t)> receivedCallback;
+		receivedCallback.swap(readCallback);
+		receivedCallback(SUCCESS, bytes);
+	}
+	if (inboundOffset == inbound.size())
+	{
+		inbound.clear();
+		inboundOffset = 0;
+	}
+	pumping = false;
+}
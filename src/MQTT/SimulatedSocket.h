@@ -0,0 +1,39 @@
+#ifndef _SIMULATED_SOCKET_H_
+#define _SIMULATED_SOCKET_H_
+#include <vector>
+#include "Socket.h"
+#include "SimulatedNetwork.h"
+
+//In memory socket connected to the broker of a SimulatedNetwork. Nothing runs on threads of its own: writes go to the link on the
+//calling thread and reads complete on the thread advancing the virtual clock
+class SimulatedSocket : public Socket
+{
+	friend class SimulatedNetwork;
+	public:
+		SimulatedSocket(SimulatedNetwork &simulatedNetwork);
+		~SimulatedSocket();
+		bool Initialize() override { return true; };
+		void Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback) override;
+		void WriteData(std::unique_ptr<uint8_t[]> data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback) override;
+		void WriteFile(std::unique_ptr<uint8_t[]> header, std::size_t headerLength, int fd, uint64_t offset, uint64_t length, std::function<void(bool, std::size_t)> sentCallback) override;
+		void ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback) override;
+		void Close() override;
+	protected:
+		bool SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred) override;
+	private:
+		void Receive(const uint8_t *data, std::size_t length);
+		void Fail();
+		void Pump();
+	private:
+		SimulatedNetwork &simulatedNetwork;
+		bool attached;
+		bool connected;
+		bool pumping;
+		std::vector<uint8_t> inbound;
+		std::size_t inboundOffset;
+		uint8_t *readBuffer;
+		std::size_t readLength;
+		std::function<void(bool, std::size_t)> readCallback;
+};
+
+#endif //_SIMULATED_SOCKET_H_
@@ -1,11 +1,146 @@
 #include "Socket.h"
+#include <errno.h>
+#include <thread>
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#endif
+#include "MQTTConfig.h"
+#include "Utils.h"
+
+Socket::Socket() : sockfd(INVALID_SOCKET), writing(false), queuedCount(0), writtenCount(0)
+{
+}
+
+Socket::~Socket()
+{
+	if (sockfd != INVALID_SOCKET)
+	{
+#if defined(WIN32) || defined(WIN64)
+		closesocket(sockfd);
+#else
+		close(sockfd);
+#endif
+	}
+}
+
+void Socket::WriteData(std::unique_ptr<uint8_t[]> data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback)
+{
+	if (dataLength == 0)
+	{
+		return;
+	}
+	QueueWrite(WriteRequest{ std::move(data), dataLength, false, -1, 0, 0, sentCallback });
+}
+
+void Socket::WriteFile(std::unique_ptr<uint8_t[]> header, std::size_t headerLength, int fd, uint64_t offset, uint64_t length, std::function<void(bool, std::size_t)> sentCallback)
+{
+	QueueWrite(WriteRequest{ std::move(header), headerLength, true, fd, offset, length, sentCallback });
+}
+
+void Socket::QueueWrite(WriteRequest request)
+{
+	std::unique_lock<std::mutex> lock(queueMutex);
+	writeQueue.push_back(std::move(request));
+	++queuedCount;
+	if (writing)
+	{
+		return;
+	}
+	writing = true;
+	if (CallerWriteEnabled())
+	{
+		//Also writes what other threads queue meanwhile, in order
+		lock.unlock();
+		DrainWriteQueue();
+		return;
+	}
+	std::thread(&Socket::DrainWriteQueue, this).detach();
+}
+
+void Socket::DrainWriteQueue()
+{
+	std::unique_lock<std::mutex> lock(queueMutex);
+	writerThread = std::this_thread::get_id();
+	//Started with a frame queued, ends once the queue is empty
+	while (true)
+	{
+		WriteRequest request = std::move(writeQueue.front());
+		writeQueue.pop_front();
+		lock.unlock();
+		Write(request);
+		lock.lock();
+		++writtenCount;
+		queueCondition.notify_all();
+		if (writeQueue.empty())
+		{
+			writing = false;
+			writerThread = std::thread::id();
+			lock.unlock();
+			//The callback of the last frame may own this socket, it is released once nothing here is touched any more
+			return;
+		}
+	}
+}
+
+void Socket::Write(WriteRequest &request)
+{
+	std::size_t dataTransferred = 0;
+	uint64_t fileTransferred = 0;
+	bool success;
+	{
+		//Header and body must reach the stream as one frame
+		std::lock_guard<std::mutex> lock(writeMutex);
+		success = SendData(request.data.get(), request.dataLength, dataTransferred);
+		if (success && request.file && (request.length > 0))
+		{
+			if (DirectWriteEnabled())
+			{
+				success = SendFile(request.fd, request.offset, request.length, fileTransferred);
+			}
+			else
+			{
+				success = SendFileChunks(request.fd, request.offset, request.length, fileTransferred);
+			}
+		}
+	}
+	if (request.sentCallback)
+	{
+		request.sentCallback(success ? SUCCESS : FAIL, dataTransferred + static_cast<std::size_t>(fileTransferred));
+	}
+}
 
 void Socket::Close()
 {
+	if (sockfd == INVALID_SOCKET)
+	{
+		return;
+	}
 #if defined(WIN32) || defined(WIN64)
-	closesocket(sockfd);
+	shutdown(sockfd, SD_BOTH);
 #else
-	close(sockfd);
+	shutdown(sockfd, SHUT_RDWR);
+#endif
+}
+
+bool Socket::SetUnsentLimit(uint32_t bytes)
+{
+#if defined(TCP_NOTSENT_LOWAT)
+	//Sends wait for writability while more than bytes are unsent, not only when the whole send buffer is full
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) < 0)
+	{
+		LOGI("Set TCP_NOTSENT_LOWAT error");
+		return false;
+	}
+	return true;
+#else
+	return false;
 #endif
 }
 
@@ -23,4 +158,220 @@ bool Socket::SetSocketBlockingEnabled(bool blocking)
 	flags = blocking ? (flags&~O_NONBLOCK) : (flags | O_NONBLOCK);
 	return (fcntl(sockfd, F_SETFL, flags) == 0) ? true : false;
 #endif
+}
+
+bool Socket::SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred)
+{
+	//Send all bytes on the nonblocking socket, waiting for the socket to become writable when the kernel buffer is full
+	fd_set writefds;
+	int activity;
+	bytesTransferred = 0;
+	while (bytesTransferred < dataLength)
+	{
+		FD_ZERO(&writefds);
+		FD_SET(sockfd, &writefds);
+		activity = select(sockfd + 1, nullptr, &writefds, nullptr, nullptr);
+		if ((activity < 0) && (errno != EINTR/*A signal was caught*/))
+		{
+			LOGI("Select error");
+			return false;
+		}
+		if (FD_ISSET(sockfd, &writefds))
+		{
+			int sent = send(sockfd, (char*)data + bytesTransferred, static_cast<int>(dataLength - bytesTransferred), 0);
+			if (sent <= 0)
+			{
+				if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+				{
+					continue;
+				}
+				return false;
+			}
+			bytesTransferred += sent;
+		}
+	}
+	return true;
+}
+
+bool Socket::WriteSegments(const std::vector<DataSegment> &segments, std::size_t &bytesTransferred)
+{
+	{
+		std::unique_lock<std::mutex> lock(queueMutex);
+		//Called from a sent callback the frames queued before are already written, waiting would never end
+		if (writerThread != std::this_thread::get_id())
+		{
+			uint64_t queued = queuedCount;
+			queueCondition.wait(lock, [this, queued]() { return writtenCount >= queued; });
+		}
+	}
+	std::lock_guard<std::mutex> lock(writeMutex);
+#if !defined(WIN32) && !defined(WIN64)
+	if (DirectWriteEnabled())
+	{
+		return SendVector(segments, bytesTransferred);
+	}
+#endif
+	//One SendData per segment, for TLS each becomes its own SSL_write
+	bytesTransferred = 0;
+	for (const DataSegment &segment : segments)
+	{
+		std::size_t sent = 0;
+		bool success = (segment.length == 0) || SendData(const_cast<uint8_t*>(segment.data), segment.length, sent);
+		bytesTransferred += sent;
+		if (!success)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#if !defined(WIN32) && !defined(WIN64)
+bool Socket::SendVector(const std::vector<DataSegment> &segments, std::size_t &bytesTransferred)
+{
+	bytesTransferred = 0;
+	//Gather every segment with one writev per wakeup, advancing through the list on partial writes
+	std::vector<struct iovec> vector(segments.size());
+	for (std::size_t i = 0; i < segments.size(); ++i)
+	{
+		vector[i].iov_base = const_cast<uint8_t*>(segments[i].data);
+		vector[i].iov_len = segments[i].length;
+	}
+	std::size_t index = 0;
+	fd_set writefds;
+	while (index < vector.size())
+	{
+		if (vector[index].iov_len == 0)
+		{
+			++index;
+			continue;
+		}
+		int count = static_cast<int>(((vector.size() - index) < IOV_MAX) ? (vector.size() - index) : IOV_MAX);
+		ssize_t sent = writev(sockfd, &vector[index], count);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			{
+				LOGI("writev error %d", errno);
+				return false;
+			}
+			FD_ZERO(&writefds);
+			FD_SET(sockfd, &writefds);
+			if ((select(sockfd + 1, nullptr, &writefds, nullptr, nullptr) < 0) && (errno != EINTR/*A signal was caught*/))
+			{
+				LOGI("Select error");
+				return false;
+			}
+			continue;
+		}
+		bytesTransferred += sent;
+		std::size_t left = static_cast<std::size_t>(sent);
+		while ((index < vector.size()) && (left >= vector[index].iov_len))
+		{
+			left -= vector[index].iov_len;
+			++index;
+		}
+		if (left > 0)
+		{
+			vector[index].iov_base = static_cast<uint8_t*>(vector[index].iov_base) + left;
+			vector[index].iov_len -= left;
+		}
+	}
+	return true;
+}
+#endif
+
+bool Socket::SendFile(int fd, uint64_t offset, uint64_t length, uint64_t &bytesTransferred)
+{
+#if defined(__linux__)
+	//The kernel copies from the page cache to the socket, the file content never enters user space
+	fd_set writefds;
+	off_t fileOffset = static_cast<off_t>(offset);
+	bytesTransferred = 0;
+	while (bytesTransferred < length)
+	{
+		uint64_t bytesLeft = length - bytesTransferred;
+		ssize_t sent = sendfile(sockfd, fd, &fileOffset, static_cast<std::size_t>((bytesLeft < MQTT_FILE_CHUNK_LENGTH) ? bytesLeft : MQTT_FILE_CHUNK_LENGTH));
+		if (sent > 0)
+		{
+			bytesTransferred += sent;
+			continue;
+		}
+		if (sent == 0)
+		{
+			LOGI("File is shorter than the publish length");
+			return false;
+		}
+		if (errno == EINTR)
+		{
+			continue;
+		}
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+		{
+			LOGI("sendfile error %d", errno);
+			return false;
+		}
+		FD_ZERO(&writefds);
+		FD_SET(sockfd, &writefds);
+		if ((select(sockfd + 1, nullptr, &writefds, nullptr, nullptr) < 0) && (errno != EINTR/*A signal was caught*/))
+		{
+			LOGI("Select error");
+			return false;
+		}
+	}
+	return true;
+#else
+	return SendFileChunks(fd, offset, length, bytesTransferred);
+#endif
+}
+
+bool Socket::SendFileChunks(int fd, uint64_t offset, uint64_t length, uint64_t &bytesTransferred)
+{
+	//Read through a buffer of MQTT_FILE_CHUNK_LENGTH bytes so memory stays constant whatever the file size. Unlike a mapping,
+	//a file truncated while it is sent only makes a read come back short instead of raising SIGBUS
+	bytesTransferred = 0;
+	std::unique_ptr<uint8_t[]> chunk(new uint8_t[MQTT_FILE_CHUNK_LENGTH]);
+#if defined(WIN32) || defined(WIN64)
+	if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0)
+	{
+		LOGI("Seek file error");
+		return false;
+	}
+#endif
+	while (bytesTransferred < length)
+	{
+		uint64_t bytesLeft = length - bytesTransferred;
+		std::size_t chunkLength = static_cast<std::size_t>((bytesLeft < MQTT_FILE_CHUNK_LENGTH) ? bytesLeft : MQTT_FILE_CHUNK_LENGTH);
+#if defined(WIN32) || defined(WIN64)
+		int readLength = _read(fd, chunk.get(), static_cast<unsigned int>(chunkLength));
+#else
+		ssize_t readLength = pread(fd, chunk.get(), chunkLength, static_cast<off_t>(offset + bytesTransferred));
+		if ((readLength < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+#endif
+		if (readLength < 0)
+		{
+			LOGI("Read file error");
+			return false;
+		}
+		if (readLength == 0)
+		{
+			LOGI("File is shorter than the publish length");
+			return false;
+		}
+		std::size_t sent;
+		bool success = SendData(chunk.get(), static_cast<std::size_t>(readLength), sent);
+		bytesTransferred += sent;
+		if (!success)
+		{
+			return false;
+		}
+	}
+	return true;
 }
\ No newline at end of file
@@ -14,20 +14,83 @@
 #include <fcntl.h>
 #endif
 #include <functional>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+
+struct DataSegment
+{
+	const uint8_t *data;
+	std::size_t length;
+};
 
 class Socket
 {
 	public:
-		Socket() = default;
-		virtual ~Socket() = default;
+		Socket();
+		//Releases the descriptor, once no I/O thread of the socket is left
+		virtual ~Socket();
 		virtual bool Initialize() = 0;
 		virtual void Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback) = 0;
-		virtual void WriteData(uint8_t *data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback) = 0;
+		//Frames are queued and written in the order they were handed over by one writer thread, started while the queue is not empty.
+		//sentCallback runs on that thread, which is the calling one when CallerWriteEnabled
+		//The socket owns data from now on and frees it once written
+		virtual void WriteData(std::unique_ptr<uint8_t[]> data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback);
+		//Send header followed by length bytes of the file fd starting at offset, without reading the file into user space buffers
+		virtual void WriteFile(std::unique_ptr<uint8_t[]> header, std::size_t headerLength, int fd, uint64_t offset, uint64_t length, std::function<void(bool, std::size_t)> sentCallback);
+		//Send the segments back to back as one frame, after the frames already queued. Blocks until every byte is handed to the kernel
+		//so the caller may release the segments on return
+		bool WriteSegments(const std::vector<DataSegment> &segments, std::size_t &bytesTransferred);
 		virtual void ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback) = 0;
+		//Shuts the connection down and wakes up the reads and writes blocked on it. The descriptor stays open until destruction so
+		//a thread still holding it never reaches a descriptor number reused by another connection
 		virtual void Close();
+		//Let the kernel hold at most bytes not yet sent, a longer backlog then waits in user space where it can still be changed (Linux only)
+		bool SetUnsentLimit(uint32_t bytes);
 	protected:
 		bool SetSocketBlockingEnabled(bool blocking);
+		virtual bool SendData(uint8_t *data, std::size_t dataLength, std::size_t &bytesTransferred);
+		//True when bytes written to sockfd reach the peer as they are (plain TCP or kernel TLS)
+		virtual bool DirectWriteEnabled() { return false; };
+		//True when a frame queued while no writer runs is written on the calling thread instead of a new writer thread
+		virtual bool CallerWriteEnabled() { return false; };
+#if !defined(WIN32) && !defined(WIN64)
+		bool SendVector(const std::vector<DataSegment> &segments, std::size_t &bytesTransferred);
+#endif
+		bool SendFile(int fd, uint64_t offset, uint64_t length, uint64_t &bytesTransferred);
+		//Reads the file into user space, for sockets that must see the bytes (TLS in user space) and systems without sendfile
+		bool SendFileChunks(int fd, uint64_t offset, uint64_t length, uint64_t &bytesTransferred);
 		int sockfd;
+		//Serializes whole frames so concurrent writers never interleave their bytes on the stream
+		std::mutex writeMutex;
+	private:
+		//A frame waiting for the writer thread: data, or a header followed by a file body when file is set. Freed once written
+		struct WriteRequest
+		{
+			std::unique_ptr<uint8_t[]> data;
+			std::size_t dataLength;
+			bool file;
+			int fd;
+			uint64_t offset;
+			uint64_t length;
+			std::function<void(bool, std::size_t)> sentCallback;
+		};
+		void QueueWrite(WriteRequest request);
+		void DrainWriteQueue();
+		void Write(WriteRequest &request);
+	private:
+		std::mutex queueMutex;
+		std::condition_variable queueCondition;
+		std::deque<WriteRequest> writeQueue;
+		bool writing;
+		std::thread::id writerThread;
+		//Frames queued and written so far, WriteSegments waits for those queued before it
+		uint64_t queuedCount;
+		uint64_t writtenCount;
 };
 
 #endif
\ No newline at end of file
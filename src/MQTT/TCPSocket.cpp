@@ -5,48 +5,55 @@
 
 void TCPSocket::Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback)
 {
-	std::thread([&, host, port, connectedCallback]
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	struct sockaddr_in *serverAddress = reinterpret_cast<struct sockaddr_in*>(&address);
+	serverAddress->sin_family = AF_INET;
+	serverAddress->sin_port = htons(port);
+#if defined(WIN32) || defined(WIN64)
+	bool valid = (inet_pton(AF_INET, host.c_str(), &serverAddress->sin_addr.S_un.S_addr) > 0);
+#else
+	bool valid = (inet_pton(AF_INET, host.c_str(), &serverAddress->sin_addr.s_addr) > 0);
+#endif
+	ConnectAddress(address, valid ? sizeof(struct sockaddr_in) : 0, connectedCallback);
+}
+
+void TCPSocket::ConnectAddress(const struct sockaddr_storage &address, socklen_t addressLength, std::function<void(bool)> connectedCallback)
+{
+	std::thread([this, address, addressLength, connectedCallback]
 	{
-		//Create socket
-		struct sockaddr_in serverAddress;
-		sockfd = socket(AF_INET, SOCK_STREAM, 0);
-		if (sockfd == INVALID_SOCKET)
+		if (addressLength == 0)
 		{
-			LOGI("Create socket fail");
+			LOGI("Invalid address");
 			if (connectedCallback)
 			{
 				connectedCallback(FAIL);
 			}
 			return;
 		}
-		int opt = 1;
-		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0)
+		//Create socket
+		sockfd = socket(address.ss_family, SOCK_STREAM, 0);
+		if (sockfd == INVALID_SOCKET)
 		{
-			LOGI("Set socket options error");
+			LOGI("Create socket fail");
 			if (connectedCallback)
 			{
 				connectedCallback(FAIL);
 			}
 			return;
 		}
-		memset(&serverAddress, 0, sizeof(serverAddress));
-		serverAddress.sin_family = AF_INET;
-#if defined(WIN32) || defined(WIN64)
-		if (inet_pton(AF_INET, host.c_str(), &serverAddress.sin_addr.S_un.S_addr) <= 0)
-#else
-		if (inet_pton(AF_INET, host.c_str(), &serverAddress.sin_addr.s_addr) <= 0)
-#endif
+		int opt = 1;
+		if ((address.ss_family == AF_INET) && (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt)) < 0))
 		{
-			LOGI("Invalid address");
+			LOGI("Set socket options error");
 			if (connectedCallback)
 			{
 				connectedCallback(FAIL);
 			}
 			return;
 		}
-		serverAddress.sin_port = htons(port);
 		//Connect to server
-		if (connect(sockfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+		if (connect(sockfd, reinterpret_cast<const struct sockaddr*>(&address), addressLength) < 0)
 		{
 			LOGI("Failed to connect to server");
 			if (connectedCallback)
@@ -74,55 +81,6 @@ void TCPSocket::Connect(std::string host, uint32_t port, std::function<void(bool
 	}).detach();
 }
 
-void TCPSocket::WriteData(uint8_t *data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback)
-{
-	if (dataLength == 0)
-	{
-		return;
-	}
-	std::thread([&, data, dataLength, sentCallback]
-	{
-		fd_set writefds;
-		std::size_t total = 0;
-		std::size_t bytesLeft = dataLength;
-		std::size_t bytesTransferred;
-		int activity;
-		while (total < dataLength)
-		{
-			FD_ZERO(&writefds);
-			FD_SET(sockfd, &writefds);
-			activity = select(sockfd + 1, nullptr, &writefds, nullptr, nullptr);
-			if ((activity < 0) && (errno != EINTR/*A signal was caught*/))
-			{
-				LOGI("Select error");
-				if (sentCallback)
-				{
-					sentCallback(FAIL, 0);
-				}
-				return;
-			}
-			if (FD_ISSET(sockfd, &writefds))
-			{
-				bytesTransferred = send(sockfd, (char*)data + total, bytesLeft, 0);
-				if (bytesTransferred <= 0)
-				{
-					if (sentCallback)
-					{
-						sentCallback(FAIL, total);
-					}
-					break;
-				}
-				total += bytesTransferred;
-				bytesLeft -= bytesTransferred;
-			}
-		}
-		if (sentCallback)
-		{
-			sentCallback(SUCCESS, total);
-		}
-	}).detach();
-}
-
 void TCPSocket::ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback)
 {
 	if (bytes == 0)
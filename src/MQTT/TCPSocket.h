@@ -9,8 +9,12 @@ class TCPSocket : public Socket
 		~TCPSocket() = default;
 		bool Initialize() override { return true; };
 		void Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback) override;
-	    void WriteData(uint8_t *data, std::size_t dataLength, std::function<void(bool, std::size_t)> sentCallback) override;
 		void ReadData(uint8_t *buffer, std::size_t bytes, std::function<void(bool, std::size_t)> receivedCallback) override;
+	protected:
+		bool DirectWriteEnabled() override { return true; };
+		//Connects a stream socket of the family of address on a thread of its own then makes it nonblocking.
+		//An addressLength of 0 stands for an address that could not be parsed and fails the connect
+		void ConnectAddress(const struct sockaddr_storage &address, socklen_t addressLength, std::function<void(bool)> connectedCallback);
 };
 
 #endif //_TCP_SOCKET_H_
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <functional>
 #include <chrono>
 #include <future>
+#include <thread>
 #include <cstdio>
 
 class Timer
@@ -0,0 +1,28 @@
+#include "UnixSocket.h"
+#include <string.h>
+#if !defined(WIN32) && !defined(WIN64)
+#include <sys/un.h>
+#endif
+#include "Utils.h"
+
+void UnixSocket::Connect(std::string host, uint32_t, std::function<void(bool)> connectedCallback)
+{
+#if defined(WIN32) || defined(WIN64)
+	LOGI("Unix domain sockets are not supported");
+	if (connectedCallback)
+	{
+		connectedCallback(FAIL);
+	}
+#else
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	struct sockaddr_un *serverAddress = reinterpret_cast<struct sockaddr_un*>(&address);
+	serverAddress->sun_family = AF_UNIX;
+	bool valid = !host.empty() && (host.size() < sizeof(serverAddress->sun_path));
+	if (valid)
+	{
+		memcpy(serverAddress->sun_path, host.c_str(), host.size());
+	}
+	ConnectAddress(address, valid ? sizeof(struct sockaddr_un) : 0, connectedCallback);
+#endif
+}
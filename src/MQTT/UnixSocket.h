@@ -0,0 +1,16 @@
+#ifndef _UNIX_SOCKET_H_
+#define _UNIX_SOCKET_H_
+#include "TCPSocket.h"
+
+#define UNIX_SOCKET_SCHEME "unix://"
+
+//Stream socket to a broker on the same host, host is the path of its socket and port is unused. Connecting, reads and writes are those of TCPSocket
+class UnixSocket : public TCPSocket
+{
+	public:
+		UnixSocket() = default;
+		~UnixSocket() = default;
+		void Connect(std::string host, uint32_t port, std::function<void(bool)> connectedCallback) override;
+};
+
+#endif //_UNIX_SOCKET_H_
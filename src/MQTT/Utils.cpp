@@ -1,6 +1,12 @@
 #include "Utils.h"
 #define __STDC_WANT_LIB_EXT1__ 1
 #include <string.h>
+#include <fcntl.h>
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 void WriteShort(uint8_t **pptr, uint16_t data)
 {
@@ -23,3 +29,21 @@ void WriteUTF(uint8_t** pptr, std::string string)
 	memcpy(*pptr, string.c_str(), len);
 	*pptr += len;
 }
+
+int OpenFile(std::string path)
+{
+#if defined(WIN32) || defined(WIN64)
+	return _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+	return open(path.c_str(), O_RDONLY);
+#endif
+}
+
+void CloseFile(int fd)
+{
+#if defined(WIN32) || defined(WIN64)
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
@@ -31,5 +31,7 @@ std::unique_ptr<T> make_unique(Ts&&... params)
 void WriteShort(uint8_t **buffer, uint16_t data);
 void WriteChar(uint8_t **buffer, uint8_t data);
 void WriteUTF(uint8_t** pptr, std::string string);
+int OpenFile(std::string path);
+void CloseFile(int fd);
 
 #endif //_UTILS_H_
\ No newline at end of file
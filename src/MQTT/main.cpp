@@ -1,5 +1,7 @@
 #include <iostream>
+#include <algorithm>
 #include "MQTTClient.h"
+#include "SimulatedNetwork.h"
 #include "MQTTConnectOptions.h"
 #include "Utils.h"
 #include "NetworkSecurityOptions.h"
@@ -24,6 +26,67 @@ void MQTTOnReceived(std::string topic, std::string payload)
 	LOGI("Topic: %s - Payload: %s", topic.c_str(), payload.c_str());
 }
 
+//Runs the client against simulated links in virtual time: 1000 QoS1 publishes echoed back by the broker, then an idle hour of keep alives
+void Simulate()
+{
+	struct Profile
+	{
+		const char *name;
+		SimulatedLinkProfile link;
+	};
+	const Profile profiles[] =
+	{
+		{ "lan", { std::chrono::microseconds(100), std::chrono::microseconds(50), 125000000, 0.0, 0.0, std::chrono::milliseconds(200) } },
+		{ "wan", { std::chrono::milliseconds(40), std::chrono::milliseconds(10), 1250000, 0.001, 0.01, std::chrono::milliseconds(200) } },
+		{ "lossy", { std::chrono::milliseconds(80), std::chrono::milliseconds(40), 250000, 0.05, 0.05, std::chrono::milliseconds(300) } },
+		{ "satellite", { std::chrono::milliseconds(300), std::chrono::milliseconds(20), 500000, 0.01, 0.0, std::chrono::seconds(1) } }
+	};
+	for (const Profile &profile : profiles)
+	{
+		std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+		std::shared_ptr<MQTTVirtualClock> clock = std::make_shared<MQTTVirtualClock>();
+		SimulatedNetwork simulatedNetwork(*clock, 1);
+		simulatedNetwork.SetProfile(profile.link);
+		std::vector<int64_t> latencies;
+		{
+			MQTTClient mqttClient("simulated", 1883, "MQTTSimulation");
+			mqttClient.SetClock(clock);
+			mqttClient.SetSocketFactory(std::bind(&SimulatedNetwork::CreateSocket, &simulatedNetwork));
+			mqttClient.MQTTOnReceivedPayload([&](std::string /*topic*/, std::string payload)
+			{
+				latencies.push_back(clock->Now().count() - std::stoll(payload));
+			});
+			MQTTConnectOptions connectOptions;
+			connectOptions.SetCleanSession(true);
+			connectOptions.SetKeepAlive(60);
+			mqttClient.Connect(connectOptions, false);
+			clock->Advance(std::chrono::seconds(5));
+			mqttClient.Subscribe("sim/echo", 1);
+			clock->Advance(std::chrono::seconds(5));
+			std::chrono::nanoseconds publishStart = clock->Now();
+			for (int i = 0; i < 1000; ++i)
+			{
+				mqttClient.Publish("sim/echo", std::to_string(clock->Now().count()), 1, false);
+				clock->Advance(std::chrono::milliseconds(1));
+			}
+			while ((latencies.size() < 1000) && clock->RunNext(publishStart + std::chrono::seconds(60)))
+			{
+			}
+			double elapsed = std::chrono::duration<double>(clock->Now() - publishStart).count();
+			std::sort(latencies.begin(), latencies.end());
+			uint64_t pings = simulatedNetwork.GetBroker().GetPingCount();
+			clock->Advance(std::chrono::hours(1));
+			printf("%-10s delivered %zu/1000 in %.3f s (%.0f msg/s) p50 %.2f ms p99 %.2f ms retransmissions %llu pings/h %llu real %lld ms\n",
+				profile.name, latencies.size(), elapsed, latencies.size() / elapsed,
+				latencies.empty() ? 0.0 : latencies[latencies.size() / 2] / 1e6, latencies.empty() ? 0.0 : latencies[latencies.size() * 99 / 100] / 1e6,
+				static_cast<unsigned long long>(simulatedNetwork.GetUplinkStatistics().retransmissions + simulatedNetwork.GetDownlinkStatistics().retransmissions),
+				static_cast<unsigned long long>(simulatedNetwork.GetBroker().GetPingCount() - pings),
+				static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count()));
+		}
+		//The keep alive task of the client is left in the clock, both go away together
+	}
+}
+
 int main()
 {
 	SOCKET_START
@@ -59,6 +122,19 @@ int main()
 		{
 			mqttClient.Unsubscribe("Hello");
 		}
+		else if (!command.compare("capture"))
+		{
+			mqttClient.StartCapture("mqtt_client.cap");
+		}
+		else if (!command.compare("replay"))
+		{
+			mqttClient.StopCapture();
+			mqttClient.Replay("mqtt_client.cap", true);
+		}
+		else if (!command.compare("simulate"))
+		{
+			Simulate();
+		}
 		else if (!command.compare("exit"))
 		{
 			break;